@@ -0,0 +1,218 @@
+/***********************************************************************
+ * NAME
+ *      bench_transfer -- Measure the throughput of remote_writev() and
+ *                        remote_readv()
+ *
+ * SYNOPSIS
+ *      bench_transfer [ rounds [ pid ] ]
+ *
+ * DESCRIPTION
+ *      Copies to and from a region allocated in the task of pid, or in
+ *      its own task if none is given, rounds times per case:
+ *
+ *      small_*   4096 spans of 64 bytes: written one malloc()ed bounce
+ *                buffer and vm_write() at a time, as remote_copyout()
+ *                used to (old); with gaps between them, so that each
+ *                is its own write (scattered); and adjacent, so that
+ *                they are merged into one (adjacent, and read back).
+ *      large_*   16M: from a page-aligned buffer, written directly
+ *                (aligned); from an unaligned one, bounced (unaligned);
+ *                and as 256 adjacent spans of 64K, gathered into one
+ *                write (gathered, and read back).
+ *
+ *      Reports megabytes per second and kernel calls per round for
+ *      each case, as one key=value line so that results can be diffed
+ *      between releases and platforms.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/mach_error.h>
+
+#include "remote_transfer.h"
+
+#define SMALL_SPANS (4096)
+#define SMALL_SIZE  (64)
+#define LARGE_SIZE  (16*1024*1024)
+#define LARGE_SPANS (LARGE_SIZE / TRANSFER_BUFFER_SIZE)
+
+typedef struct {
+    double        mb_per_s;
+    unsigned long calls;       // Per round
+} result_t;
+
+static double
+now_ns(void)
+{
+    static mach_timebase_info_data_t timebase;
+
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+/*
+ * What remote_copyout() did before remote_writev(), for comparison
+ */
+static kern_return_t
+old_copyout(task_t task, void* src, vm_address_t dest, size_t n)
+{
+    kern_return_t kr;
+    void* buf;
+
+    buf = malloc((n + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    memcpy(buf, src, n);
+    kr = vm_write(task, dest, (vm_offset_t)buf, n);
+    free(buf);
+
+    return kr;
+}
+
+static void
+check(kern_return_t kr, const char* what)
+{
+    if (kr) {
+        fprintf(stderr, "bench_transfer: %s: %s\n", what, mach_error_string(kr));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static result_t
+run_old(task_t task, const remote_iovec_t* iov, int count, size_t bytes,
+        int rounds)
+{
+    result_t result;
+    double start = now_ns();
+    int r, i;
+
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < count; i++)
+            check(old_copyout(task, iov[i].local, iov[i].address, iov[i].size),
+                  "vm_write");
+
+    result.mb_per_s = (double)bytes * rounds / (1 << 20) /
+        ((now_ns() - start) / 1e9);
+    result.calls = count;
+    return result;
+}
+
+static result_t
+run_vectored(task_t task, const remote_iovec_t* iov, int count,
+             size_t bytes, int rounds, int write)
+{
+    result_t result;
+    unsigned long calls = remote_transfer_calls();
+    double start = now_ns();
+    int r;
+
+    for (r = 0; r < rounds; r++)
+        check(write ? remote_writev(task, iov, count) :
+              remote_readv(task, iov, count),
+              write ? "remote_writev" : "remote_readv");
+
+    result.mb_per_s = (double)bytes * rounds / (1 << 20) /
+        ((now_ns() - start) / 1e9);
+    result.calls = (remote_transfer_calls() - calls) / rounds;
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int rounds = 16, i;
+    task_t task = mach_task_self();
+    vm_address_t remote, local;
+    remote_iovec_t* small, *large;
+    result_t old, scattered, adjacent, adjacent_read,
+        aligned, unaligned, gathered, gathered_read;
+
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+    if (argc > 2)
+        check(task_for_pid(mach_task_self(), atoi(argv[2]), &task),
+              "task_for_pid");
+    if (rounds <= 0 || argc > 3) {
+        fprintf(stderr, "usage: %s [rounds [pid]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    check(vm_allocate(task, &remote, LARGE_SIZE + PAGE_SIZE, TRUE),
+          "vm_allocate");
+    check(vm_allocate(mach_task_self(), &local, LARGE_SIZE + PAGE_SIZE, TRUE),
+          "vm_allocate");
+    memset((void*)local, 0xa5, LARGE_SIZE + PAGE_SIZE);
+
+    small = calloc(SMALL_SPANS, sizeof(*small));
+    large = calloc(LARGE_SPANS, sizeof(*large));
+    if (!small || !large) {
+        perror("bench_transfer");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Small spans, every other 64 bytes
+     */
+    for (i = 0; i < SMALL_SPANS; i++) {
+        small[i].address = remote + i * 2 * SMALL_SIZE;
+        small[i].local = (char*)local + i * SMALL_SIZE;
+        small[i].size = SMALL_SIZE;
+    }
+    old = run_old(task, small, SMALL_SPANS, SMALL_SPANS * SMALL_SIZE, rounds);
+    scattered = run_vectored(task, small, SMALL_SPANS,
+                             SMALL_SPANS * SMALL_SIZE, rounds, 1);
+
+    /*
+     * The same, back to back
+     */
+    for (i = 0; i < SMALL_SPANS; i++)
+        small[i].address = remote + i * SMALL_SIZE;
+    adjacent = run_vectored(task, small, SMALL_SPANS,
+                            SMALL_SPANS * SMALL_SIZE, rounds, 1);
+    adjacent_read = run_vectored(task, small, SMALL_SPANS,
+                                 SMALL_SPANS * SMALL_SIZE, rounds, 0);
+
+    large[0].address = remote;
+    large[0].local = (void*)local;
+    large[0].size = LARGE_SIZE;
+    aligned = run_vectored(task, large, 1, LARGE_SIZE, rounds, 1);
+
+    large[0].local = (char*)local + 1;
+    unaligned = run_vectored(task, large, 1, LARGE_SIZE, rounds, 1);
+
+    for (i = 0; i < LARGE_SPANS; i++) {
+        large[i].address = remote + i * TRANSFER_BUFFER_SIZE;
+        large[i].local = (char*)local + i * TRANSFER_BUFFER_SIZE;
+        large[i].size = TRANSFER_BUFFER_SIZE;
+    }
+    gathered = run_vectored(task, large, LARGE_SPANS, LARGE_SIZE, rounds, 1);
+    gathered_read = run_vectored(task, large, LARGE_SPANS, LARGE_SIZE,
+                                 rounds, 0);
+
+    printf("rounds=%d "
+           "small_old_mbps=%.1f small_old_calls=%lu "
+           "small_scattered_mbps=%.1f small_scattered_calls=%lu "
+           "small_adjacent_mbps=%.1f small_adjacent_calls=%lu "
+           "small_adjacent_read_mbps=%.1f small_adjacent_read_calls=%lu "
+           "large_aligned_mbps=%.1f large_aligned_calls=%lu "
+           "large_unaligned_mbps=%.1f large_unaligned_calls=%lu "
+           "large_gathered_mbps=%.1f large_gathered_calls=%lu "
+           "large_gathered_read_mbps=%.1f large_gathered_read_calls=%lu\n",
+           rounds,
+           old.mb_per_s, old.calls,
+           scattered.mb_per_s, scattered.calls,
+           adjacent.mb_per_s, adjacent.calls,
+           adjacent_read.mb_per_s, adjacent_read.calls,
+           aligned.mb_per_s, aligned.calls,
+           unaligned.mb_per_s, unaligned.calls,
+           gathered.mb_per_s, gathered.calls,
+           gathered_read.mb_per_s, gathered_read.calls);
+
+    free(small);
+    free(large);
+    vm_deallocate(task, remote, LARGE_SIZE + PAGE_SIZE);
+    vm_deallocate(mach_task_self(), local, LARGE_SIZE + PAGE_SIZE);
+
+    return 0;
+}
@@ -4,7 +4,9 @@
  *                       running process
  *
  * SYNOPSIS
- *      inject_bundle path_to_bundle [ pid ]
+ *      inject_bundle [ -a ] path_to_bundle [ pid ]
+ *      inject_bundle [ -a ] [ -j jobs ] [ -t seconds ] [ -n pattern ]
+ *                    path_to_bundle [ pid ... ]
  *
  * DESCRIPTION
  *      The inject_bundle utility injects a dynamic library or bundle
@@ -13,22 +15,54 @@
  *      creating a new thread to call dlopen().  If the dylib or
  *      bundle exports a function called "run", it will be called
  *      separately.
+ *
+ *      With -a, the calls are made by one agent thread, started in
+ *      the remote process before the first of them, which takes
+ *      each call from memory shared with inject_bundle rather than
+ *      needing a thread of its own.
+ *
+ *      The functions called are found in the remote process' own
+ *      images, from its dyld image list, where it can be read; the
+ *      bundle's "run" is found in its symbol table once it is loaded.
+ *      Otherwise they are assumed to be where they are in
+ *      inject_bundle, and "run" is looked up with dlsym().
+ *
+ *      Given more than one pid, or -n, it injects into each of them,
+ *      and into every other process whose name matches the shell
+ *      pattern, up to jobs at once (8 by default).  Each injection is
+ *      made by a process of its own, so that a target that fails or
+ *      hangs holds up no others; with -t, one taking more than the
+ *      seconds given is killed, which may leave the target with a
+ *      suspended thread.  A line is printed for each target as it
+ *      finishes, with its pid, name, status ("ok", "failed" or
+ *      "timeout") and the milliseconds it took, then one for all.
  * 
  * EXIT STATUS
- *      Exits 0 on success, -1 on error.
+ *      Exits 0 on success, -1 on error.  With several targets, exits 0
+ *      if every one succeeded, 1 otherwise.
  **********************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
 #include <err.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <signal.h>
 
 #include <dlfcn.h>
 #include <mach/mach.h>
 #include <mach/mach_error.h>
+#include <mach/mach_time.h>
+#include <mach/semaphore.h>
+#include <mach/sync_policy.h>
 #include <pthread.h>
 #include <sys/param.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
 
 #define __i386__ 1
 
@@ -36,6 +70,9 @@
 #include <architecture/ppc/cframe.h>
 #endif
 
+#include "remote_transfer.h"
+#include "remote_symbols.h"
+
 /*
  * If this symbol is exported from the bundle, it will be called
  * separately after initialization.
@@ -73,29 +110,13 @@ remote_copyout(task_t task, void* src, vm_address_t dest, size_t n);
 kern_return_t
 remote_copyin(task_t task, vm_address_t src, void* dest, size_t n);
 
-extern vm_address_t
-remote_malloc(task_t task, size_t size);
-    
-extern kern_return_t
-remote_free(task_t task, vm_address_t addr);
-
 kern_return_t
 remote_copyout(mach_port_t task, void* src, vm_address_t dest, size_t n)
 {
-    kern_return_t kr = KERN_SUCCESS;
-    void* buf;
-    
-    // vm_write needs to copy data from a page-aligned buffer
-    buf = malloc((n + PAGE_SIZE) & ~PAGE_SIZE);
-    memcpy(buf, src, n);
-    
-    if ((kr = vm_write(task, dest, (vm_offset_t)buf, n))) {
-        return kr;
-    }
+    remote_iovec_t iov = { dest, src, n };
 
-    free(buf);
-
-    return kr;
+    // Bounced through a pooled page-aligned buffer if src isn't one
+    return remote_writev(task, &iov, 1);
 }
 
 kern_return_t
@@ -111,43 +132,122 @@ remote_copyin(mach_port_t task, vm_address_t src, void* dest, size_t n)
     return kr;
 }
 
+/**********************************************************************
+ * Remote arena
+ **********************************************************************/
+
+/*
+ * An arena is one region in the task that the arguments of calls are
+ * carved from.  Which parts are in use is only known here, and the
+ * blocks are built in a local copy of the region, so marshaling the
+ * arguments of a call costs one vm_write() for all of them, and
+ * freeing them none at all.
+ */
+#define ARENA_SIZE  (16*1024)
+#define ARENA_ALIGN (16)
+
+typedef struct {
+    task_t        task;
+    vm_address_t  base;        // The region, in the task
+    size_t        size;
+    size_t        used;        // Bytes handed out
+    size_t        written;     // Of those, bytes copied out to the task
+    char*         local;       // Local copy of the region
+} remote_arena_t;
+
+kern_return_t
+remote_arena_create(task_t task, size_t size, remote_arena_t* arena);
+
 vm_address_t
-remote_malloc(mach_port_t task, size_t size)
+remote_arena_alloc(remote_arena_t* arena, const void* src, size_t n);
+
+kern_return_t
+remote_arena_flush(remote_arena_t* arena);
+
+void
+remote_arena_destroy(remote_arena_t* arena);
+
+kern_return_t
+remote_arena_create(task_t task, size_t size, remote_arena_t* arena)
 {
-    kern_return_t kr = KERN_SUCCESS;
-    vm_address_t addr;
+    kern_return_t kr;
+    vm_address_t local;
+
+    bzero(arena, sizeof(*arena));
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     
-    if ((kr = vm_allocate(task, &addr, size + sizeof(size), TRUE)))
-        return (vm_address_t)NULL;
+    if ((kr = vm_allocate(task, &arena->base, size, TRUE)))
+        return kr;
 
-    /*
-     * Write allocation size into first bytes of remote page
-     */
-    if (remote_copyout(task, &size, addr, sizeof(size))) {
-        vm_deallocate(task, addr, size);
-        return (vm_address_t)NULL;
+    // vm_write needs to copy data from a page-aligned buffer
+    if ((kr = vm_allocate(mach_task_self(), &local, size, TRUE))) {
+        vm_deallocate(task, arena->base, size);
+        arena->base = 0;
+        return kr;
     }
 
-    return addr + sizeof(size);
+    arena->task = task;
+    arena->size = size;
+    arena->local = (char*)local;
+
+    return kr;
 }
 
+/*
+ * remote_arena_alloc -- Allocate a block of n bytes and fill it from
+ * src, if given.  The block is in the task once remote_arena_flush()
+ * has been called.  Returns 0 when the arena is full.
+ */
+vm_address_t
+remote_arena_alloc(remote_arena_t* arena, const void* src, size_t n)
+{
+    size_t offset = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (offset > arena->size || n > arena->size - offset)
+        return (vm_address_t)NULL;
+
+    if (src)
+        memcpy(arena->local + offset, src, n);
+    else
+        bzero(arena->local + offset, n);
+    arena->used = offset + n;
+
+    return arena->base + offset;
+}
+
+/*
+ * remote_arena_flush -- Copy out the blocks allocated since the last
+ * flush, with one vm_write().
+ */
 kern_return_t
-remote_free(mach_port_t task, vm_address_t addr)
+remote_arena_flush(remote_arena_t* arena)
 {
-    kern_return_t kr = KERN_SUCCESS;
-    size_t size;
-    
-    /*
-     * Read allocation size from remote memory
-     */
-    if ((kr = remote_copyin(task, addr - sizeof(size), &size, sizeof(size)))) {
+    kern_return_t kr;
+
+    if (arena->used == arena->written)
+        return KERN_SUCCESS;
+
+    if ((kr = vm_write(arena->task, arena->base + arena->written,
+                       (vm_offset_t)(arena->local + arena->written),
+                       arena->used - arena->written))) {
         return kr;
     }
 
-    kr = vm_deallocate(task, addr - sizeof(size), size);
+    arena->written = arena->used;
     return kr;
 }
 
+void
+remote_arena_destroy(remote_arena_t* arena)
+{
+    if (arena->base)
+        vm_deallocate(arena->task, arena->base, arena->size);
+    if (arena->local)
+        vm_deallocate(mach_task_self(), (vm_address_t)arena->local,
+                      arena->size);
+    bzero(arena, sizeof(*arena));
+}
+
 /**********************************************************************
  * Remote threads
  **********************************************************************/
@@ -166,6 +266,7 @@ typedef struct {
     thread_t              thread;
     vm_address_t          stack;
     size_t                stack_size;
+    mach_port_t           exception_port;
 } remote_thread_t;
 
 /*
@@ -178,8 +279,20 @@ typedef struct {
 #define PTHREAD_SIZE (4096)    // Size to reserve for pthread_t struct
 
 kern_return_t
-create_remote_thread(mach_port_t task, remote_thread_t* rt, 
-		     vm_address_t start_address, int argc, ...);
+create_remote_thread(mach_port_t task, remote_symbols_t* symbols,
+		     remote_thread_t* rt, vm_address_t start_address,
+		     int argc, ...);
+
+kern_return_t
+vcreate_remote_thread(mach_port_t task, remote_symbols_t* symbols,
+		      remote_thread_t* rt, vm_address_t start_address,
+		      int argc, va_list ap);
+
+kern_return_t
+start_remote_thread(remote_thread_t* remote_thread);
+
+kern_return_t
+wait_remote_thread(remote_thread_t* remote_thread, void** return_value);
 
 kern_return_t
 join_remote_thread(remote_thread_t* remote_thread, void** return_value);
@@ -234,13 +347,15 @@ kern_return_t catch_exception_raise_state_identity(
     return KERN_INVALID_ARGUMENT;
 }
 
+/*
+ * start_remote_thread -- Run a created thread, with its exception port
+ * set so that wait_remote_thread() can catch its return.
+ */
 kern_return_t
-join_remote_thread(remote_thread_t* remote_thread, void** return_value)
+start_remote_thread(remote_thread_t* remote_thread)
 {
     kern_return_t kr;
     mach_port_t exception_port;
-    thread_basic_info_data_t thread_basic_info;
-    mach_msg_type_number_t thread_basic_info_count = THREAD_BASIC_INFO_COUNT;
 
     // Allocate exception port
     if ((kr = mach_port_allocate(mach_task_self(),
@@ -283,13 +398,28 @@ join_remote_thread(remote_thread_t* remote_thread, void** return_value)
     }
 
     remote_thread->state = RUNNING;
-    
+    remote_thread->exception_port = exception_port;
+
+    return kr;
+}
+
+/*
+ * wait_remote_thread -- Wait for a started thread to return, then
+ * terminate it and free its stack.
+ */
+kern_return_t
+wait_remote_thread(remote_thread_t* remote_thread, void** return_value)
+{
+    kern_return_t kr;
+    thread_basic_info_data_t thread_basic_info;
+    mach_msg_type_number_t thread_basic_info_count = THREAD_BASIC_INFO_COUNT;
+
     /*
      * Run exception handling loop until thread terminates
      */
     while (1) {
         if ((kr = mach_msg_server_once(exc_server, sizeof(exc_msg_t),
-                                       exception_port,
+                                       remote_thread->exception_port,
                                        MACH_MSG_TIMEOUT_NONE))) {
             errx(EXIT_FAILURE, "mach_msg_server: %s", mach_error_string(kr));
         }
@@ -347,6 +477,9 @@ join_remote_thread(remote_thread_t* remote_thread, void** return_value)
                      mach_error_string(kr));
             }
             
+            mach_port_destroy(mach_task_self(),
+                              remote_thread->exception_port);
+            remote_thread->exception_port = MACH_PORT_NULL;
             remote_thread->state = TERMINATED;
 
             break;
@@ -356,6 +489,17 @@ join_remote_thread(remote_thread_t* remote_thread, void** return_value)
     return kr;
 }
 
+kern_return_t
+join_remote_thread(remote_thread_t* remote_thread, void** return_value)
+{
+    kern_return_t kr;
+
+    if ((kr = start_remote_thread(remote_thread)))
+        return kr;
+
+    return wait_remote_thread(remote_thread, return_value);
+}
+
 /*
  * Raw assembly code for trampolines.  If they are changed,
  * TRAMPOLINE_SIZE must be calculated manually and updated as well.
@@ -381,10 +525,14 @@ asm void mach_thread_trampoline(void)
     jmp     eax
 }
 
+/*
+ * Not needed to start the function on i386, so it is the no-op called
+ * in place of cthread_set_self() where the task has none.
+ */
 #define PTHREAD_TRAMPOLINE_SIZE (4)
 asm void pthread_trampoline(void)
 {
-    nop
+    ret
     nop
     nop
     nop
@@ -464,6 +612,73 @@ asm void pthread_trampoline(void)
 }
 #endif
 
+/*
+ * The images that the functions called remotely may be in, newest
+ * release first: libSystem was split into libsystem_* parts in 10.7,
+ * and _pthread_set_self() moved out of libsystem_c in 10.9.
+ */
+static const char* const dyld_images[] = {
+    "libdyld", "libSystem", NULL
+};
+static const char* const pthread_images[] = {
+    "libsystem_pthread", "libsystem_c", "libSystem", NULL
+};
+static const char* const kernel_images[] = {
+    "libsystem_kernel", "libSystem", NULL
+};
+
+/*
+ * The functions called remotely, by their C names.  warm_symbols()
+ * reads the same images that they are looked up in here.
+ */
+enum {
+    FUNCTION_DLOPEN,
+    FUNCTION_DLSYM,
+    FUNCTION_PTHREAD_SET_SELF,
+    FUNCTION_CTHREAD_SET_SELF,
+    FUNCTION_SEMAPHORE_WAIT,
+    FUNCTION_SEMAPHORE_SIGNAL,
+    FUNCTION_COUNT
+};
+
+static const struct {
+    const char*        name;
+    const char* const* images;
+} remote_functions[FUNCTION_COUNT] = {
+    { "dlopen",             dyld_images },
+    { "dlsym",              dyld_images },
+    { "__pthread_set_self", pthread_images },
+    { "cthread_set_self",   pthread_images },
+    { "semaphore_wait",     kernel_images },
+    { "semaphore_signal",   kernel_images },
+};
+
+/*
+ * remote_function -- The address of one of remote_functions in the
+ * task.  With symbols, it is looked up in the task's images that it
+ * may be in, and is 0 if it isn't in any of them; without, it is
+ * assumed to be where it is here.  Only those images' symbol tables
+ * are read, so a function the task doesn't have doesn't cost reading
+ * all of them.
+ */
+static vm_address_t
+remote_function(remote_symbols_t* symbols, int function, void* local)
+{
+    const char* const* images = remote_functions[function].images;
+    vm_address_t address;
+
+    if (!symbols)
+        return (vm_address_t)local;
+
+    for (; *images; images++) {
+        if (!remote_symbols_lookup(symbols, remote_functions[function].name,
+                                   *images, &address))
+            return address;
+    }
+
+    return 0;
+}
+
 /*
  * create_remote_thread -- Create the remote thread, but do not run it yet.
  * 
@@ -480,10 +695,25 @@ asm void pthread_trampoline(void)
  * pthread_join() on the newly created thread.
  */
 kern_return_t
-create_remote_thread(mach_port_t task, remote_thread_t* rt, 
-		     vm_address_t start_address, int argc, ...)
+create_remote_thread(mach_port_t task, remote_symbols_t* symbols,
+		     remote_thread_t* rt, vm_address_t start_address,
+		     int argc, ...)
 {
     va_list ap;
+    kern_return_t kr;
+
+    va_start(ap, argc);
+    kr = vcreate_remote_thread(task, symbols, rt, start_address, argc, ap);
+    va_end(ap);
+
+    return kr;
+}
+
+kern_return_t
+vcreate_remote_thread(mach_port_t task, remote_symbols_t* symbols,
+		      remote_thread_t* rt, vm_address_t start_address,
+		      int argc, va_list ap)
+{
     int i;
     kern_return_t kr;
     thread_t remote_thread;
@@ -491,8 +721,9 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
 	mach_thread_trampoline_code, pthread_trampoline_code;
     size_t stack_size = STACK_SIZE;
     unsigned long* stack, *sp;
-    static void (*pthread_set_self)(pthread_t) = NULL;
-    static void (*cthread_set_self)(void*) = NULL;
+    vm_address_t pthread_set_self, cthread_set_self;
+    static void (*local_pthread_set_self)(pthread_t) = NULL;
+    static void (*local_cthread_set_self)(void*) = NULL;
 
     /*
      * Initialize remote_thread_t
@@ -500,6 +731,7 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
     rt->state = UNINIT;
     rt->task = rt->thread = 0;
     rt->stack = rt->stack_size = 0;
+    rt->exception_port = MACH_PORT_NULL;
 
     if (argc > 8) {
 	// We don't handle that many arguments
@@ -512,16 +744,27 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
      * make it a real pthread.  Many library functions fail if they
      * are called from a basic mach thread.
      */
-    if (pthread_set_self == NULL) {
-	pthread_set_self = (void (*)(pthread_t))
+    if (local_pthread_set_self == NULL) {
+	local_pthread_set_self = (void (*)(pthread_t))
 	    dlsym(RTLD_DEFAULT, "__pthread_set_self");
     }
 
-    if (cthread_set_self == NULL) {
-	cthread_set_self = (void (*)(void*))
+    if (local_cthread_set_self == NULL) {
+	local_cthread_set_self = (void (*)(void*))
 	    dlsym(RTLD_DEFAULT, "cthread_set_self");
     }
 
+    /*
+     * Where they are in the task, if it can tell us.  cthread_set_self()
+     * is gone from current releases, so a no-op is called in its place
+     */
+    pthread_set_self = remote_function(symbols, FUNCTION_PTHREAD_SET_SELF,
+                                       (void*)local_pthread_set_self);
+    cthread_set_self = remote_function(symbols, FUNCTION_CTHREAD_SET_SELF,
+                                       (void*)local_cthread_set_self);
+    if (!pthread_set_self)
+        return KERN_FAILURE;
+
     /*
      * Allocate remote and local (temporary copy) stacks
      */
@@ -574,20 +817,19 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
         
         args = sp;
         
-        va_start(ap, argc);
         for (i = 0; i < argc; i++) {
             unsigned long arg = va_arg(ap, unsigned long);
             *(args + i) = arg;
         }
-        va_end(ap);
         
 	// Push magic return address and start address onto stack
 	*(--sp) = MAGIC_RETURN;
         *(--sp) = (unsigned long)start_address;
         
-        // Push pthread_t arg and address of cthread_set_self
+        // Push pthread_t arg and address of cthread_set_self, or a no-op
         *(--sp) = pthread;
-        *(--sp) = (unsigned long)cthread_set_self;
+        *(--sp) = cthread_set_self ?
+            (unsigned long)cthread_set_self : pthread_trampoline_code;
         
         // Push pthread_t arg and address of pthread_set_self
         *(--sp) = pthread;
@@ -628,12 +870,10 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
         sp -= 8;
         start_arg = sp;
         
-        va_start(ap, argc);
         for (i = 0; i < argc; i++) {
             unsigned long arg = va_arg(ap, unsigned long);
             *(sp + i) = arg;
         }
-        va_end(ap);
 
         sp -= ((unsigned int)sp % 16) / sizeof(*sp);
         
@@ -664,7 +904,10 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
 	remote_thread_state.__r27  = (unsigned int)pthread_join;
 	remote_thread_state.__r28  = (unsigned int)pthread_create;
 	remote_thread_state.__r29  = (unsigned int)pthread_set_self;
-	remote_thread_state.__r30  = (unsigned int)cthread_set_self;
+	// Without cthread_set_self, the trampoline's final blr is a no-op
+	remote_thread_state.__r30  = cthread_set_self ?
+            (unsigned int)cthread_set_self :
+            mach_thread_trampoline_code + MACH_THREAD_TRAMPOLINE_SIZE - 4;
 	remote_thread_state.__r31  = (unsigned int)pthread_trampoline_code;
 
 	remote_thread_state.__lr   = MAGIC_RETURN;
@@ -687,6 +930,455 @@ create_remote_thread(mach_port_t task, remote_thread_t* rt,
     return kr;
 }
 
+/**********************************************************************
+ * Remote agent
+ **********************************************************************/
+
+/*
+ * A remote thread costs a 512K stack written into the task, a thread
+ * and an exception port, so each call made on one takes milliseconds.
+ * The agent is a single remote thread, started once, that takes calls
+ * from a queue in memory shared with the task and posts a semaphore
+ * as each one completes.  A call then costs two semaphore operations,
+ * and any number of calls can be posted before waiting for the first.
+ */
+#define AGENT_QUEUE_SIZE (64)    // Calls in flight; a power of two
+#define AGENT_TIMEOUT    (10)    // Seconds to wait on a call but run()
+
+/*
+ * agent_code reads these at fixed offsets, so they must not change
+ * without it.
+ */
+typedef struct {
+    uint32_t function;           // 0 asks the agent to return
+    uint32_t argc;
+    uint32_t args[8];
+    uint32_t result;
+    uint32_t pad;
+} agent_call_t;
+
+typedef struct {
+    uint32_t semaphore_wait;     // Addresses, as called by the agent
+    uint32_t semaphore_signal;
+    uint32_t request_semaphore;  // Names in the task's port space
+    uint32_t done_semaphore;
+    volatile uint32_t head;      // Calls posted
+    volatile uint32_t tail;      // Calls completed
+    uint32_t pad[2];
+    agent_call_t calls[AGENT_QUEUE_SIZE];
+} agent_queue_t;
+
+typedef struct {
+    task_t            task;
+    remote_thread_t   thread;
+    vm_address_t      code;      // agent_code, in the task
+    vm_address_t      queue_rptr;
+    agent_queue_t*    queue;     // The same pages, mapped here
+    semaphore_t       request_semaphore;
+    semaphore_t       done_semaphore;
+} remote_agent_t;
+
+#define AGENT_QUEUE_PAGES \
+    ((sizeof(agent_queue_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#if defined(__i386__)
+/*
+ * agent_code(agent_queue_t* queue), as machine code since, unlike the
+ * trampolines, it is copied to a page of its own and outlives any one
+ * call.  Each call is made with all eight arguments, which the
+ * function ignores the extra ones of.
+ */
+static const unsigned char agent_code[] = {
+    0x55,                               // push   ebp
+    0x89, 0xe5,                         // mov    ebp, esp
+    0x53,                               // push   ebx
+    0x56,                               // push   esi
+    0x57,                               // push   edi
+    0x83, 0xec, 0x2c,                   // sub    esp, 44
+    0x8b, 0x5d, 0x08,                   // mov    ebx, [ebp+8]      queue
+    // wait:
+    0x8b, 0x43, 0x08,                   // mov    eax, [ebx+8]
+    0x89, 0x04, 0x24,                   // mov    [esp], eax
+    0xff, 0x13,                         // call   [ebx]             semaphore_wait(request)
+    0x85, 0xc0,                         // test   eax, eax
+    0x75, 0xf4,                         // jne    wait
+    0x8b, 0x73, 0x14,                   // mov    esi, [ebx+20]     tail
+    0x89, 0xf0,                         // mov    eax, esi
+    0x83, 0xe0, AGENT_QUEUE_SIZE - 1,   // and    eax, AGENT_QUEUE_SIZE - 1
+    0x6b, 0xc0, 0x30,                   // imul   eax, eax, 48
+    0x8d, 0x7c, 0x03, 0x20,             // lea    edi, [ebx+eax+32] call
+    0x8b, 0x07,                         // mov    eax, [edi]
+    0x85, 0xc0,                         // test   eax, eax
+    0x74, 0x4d,                         // je     quit
+    0x8b, 0x4f, 0x08,                   // mov    ecx, [edi+8]
+    0x89, 0x0c, 0x24,                   // mov    [esp], ecx
+    0x8b, 0x4f, 0x0c,                   // mov    ecx, [edi+12]
+    0x89, 0x4c, 0x24, 0x04,             // mov    [esp+4], ecx
+    0x8b, 0x4f, 0x10,                   // mov    ecx, [edi+16]
+    0x89, 0x4c, 0x24, 0x08,             // mov    [esp+8], ecx
+    0x8b, 0x4f, 0x14,                   // mov    ecx, [edi+20]
+    0x89, 0x4c, 0x24, 0x0c,             // mov    [esp+12], ecx
+    0x8b, 0x4f, 0x18,                   // mov    ecx, [edi+24]
+    0x89, 0x4c, 0x24, 0x10,             // mov    [esp+16], ecx
+    0x8b, 0x4f, 0x1c,                   // mov    ecx, [edi+28]
+    0x89, 0x4c, 0x24, 0x14,             // mov    [esp+20], ecx
+    0x8b, 0x4f, 0x20,                   // mov    ecx, [edi+32]
+    0x89, 0x4c, 0x24, 0x18,             // mov    [esp+24], ecx
+    0x8b, 0x4f, 0x24,                   // mov    ecx, [edi+36]
+    0x89, 0x4c, 0x24, 0x1c,             // mov    [esp+28], ecx
+    0xff, 0xd0,                         // call   eax
+    0x89, 0x47, 0x28,                   // mov    [edi+40], eax     result
+    0x8d, 0x46, 0x01,                   // lea    eax, [esi+1]
+    0x89, 0x43, 0x14,                   // mov    [ebx+20], eax     tail
+    0x8b, 0x43, 0x0c,                   // mov    eax, [ebx+12]
+    0x89, 0x04, 0x24,                   // mov    [esp], eax
+    0xff, 0x53, 0x04,                   // call   [ebx+4]           semaphore_signal(done)
+    0xeb, 0x92,                         // jmp    wait
+    // quit:
+    0x8d, 0x46, 0x01,                   // lea    eax, [esi+1]
+    0x89, 0x43, 0x14,                   // mov    [ebx+20], eax     tail
+    0x8b, 0x43, 0x0c,                   // mov    eax, [ebx+12]
+    0x89, 0x04, 0x24,                   // mov    [esp], eax
+    0xff, 0x53, 0x04,                   // call   [ebx+4]           semaphore_signal(done)
+    0x31, 0xc0,                         // xor    eax, eax
+    0x83, 0xc4, 0x2c,                   // add    esp, 44
+    0x5f,                               // pop    edi
+    0x5e,                               // pop    esi
+    0x5b,                               // pop    ebx
+    0x5d,                               // pop    ebp
+    0xc3                                // ret                      to MAGIC_RETURN
+};
+#endif
+
+kern_return_t
+remote_agent_start(task_t task, remote_symbols_t* symbols,
+                   remote_agent_t* agent);
+
+kern_return_t
+remote_agent_post(remote_agent_t* agent, vm_address_t function,
+                  uint32_t* ticket, int argc, ...);
+
+kern_return_t
+remote_agent_vpost(remote_agent_t* agent, vm_address_t function,
+                   uint32_t* ticket, int argc, va_list ap);
+
+kern_return_t
+remote_agent_wait(remote_agent_t* agent, uint32_t ticket, int timeout,
+                  void** return_value);
+
+kern_return_t
+remote_agent_stop(remote_agent_t* agent);
+
+/*
+ * Gives the task a send right to a semaphore we have one to, under a
+ * name it doesn't use yet.  The name is found by allocating a dead
+ * name and freeing it again, which the task could take in between.
+ */
+static kern_return_t
+remote_insert_semaphore(task_t task, semaphore_t semaphore,
+                        mach_port_name_t* name)
+{
+    kern_return_t kr = KERN_NAME_EXISTS;
+    int tries;
+
+    if (task == mach_task_self()) {
+        *name = semaphore;
+        return KERN_SUCCESS;
+    }
+    
+    for (tries = 0; tries < 8 && kr == KERN_NAME_EXISTS; tries++) {
+        if ((kr = mach_port_allocate(task, MACH_PORT_RIGHT_DEAD_NAME, name)))
+            return kr;
+        mach_port_mod_refs(task, *name, MACH_PORT_RIGHT_DEAD_NAME, -1);
+        kr = mach_port_insert_right(task, *name, semaphore,
+                                    MACH_MSG_TYPE_COPY_SEND);
+    }
+
+    return kr;
+}
+
+/*
+ * Frees whatever remote_agent_start() got to, terminating the agent
+ * if it is still running.
+ */
+static void
+remote_agent_release(remote_agent_t* agent)
+{
+    task_t task = agent->task;
+    
+    if (agent->thread.state == CREATED || agent->thread.state == RUNNING) {
+        thread_terminate(agent->thread.thread);
+        vm_deallocate(task, agent->thread.stack, agent->thread.stack_size);
+        agent->thread.state = TERMINATED;
+    }
+    if (agent->thread.exception_port != MACH_PORT_NULL) {
+        mach_port_destroy(mach_task_self(), agent->thread.exception_port);
+        agent->thread.exception_port = MACH_PORT_NULL;
+    }
+
+    if (agent->queue) {
+        if (task != mach_task_self()) {
+            if (agent->queue->request_semaphore)
+                mach_port_deallocate(task, agent->queue->request_semaphore);
+            if (agent->queue->done_semaphore)
+                mach_port_deallocate(task, agent->queue->done_semaphore);
+        }
+        vm_deallocate(mach_task_self(), (vm_address_t)agent->queue,
+                      AGENT_QUEUE_PAGES);
+        agent->queue = NULL;
+    }
+    if (agent->queue_rptr) {
+        vm_deallocate(task, agent->queue_rptr, AGENT_QUEUE_PAGES);
+        agent->queue_rptr = 0;
+    }
+    if (agent->code) {
+        vm_deallocate(task, agent->code, PAGE_SIZE);
+        agent->code = 0;
+    }
+
+    if (agent->request_semaphore) {
+        semaphore_destroy(task, agent->request_semaphore);
+        agent->request_semaphore = 0;
+    }
+    if (agent->done_semaphore) {
+        semaphore_destroy(task, agent->done_semaphore);
+        agent->done_semaphore = 0;
+    }
+}
+
+/*
+ * remote_agent_start -- Start the agent in the task.  This makes the
+ * one remote thread that the agent's calls will need.
+ */
+kern_return_t
+remote_agent_start(task_t task, remote_symbols_t* symbols,
+                   remote_agent_t* agent)
+{
+#if defined(__i386__)
+    kern_return_t kr;
+    vm_address_t queue = 0;
+    vm_prot_t cur_prot, max_prot;
+    mach_port_name_t request_name, done_name;
+
+    bzero(agent, sizeof(*agent));
+    agent->task = task;
+
+    /*
+     * Copy the agent's code to a page of its own
+     */
+    if ((kr = vm_allocate(task, &agent->code, PAGE_SIZE, TRUE)) ||
+        (kr = remote_copyout(task, (void*)agent_code, agent->code,
+                             sizeof(agent_code))) ||
+        (kr = vm_protect(task, agent->code, PAGE_SIZE, FALSE,
+                         VM_PROT_READ | VM_PROT_EXECUTE))) {
+        remote_agent_release(agent);
+        return kr;
+    }
+
+    /*
+     * Allocate the queue in the task and map the same pages here,
+     * so that posting a call needs no vm_write()
+     */
+    if ((kr = vm_allocate(task, &agent->queue_rptr, AGENT_QUEUE_PAGES,
+                          TRUE)) ||
+        (kr = vm_remap(mach_task_self(), &queue, AGENT_QUEUE_PAGES, 0,
+                       TRUE, task, agent->queue_rptr, FALSE,
+                       &cur_prot, &max_prot, VM_INHERIT_NONE))) {
+        remote_agent_release(agent);
+        return kr;
+    }
+    agent->queue = (agent_queue_t*)queue;
+
+    /*
+     * The semaphores belong to the task, and both sides have a
+     * send right to each
+     */
+    if ((kr = semaphore_create(task, &agent->request_semaphore,
+                               SYNC_POLICY_FIFO, 0)) ||
+        (kr = semaphore_create(task, &agent->done_semaphore,
+                               SYNC_POLICY_FIFO, 0)) ||
+        (kr = remote_insert_semaphore(task, agent->request_semaphore,
+                                      &request_name))) {
+        remote_agent_release(agent);
+        return kr;
+    }
+    agent->queue->request_semaphore = request_name;
+    
+    if ((kr = remote_insert_semaphore(task, agent->done_semaphore,
+                                      &done_name))) {
+        remote_agent_release(agent);
+        return kr;
+    }
+    agent->queue->done_semaphore = done_name;
+
+    agent->queue->semaphore_wait =
+        remote_function(symbols, FUNCTION_SEMAPHORE_WAIT,
+                        (void*)&semaphore_wait);
+    agent->queue->semaphore_signal =
+        remote_function(symbols, FUNCTION_SEMAPHORE_SIGNAL,
+                        (void*)&semaphore_signal);
+    if (!agent->queue->semaphore_wait || !agent->queue->semaphore_signal) {
+        remote_agent_release(agent);
+        return KERN_FAILURE;
+    }
+
+    if ((kr = create_remote_thread(task, symbols, &agent->thread,
+                                   agent->code, 1, agent->queue_rptr)) ||
+        (kr = start_remote_thread(&agent->thread))) {
+        remote_agent_release(agent);
+        return kr;
+    }
+
+    return kr;
+#else
+    return KERN_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Waits for the agent to complete a call, or timeout seconds unless
+ * timeout is 0.
+ */
+static kern_return_t
+remote_agent_wait_one(remote_agent_t* agent, int timeout)
+{
+    mach_timespec_t wait_time = { timeout, 0 };
+    kern_return_t kr;
+
+    kr = timeout ? semaphore_timedwait(agent->done_semaphore, wait_time)
+        : semaphore_wait(agent->done_semaphore);
+    return kr == KERN_ABORTED ? KERN_SUCCESS : kr;
+}
+
+/*
+ * remote_agent_post -- Queue a call for the agent, without waiting for
+ * it unless the queue is full.  The ticket is what to wait for it with.
+ */
+kern_return_t
+remote_agent_post(remote_agent_t* agent, vm_address_t function,
+                  uint32_t* ticket, int argc, ...)
+{
+    va_list ap;
+    kern_return_t kr;
+
+    va_start(ap, argc);
+    kr = remote_agent_vpost(agent, function, ticket, argc, ap);
+    va_end(ap);
+
+    return kr;
+}
+
+kern_return_t
+remote_agent_vpost(remote_agent_t* agent, vm_address_t function,
+                   uint32_t* ticket, int argc, va_list ap)
+{
+    agent_queue_t* queue = agent->queue;
+    agent_call_t* call;
+    kern_return_t kr;
+    int i;
+
+    if (argc > 8) {
+	// We don't handle that many arguments
+	return KERN_FAILURE;
+    }
+
+    while (queue->head - queue->tail >= AGENT_QUEUE_SIZE) {
+        if ((kr = remote_agent_wait_one(agent, AGENT_TIMEOUT)))
+            return kr;
+    }
+    
+    call = &queue->calls[queue->head % AGENT_QUEUE_SIZE];
+    call->function = function;
+    call->argc = argc;
+    for (i = 0; i < 8; i++)
+        call->args[i] = i < argc ? va_arg(ap, unsigned long) : 0;
+
+    /*
+     * semaphore_signal() is a trap, which orders the call before the
+     * agent can read it
+     */
+    *ticket = queue->head++;
+
+    return semaphore_signal(agent->request_semaphore);
+}
+
+/*
+ * remote_agent_wait -- Wait for a posted call to complete and get its
+ * return value, which is kept until AGENT_QUEUE_SIZE more calls have
+ * been posted.  Calls complete in the order they were posted.  Each
+ * completion is waited for timeout seconds at most, unless it is 0.
+ */
+kern_return_t
+remote_agent_wait(remote_agent_t* agent, uint32_t ticket, int timeout,
+                  void** return_value)
+{
+    agent_queue_t* queue = agent->queue;
+    kern_return_t kr;
+
+    /*
+     * The semaphore counts completions, not this call's; a call
+     * completed while waiting for a free slot left a count behind
+     */
+    while ((int32_t)(queue->tail - ticket) <= 0) {
+        if ((kr = remote_agent_wait_one(agent, timeout)))
+            return kr;
+    }
+
+    *return_value =
+        (void*)(unsigned long)queue->calls[ticket % AGENT_QUEUE_SIZE].result;
+    return KERN_SUCCESS;
+}
+
+/*
+ * remote_agent_stop -- Have the agent return once the calls posted
+ * already are done, and free it.
+ */
+kern_return_t
+remote_agent_stop(remote_agent_t* agent)
+{
+    kern_return_t kr = KERN_SUCCESS;
+    uint32_t ticket;
+    void* return_value;
+
+    if (agent->thread.state == RUNNING &&
+        !(kr = remote_agent_post(agent, 0, &ticket, 0))) {
+        kr = wait_remote_thread(&agent->thread, &return_value);
+    }
+
+    remote_agent_release(agent);
+    return kr;
+}
+
+/*
+ * remote_call -- Call a function in the task, through the agent if
+ * there is one, or on a remote thread of its own.  Symbols, if given,
+ * are what the thread is set up with.  The agent gives up on the call
+ * after timeout seconds, unless it is 0; a thread is always joined.
+ */
+kern_return_t
+remote_call(task_t task, remote_symbols_t* symbols, remote_agent_t* agent,
+            vm_address_t function, int timeout, void** return_value,
+            int argc, ...)
+{
+    va_list ap;
+    kern_return_t kr;
+    remote_thread_t thread;
+    uint32_t ticket;
+
+    va_start(ap, argc);
+    if (agent) {
+        if (!(kr = remote_agent_vpost(agent, function, &ticket, argc, ap)))
+            kr = remote_agent_wait(agent, ticket, timeout, return_value);
+    }
+    else if (!(kr = vcreate_remote_thread(task, symbols, &thread, function,
+                                          argc, ap))) {
+        kr = join_remote_thread(&thread, return_value);
+    }
+    va_end(ap);
+
+    return kr;
+}
+
 /**********************************************************************
  * Bundle injection
  **********************************************************************/
@@ -697,7 +1389,7 @@ remote_getpid(task_t task, pid_t* pid)
     kern_return_t kr;
     remote_thread_t thread;
     
-    if ((kr = create_remote_thread(task, &thread,
+    if ((kr = create_remote_thread(task, NULL, &thread,
                                    (vm_address_t)&getpid, 0))) {
         warnx("create_remote_thread() failed: %s", mach_error_string(kr));
         return kr;
@@ -712,12 +1404,13 @@ remote_getpid(task_t task, pid_t* pid)
 }
 
 kern_return_t
-inject_bundle(task_t task, const char* bundle_path, void** return_value)
+inject_bundle(task_t task, remote_symbols_t* symbols, remote_agent_t* agent,
+              const char* bundle_path, void** return_value)
 {
     kern_return_t kr;
     char path[PATH_MAX];
-    vm_address_t path_rptr, sub_rptr;
-    remote_thread_t thread;
+    remote_arena_t arena;
+    vm_address_t path_rptr, sub_rptr, dlopen_addr, dlsym_addr, address;
     void* dl_handle = 0, *sub_addr = 0;
 
     /*
@@ -729,101 +1422,532 @@ inject_bundle(task_t task, const char* bundle_path, void** return_value)
         warn("realpath");
         return KERN_FAILURE;
     }
-    
+
+    if (!(dlopen_addr = remote_function(symbols, FUNCTION_DLOPEN,
+                                        (void*)&dlopen))) {
+        warnx("dlopen() not found in the task");
+        return KERN_FAILURE;
+    }
+
     /*
-     * dl_handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)
+     * Both strings go out together, before the first call; "run" is
+     * only needed to look it up with a remote dlsym(), which is done
+     * without symbols, or if the task's image list can't be read again
      */
-    path_rptr = remote_malloc(task, sizeof(path));
-    remote_copyout(task, path, path_rptr, sizeof(path));
-
-    if ((kr = create_remote_thread(task, &thread,
-                                   (vm_address_t)&dlopen, 2,
-                                   path_rptr, RTLD_NOW | RTLD_LOCAL))) {
-	warnx("create_remote_thread dlopen() failed: %s",
-              mach_error_string(kr));
+    if ((kr = remote_arena_create(task, ARENA_SIZE, &arena))) {
+        warnx("remote_arena_create() failed: %s", mach_error_string(kr));
         return kr;
     }
 
-    if ((kr = join_remote_thread(&thread, &dl_handle))) {
-	warnx("join_remote_thread dlopen() failed: %s",
-              mach_error_string(kr));
+    path_rptr = remote_arena_alloc(&arena, path, strlen(path) + 1);
+    sub_rptr = remote_arena_alloc(&arena, BUNDLE_MAIN, sizeof(BUNDLE_MAIN));
+    
+    if ((kr = remote_arena_flush(&arena))) {
+        warnx("remote_arena_flush() failed: %s", mach_error_string(kr));
+        remote_arena_destroy(&arena);
+        return kr;
+    }
+    
+    /*
+     * dl_handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)
+     */
+    if ((kr = remote_call(task, symbols, agent, dlopen_addr, AGENT_TIMEOUT,
+                          &dl_handle, 2, path_rptr, RTLD_NOW | RTLD_LOCAL))) {
+	warnx("remote dlopen() failed: %s", mach_error_string(kr));
+        remote_arena_destroy(&arena);
         return kr;
     }
-
-    remote_free(task, path_rptr);
 
     if (dl_handle == NULL) {
         warnx("dlopen() failed");
+        remote_arena_destroy(&arena);
         return KERN_FAILURE;
     }
     
     /*
-     * sub_addr = dlsym(dl_handle, "run")
+     * sub_addr = dlsym(dl_handle, "run"), from the bundle's symbol
+     * table, now that it is in the task's image list.  The list can't
+     * be read while dyld is changing it, so the task is asked instead.
      */
-    sub_rptr = remote_malloc(task, strlen(BUNDLE_MAIN) + 1);
-    remote_copyout(task, BUNDLE_MAIN, sub_rptr, strlen(BUNDLE_MAIN) + 1);
-
-    if ((kr = create_remote_thread(task, &thread,
-                                   (vm_address_t)&dlsym, 2,
-                                   dl_handle, sub_rptr))) {
-        warnx("create_remote_thread dlsym() failed: %s",
+    if (symbols && (kr = remote_symbols_refresh(symbols)))
+        warnx("remote_symbols_refresh() failed: %s, using dlsym()",
               mach_error_string(kr));
-        return kr;
-    }
 
-    if ((kr = join_remote_thread(&thread, &sub_addr))) {
-	warnx("join_remote_thread dlsym() failed: %s",
-              mach_error_string(kr));
+    if (symbols && !kr) {
+        if (!remote_symbols_lookup(symbols, BUNDLE_MAIN, path, &address))
+            sub_addr = (void*)address;
+    }
+    else if (!(dlsym_addr = remote_function(symbols, FUNCTION_DLSYM,
+                                            (void*)&dlsym))) {
+        warnx("dlsym() not found in the task");
+        remote_arena_destroy(&arena);
+        return KERN_FAILURE;
+    }
+    else if ((kr = remote_call(task, symbols, agent, dlsym_addr,
+                               AGENT_TIMEOUT, &sub_addr, 2, dl_handle,
+                               sub_rptr))) {
+	warnx("remote dlsym() failed: %s", mach_error_string(kr));
+        remote_arena_destroy(&arena);
         return kr;
     }
 
-    remote_free(task, sub_rptr);
+    remote_arena_destroy(&arena);
 
     if (sub_addr) {
         /*
-         * return_value = run()
+         * return_value = run(), which takes as long as it takes
          */
-        if ((kr = create_remote_thread(task, &thread,
-                                       (vm_address_t)sub_addr, 0))) {
-            warnx("create_remote_thread run() failed: %s",
-                   mach_error_string(kr));
-            return kr;
-        }
-        
-        if ((kr = join_remote_thread(&thread, return_value))) {
-            warnx("join_remote_thread run() failed: %s",
-                  mach_error_string(kr));
+        if ((kr = remote_call(task, symbols, agent, (vm_address_t)sub_addr,
+                              0, return_value, 0))) {
+            warnx("remote run() failed: %s", mach_error_string(kr));
             return kr;
         }
-        
-        return (int)return_value;
     }
 
     return kr;
 }
 
-int main(int argc, char* argv[])
+/**********************************************************************
+ * Targets
+ **********************************************************************/
+
+#define TARGET_JOBS (8)     // Injections at once, by default
+#define TARGET_POLL (10)    // Milliseconds between checks for overdue ones
+
+#define WORKER_RUN_FAILED    (1)    // Worker exit: run() didn't return 0
+#define WORKER_INJECT_FAILED (2)    // Worker exit: the bundle wasn't run
+
+typedef enum {
+    PENDING,
+    INJECTING,
+    SUCCEEDED,
+    FAILED,         // Not injected, or the worker died
+    RUN_FAILED,     // Injected, but run() didn't return 0
+    TIMED_OUT
+} target_state_t;
+
+typedef struct {
+    pid_t           pid;
+    char            name[MAXCOMLEN + 1];
+    target_state_t  state;
+    pid_t           worker;     // Injecting into it
+    int             status;     // Of the worker, from waitpid()
+    uint64_t        start;      // mach_absolute_time()
+    uint64_t        end;
+} target_t;
+
+static double
+elapsed_ms(uint64_t start, uint64_t end)
 {
-    pid_t pid;
-    kern_return_t kr;
+    static mach_timebase_info_data_t timebase;
+
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+    return (double)(end - start) * timebase.numer / timebase.denom / 1e6;
+}
+
+/*
+ * inject_pid -- Inject the bundle into pid, or into ourselves if it is
+ * our own.  What run() returned, if it was called, is in return_value.
+ */
+static kern_return_t
+inject_pid(pid_t pid, const char* bundle_path, int with_agent,
+           void** return_value)
+{
+    kern_return_t kr, inject_kr;
     task_t task;
-    void* return_value;
+    remote_agent_t agent, *use_agent = NULL;
+    remote_symbols_t* symbols = NULL;
+
+    if (pid == getpid()) {
+        task = mach_task_self();
+    }
+    else if ((kr = task_for_pid(mach_task_self(), pid, &task))) {
+        errx(EXIT_FAILURE, "task_for_pid: %s", mach_error_string(kr));
+    }
+
+    /*
+     * Without the task's own symbols, functions are assumed to be
+     * where they are here
+     */
+    if ((kr = remote_symbols_create(task, &symbols)))
+        warnx("can't read the task's images, assuming they are laid out "
+              "as ours: %s", mach_error_string(kr));
+
+    if (with_agent) {
+        if ((kr = remote_agent_start(task, symbols, &agent)))
+            warnx("remote agent not started, using a thread per call: %s",
+                  mach_error_string(kr));
+        else
+            use_agent = &agent;
+    }
     
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s <path to bundle> [<pid>]\n", argv[0]);
-        exit(EXIT_FAILURE);
+    *return_value = NULL;
+    inject_kr = inject_bundle(task, symbols, use_agent, bundle_path,
+                              return_value);
+
+    if (use_agent && (kr = remote_agent_stop(use_agent)))
+        warnx("remote agent did not stop: %s", mach_error_string(kr));
+    remote_symbols_destroy(symbols);
+
+    return inject_kr;
+}
+
+/*
+ * list_processes -- Every process on the system, from sysctl()
+ */
+static struct kinfo_proc*
+list_processes(size_t* count)
+{
+    int mib[3] = { CTL_KERN, KERN_PROC, KERN_PROC_ALL };
+    struct kinfo_proc* procs = NULL;
+    size_t size;
+
+    // The list can grow between sizing it and reading it
+    while (1) {
+        if (sysctl(mib, 3, NULL, &size, NULL, 0) < 0)
+            err(EXIT_FAILURE, "sysctl");
+        size += size / 8;
+        if (!(procs = realloc(procs, size)))
+            err(EXIT_FAILURE, "realloc");
+        if (sysctl(mib, 3, procs, &size, NULL, 0) == 0)
+            break;
+        if (errno != ENOMEM)
+            err(EXIT_FAILURE, "sysctl");
+    }
+
+    *count = size / sizeof(*procs);
+    return procs;
+}
+
+static void
+add_target(target_t* targets, int* count, pid_t pid, const char* name)
+{
+    int i;
+
+    for (i = 0; i < *count; i++)
+        if (targets[i].pid == pid)
+            return;
+
+    targets[*count].pid = pid;
+    strlcpy(targets[*count].name, name, sizeof(targets[*count].name));
+    targets[*count].state = PENDING;
+    (*count)++;
+}
+
+/*
+ * parse_pid -- A pid given on the command line.  Anything but a
+ * positive number is refused, since pid 0 is the kernel.
+ */
+static pid_t
+parse_pid(const char* arg)
+{
+    char* end;
+    long pid;
+
+    errno = 0;
+    pid = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || pid <= 0 || pid != (pid_t)pid)
+        errx(EXIT_FAILURE, "%s: not a process id", arg);
+
+    return (pid_t)pid;
+}
+
+/*
+ * find_targets -- The pids given, then every other process whose name
+ * matches pattern, if there is one, but for ourselves and the kernel.
+ */
+static target_t*
+find_targets(char* pids[], int npids, const char* pattern, int* count)
+{
+    struct kinfo_proc* procs;
+    target_t* targets;
+    size_t nprocs, i;
+    const char* name;
+    pid_t pid;
+    int j;
+
+    procs = list_processes(&nprocs);
+    if (!(targets = calloc(nprocs + npids, sizeof(*targets))))
+        err(EXIT_FAILURE, "calloc");
+    *count = 0;
+
+    for (j = 0; j < npids; j++) {
+        pid = parse_pid(pids[j]);
+        for (i = 0, name = "-"; i < nprocs; i++)
+            if (procs[i].kp_proc.p_pid == pid)
+                name = procs[i].kp_proc.p_comm;
+        add_target(targets, count, pid, name);
+    }
+
+    for (i = 0; pattern && i < nprocs; i++) {
+        pid = procs[i].kp_proc.p_pid;
+        if (pid != 0 && pid != getpid() &&
+            !fnmatch(pattern, procs[i].kp_proc.p_comm, 0))
+            add_target(targets, count, pid, procs[i].kp_proc.p_comm);
     }
 
-    if (argc == 3) {
-        pid = atoi(argv[2]);
-        if ((kr = task_for_pid(mach_task_self(), pid, &task))) {
-            errx(EXIT_FAILURE, "task_for_pid: %s", mach_error_string(kr));
+    free(procs);
+    return targets;
+}
+
+/*
+ * warm_symbols -- Read the symbol tables of the images that the
+ * functions called remotely are in, from our own task, so that workers
+ * inherit them: targets sharing those images (as every process using
+ * the shared cache does) then only need their slide read.
+ */
+static void
+warm_symbols(void)
+{
+    remote_symbols_t* symbols;
+    int i;
+
+    if (remote_symbols_create(mach_task_self(), &symbols))
+        return;
+    for (i = 0; i < FUNCTION_COUNT; i++)
+        remote_function(symbols, i, NULL);
+    remote_symbols_destroy(symbols);
+}
+
+/*
+ * start_target -- Fork a worker to inject into the target.  Its
+ * warnings are prefixed with the target's pid.
+ */
+static int
+start_target(target_t* target, const char* bundle_path, int with_agent)
+{
+    static char progname[64];
+    void* return_value;
+
+    target->start = mach_absolute_time();
+    if ((target->worker = fork()) < 0)
+        return -1;
+
+    if (target->worker == 0) {
+        snprintf(progname, sizeof(progname), "%s: %d", getprogname(),
+                 target->pid);
+        setprogname(progname);
+        if (inject_pid(target->pid, bundle_path, with_agent, &return_value))
+            _exit(WORKER_INJECT_FAILED);
+        _exit(return_value ? WORKER_RUN_FAILED : EXIT_SUCCESS);
+    }
+
+    target->state = INJECTING;
+    return 0;
+}
+
+/*
+ * expire_targets -- Kill the workers of targets that have taken more
+ * than timeout seconds.  The target may be left with a suspended
+ * thread, or memory that is never freed.
+ */
+static void
+expire_targets(target_t* targets, int count, int timeout)
+{
+    uint64_t now = mach_absolute_time();
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (targets[i].state == INJECTING &&
+            elapsed_ms(targets[i].start, now) > timeout * 1000.0) {
+            kill(targets[i].worker, SIGKILL);
+            targets[i].state = TIMED_OUT;
         }
     }
-    else {
-        task = mach_task_self();
+}
+
+/*
+ * wait_worker -- Reap a worker, killing overdue ones while waiting if
+ * there is a timeout.
+ */
+static pid_t
+wait_worker(target_t* targets, int count, int timeout, int* status)
+{
+    pid_t worker;
+
+    while (1) {
+        if ((worker = waitpid(-1, status, timeout ? WNOHANG : 0)) > 0)
+            return worker;
+        if (worker < 0 && errno != EINTR)
+            err(EXIT_FAILURE, "waitpid");
+
+        if (worker == 0) {
+            expire_targets(targets, count, timeout);
+            usleep(TARGET_POLL * 1000);
+        }
     }
+}
+
+/*
+ * print_quoted -- Print a process name as a double-quoted value, with
+ * quotes, backslashes and unprintable characters escaped, so that the
+ * line stays key=value pairs whatever the name holds.
+ */
+static void
+print_quoted(const char* name)
+{
+    const unsigned char* p;
+
+    putchar('"');
+    for (p = (const unsigned char*)name; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            printf("\\%c", *p);
+        else if (*p < ' ' || *p >= 0x7f)
+            printf("\\%03o", *p);
+        else
+            putchar(*p);
+    }
+    putchar('"');
+}
+
+static void
+report_target(const target_t* target)
+{
+    static const char* const states[] = {
+        "pending", "injecting", "ok", "failed", "run_failed", "timeout"
+    };
+
+    printf("pid=%d name=", target->pid);
+    print_quoted(target->name);
+    printf(" status=%s", states[target->state]);
+    if (target->state == FAILED && WIFEXITED(target->status))
+        printf(" exit=%d", WEXITSTATUS(target->status));
+    else if (target->state == FAILED && WIFSIGNALED(target->status))
+        printf(" signal=%d", WTERMSIG(target->status));
+    printf(" ms=%.1f\n", elapsed_ms(target->start, target->end));
+
+    // Before the next fork, which would copy anything still buffered
+    fflush(stdout);
+}
+
+/*
+ * inject_targets -- Inject into every target, up to jobs of them at
+ * once, each from a worker process, so that one that fails or hangs
+ * takes no others with it.  Reports each target as it finishes, then
+ * all of them, and returns how many did not succeed.
+ */
+static int
+inject_targets(target_t* targets, int count, const char* bundle_path,
+               int with_agent, int jobs, int timeout)
+{
+    int next = 0, running = 0, failed = 0, run_failed = 0, timed_out = 0;
+    int status, i;
+    uint64_t start = mach_absolute_time();
+    target_t* target;
+    pid_t worker;
+
+    warm_symbols();
+
+    while (next < count || running > 0) {
+        while (running < jobs && next < count) {
+            // Out of processes: wait for a worker to finish first
+            if (start_target(&targets[next], bundle_path, with_agent) < 0) {
+                if (running == 0)
+                    err(EXIT_FAILURE, "fork");
+                break;
+            }
+            next++;
+            running++;
+        }
+
+        worker = wait_worker(targets, next, timeout, &status);
+        for (i = 0; i < next && targets[i].worker != worker; i++)
+            ;
+        if (i == next)
+            continue;
+
+        // Its pid may be a later worker's
+        target = &targets[i];
+        target->worker = 0;
+        target->end = mach_absolute_time();
+        target->status = status;
+        if (target->state == INJECTING && WIFEXITED(status) &&
+            WEXITSTATUS(status) == EXIT_SUCCESS)
+            target->state = SUCCEEDED;
+        else if (target->state == INJECTING && WIFEXITED(status) &&
+                 WEXITSTATUS(status) == WORKER_RUN_FAILED)
+            target->state = RUN_FAILED;
+        else if (target->state == INJECTING)
+            target->state = FAILED;
+        failed += target->state == FAILED;
+        run_failed += target->state == RUN_FAILED;
+        timed_out += target->state == TIMED_OUT;
+        running--;
+
+        report_target(target);
+    }
+
+    printf("targets=%d ok=%d failed=%d run_failed=%d timeout=%d ms=%.1f\n",
+           count, count - failed - run_failed - timed_out, failed, run_failed,
+           timed_out, elapsed_ms(start, mach_absolute_time()));
+
+    return failed + run_failed + timed_out;
+}
+
+static void
+usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-a] <path to bundle> [<pid>]\n"
+            "       %s [-a] [-j jobs] [-t seconds] [-n pattern] "
+            "<path to bundle> [<pid> ...]\n", name, name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* name = argv[0];
+    const char* pattern = NULL;
+    target_t* targets;
+    void* return_value;
+    int ch, count, with_agent = 0, jobs = TARGET_JOBS, timeout = 0;
     
-    inject_bundle(task, argv[1], &return_value);
-    return (int)return_value;
+    while ((ch = getopt(argc, argv, "aj:n:t:")) != -1) {
+        switch (ch) {
+        case 'a':
+            with_agent = 1;
+            break;
+        case 'j':
+            if ((jobs = atoi(optarg)) <= 0)
+                usage(name);
+            break;
+        case 'n':
+            pattern = optarg;
+            break;
+        case 't':
+            if ((timeout = atoi(optarg)) <= 0)
+                usage(name);
+            break;
+        default:
+            usage(name);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 2)
+        usage(name);
+
+    /*
+     * One target, in this process, which returns what run() did, as
+     * ever, once it is injected
+     */
+    if (!pattern && argc <= 3) {
+        if (inject_pid(argc == 3 ? parse_pid(argv[2]) : getpid(), argv[1],
+                       with_agent, &return_value))
+            return EXIT_FAILURE;
+        return (int)(intptr_t)return_value;
+    }
+
+    targets = find_targets(argv + 2, argc - 2, pattern, &count);
+    if (count == 0)
+        errx(EXIT_FAILURE, "no processes match %s", pattern);
+
+    if (inject_targets(targets, count, argv[1], with_agent, jobs, timeout)) {
+        free(targets);
+        return EXIT_FAILURE;
+    }
+
+    free(targets);
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,354 @@
+/***********************************************************************
+ * remote_cache.c -- Read-through page cache of a task's memory
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "remote_cache.h"
+#include "remote_transfer.h"
+
+#define PAGE_OF(a)     ((a) & ~(vm_address_t)(PAGE_SIZE - 1))
+#define NONE           (-1)
+#define MAX_PREFETCH   (16)
+
+typedef enum {
+    FREE,
+    CACHED,      // In its bucket, valid while its epoch is the cache's
+    FILLING      // Being read; not to be evicted
+} entry_state_t;
+
+typedef struct {
+    vm_address_t  address;     // Of the page
+    uint32_t      epoch;
+    int           next;        // In its bucket
+    char          state;
+    char          referenced;  // Since the clock hand last passed it
+} cache_entry_t;
+
+struct remote_cache {
+    task_t                task;
+    int                   pages;
+    int                   prefetch;
+    cache_entry_t*        entries;
+    char*                 data;          // A page per entry
+    int*                  buckets;
+    int                   bucket_shift;
+    int                   hand;
+    uint32_t              epoch;         // Advanced by invalidate_all
+    uint32_t              generation;
+    remote_cache_stats_t  stats;
+};
+
+static int
+bucket_of(remote_cache_t* cache, vm_address_t page)
+{
+    return (int)((uint32_t)(page / PAGE_SIZE) * 2654435761U >>
+                 cache->bucket_shift);
+}
+
+static void
+unlink_entry(remote_cache_t* cache, int i)
+{
+    int* link = &cache->buckets[bucket_of(cache, cache->entries[i].address)];
+
+    while (*link != i)
+        link = &cache->entries[*link].next;
+    *link = cache->entries[i].next;
+    cache->entries[i].state = FREE;
+}
+
+static void
+link_entry(remote_cache_t* cache, int i)
+{
+    int* bucket = &cache->buckets[bucket_of(cache, cache->entries[i].address)];
+
+    cache->entries[i].epoch = cache->epoch;
+    cache->entries[i].next = *bucket;
+    cache->entries[i].state = CACHED;
+    *bucket = i;
+}
+
+/*
+ * The entry caching page, or NONE.  An entry from before the last
+ * remote_cache_invalidate_all() is freed on the way.
+ */
+static int
+lookup(remote_cache_t* cache, vm_address_t page)
+{
+    int i = cache->buckets[bucket_of(cache, page)];
+
+    for (; i != NONE; i = cache->entries[i].next) {
+        if (cache->entries[i].address != page)
+            continue;
+        if (cache->entries[i].epoch == cache->epoch)
+            return i;
+        unlink_entry(cache, i);
+        return NONE;
+    }
+
+    return NONE;
+}
+
+/*
+ * An entry to fill, evicting by the clock algorithm if none is free:
+ * a page referenced since the hand last passed it gets another turn.
+ */
+static int
+allocate_entry(remote_cache_t* cache)
+{
+    cache_entry_t* entry;
+    int i;
+
+    while (1) {
+        i = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->pages;
+        entry = &cache->entries[i];
+
+        if (entry->state == FILLING)
+            continue;
+        if (entry->state == CACHED) {
+            if (entry->epoch == cache->epoch && entry->referenced) {
+                entry->referenced = 0;
+                continue;
+            }
+            if (entry->epoch == cache->epoch)
+                cache->stats.evicted++;
+            unlink_entry(cache, i);
+        }
+
+        entry->state = FILLING;
+        return i;
+    }
+}
+
+/*
+ * Reads page, and the pages after it up to the first cached one or
+ * prefetch of them, with one call.  If the pages after it can't be
+ * read, page is read on its own.
+ */
+static kern_return_t
+fill(remote_cache_t* cache, vm_address_t page, int* entry)
+{
+    remote_iovec_t iov[1 + MAX_PREFETCH];
+    int batch[1 + MAX_PREFETCH];
+    kern_return_t kr;
+    vm_address_t next;
+    int i, count = 0;
+
+    for (i = 0; i <= cache->prefetch; i++) {
+        next = page + i * PAGE_SIZE;
+        if (i > 0 && (next < page || lookup(cache, next) != NONE))
+            break;
+
+        batch[count] = allocate_entry(cache);
+        cache->entries[batch[count]].address = next;
+        iov[count].address = next;
+        iov[count].local = cache->data + (size_t)batch[count] * PAGE_SIZE;
+        iov[count].size = PAGE_SIZE;
+        count++;
+    }
+
+    cache->stats.reads++;
+    if ((kr = remote_readv(cache->task, iov, count)) && count > 1) {
+        for (i = 1; i < count; i++)
+            cache->entries[batch[i]].state = FREE;
+        count = 1;
+
+        cache->stats.reads++;
+        kr = remote_readv(cache->task, iov, 1);
+    }
+    if (kr) {
+        cache->entries[batch[0]].state = FREE;
+        return kr;
+    }
+
+    /*
+     * Prefetched pages are the first to go unless they are used
+     */
+    for (i = 0; i < count; i++) {
+        cache->entries[batch[i]].referenced = i == 0;
+        link_entry(cache, batch[i]);
+    }
+
+    cache->stats.misses++;
+    cache->stats.prefetched += count - 1;
+    *entry = batch[0];
+
+    return KERN_SUCCESS;
+}
+
+kern_return_t
+remote_cache_create(task_t task, int pages, int prefetch,
+                    remote_cache_t** cache)
+{
+    remote_cache_t* c;
+    vm_address_t data;
+    int i, buckets;
+
+    if (pages <= 0)
+        pages = REMOTE_CACHE_PAGES;
+    if (prefetch <= 0)
+        prefetch = REMOTE_CACHE_PREFETCH;
+
+    // A fill must leave at least one page to evict
+    if (prefetch > MAX_PREFETCH)
+        prefetch = MAX_PREFETCH;
+    if (prefetch > pages / 2 - 1)
+        prefetch = pages / 2 > 1 ? pages / 2 - 1 : 0;
+
+    if (!(c = calloc(1, sizeof(*c))))
+        return KERN_RESOURCE_SHORTAGE;
+
+    for (buckets = 1, c->bucket_shift = 32; buckets < pages; buckets <<= 1)
+        c->bucket_shift--;
+    if (c->bucket_shift == 32) {
+        // A shift by 32 is undefined; two buckets will do
+        buckets = 2;
+        c->bucket_shift = 31;
+    }
+
+    c->entries = calloc(pages, sizeof(*c->entries));
+    c->buckets = malloc(buckets * sizeof(*c->buckets));
+    if (!c->entries || !c->buckets ||
+        vm_allocate(mach_task_self(), &data, (vm_size_t)pages * PAGE_SIZE,
+                    TRUE)) {
+        free(c->entries);
+        free(c->buckets);
+        free(c);
+        return KERN_RESOURCE_SHORTAGE;
+    }
+
+    for (i = 0; i < buckets; i++)
+        c->buckets[i] = NONE;
+
+    c->task = task;
+    c->pages = pages;
+    c->prefetch = prefetch;
+    c->data = (char*)data;
+    *cache = c;
+
+    return KERN_SUCCESS;
+}
+
+void
+remote_cache_destroy(remote_cache_t* cache)
+{
+    if (!cache)
+        return;
+
+    vm_deallocate(mach_task_self(), (vm_address_t)cache->data,
+                  (vm_size_t)cache->pages * PAGE_SIZE);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+}
+
+kern_return_t
+remote_cache_read(remote_cache_t* cache, vm_address_t src, void* dest,
+                  size_t n)
+{
+    kern_return_t kr;
+    vm_address_t page;
+    size_t offset, chunk;
+    char* p = dest;
+    int i;
+
+    /*
+     * Large reads would only evict the pages being walked
+     */
+    if (n >= REMOTE_CACHE_BYPASS) {
+        remote_iovec_t iov = { src, dest, n };
+
+        cache->stats.bypassed++;
+        cache->stats.reads++;
+        return remote_readv(cache->task, &iov, 1);
+    }
+
+    while (n > 0) {
+        page = PAGE_OF(src);
+        offset = src - page;
+        chunk = PAGE_SIZE - offset < n ? PAGE_SIZE - offset : n;
+
+        if ((i = lookup(cache, page)) != NONE) {
+            cache->stats.hits++;
+            cache->entries[i].referenced = 1;
+        }
+        else if ((kr = fill(cache, page, &i))) {
+            return kr;
+        }
+
+        memcpy(p, cache->data + (size_t)i * PAGE_SIZE + offset, chunk);
+        src += chunk;
+        p += chunk;
+        n -= chunk;
+    }
+
+    return KERN_SUCCESS;
+}
+
+void
+remote_cache_invalidate(remote_cache_t* cache, vm_address_t address,
+                        size_t n)
+{
+    vm_address_t page, end;
+    int i;
+
+    cache->generation++;
+    if (n == 0)
+        return;
+
+    page = PAGE_OF(address);
+    end = PAGE_OF(address + n - 1);
+
+    /*
+     * A range bigger than the cache is quicker to check entry by entry
+     */
+    if ((end - page) / PAGE_SIZE >= (vm_address_t)cache->pages) {
+        for (i = 0; i < cache->pages; i++) {
+            if (cache->entries[i].state == CACHED &&
+                cache->entries[i].address >= page &&
+                cache->entries[i].address <= end) {
+                unlink_entry(cache, i);
+            }
+        }
+        return;
+    }
+
+    for (;; page += PAGE_SIZE) {
+        if ((i = lookup(cache, page)) != NONE)
+            unlink_entry(cache, i);
+        if (page == end)
+            break;
+    }
+}
+
+void
+remote_cache_invalidate_all(remote_cache_t* cache)
+{
+    int i;
+
+    cache->generation++;
+
+    /*
+     * Entries check their epoch when found; only when it wraps do
+     * they need to be freed here
+     */
+    if (++cache->epoch == 0) {
+        for (i = 0; i < cache->pages; i++)
+            if (cache->entries[i].state == CACHED)
+                unlink_entry(cache, i);
+    }
+}
+
+uint32_t
+remote_cache_generation(remote_cache_t* cache)
+{
+    return cache->generation;
+}
+
+void
+remote_cache_statistics(remote_cache_t* cache, remote_cache_stats_t* stats)
+{
+    *stats = cache->stats;
+}
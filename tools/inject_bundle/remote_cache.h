@@ -0,0 +1,82 @@
+/***********************************************************************
+ * remote_cache.h -- Read-through page cache of a task's memory
+ *
+ * Walking structures in another task, a field at a time, costs a
+ * vm_read_overwrite() per field with remote_copyin().  Read through a
+ * cache, it costs one per page not read before, with a few of the
+ * pages after it prefetched in the same call.  Reads of more than a
+ * few pages go straight to the task, and aren't kept.
+ *
+ * Nothing notices the task writing its memory, or remote_copyout()
+ * doing so: pages known to have changed must be invalidated.  Each
+ * invalidation advances the cache's generation, so anything derived
+ * from what was read can be checked for being as current.
+ *
+ * A cache is for one thread at a time.
+ **********************************************************************/
+
+#ifndef REMOTE_CACHE_H
+#define REMOTE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mach/mach.h>
+
+#define REMOTE_CACHE_PAGES    (256)           // Default size, in pages
+#define REMOTE_CACHE_PREFETCH (3)             // Default pages read ahead
+#define REMOTE_CACHE_BYPASS   (4*PAGE_SIZE)   // Reads this big skip it
+
+typedef struct remote_cache remote_cache_t;
+
+typedef struct {
+    unsigned long hits;          // Pages found cached
+    unsigned long misses;        // Pages that had to be read
+    unsigned long prefetched;    // Pages read ahead of a miss
+    unsigned long bypassed;      // Reads too big to cache
+    unsigned long reads;         // vm_read_overwrite() calls
+    unsigned long evicted;
+} remote_cache_stats_t;
+
+/*
+ * remote_cache_create -- Create a cache of up to pages pages of the
+ * task, reading up to prefetch pages after each miss.  0 for either
+ * picks the default.
+ */
+kern_return_t
+remote_cache_create(task_t task, int pages, int prefetch,
+                    remote_cache_t** cache);
+
+void
+remote_cache_destroy(remote_cache_t* cache);
+
+/*
+ * remote_cache_read -- remote_copyin(), through the cache.
+ */
+kern_return_t
+remote_cache_read(remote_cache_t* cache, vm_address_t src, void* dest,
+                  size_t n);
+
+/*
+ * remote_cache_invalidate -- Forget the pages holding n bytes at
+ * address.
+ */
+void
+remote_cache_invalidate(remote_cache_t* cache, vm_address_t address,
+                        size_t n);
+
+/*
+ * remote_cache_invalidate_all -- Forget every page, in constant time.
+ */
+void
+remote_cache_invalidate_all(remote_cache_t* cache);
+
+/*
+ * remote_cache_generation -- Advanced by every invalidation.
+ */
+uint32_t
+remote_cache_generation(remote_cache_t* cache);
+
+void
+remote_cache_statistics(remote_cache_t* cache, remote_cache_stats_t* stats);
+
+#endif
@@ -0,0 +1,586 @@
+/***********************************************************************
+ * remote_symbols.c -- Resolve symbols in a task from its own images
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+
+#include "remote_cache.h"
+#include "remote_symbols.h"
+
+#ifndef TASK_DYLD_ALL_IMAGE_INFO_64
+#define TASK_DYLD_ALL_IMAGE_INFO_64 1
+#endif
+
+#define IMAGE_PATH_MAX    (1024)
+#define SYMBOL_NAME_MAX   (1024)
+#define COMMANDS_MAX      (1024*1024)         // sizeofcmds we believe
+#define SYMBOLS_MAX       (4*1024*1024)       // nsyms we believe
+#define STRINGS_SPAN_MAX  (16*1024*1024)      // Read in one go, or by name
+
+/*
+ * An image's exported symbols, by name, at their unslid addresses.
+ * Name offset 0 is the empty string and marks an empty slot.
+ */
+typedef struct {
+    uint32_t  name;
+    uint64_t  value;
+} symbol_slot_t;
+
+typedef struct image_table {
+    uint8_t              uuid[16];
+    int                  has_uuid;
+    uint64_t             text_vmaddr;    // Unslid, to work out the slide
+    char*                names;
+    symbol_slot_t*       slots;
+    uint32_t             mask;           // Slots, less one
+    struct image_table*  next;           // In tables
+} image_table_t;
+
+typedef struct {
+    uint64_t         load_address;       // Of its Mach-O header
+    char*            path;
+    image_table_t*   table;              // NULL until first looked in
+    int              unreadable;         // So not tried again
+} remote_image_t;
+
+struct remote_symbols {
+    task_t           task;
+    remote_cache_t*  cache;
+    int              is64;
+    remote_image_t*  images;
+    int              count;
+};
+
+/*
+ * Tables of images with a UUID, shared by all resolvers and never freed
+ */
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static image_table_t* tables;
+
+static uint32_t
+hash_name(const char* name)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*name)
+        hash = (hash ^ (unsigned char)*name++) * 16777619U;
+    return hash;
+}
+
+static void
+free_table(image_table_t* table)
+{
+    if (table) {
+        free(table->names);
+        free(table->slots);
+        free(table);
+    }
+}
+
+static image_table_t*
+find_table(const uint8_t* uuid)
+{
+    image_table_t* table;
+
+    for (table = tables; table; table = table->next)
+        if (!memcmp(table->uuid, uuid, sizeof(table->uuid)))
+            return table;
+    return NULL;
+}
+
+/**********************************************************************
+ * Reading the task
+ **********************************************************************/
+
+static kern_return_t
+read_pointer(remote_symbols_t* symbols, uint64_t address, uint64_t* value)
+{
+    kern_return_t kr;
+    uint32_t value32;
+
+    if (symbols->is64)
+        return remote_cache_read(symbols->cache, (vm_address_t)address,
+                                 value, sizeof(*value));
+
+    kr = remote_cache_read(symbols->cache, (vm_address_t)address,
+                           &value32, sizeof(value32));
+    *value = value32;
+    return kr;
+}
+
+/*
+ * Reads a NUL-terminated string a page at most at a time, so that it
+ * can end just before memory that can't be read.
+ */
+static kern_return_t
+read_string(remote_symbols_t* symbols, uint64_t address, char* string,
+            size_t size)
+{
+    kern_return_t kr;
+    size_t done = 0, chunk;
+
+    while (done < size - 1) {
+        chunk = PAGE_SIZE - (size_t)((address + done) & (PAGE_SIZE - 1));
+        if (chunk > size - 1 - done)
+            chunk = size - 1 - done;
+        if ((kr = remote_cache_read(symbols->cache,
+                                    (vm_address_t)(address + done),
+                                    string + done, chunk)))
+            return kr;
+        if (memchr(string + done, '\0', chunk))
+            return KERN_SUCCESS;
+        done += chunk;
+    }
+
+    string[done] = '\0';
+    return KERN_SUCCESS;
+}
+
+/**********************************************************************
+ * Symbol tables
+ **********************************************************************/
+
+static int
+add_symbol(image_table_t* table, size_t* names_size, size_t* names_used,
+           const char* name, uint64_t value)
+{
+    uint32_t i;
+    size_t length = strlen(name) + 1;
+    char* names;
+
+    for (i = hash_name(name) & table->mask; table->slots[i].name;
+         i = (i + 1) & table->mask) {
+        if (!strcmp(table->names + table->slots[i].name, name))
+            return 1;    // The first definition wins
+    }
+
+    if (*names_used + length > *names_size) {
+        *names_size = (*names_size + length) * 2;
+        if (!(names = realloc(table->names, *names_size)))
+            return 0;
+        table->names = names;
+    }
+
+    memcpy(table->names + *names_used, name, length);
+    table->slots[i].name = (uint32_t)*names_used;
+    table->slots[i].value = value;
+    *names_used += length;
+
+    return 1;
+}
+
+static int
+is_exported(uint8_t type)
+{
+    return !(type & N_STAB) && (type & N_TYPE) == N_SECT && (type & N_EXT);
+}
+
+/*
+ * Reads the exported symbols of the image from its symbol table,
+ * found through its load commands.
+ */
+static image_table_t*
+read_table(remote_symbols_t* symbols, remote_image_t* image)
+{
+    struct mach_header_64 header;
+    struct load_command* lc;
+    struct symtab_command* symtab = NULL;
+    struct uuid_command* uuid_command;
+    uint8_t uuid[16];
+    uint64_t text_vmaddr = 0, linkedit_vmaddr = 0, linkedit_fileoff = 0;
+    uint64_t slide, linkedit, value;
+    uint32_t header_size, i, kept = 0, strx, min_strx = UINT32_MAX,
+        max_strx = 0, n_strx, slots;
+    size_t nlist_size, strings_span = 0, names_size = 4096, names_used = 1;
+    int has_text = 0, has_linkedit = 0, has_uuid = 0;
+    char* commands = NULL, *nlists = NULL, *strings = NULL, *p;
+    char name[SYMBOL_NAME_MAX];
+    image_table_t* table = NULL, *shared;
+    uint8_t type;
+
+    if (remote_cache_read(symbols->cache, (vm_address_t)image->load_address,
+                          &header, sizeof(header)))
+        return NULL;
+
+    if (header.magic == MH_MAGIC_64)
+        header_size = sizeof(struct mach_header_64);
+    else if (header.magic == MH_MAGIC)
+        header_size = sizeof(struct mach_header);
+    else
+        return NULL;
+
+    if (header.sizeofcmds > COMMANDS_MAX ||
+        !(commands = malloc(header.sizeofcmds)) ||
+        remote_cache_read(symbols->cache,
+                          (vm_address_t)(image->load_address + header_size),
+                          commands, header.sizeofcmds))
+        goto fail;
+
+    /*
+     * The slide comes from __TEXT, and the symbol table is in
+     * __LINKEDIT
+     */
+    for (i = 0, p = commands; i < header.ncmds; i++, p += lc->cmdsize) {
+        lc = (struct load_command*)p;
+        if ((size_t)(p - commands) + sizeof(*lc) > header.sizeofcmds ||
+            lc->cmdsize < sizeof(*lc) ||
+            lc->cmdsize > header.sizeofcmds - (size_t)(p - commands))
+            goto fail;
+
+        if (lc->cmd == LC_SEGMENT &&
+            lc->cmdsize >= sizeof(struct segment_command)) {
+            struct segment_command* segment = (struct segment_command*)lc;
+            if (!strncmp(segment->segname, SEG_TEXT, 16)) {
+                text_vmaddr = segment->vmaddr;
+                has_text = 1;
+            }
+            else if (!strncmp(segment->segname, SEG_LINKEDIT, 16)) {
+                linkedit_vmaddr = segment->vmaddr;
+                linkedit_fileoff = segment->fileoff;
+                has_linkedit = 1;
+            }
+        }
+        else if (lc->cmd == LC_SEGMENT_64 &&
+                 lc->cmdsize >= sizeof(struct segment_command_64)) {
+            struct segment_command_64* segment = (struct segment_command_64*)lc;
+            if (!strncmp(segment->segname, SEG_TEXT, 16)) {
+                text_vmaddr = segment->vmaddr;
+                has_text = 1;
+            }
+            else if (!strncmp(segment->segname, SEG_LINKEDIT, 16)) {
+                linkedit_vmaddr = segment->vmaddr;
+                linkedit_fileoff = segment->fileoff;
+                has_linkedit = 1;
+            }
+        }
+        else if (lc->cmd == LC_SYMTAB && lc->cmdsize >= sizeof(*symtab)) {
+            symtab = (struct symtab_command*)lc;
+        }
+        else if (lc->cmd == LC_UUID && lc->cmdsize >= sizeof(*uuid_command)) {
+            uuid_command = (struct uuid_command*)lc;
+            memcpy(uuid, uuid_command->uuid, sizeof(uuid));
+            has_uuid = 1;
+        }
+    }
+
+    if (!has_text || !has_linkedit || !symtab || symtab->nsyms > SYMBOLS_MAX)
+        goto fail;
+
+    /*
+     * Another task may have had it read already
+     */
+    if (has_uuid) {
+        pthread_mutex_lock(&tables_lock);
+        shared = find_table(uuid);
+        pthread_mutex_unlock(&tables_lock);
+        if (shared) {
+            free(commands);
+            return shared;
+        }
+    }
+
+    slide = image->load_address - text_vmaddr;
+    linkedit = linkedit_vmaddr + slide - linkedit_fileoff;
+    nlist_size = symbols->is64 ? sizeof(struct nlist_64) : sizeof(struct nlist);
+
+    if (!(nlists = malloc(symtab->nsyms * nlist_size + 1)) ||
+        remote_cache_read(symbols->cache,
+                          (vm_address_t)(linkedit + symtab->symoff),
+                          nlists, symtab->nsyms * nlist_size))
+        goto fail;
+
+    /*
+     * The names of the exported symbols are read at once if they are
+     * close enough together; in the shared cache, the string table is
+     * every image's
+     */
+    for (i = 0; i < symtab->nsyms; i++) {
+        p = nlists + i * nlist_size;
+        type = symbols->is64 ? ((struct nlist_64*)p)->n_type :
+            ((struct nlist*)p)->n_type;
+        strx = symbols->is64 ? ((struct nlist_64*)p)->n_un.n_strx :
+            ((struct nlist*)p)->n_un.n_strx;
+        if (!is_exported(type) || strx >= symtab->strsize)
+            continue;
+        kept++;
+        if (strx < min_strx)
+            min_strx = strx;
+        if (strx > max_strx)
+            max_strx = strx;
+    }
+
+    if (kept) {
+        strings_span = symtab->strsize - min_strx;
+        if (strings_span > (size_t)(max_strx - min_strx) + SYMBOL_NAME_MAX)
+            strings_span = (size_t)(max_strx - min_strx) + SYMBOL_NAME_MAX;
+        if (strings_span > STRINGS_SPAN_MAX ||
+            !(strings = malloc(strings_span)) ||
+            remote_cache_read(symbols->cache,
+                              (vm_address_t)(linkedit + symtab->stroff +
+                                             min_strx),
+                              strings, strings_span)) {
+            free(strings);
+            strings = NULL;
+        }
+    }
+
+    for (slots = 16; slots < kept * 2; slots <<= 1)
+        ;
+    if (!(table = calloc(1, sizeof(*table))) ||
+        !(table->slots = calloc(slots, sizeof(*table->slots))) ||
+        !(table->names = malloc(names_size)))
+        goto fail;
+    table->names[0] = '\0';
+    table->mask = slots - 1;
+    table->text_vmaddr = text_vmaddr;
+
+    for (i = 0; i < symtab->nsyms; i++) {
+        p = nlists + i * nlist_size;
+        if (symbols->is64) {
+            type = ((struct nlist_64*)p)->n_type;
+            n_strx = ((struct nlist_64*)p)->n_un.n_strx;
+            value = ((struct nlist_64*)p)->n_value;
+        }
+        else {
+            type = ((struct nlist*)p)->n_type;
+            n_strx = ((struct nlist*)p)->n_un.n_strx;
+            value = ((struct nlist*)p)->n_value;
+        }
+        if (!is_exported(type) || n_strx >= symtab->strsize)
+            continue;
+
+        if (strings && memchr(strings + (n_strx - min_strx), '\0',
+                              strings_span - (n_strx - min_strx))) {
+            p = strings + (n_strx - min_strx);
+        }
+        else if (!read_string(symbols, linkedit + symtab->stroff + n_strx,
+                              name, sizeof(name))) {
+            p = name;
+        }
+        else {
+            continue;
+        }
+
+        if (*p && !add_symbol(table, &names_size, &names_used, p, value))
+            goto fail;
+    }
+
+    free(commands);
+    free(nlists);
+    free(strings);
+
+    if (has_uuid) {
+        memcpy(table->uuid, uuid, sizeof(table->uuid));
+        table->has_uuid = 1;
+
+        pthread_mutex_lock(&tables_lock);
+        if ((shared = find_table(table->uuid))) {
+            free_table(table);
+            table = shared;
+        }
+        else {
+            table->next = tables;
+            tables = table;
+        }
+        pthread_mutex_unlock(&tables_lock);
+    }
+
+    return table;
+
+fail:
+    free(commands);
+    free(nlists);
+    free(strings);
+    free_table(table);
+    return NULL;
+}
+
+static int
+find_symbol(image_table_t* table, const char* name, uint64_t* value)
+{
+    uint32_t i;
+
+    for (i = hash_name(name) & table->mask; table->slots[i].name;
+         i = (i + 1) & table->mask) {
+        if (!strcmp(table->names + table->slots[i].name, name)) {
+            *value = table->slots[i].value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**********************************************************************
+ * Image list
+ **********************************************************************/
+
+static void
+free_images(remote_image_t* images, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(images[i].path);
+        if (images[i].table && !images[i].table->has_uuid)
+            free_table(images[i].table);
+    }
+    free(images);
+}
+
+kern_return_t
+remote_symbols_refresh(remote_symbols_t* symbols)
+{
+    struct task_dyld_info info;
+    mach_msg_type_number_t count = TASK_DYLD_INFO_COUNT;
+    kern_return_t kr;
+    uint32_t image_count, i;
+    uint64_t array, path;
+    size_t info_size;
+    remote_image_t* images;
+    char buffer[IMAGE_PATH_MAX];
+    int j;
+
+    if (task_info(symbols->task, TASK_DYLD_INFO, (task_info_t)&info, &count))
+        return KERN_FAILURE;
+    symbols->is64 = info.all_image_info_format == TASK_DYLD_ALL_IMAGE_INFO_64;
+    info_size = symbols->is64 ? 3 * sizeof(uint64_t) : 3 * sizeof(uint32_t);
+
+    // The list may have changed since it was last read
+    remote_cache_invalidate_all(symbols->cache);
+
+    /*
+     * dyld_all_image_infos: version, infoArrayCount, then infoArray,
+     * which is NULL while dyld is changing it
+     */
+    if ((kr = remote_cache_read(symbols->cache,
+                                (vm_address_t)info.all_image_info_addr + 4,
+                                &image_count, sizeof(image_count))) ||
+        (kr = read_pointer(symbols, info.all_image_info_addr + 8, &array)))
+        return kr;
+    if (!array || image_count > 65536)
+        return KERN_FAILURE;
+
+    if (!(images = calloc(image_count ? image_count : 1, sizeof(*images))))
+        return KERN_RESOURCE_SHORTAGE;
+
+    for (i = 0; i < image_count; i++) {
+        if ((kr = read_pointer(symbols, array + i * info_size,
+                               &images[i].load_address)) ||
+            (kr = read_pointer(symbols, array + i * info_size + info_size / 3,
+                               &path)) ||
+            (kr = read_string(symbols, path, buffer, sizeof(buffer)))) {
+            free_images(images, i);
+            return kr;
+        }
+        if (!(images[i].path = strdup(buffer))) {
+            free_images(images, i);
+            return KERN_RESOURCE_SHORTAGE;
+        }
+
+        /*
+         * Keep what was read of images that are still loaded
+         */
+        for (j = 0; j < symbols->count; j++) {
+            if (symbols->images[j].load_address == images[i].load_address &&
+                !strcmp(symbols->images[j].path, images[i].path)) {
+                images[i].table = symbols->images[j].table;
+                images[i].unreadable = symbols->images[j].unreadable;
+                symbols->images[j].table = NULL;
+                break;
+            }
+        }
+    }
+
+    free_images(symbols->images, symbols->count);
+    symbols->images = images;
+    symbols->count = image_count;
+
+    return KERN_SUCCESS;
+}
+
+kern_return_t
+remote_symbols_create(task_t task, remote_symbols_t** symbols)
+{
+    remote_symbols_t* s;
+    kern_return_t kr;
+
+    if (!(s = calloc(1, sizeof(*s))))
+        return KERN_RESOURCE_SHORTAGE;
+    s->task = task;
+
+    if ((kr = remote_cache_create(task, 0, 0, &s->cache)) ||
+        (kr = remote_symbols_refresh(s))) {
+        remote_symbols_destroy(s);
+        return kr;
+    }
+
+    *symbols = s;
+    return KERN_SUCCESS;
+}
+
+void
+remote_symbols_destroy(remote_symbols_t* symbols)
+{
+    if (!symbols)
+        return;
+
+    free_images(symbols->images, symbols->count);
+    remote_cache_destroy(symbols->cache);
+    free(symbols);
+}
+
+/*
+ * The name stops at a '.', so "libsystem_c" is libsystem_c.dylib and
+ * not libsystem_coreservices.dylib, and "libSystem" is libSystem.B.dylib
+ */
+static int
+image_matches(const char* path, const char* image)
+{
+    const char* file = strrchr(path, '/');
+    size_t length = strlen(image);
+
+    file = file ? file + 1 : path;
+    return !strcmp(path, image) ||
+        (!strncmp(file, image, length) &&
+         (file[length] == '\0' || file[length] == '.'));
+}
+
+kern_return_t
+remote_symbols_lookup(remote_symbols_t* symbols, const char* name,
+                      const char* image, vm_address_t* address)
+{
+    remote_image_t* remote_image;
+    char symbol[SYMBOL_NAME_MAX];
+    uint64_t value;
+    int i;
+
+    // Symbol tables have C names with an underscore in front
+    if (strlen(name) + 2 > sizeof(symbol))
+        return KERN_INVALID_ARGUMENT;
+    symbol[0] = '_';
+    strcpy(symbol + 1, name);
+
+    for (i = 0; i < symbols->count; i++) {
+        remote_image = &symbols->images[i];
+        if (image && !image_matches(remote_image->path, image))
+            continue;
+
+        if (!remote_image->table && !remote_image->unreadable &&
+            !(remote_image->table = read_table(symbols, remote_image)))
+            remote_image->unreadable = 1;
+
+        if (remote_image->table &&
+            find_symbol(remote_image->table, symbol, &value)) {
+            *address = (vm_address_t)(value + remote_image->load_address -
+                                      remote_image->table->text_vmaddr);
+            return KERN_SUCCESS;
+        }
+    }
+
+    return KERN_INVALID_ADDRESS;
+}
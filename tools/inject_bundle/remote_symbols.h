@@ -0,0 +1,54 @@
+/***********************************************************************
+ * remote_symbols.h -- Resolve symbols in a task from its own images
+ *
+ * Finds where a function is in a task without calling dlsym() there,
+ * or assuming that its libraries are loaded where ours are: the
+ * task's dyld image list and each image's Mach-O header and symbol
+ * table are read through a remote_cache_t, and looked up locally.
+ *
+ * An image's symbols are read the first time a lookup gets to it, and
+ * kept, by the UUID of the image, for every task they are looked up
+ * in; where an image is loaded only changes its slide.  Images that
+ * have no UUID are kept for the one task.
+ *
+ * A resolver is for one thread at a time; several may share the
+ * symbols of their images.
+ **********************************************************************/
+
+#ifndef REMOTE_SYMBOLS_H
+#define REMOTE_SYMBOLS_H
+
+#include <mach/mach.h>
+
+typedef struct remote_symbols remote_symbols_t;
+
+/*
+ * remote_symbols_create -- Read the task's image list.  Fails with
+ * KERN_FAILURE where the kernel can't say where it is (before 10.6),
+ * or dyld has not written it yet.
+ */
+kern_return_t
+remote_symbols_create(task_t task, remote_symbols_t** symbols);
+
+void
+remote_symbols_destroy(remote_symbols_t* symbols);
+
+/*
+ * remote_symbols_refresh -- Read the image list again, after images
+ * have been loaded or unloaded.
+ */
+kern_return_t
+remote_symbols_refresh(remote_symbols_t* symbols);
+
+/*
+ * remote_symbols_lookup -- Find a symbol by its C name, as dlsym()
+ * takes it, in the image whose path or file name is image, or whose
+ * file name is image followed by a '.' and its extensions, or in the
+ * first image that has it if image is NULL.
+ * Returns KERN_INVALID_ADDRESS if there is no such symbol.
+ */
+kern_return_t
+remote_symbols_lookup(remote_symbols_t* symbols, const char* name,
+                      const char* image, vm_address_t* address);
+
+#endif
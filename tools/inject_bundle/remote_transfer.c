@@ -0,0 +1,183 @@
+/***********************************************************************
+ * remote_transfer.c -- Vectored copies to and from a task's memory
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libkern/OSAtomic.h>
+
+#include "remote_transfer.h"
+
+#define PAGE_ROUND(n) (((n) + PAGE_SIZE - 1) & ~(vm_size_t)(PAGE_SIZE - 1))
+
+/*
+ * Spans sorted on the stack rather than in a malloc()ed array
+ */
+#define TRANSFER_STACK_SPANS (16)
+
+/*
+ * Free bounce buffers of TRANSFER_BUFFER_SIZE bytes, shared by every
+ * task being transferred to or from
+ */
+static struct {
+    pthread_mutex_t lock;
+    int             count;
+    vm_address_t    buffers[TRANSFER_POOL_SIZE];
+} pool = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static volatile int32_t calls;
+
+static kern_return_t
+buffer_get(size_t size, vm_address_t* buffer)
+{
+    if (size <= TRANSFER_BUFFER_SIZE) {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.count > 0) {
+            *buffer = pool.buffers[--pool.count];
+            pthread_mutex_unlock(&pool.lock);
+            return KERN_SUCCESS;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        size = TRANSFER_BUFFER_SIZE;
+    }
+
+    // vm_allocate() memory is page-aligned, as vm_write wants it
+    return vm_allocate(mach_task_self(), buffer, PAGE_ROUND(size), TRUE);
+}
+
+static void
+buffer_put(vm_address_t buffer, size_t size)
+{
+    if (size <= TRANSFER_BUFFER_SIZE) {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.count < TRANSFER_POOL_SIZE) {
+            pool.buffers[pool.count++] = buffer;
+            pthread_mutex_unlock(&pool.lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        size = TRANSFER_BUFFER_SIZE;
+    }
+
+    vm_deallocate(mach_task_self(), buffer, PAGE_ROUND(size));
+}
+
+static int
+compare_address(const void* a, const void* b)
+{
+    vm_address_t x = (*(const remote_iovec_t* const*)a)->address;
+    vm_address_t y = (*(const remote_iovec_t* const*)b)->address;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Moves a run of adjacent spans, size bytes in all, with one call.
+ */
+static kern_return_t
+transfer_run(task_t task, const remote_iovec_t** run, int count,
+             size_t size, int write)
+{
+    kern_return_t kr;
+    vm_address_t buffer;
+    vm_size_t done;
+    char* p;
+    int i;
+
+    if (size == 0)
+        return KERN_SUCCESS;
+
+    OSAtomicIncrement32(&calls);
+
+    /*
+     * A span of its own needs no bounce buffer, to be read into or
+     * to be written from if it is page-aligned
+     */
+    if (count == 1 && !write) {
+        return vm_read_overwrite(task, run[0]->address, size,
+                                 (vm_address_t)run[0]->local, &done);
+    }
+    if (count == 1 && !((vm_address_t)run[0]->local & (PAGE_SIZE - 1))) {
+        return vm_write(task, run[0]->address, (vm_offset_t)run[0]->local,
+                        size);
+    }
+
+    if ((kr = buffer_get(size, &buffer)))
+        return kr;
+
+    if (write) {
+        for (i = 0, p = (char*)buffer; i < count; p += run[i++]->size)
+            memcpy(p, run[i]->local, run[i]->size);
+        kr = vm_write(task, run[0]->address, (vm_offset_t)buffer, size);
+    }
+    else if (!(kr = vm_read_overwrite(task, run[0]->address, size,
+                                      buffer, &done))) {
+        for (i = 0, p = (char*)buffer; i < count; p += run[i++]->size)
+            memcpy(run[i]->local, p, run[i]->size);
+    }
+
+    buffer_put(buffer, size);
+    return kr;
+}
+
+static kern_return_t
+transfer(task_t task, const remote_iovec_t* iov, int count, int write)
+{
+    const remote_iovec_t* stack_order[TRANSFER_STACK_SPANS];
+    const remote_iovec_t** order = stack_order;
+    kern_return_t kr = KERN_SUCCESS;
+    vm_address_t end;
+    size_t size;
+    int i, j, sorted = 1;
+
+    if (count > TRANSFER_STACK_SPANS &&
+        !(order = malloc(count * sizeof(*order)))) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+
+    for (i = 0; i < count; i++) {
+        order[i] = &iov[i];
+        if (i > 0 && iov[i].address < iov[i - 1].address)
+            sorted = 0;
+    }
+    if (!sorted)
+        qsort(order, count, sizeof(*order), compare_address);
+
+    /*
+     * Merge each run of spans that follow each other in the task
+     */
+    for (i = 0; i < count && kr == KERN_SUCCESS; i = j) {
+        size = order[i]->size;
+        end = order[i]->address + size;
+        for (j = i + 1; j < count && order[j]->address == end; j++) {
+            size += order[j]->size;
+            end += order[j]->size;
+        }
+
+        kr = transfer_run(task, order + i, j - i, size, write);
+    }
+
+    if (order != stack_order)
+        free(order);
+
+    return kr;
+}
+
+kern_return_t
+remote_writev(task_t task, const remote_iovec_t* iov, int count)
+{
+    return transfer(task, iov, count, 1);
+}
+
+kern_return_t
+remote_readv(task_t task, const remote_iovec_t* iov, int count)
+{
+    return transfer(task, iov, count, 0);
+}
+
+unsigned long
+remote_transfer_calls(void)
+{
+    return (unsigned long)(uint32_t)calls;
+}
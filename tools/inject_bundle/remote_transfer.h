@@ -0,0 +1,52 @@
+/***********************************************************************
+ * remote_transfer.h -- Vectored copies to and from a task's memory
+ *
+ * A transfer is a list of spans, each a remote address and a local
+ * buffer of the same size.  Spans that are adjacent in the task are
+ * merged and moved with one vm_write() or vm_read_overwrite(), through
+ * page-aligned bounce buffers that are kept in a pool and reused.
+ **********************************************************************/
+
+#ifndef REMOTE_TRANSFER_H
+#define REMOTE_TRANSFER_H
+
+#include <stddef.h>
+#include <mach/mach.h>
+
+/*
+ * Runs of adjacent spans up to this size are gathered in pooled
+ * buffers; larger ones get a buffer of their own for the transfer.
+ */
+#define TRANSFER_BUFFER_SIZE (64*1024)
+#define TRANSFER_POOL_SIZE   (8)
+
+typedef struct {
+    vm_address_t  address;     // In the task
+    void*         local;
+    size_t        size;
+} remote_iovec_t;
+
+/*
+ * remote_writev -- Copy each span's local buffer to its address in
+ * the task.  Spans must not overlap; their order doesn't matter.
+ * Stops at the first failed write, leaving the spans after it in
+ * address order unwritten.
+ */
+kern_return_t
+remote_writev(task_t task, const remote_iovec_t* iov, int count);
+
+/*
+ * remote_readv -- Fill each span's local buffer from its address in
+ * the task.  As remote_writev(), in the other direction.
+ */
+kern_return_t
+remote_readv(task_t task, const remote_iovec_t* iov, int count);
+
+/*
+ * remote_transfer_calls -- Number of vm_write() and vm_read_overwrite()
+ * calls made so far, for measuring how well spans are merged.
+ */
+unsigned long
+remote_transfer_calls(void);
+
+#endif
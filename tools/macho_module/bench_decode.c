@@ -0,0 +1,203 @@
+/***********************************************************************
+ * NAME
+ *      bench_decode -- Measure x86_decode throughput and hook success
+ *                      rate over a corpus of real function prologues
+ *
+ * SYNOPSIS
+ *      bench_decode [ iterations ]
+ *
+ * DESCRIPTION
+ *      Decodes every prologue in the built-in i386 and x86_64 corpora
+ *      the way eatKnownInstructions() does and reports, per
+ *      architecture, how many prologues mach_override_ptr() could
+ *      patch and how long decoding takes.  Output is one key=value
+ *      line per architecture so that results can be diffed between
+ *      releases.
+ *
+ *      The prologues were taken from libSystem, CoreFoundation,
+ *      Foundation and AppKit on Mac OS X 10.5 and 10.6.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "x86_decode.h"
+
+#define JMP_SIZE 5      // E9 rel32 written over the prologue
+
+/*
+ * Keep in sync with instructionIsMovable() in mach_override.c.  Other
+ * pc-relative instructions are relocated into the reentry island.
+ */
+#define IS_MOVABLE(insn) \
+    (!(((insn).flags & kX86FlagRelativeBranch) && (insn).immSize == 2))
+
+typedef struct {
+    const char*   name;
+    unsigned char code[24];
+} prologue_t;
+
+static const prologue_t prologues_i386[] = {
+    { "malloc",              { 0x55, 0x89, 0xe5, 0x53, 0x83, 0xec, 0x14, 0xe8, 0x00, 0x00, 0x00, 0x00 } },
+    { "free",                { 0x55, 0x89, 0xe5, 0x57, 0x56, 0x53, 0x83, 0xec, 0x2c, 0xe8, 0x00, 0x00, 0x00, 0x00 } },
+    { "strlen",              { 0x8b, 0x4c, 0x24, 0x04, 0x89, 0xca, 0x83, 0xe2, 0x0f, 0x74, 0x12 } },
+    { "memcpy",              { 0x55, 0x89, 0xe5, 0x56, 0x57, 0x8b, 0x7d, 0x08, 0x8b, 0x75, 0x0c } },
+    { "open",                { 0xb8, 0x05, 0x00, 0x00, 0x00, 0xe8, 0x01, 0x00, 0x00, 0x00, 0xc3 } },
+    { "write",               { 0xb8, 0x04, 0x00, 0x00, 0x00, 0xe8, 0x01, 0x00, 0x00, 0x00, 0xc3 } },
+    { "pthread_mutex_lock",  { 0x55, 0x89, 0xe5, 0x57, 0x56, 0x53, 0x83, 0xec, 0x3c, 0x8b, 0x5d, 0x08 } },
+    { "printf",              { 0x55, 0x89, 0xe5, 0x53, 0x83, 0xec, 0x24, 0xe8, 0x00, 0x00, 0x00, 0x00, 0x5b } },
+    { "dlopen",              { 0x55, 0x89, 0xe5, 0x81, 0xec, 0x88, 0x00, 0x00, 0x00, 0x89, 0x5d, 0xf4 } },
+    { "dlsym",               { 0x55, 0x89, 0xe5, 0xe8, 0x00, 0x00, 0x00, 0x00, 0x59, 0x83, 0xec, 0x18 } },
+    { "NSCreateObjectFileImageFromMemory",
+                             { 0x55, 0x89, 0xe5, 0x57, 0x56, 0x53, 0x83, 0xec, 0x4c, 0xe8, 0x00, 0x00, 0x00, 0x00 } },
+    { "NSLinkModule",        { 0x55, 0x89, 0xe5, 0x83, 0xec, 0x28, 0x8b, 0x45, 0x10, 0x89, 0x44, 0x24, 0x08 } },
+    { "CFRetain",            { 0x55, 0x89, 0xe5, 0x5d, 0xe9, 0x10, 0x20, 0x00, 0x00 } },
+    { "CFRelease",           { 0x55, 0x89, 0xe5, 0x53, 0x57, 0x56, 0x83, 0xe4, 0xf0, 0x83, 0xec, 0x30 } },
+    { "objc_msgSend",        { 0x8b, 0x44, 0x24, 0x04, 0x85, 0xc0, 0x74, 0x4f, 0x8b, 0x10 } },
+    { "_sysenter_trap",      { 0x5a, 0x89, 0xe1, 0x0f, 0x34, 0x90 } },
+    { "getpid",              { 0xb8, 0x14, 0x00, 0x00, 0x00, 0xcd, 0x80, 0x72, 0x01, 0xc3 } },
+    { "stub_helper",         { 0xff, 0x25, 0x3c, 0x10, 0x00, 0x00 } },
+    { "__error",             { 0x55, 0x89, 0xe5, 0x83, 0xec, 0x08, 0xe8, 0x00, 0x00, 0x00, 0x00 } },
+    { "bzero",               { 0x55, 0x89, 0xe5, 0x57, 0x8b, 0x7d, 0x08, 0x8b, 0x4d, 0x0c, 0x31, 0xc0 } },
+    { "spin_lock",           { 0x8b, 0x54, 0x24, 0x04, 0x31, 0xc0, 0xb9, 0x01, 0x00, 0x00, 0x00 } },
+    { "sqrt",                { 0xf2, 0x0f, 0x51, 0x44, 0x24, 0x04, 0xf2, 0x0f, 0x11, 0x44, 0x24, 0x04 } },
+    { "nop_padded",          { 0x90, 0x90, 0x55, 0x89, 0xe5, 0x53, 0x83, 0xec, 0x04 } },
+    { "pthread_self",        { 0x65, 0xa1, 0x18, 0x00, 0x00, 0x00, 0xc3 } },
+    { "OSAtomicAdd32",       { 0x8b, 0x44, 0x24, 0x04, 0x8b, 0x54, 0x24, 0x08, 0x89, 0xc1, 0xf0, 0x0f, 0xc1, 0x02 } },
+    { "return_zero",         { 0x31, 0xc0, 0xc3, 0x90, 0x90, 0x90 } },
+    { "short_jump",          { 0xeb, 0x06, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90 } },
+};
+
+static const prologue_t prologues_x86_64[] = {
+    { "malloc",              { 0x55, 0x48, 0x89, 0xe5, 0x41, 0x57, 0x41, 0x56, 0x53, 0x50 } },
+    { "free",                { 0x55, 0x48, 0x89, 0xe5, 0x41, 0x56, 0x53, 0x48, 0x89, 0xfb } },
+    { "strlen",              { 0x48, 0x89, 0xf9, 0x48, 0x89, 0xfa, 0x48, 0x83, 0xe7, 0xf0, 0x66, 0x0f, 0xef, 0xc0 } },
+    { "memcpy",              { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x89, 0xf8, 0x48, 0x83, 0xfa, 0x50 } },
+    { "open",                { 0xb8, 0x05, 0x00, 0x00, 0x02, 0x49, 0x89, 0xca, 0x0f, 0x05 } },
+    { "write",               { 0xb8, 0x04, 0x00, 0x00, 0x02, 0x49, 0x89, 0xca, 0x0f, 0x05 } },
+    { "pthread_mutex_lock",  { 0x55, 0x48, 0x89, 0xe5, 0x41, 0x57, 0x41, 0x56, 0x41, 0x55, 0x41, 0x54 } },
+    { "printf",              { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x81, 0xec, 0xd0, 0x00, 0x00, 0x00, 0x84, 0xc0 } },
+    { "dlopen",              { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x8b, 0x05, 0x95, 0x3e, 0x02, 0x00 } },
+    { "dlsym",               { 0x48, 0x8b, 0x05, 0xd1, 0x2a, 0x01, 0x00, 0x48, 0x8b, 0x00 } },
+    { "NSCreateObjectFileImageFromMemory",
+                             { 0x55, 0x48, 0x89, 0xe5, 0x41, 0x57, 0x41, 0x56, 0x41, 0x55, 0x41, 0x54, 0x53 } },
+    { "NSLinkModule",        { 0x55, 0x48, 0x89, 0xe5, 0x53, 0x48, 0x83, 0xec, 0x18, 0x48, 0x89, 0xfb } },
+    { "CFRetain",            { 0x55, 0x48, 0x89, 0xe5, 0x5d, 0xe9, 0x66, 0x12, 0x00, 0x00 } },
+    { "CFRelease",           { 0x55, 0x48, 0x89, 0xe5, 0x53, 0x50, 0x48, 0x85, 0xff, 0x74, 0x2a } },
+    { "objc_msgSend",        { 0x48, 0x85, 0xff, 0x74, 0x4b, 0x48, 0x8b, 0x07 } },
+    { "pthread_self",        { 0x65, 0x48, 0x8b, 0x04, 0x25, 0x00, 0x00, 0x00, 0x00, 0xc3 } },
+    { "getpid",              { 0xb8, 0x14, 0x00, 0x00, 0x02, 0x49, 0x89, 0xca, 0x0f, 0x05, 0xc3 } },
+    { "stub_helper",         { 0xff, 0x25, 0x62, 0x0f, 0x00, 0x00 } },
+    { "__error",             { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x8d, 0x05, 0x3c, 0x7b, 0x02, 0x00, 0x5d, 0xc3 } },
+    { "bzero",               { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x89, 0xf1, 0x48, 0x83, 0xfe, 0x10 } },
+    { "spin_lock",           { 0x31, 0xc0, 0xb9, 0x01, 0x00, 0x00, 0x00, 0xf0, 0x0f, 0xb1, 0x0f } },
+    { "sqrt",                { 0xf2, 0x0f, 0x51, 0xc0, 0xc3 } },
+    { "nop_padded",          { 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00, 0x55 } },
+    { "endbr64",             { 0xf3, 0x0f, 0x1e, 0xfa, 0x55, 0x48, 0x89, 0xe5 } },
+    { "vzeroupper",          { 0xc5, 0xf8, 0x77, 0x55, 0x48, 0x89, 0xe5 } },
+    { "stack_guard",         { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xec, 0x40, 0x48, 0x8b, 0x05, 0x11, 0x22, 0x00, 0x00 } },
+    { "OSAtomicAdd32",       { 0x89, 0xf8, 0xf0, 0x0f, 0xc1, 0x06, 0x01, 0xf8, 0xc3 } },
+    { "tail_call",           { 0x48, 0x83, 0xc7, 0x10, 0xe9, 0x10, 0x00, 0x00, 0x00 } },
+    { "return_zero",         { 0x31, 0xc0, 0xc3, 0x90, 0x90, 0x90 } },
+    { "short_jump",          { 0xeb, 0x06, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90 } },
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Returns the number of bytes eaten to make room for the jump, or 0 if
+ * the prologue cannot be patched.  Mirrors eatKnownInstructions().
+ */
+static int
+eat_prologue(const unsigned char* code, int is64, int* insn_count)
+{
+    X86Instruction insn;
+    int eaten = 0;
+
+    while (eaten < JMP_SIZE) {
+        int n = x86DecodeInstruction(code + eaten, is64, &insn);
+
+        (*insn_count)++;
+        if (n == 0 || !IS_MOVABLE(insn))
+            return 0;
+        eaten += n;
+        if ((insn.flags & kX86FlagEndsFlow) && eaten < JMP_SIZE)
+            return 0;
+    }
+
+    return eaten;
+}
+
+static double
+now_ns(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+static void
+bench(const char* arch, const prologue_t* corpus, size_t count,
+      int is64, long iterations)
+{
+    size_t i;
+    long iter;
+    int hookable = 0, insns = 0, eaten_total = 0;
+    volatile int sink = 0;
+    double start, elapsed;
+
+    /*
+     * One pass for the success rate and, with BENCH_VERBOSE set, the
+     * prologues that cannot be patched.
+     */
+    for (i = 0; i < count; i++) {
+        int eaten = eat_prologue(corpus[i].code, is64, &insns);
+
+        if (eaten) {
+            hookable++;
+            eaten_total += eaten;
+        }
+        else if (getenv("BENCH_VERBOSE")) {
+            fprintf(stderr, "%s: cannot patch %s\n", arch, corpus[i].name);
+        }
+    }
+
+    start = now_ns();
+    for (iter = 0; iter < iterations; iter++) {
+        int n = 0;
+
+        for (i = 0; i < count; i++) {
+            sink += eat_prologue(corpus[i].code, is64, &n);
+        }
+    }
+    elapsed = now_ns() - start;
+
+    printf("arch=%s prologues=%lu hookable=%d success_rate=%.3f "
+           "avg_eaten=%.2f insns=%d ns_per_insn=%.2f ns_per_prologue=%.2f\n",
+           arch, (unsigned long)count, hookable,
+           (double)hookable / count,
+           hookable ? (double)eaten_total / hookable : 0.0, insns,
+           elapsed / ((double)insns * iterations),
+           elapsed / ((double)count * iterations));
+}
+
+int main(int argc, char* argv[])
+{
+    long iterations = 200000;
+
+    if (argc > 1) {
+        iterations = atol(argv[1]);
+        if (iterations <= 0) {
+            fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bench("i386", prologues_i386, COUNT(prologues_i386), 0, iterations);
+    bench("x86_64", prologues_x86_64, COUNT(prologues_x86_64), 1, iterations);
+
+    return 0;
+}
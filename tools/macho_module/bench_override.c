@@ -0,0 +1,260 @@
+/***********************************************************************
+ * NAME
+ *      bench_override -- Measure hook install latency, island memory
+ *                        and per-call overhead of mach_override
+ *
+ * SYNOPSIS
+ *      bench_override [ hooks [ calls ] ]
+ *
+ * DESCRIPTION
+ *      Generates 2 * hooks small functions in an executable page and
+ *      overrides the first half one mach_override_ptr() call at a
+ *      time and the second half with a single mach_override_batch().
+ *      Reports the latency of each install (mean, median and 99th
+ *      percentile), the bytes of islands each hook uses and the
+ *      executable memory mapped for them per hook (which grows a slab
+ *      at a time), and how many nanoseconds a call costs before and
+ *      after hooking, both for an override that replaces its function
+ *      and for one that calls through to the original via the reentry
+ *      island.
+ *
+ *      Output is one key=value line so that results can be diffed
+ *      between releases and platforms.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+
+#include "mach_override.h"
+
+#define FUNCTION_SIZE 32
+
+#if defined(__x86_64__)
+#define ARCH "x86_64"
+/* push %rbp; mov %rsp,%rbp; lea 1(%rdi),%eax; pop %rbp; ret */
+static const unsigned char function_template[] = {
+    0x55, 0x48, 0x89, 0xe5, 0x8d, 0x47, 0x01, 0x5d, 0xc3
+};
+#elif defined(__i386__)
+#define ARCH "i386"
+/* push %ebp; mov %esp,%ebp; mov 8(%ebp),%eax; inc %eax; pop %ebp; ret */
+static const unsigned char function_template[] = {
+    0x55, 0x89, 0xe5, 0x8b, 0x45, 0x08, 0x40, 0x5d, 0xc3
+};
+#else
+#error bench_override only knows how to generate x86 functions
+#endif
+
+#ifdef __APPLE__
+#define OS "darwin"
+#elif defined(__linux__)
+#define OS "linux"
+#else
+#define OS "unknown"
+#endif
+
+typedef int (*function_t)(int);
+
+static function_t reentry_passthrough;
+
+static int
+replace(int x)
+{
+    return x + 1;
+}
+
+static int
+passthrough(int x)
+{
+    return reentry_passthrough(x);
+}
+
+static double
+now_ns(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static int
+compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Bytes of executable memory mapped in the task; islands are the only
+ * executable memory created while hooks are installed.
+ */
+static unsigned long
+executable_bytes(void)
+{
+    vm_address_t address = 0;
+    vm_size_t size = 0;
+    vm_region_basic_info_data_64_t info;
+    mach_msg_type_number_t count;
+    mach_port_t object;
+    unsigned long total = 0;
+
+    for (;; address += size) {
+        count = VM_REGION_BASIC_INFO_COUNT_64;
+        if (vm_region_64(mach_task_self(), &address, &size, VM_REGION_BASIC_INFO_64,
+                         (vm_region_info_t)&info, &count, &object) != KERN_SUCCESS)
+            break;
+        if (info.protection & VM_PROT_EXECUTE)
+            total += size;
+    }
+
+    return total;
+}
+
+/*
+ * Bytes of islands behind a mach_override_ptr() hook: the escape island
+ * its prologue now jumps to, and its reentry island if it has one.
+ */
+static unsigned long
+island_bytes(function_t function, void* reentry)
+{
+    const unsigned char* code = (const unsigned char*)function;
+    unsigned long bytes = reentry ? MACH_OVERRIDE_ISLAND_STRIDE : 0;
+
+    if (code[0] == 0xE9)
+        bytes += MACH_OVERRIDE_ISLAND_STRIDE;
+    return bytes;
+}
+
+/* Average cost of one call through a pointer the compiler can't see through. */
+static double
+call_ns(function_t function, long calls)
+{
+    function_t volatile fn = function;
+    volatile int sink = 0;
+    double start;
+    long i;
+
+    for (i = 0; i < calls / 16; i++)
+        sink += fn((int)i);
+
+    start = now_ns();
+    for (i = 0; i < calls; i++)
+        sink += fn((int)i);
+
+    return (now_ns() - start) / calls;
+}
+
+int main(int argc, char* argv[])
+{
+    long hooks = 256, calls = 20000000, i;
+    unsigned char* page;
+    size_t page_size;
+    function_t* functions;
+    void** reentries;
+    double* latency;
+    double base_ns, replace_ns, passthrough_ns, batch_ns, total = 0;
+    unsigned long exec_before, exec_after, islands = 0;
+    mach_override_entry_t* entries;
+    mach_error_t err;
+
+    if (argc > 1)
+        hooks = atol(argv[1]);
+    if (argc > 2)
+        calls = atol(argv[2]);
+    if (hooks < 2 || calls <= 0) {
+        fprintf(stderr, "usage: %s [hooks [calls]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    page_size = (size_t)hooks * 2 * FUNCTION_SIZE;
+    page = mmap(NULL, page_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANON, -1, 0);
+    functions = calloc(hooks * 2, sizeof(*functions));
+    reentries = calloc(hooks, sizeof(*reentries));
+    latency = calloc(hooks, sizeof(*latency));
+    entries = calloc(hooks, sizeof(*entries));
+    if (page == MAP_FAILED || !functions || !reentries || !latency || !entries) {
+        perror("bench_override");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < hooks * 2; i++) {
+        unsigned char* code = page + i * FUNCTION_SIZE;
+
+        memset(code, 0x90, FUNCTION_SIZE);
+        memcpy(code, function_template, sizeof(function_template));
+        functions[i] = (function_t)code;
+    }
+
+    base_ns = call_ns(functions[0], calls);
+    exec_before = executable_bytes();
+
+    for (i = 0; i < hooks; i++) {
+        double start = now_ns();
+
+        err = mach_override_ptr((void*)functions[i],
+                                (const void*)(i == 0 ? passthrough : replace),
+                                &reentries[i]);
+        latency[i] = now_ns() - start;
+        if (err) {
+            fprintf(stderr, "mach_override_ptr: hook %ld failed: %d\n", i, err);
+            exit(EXIT_FAILURE);
+        }
+        total += latency[i];
+    }
+    exec_after = executable_bytes();
+    for (i = 0; i < hooks; i++)
+        islands += island_bytes(functions[i], reentries[i]);
+    reentry_passthrough = (function_t)reentries[0];
+
+    for (i = 0; i < hooks; i++) {
+        entries[i].originalFunctionAddress = (void*)functions[hooks + i];
+        entries[i].overrideFunctionAddress = (const void*)replace;
+        entries[i].originalFunctionReentryIsland = &reentries[i];
+    }
+    batch_ns = now_ns();
+    err = mach_override_batch(entries, hooks, NULL);
+    batch_ns = now_ns() - batch_ns;
+    if (err) {
+        fprintf(stderr, "mach_override_batch: %d\n", err);
+        exit(EXIT_FAILURE);
+    }
+
+    if (functions[0](41) != 42 || functions[1](41) != 42 || functions[hooks](41) != 42) {
+        fprintf(stderr, "bench_override: hooked functions returned wrong results\n");
+        exit(EXIT_FAILURE);
+    }
+    passthrough_ns = call_ns(functions[0], calls);
+    replace_ns = call_ns(functions[1], calls);
+
+    qsort(latency, hooks, sizeof(*latency), compare_double);
+
+    printf("arch=%s os=%s hooks=%ld install_ns_mean=%.0f install_ns_p50=%.0f "
+           "install_ns_p99=%.0f batch_ns_per_hook=%.0f island_bytes_per_hook=%.1f "
+           "island_mapped_bytes_per_hook=%.1f "
+           "call_ns=%.2f call_ns_replace=%.2f call_ns_passthrough=%.2f "
+           "extra_ns_replace=%.2f extra_ns_passthrough=%.2f\n",
+           ARCH, OS, hooks, total / hooks, latency[hooks / 2],
+           latency[(hooks * 99) / 100], batch_ns / hooks,
+           (double)islands / hooks, (double)(exec_after - exec_before) / hooks,
+           base_ns, replace_ns, passthrough_ns,
+           replace_ns - base_ns, passthrough_ns - base_ns);
+
+    return 0;
+}
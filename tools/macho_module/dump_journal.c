@@ -0,0 +1,366 @@
+/*******************************************************************************
+ dump_journal.c
+ Append-only journal of captures, each described by what its Mach-O
+ header says, with a compact index for finding captures by UUID or
+ segment without reading the journal or the modules.
+
+ Entries and their index records are appended under one lock, entries
+ first, so that every index record points at a complete entry.
+
+ ***************************************************************************/
+
+#include "dump_journal.h"
+
+#include <sys/stat.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSByteOrder.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#if defined(__x86_64__)
+#define	kHostCPUType			CPU_TYPE_X86_64
+#elif defined(__i386__)
+#define	kHostCPUType			CPU_TYPE_I386
+#else
+#define	kHostCPUType			CPU_TYPE_POWERPC
+#endif
+
+/**************************
+ *
+ *	Globals
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Globals)
+
+static char				gDirectory[PATH_MAX];
+static int				gJournalFD = -1;
+static int				gIndexFD = -1;
+static pthread_mutex_t	gJournalLock = PTHREAD_MUTEX_INITIALIZER;
+static void				*gBuffer = NULL;		//	entries being appended
+static size_t			gBufferSize = 0;
+static mach_error_t		gOpenError = err_none;
+static pthread_once_t	gOpenOnce = PTHREAD_ONCE_INIT;
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+//	Checks a journal or index header, writing it if the file is new.
+static mach_error_t
+checkHeader(
+			int			fd,
+			uint32_t	magic,
+			uint32_t	recordSize )
+{
+	dump_store_header_t	header = { magic, kDumpJournalVersion, recordSize, 0 };
+
+	return dumpStoreCheckHeader( fd, &header, sizeof( header ) );
+}
+
+static void
+openJournal( void )
+{
+	char	path[PATH_MAX];
+
+	if( mkdir( gDirectory, 0700 ) && errno != EEXIST ) {
+		gOpenError = KERN_FAILURE;
+		return;
+	}
+	snprintf( path, sizeof( path ), "%s/" kDumpJournalName, gDirectory );
+	gJournalFD = open( path, O_RDWR|O_CREAT|O_APPEND, 0600 );
+	gOpenError = gJournalFD < 0 ? KERN_FAILURE
+		: checkHeader( gJournalFD, kDumpJournalMagic, sizeof( dump_journal_entry_t ) );
+
+	if( !gOpenError ) {
+		snprintf( path, sizeof( path ), "%s/" kDumpJournalIndexName, gDirectory );
+		gIndexFD = open( path, O_RDWR|O_CREAT|O_APPEND, 0600 );
+		gOpenError = gIndexFD < 0 ? KERN_FAILURE
+			: checkHeader( gIndexFD, kDumpJournalIndexMagic, sizeof( dump_journal_index_t ) );
+	}
+}
+
+//	Picks the slice of a fat module to describe. Fat headers are big-endian.
+static mach_error_t
+findSlice(
+		  const unsigned char	**bytes,
+		  size_t				*size )
+{
+	struct fat_header	header;
+	struct fat_arch		arch;
+	uint32_t			count, i, offset = 0, length = 0;
+
+	memcpy( &header, *bytes, sizeof( header ) );
+	count = OSSwapBigToHostInt32( header.nfat_arch );
+	if( count > (*size - sizeof( header )) / sizeof( arch ) )
+		return KERN_INVALID_ARGUMENT;
+
+	for( i = 0; i < count; i++ ) {
+		memcpy( &arch, *bytes + sizeof( header ) + i * sizeof( arch ), sizeof( arch ) );
+		if( i == 0 || (cpu_type_t) OSSwapBigToHostInt32( arch.cputype ) == kHostCPUType ) {
+			offset = OSSwapBigToHostInt32( arch.offset );
+			length = OSSwapBigToHostInt32( arch.size );
+		}
+	}
+	if( !count || offset > *size || length > *size - offset )
+		return KERN_INVALID_ARGUMENT;
+	*bytes += offset;
+	*size = length;
+	return err_none;
+}
+
+static void
+addSegment(
+		   dump_journal_capture_t	*capture,
+		   const char				*name,
+		   uint64_t					vmaddr,
+		   uint64_t					vmsize,
+		   uint64_t					fileoff,
+		   uint64_t					filesize,
+		   int32_t					maxprot,
+		   int32_t					initprot )
+{
+	dump_journal_segment_t	*segment;
+
+	if( capture->entry.segmentCount == kDumpJournalMaxSegments ) {
+		capture->entry.flags |= kDumpJournalTruncated;
+		return;
+	}
+	segment = &capture->segments[capture->entry.segmentCount++];
+	memcpy( segment->name, name, sizeof( segment->name ) );
+	segment->vmaddr = vmaddr;
+	segment->vmsize = vmsize;
+	segment->fileoff = fileoff;
+	segment->filesize = filesize;
+	segment->maxprot = maxprot;
+	segment->initprot = initprot;
+}
+
+/***************************************************************************//**
+	Walks a thin module's load commands, collecting its UUID and segments.
+	Commands are copied out before use, as a module in memory needn't be
+	aligned.
+
+	@param	bytes	->	The slice.
+	@param	size	->	Its size.
+	@param	capture	<->	Filled in.
+	@result			<-	KERN_INVALID_ARGUMENT if it isn't Mach-O, or a load
+						command overruns.
+
+	***************************************************************************/
+
+static mach_error_t
+describeSlice(
+			  const unsigned char		*bytes,
+			  size_t					size,
+			  dump_journal_capture_t	*capture )
+{
+	struct mach_header_64		header;
+	struct load_command			command;
+	struct uuid_command			uuid;
+	struct segment_command		segment;
+	struct segment_command_64	segment64;
+	size_t						headerSize, offset, end;
+	uint32_t					i, magic;
+
+	if( size < sizeof( struct mach_header ) )
+		return KERN_INVALID_ARGUMENT;
+	memcpy( &magic, bytes, sizeof( magic ) );
+	if( magic == MH_MAGIC_64 )
+		headerSize = sizeof( struct mach_header_64 );
+	else if( magic == MH_MAGIC )
+		headerSize = sizeof( struct mach_header );
+	else
+		return KERN_INVALID_ARGUMENT;
+	if( size < headerSize )
+		return KERN_INVALID_ARGUMENT;
+	memcpy( &header, bytes, headerSize );
+	if( header.sizeofcmds > size - headerSize )
+		return KERN_INVALID_ARGUMENT;
+
+	capture->entry.cputype = header.cputype;
+	capture->entry.cpusubtype = header.cpusubtype;
+	capture->entry.filetype = header.filetype;
+	capture->entry.flags |= kDumpJournalMachO;
+
+	end = headerSize + header.sizeofcmds;
+	for( i = 0, offset = headerSize; i < header.ncmds; i++, offset += command.cmdsize ) {
+		if( end - offset < sizeof( command ) )
+			return KERN_INVALID_ARGUMENT;
+		memcpy( &command, bytes + offset, sizeof( command ) );
+		if( command.cmdsize < sizeof( command ) || command.cmdsize > end - offset )
+			return KERN_INVALID_ARGUMENT;
+
+		if( command.cmd == LC_UUID && command.cmdsize >= sizeof( uuid ) ) {
+			memcpy( &uuid, bytes + offset, sizeof( uuid ) );
+			memcpy( capture->entry.uuid, uuid.uuid, sizeof( capture->entry.uuid ) );
+			capture->entry.flags |= kDumpJournalHasUUID;
+		} else if( command.cmd == LC_SEGMENT_64 && magic == MH_MAGIC_64
+				   && command.cmdsize >= sizeof( segment64 ) ) {
+			memcpy( &segment64, bytes + offset, sizeof( segment64 ) );
+			addSegment( capture, segment64.segname, segment64.vmaddr, segment64.vmsize,
+						segment64.fileoff, segment64.filesize,
+						segment64.maxprot, segment64.initprot );
+		} else if( command.cmd == LC_SEGMENT && magic == MH_MAGIC
+				   && command.cmdsize >= sizeof( segment ) ) {
+			memcpy( &segment, bytes + offset, sizeof( segment ) );
+			addSegment( capture, segment.segname, segment.vmaddr, segment.vmsize,
+						segment.fileoff, segment.filesize,
+						segment.maxprot, segment.initprot );
+		}
+	}
+	return err_none;
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+dumpJournalOpen(
+				const char	*directory )
+{
+	if( !gDirectory[0] )
+		strlcpy( gDirectory, directory ? directory : kDumpStoreDefaultDirectory,
+				 sizeof( gDirectory ) );
+	pthread_once( &gOpenOnce, openJournal );
+	return gOpenError;
+}
+
+mach_error_t
+dumpJournalDescribe(
+					const void				*bytes,
+					size_t					size,
+					dump_journal_capture_t	*capture )
+{
+	const unsigned char	*slice = bytes;
+	uint32_t			magic = 0;
+	mach_error_t		err = err_none;
+
+	assert( bytes || !size );
+	assert( capture );
+
+	memset( capture->entry.uuid, 0, sizeof( capture->entry.uuid ) );
+	capture->entry.segmentCount = 0;
+	capture->entry.cputype = 0;
+	capture->entry.cpusubtype = 0;
+	capture->entry.filetype = 0;
+	capture->entry.flags = 0;
+
+	if( size >= sizeof( struct fat_header ) )
+		memcpy( &magic, slice, sizeof( magic ) );
+	if( OSSwapBigToHostInt32( magic ) == FAT_MAGIC ) {
+		err = findSlice( &slice, &size );
+		capture->entry.flags |= kDumpJournalFat;
+	}
+	if( !err )
+		err = describeSlice( slice, size, capture );
+
+	capture->entry.entrySize = sizeof( dump_journal_entry_t )
+		+ capture->entry.segmentCount * sizeof( dump_journal_segment_t );
+	return err;
+}
+
+mach_error_t
+dumpJournalAppend(
+				  const dump_journal_capture_t * const	*captures,
+				  size_t								count )
+{
+	dump_journal_index_t		*records;
+	const dump_journal_entry_t	*entry;
+	unsigned char				*p;
+	size_t						i, j, total = 0;
+	off_t						start, indexStart;
+	mach_error_t				err;
+
+	assert( captures || !count );
+
+	if( dumpJournalOpen( NULL ) )
+		return KERN_FAILURE;
+	if( !count )
+		return err_none;
+	for( i = 0; i < count; i++ )
+		total += captures[i]->entry.entrySize;
+
+	pthread_mutex_lock( &gJournalLock );
+
+	//	Entries, then the index records, in one buffer kept between calls.
+	if( gBufferSize < total + count * sizeof( *records ) ) {
+		free( gBuffer );
+		gBufferSize = total + count * sizeof( *records );
+		gBuffer = malloc( gBufferSize );
+		if( !gBuffer ) {
+			gBufferSize = 0;
+			pthread_mutex_unlock( &gJournalLock );
+			return KERN_FAILURE;
+		}
+	}
+	start = lseek( gJournalFD, 0, SEEK_END );
+	p = gBuffer;
+	records = (dump_journal_index_t *) ((unsigned char *) gBuffer + total);
+	for( i = 0; i < count; i++ ) {
+		entry = &captures[i]->entry;
+		memcpy( p, entry, entry->entrySize );
+		memcpy( records[i].uuid, entry->uuid, sizeof( records[i].uuid ) );
+		records[i].segments = 0;
+		for( j = 0; j < entry->segmentCount; j++ )
+			records[i].segments |= dumpJournalSegmentBit( captures[i]->segments[j].name );
+		records[i].offset = (uint64_t) start + (p - (unsigned char *) gBuffer);
+		records[i].entrySize = entry->entrySize;
+		records[i].flags = entry->flags;
+		p += entry->entrySize;
+	}
+
+	err = start < 0 ? KERN_FAILURE : dumpStoreWriteAll( gJournalFD, gBuffer, total );
+	if( err && start >= 0 )
+		ftruncate( gJournalFD, start );
+	if( !err ) {
+		//	Losing these only costs queries a longer read of the journal.
+		indexStart = lseek( gIndexFD, 0, SEEK_END );
+		err = indexStart < 0 ? KERN_FAILURE
+			: dumpStoreWriteAll( gIndexFD, records, count * sizeof( *records ) );
+		if( err && indexStart >= 0 )
+			ftruncate( gIndexFD, indexStart );
+	}
+
+	pthread_mutex_unlock( &gJournalLock );
+	return err;
+}
+
+uint64_t
+dumpJournalSegmentBit(
+					  const char	*name )
+{
+	uint64_t	hash = 0xCBF29CE484222325ULL;		//	FNV-1a
+	size_t		i;
+
+	assert( name );
+
+	for( i = 0; i < 16 && name[i]; i++ )
+		hash = (hash ^ (unsigned char) name[i]) * 0x100000001B3ULL;
+	return 1ULL << (hash >> 58);
+}
@@ -0,0 +1,166 @@
+/*******************************************************************************
+ dump_journal.h
+ Append-only journal of captures, each described by what its Mach-O
+ header says, with a compact index for finding captures by UUID or
+ segment without reading the journal or the modules.
+
+ ***************************************************************************/
+
+#ifndef		_dump_journal_
+#define		_dump_journal_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#include "dump_store.h"
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+#define	kDumpJournalMagic			0x44504A4E	//	'DPJN'
+#define	kDumpJournalIndexMagic		0x44504A58	//	'DPJX'
+#define	kDumpJournalVersion			1
+#define	kDumpJournalMaxSegments		16
+
+	/**
+	 Kept in the store directory, next to the store's own index. Both start
+	 with a dump_store_header_t whose recordSize is that of
+	 dump_journal_entry_t and dump_journal_index_t respectively.
+	 */
+#define	kDumpJournalName			"journal"
+#define	kDumpJournalIndexName		"journal.index"
+
+	//	dump_journal_entry_t.flags
+#define	kDumpJournalMachO			0x1			//	the header was parsed
+#define	kDumpJournalHasUUID			0x2
+#define	kDumpJournalFat				0x4			//	described slice is one of several
+#define	kDumpJournalTruncated		0x8			//	more than kDumpJournalMaxSegments
+
+	typedef	struct	{
+		char		name[16];
+		uint64_t	vmaddr;
+		uint64_t	vmsize;
+		uint64_t	fileoff;		//	from the start of the slice
+		uint64_t	filesize;
+		int32_t		maxprot;
+		int32_t		initprot;
+	}	dump_journal_segment_t;
+
+	/**
+	 One capture. Entries are entrySize bytes long: this, then segmentCount
+	 segments. Fields of a module that isn't Mach-O are zero, other than
+	 those describing the capture itself.
+	 */
+	typedef	struct	{
+		uint32_t			entrySize;
+		uint32_t			segmentCount;
+		uint64_t			time;		//	microseconds since the epoch
+		uint64_t			thread;		//	pthread_mach_thread_np()
+		uint64_t			caller;		//	of the capturing hook
+		uint64_t			address;
+		uint64_t			size;
+		dump_store_hash_t	hash;		//	of the contents, in the store
+		uint8_t				uuid[16];
+		int32_t				cputype;
+		int32_t				cpusubtype;
+		uint32_t			filetype;
+		uint32_t			flags;
+		uint32_t			pid;
+		uint32_t			reserved;
+	}	dump_journal_entry_t;
+
+	/**
+	 An entry with room for its segments, as filled in before it is
+	 appended.
+	 */
+	typedef	struct	{
+		dump_journal_entry_t	entry;
+		dump_journal_segment_t	segments[kDumpJournalMaxSegments];
+	}	dump_journal_capture_t;
+
+	/**
+	 The index has one of these per entry, in journal order. A query scans
+	 the index, which is a small fraction of the journal's size, and only
+	 reads the entries it matches. Entries appended to the journal but not
+	 the index, by a crash or a failed write in between, show up as a gap
+	 between the end of one indexed entry and the start of the next, or
+	 after the last, and are read from the journal instead.
+	 */
+	typedef	struct	{
+		uint8_t		uuid[16];
+		uint64_t	segments;		//	dumpJournalSegmentBit() of each name
+		uint64_t	offset;			//	of the entry in the journal
+		uint32_t	entrySize;
+		uint32_t	flags;			//	the entry's
+	}	dump_journal_index_t;
+
+	/***************************************************************************//**
+	 Opens, or creates, the journal and its index. Only the first call has
+	 an effect.
+
+	 @param	directory	->	Store directory. NULL for kDumpStoreDefaultDirectory.
+	 @result				<-	KERN_FAILURE if either couldn't be opened or isn't
+							one.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpJournalOpen(
+					const char	*directory );
+
+	/***************************************************************************//**
+	 Fills in a capture's CPU type, file type, UUID and segments from the
+	 module's Mach-O header, reading no further than its load commands. Of
+	 a fat module, the slice for this CPU is described, or the first. Every
+	 offset and size is checked against the module's size, so any bytes
+	 can be passed. The fields describing the capture itself are left to
+	 the caller.
+
+	 @param	bytes	->	The module.
+	 @param	size	->	Its size.
+	 @param	capture	<-	Its description; segmentCount and entrySize are set.
+	 @result			<-	KERN_INVALID_ARGUMENT if it isn't Mach-O, or its
+						header is cut short.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpJournalDescribe(
+						const void				*bytes,
+						size_t					size,
+						dump_journal_capture_t	*capture );
+
+	/***************************************************************************//**
+	 Appends captures to the journal, with one write, then their index
+	 records, with another.
+
+	 @param	captures	->	Captures to append.
+	 @param	count		->	Their number.
+	 @result				<-	KERN_FAILURE if they couldn't be written.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpJournalAppend(
+					  const dump_journal_capture_t * const	*captures,
+					  size_t								count );
+
+	/***************************************************************************//**
+	 The bit standing for a segment name in dump_journal_index_t.segments.
+	 A set bit only says an entry may have the segment.
+
+	 @param	name	->	Segment name, of up to 16 characters.
+	 @result			<-	A single bit.
+
+	 ***************************************************************************/
+
+	uint64_t
+	dumpJournalSegmentBit(
+						  const char	*name );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_dump_journal_
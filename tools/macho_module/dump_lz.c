@@ -0,0 +1,259 @@
+/*******************************************************************************
+ dump_lz.c
+ Small, dependency-free LZ compressor for captured modules, producing
+ blocks in the LZ4 block format.
+
+ ***************************************************************************/
+
+#include "dump_lz.h"
+
+#include <assert.h>
+#include <string.h>
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#define	kMinMatch				4
+#define	kHashBits				12
+#define	kLastLiterals			5		//	a block ends with at least this many
+#define	kMatchSearchMargin		12		//	no match starts in the last bytes
+#define	kSkipStrength			6		//	step up the search in literal runs
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+static inline uint32_t
+read32(
+	   const unsigned char	*p )
+{
+	uint32_t	value;
+
+	memcpy( &value, p, sizeof( value ) );
+	return value;
+}
+
+static inline uint32_t
+hashSequence(
+			 uint32_t	sequence )
+{
+	return (sequence * 2654435761U) >> (32 - kHashBits);
+}
+
+//	How many bytes at p match those at ref, stopping at limit. A word at a
+//	time: the first differing bit of the two words gives the byte.
+static inline size_t
+matchLength(
+			const unsigned char	*p,
+			const unsigned char	*ref,
+			const unsigned char	*limit )
+{
+	const unsigned char	*start = p;
+	uint64_t			a, b;
+
+	while( limit - p >= 8 ) {
+		memcpy( &a, p, 8 );
+		memcpy( &b, ref, 8 );
+		if( a != b )
+#if defined(__BIG_ENDIAN__)
+			return p - start + (__builtin_clzll( a ^ b ) >> 3);
+#else
+			return p - start + (__builtin_ctzll( a ^ b ) >> 3);
+#endif
+		p += 8;
+		ref += 8;
+	}
+	while( p < limit && *p == *ref )
+		p++, ref++;
+	return p - start;
+}
+
+//	Writes the 255-byte continuation of a length whose nibble saturated.
+static inline unsigned char *
+putLength(
+		  unsigned char	*op,
+		  size_t		length )
+{
+	for( ; length >= 255; length -= 255 )
+		*op++ = 255;
+	*op++ = (unsigned char) length;
+	return op;
+}
+
+/***************************************************************************//**
+	Emits one sequence, checking it fits first.
+
+	@param	op			->	Output position.
+	@param	outputEnd	->	End of the output.
+	@param	literals	->	The literal run.
+	@param	literalSize	->	Its size.
+	@param	offset		->	Match offset; 0 for the last sequence.
+	@param	matchSize	->	Match length.
+	@result				<-	The new output position; NULL if out of room.
+
+	***************************************************************************/
+
+static unsigned char *
+putSequence(
+			unsigned char			*op,
+			const unsigned char		*outputEnd,
+			const unsigned char		*literals,
+			size_t					literalSize,
+			size_t					offset,
+			size_t					matchSize )
+{
+	unsigned char	*token;
+	size_t			matchCode = offset ? matchSize - kMinMatch : 0;
+	size_t			needed = 1 + literalSize;
+
+	//	Token, literals, their length's continuation, then the offset and
+	//	the match length's.
+	if( literalSize >= 15 )
+		needed += (literalSize - 15) / 255 + 1;
+	if( offset )
+		needed += 2 + (matchCode >= 15 ? (matchCode - 15) / 255 + 1 : 0);
+	if( (size_t) (outputEnd - op) < needed )
+		return NULL;
+
+	token = op++;
+	*token = (unsigned char) ((literalSize < 15 ? literalSize : 15) << 4);
+	if( literalSize >= 15 )
+		op = putLength( op, literalSize - 15 );
+	memcpy( op, literals, literalSize );
+	op += literalSize;
+	if( !offset )
+		return op;
+
+	*op++ = (unsigned char) offset;
+	*op++ = (unsigned char) (offset >> 8);
+	*token |= matchCode < 15 ? matchCode : 15;
+	if( matchCode >= 15 )
+		op = putLength( op, matchCode - 15 );
+	return op;
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+size_t
+dumpLZCompress(
+			   const void	*input,
+			   size_t		inputSize,
+			   void			*output,
+			   size_t		outputCapacity )
+{
+	const unsigned char	*in = input;
+	const unsigned char	*outputEnd = (unsigned char *) output + outputCapacity;
+	unsigned char		*op = output;
+	uint16_t			table[1 << kHashBits];
+	size_t				ip = 0, anchor = 0, searches = 0, ref, length;
+	uint32_t			sequence, h;
+
+	assert( input || !inputSize );
+	assert( output );
+	assert( inputSize <= kDumpLZMaxBlockSize );
+
+	memset( table, 0, sizeof( table ) );
+	if( inputSize > kMatchSearchMargin ) {
+		while( ip < inputSize - kMatchSearchMargin ) {
+			sequence = read32( in + ip );
+			h = hashSequence( sequence );
+			ref = table[h];
+			table[h] = (uint16_t) ip;
+			if( ref >= ip || read32( in + ref ) != sequence ) {
+				//	Incompressible stretches are skipped faster and faster.
+				ip += 1 + (searches++ >> kSkipStrength);
+				continue;
+			}
+			searches = 0;
+
+			//	Grow the match backwards into the literals, then forwards.
+			while( ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1] )
+				ip--, ref--;
+			length = kMinMatch + matchLength( in + ip + kMinMatch, in + ref + kMinMatch,
+											  in + inputSize - kLastLiterals );
+
+			op = putSequence( op, outputEnd, in + anchor, ip - anchor, ip - ref, length );
+			if( !op )
+				return 0;
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	op = putSequence( op, outputEnd, in + anchor, inputSize - anchor, 0, 0 );
+	return op ? (size_t) (op - (unsigned char *) output) : 0;
+}
+
+mach_error_t
+dumpLZDecompress(
+				 const void	*input,
+				 size_t		inputSize,
+				 void		*output,
+				 size_t		outputSize )
+{
+	const unsigned char	*ip = input, *inputEnd = ip + inputSize;
+	unsigned char		*op = output, *outputEnd = op + outputSize;
+	const unsigned char	*match;
+	size_t				length, offset;
+	unsigned char		token, byte;
+
+	assert( input || !inputSize );
+	assert( output || !outputSize );
+
+	while( ip < inputEnd ) {
+		token = *ip++;
+
+		length = token >> 4;
+		if( length == 15 )
+			do {
+				if( ip == inputEnd )
+					return KERN_INVALID_ARGUMENT;
+				length += byte = *ip++;
+			} while( byte == 255 );
+		if( (size_t) (inputEnd - ip) < length || (size_t) (outputEnd - op) < length )
+			return KERN_INVALID_ARGUMENT;
+		memcpy( op, ip, length );
+		ip += length;
+		op += length;
+		if( ip == inputEnd )
+			break;
+
+		if( inputEnd - ip < 2 )
+			return KERN_INVALID_ARGUMENT;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if( !offset || offset > (size_t) (op - (unsigned char *) output) )
+			return KERN_INVALID_ARGUMENT;
+
+		length = token & 15;
+		if( length == 15 )
+			do {
+				if( ip == inputEnd )
+					return KERN_INVALID_ARGUMENT;
+				length += byte = *ip++;
+			} while( byte == 255 );
+		length += kMinMatch;
+		if( (size_t) (outputEnd - op) < length )
+			return KERN_INVALID_ARGUMENT;
+
+		//	Byte by byte: a match may overlap what it produces.
+		for( match = op - offset; length; length-- )
+			*op++ = *match++;
+	}
+	return op == outputEnd ? err_none : KERN_INVALID_ARGUMENT;
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ dump_lz.h
+ Small, dependency-free LZ compressor for captured modules, producing
+ blocks in the LZ4 block format.
+
+ ***************************************************************************/
+
+#ifndef		_dump_lz_
+#define		_dump_lz_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+	/**
+	 Largest block dumpLZCompress() takes: match offsets are 16 bits.
+	 */
+#define	kDumpLZMaxBlockSize			65536
+
+	/***************************************************************************//**
+	 Compresses one block: a sequence of literal runs and matches, each
+	 starting with a token whose high nibble is the literal count and low
+	 nibble the match length minus four, 15 meaning more bytes follow,
+	 each added until one is less than 255. The literals follow the token,
+	 then a little-endian 16-bit match offset, then the rest of the match
+	 length. The last sequence has literals only.
+
+	 Matches are found greedily through a single hash table of recent
+	 positions, which favours speed over ratio.
+
+	 @param	input			->	Block to compress.
+	 @param	inputSize		->	Its size, at most kDumpLZMaxBlockSize.
+	 @param	output			<-	Compressed block.
+	 @param	outputCapacity	->	Room in output.
+	 @result				<-	Compressed size; 0 if it didn't fit, in which
+								case the block is best stored as it is.
+
+	 ***************************************************************************/
+
+	size_t
+	dumpLZCompress(
+				   const void	*input,
+				   size_t		inputSize,
+				   void			*output,
+				   size_t		outputCapacity );
+
+	/***************************************************************************//**
+	 Decompresses a block made by dumpLZCompress(). The input is not trusted:
+	 every length and offset is checked.
+
+	 @param	input		->	Compressed block.
+	 @param	inputSize	->	Its size.
+	 @param	output		<-	Decompressed block.
+	 @param	outputSize	->	Its expected size.
+	 @result				<-	KERN_INVALID_ARGUMENT if the block is corrupt or
+							doesn't decompress to outputSize bytes.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpLZDecompress(
+					 const void	*input,
+					 size_t		inputSize,
+					 void		*output,
+					 size_t		outputSize );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_dump_lz_
@@ -0,0 +1,619 @@
+/*******************************************************************************
+ dump_store.c
+ Content-addressed store of captured modules: each distinct module is
+ written once, under its hash, and every capture is logged in an index.
+
+ The hash follows the structure of XXH3: eight 64-bit accumulators take a
+ 32x32->64 bit product and the data of each 64-byte stripe, against a key
+ that shifts from stripe to stripe, and are scrambled every 16 stripes. All
+ of it maps onto SSE2, whose 64-bit lanes can't multiply 64x64 bits.
+
+ Compressed modules are streamed into the archive one block at a time,
+ under a lock that keeps each module's frame contiguous.
+
+ ***************************************************************************/
+
+#include "dump_store.h"
+#include "dump_lz.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#define	kStripeSize				64
+#define	kStripesPerBlock		16
+#define	kScrambleKeyOffset		128
+#define	kLastStripeKeyOffset	121
+#define	kLowMergeKeyOffset		11
+#define	kHighMergeKeyOffset		117
+
+#define	kPrime32				0x9E3779B1U
+#define	kPrime64_1				0x9E3779B185EBCA87ULL
+#define	kPrime64_2				0xC2B2AE3D27D4EB4FULL
+
+#define	kInitialModuleSlots		1024		//	a power of two
+
+//	Read at byte offsets; stripe s of a block uses the 64 bytes at 8 * s.
+static const uint64_t	kHashKey[24] = {
+	0x013593285DA3D02CULL, 0x354113AE6B4B6CADULL,
+	0x512663510232CF11ULL, 0x750840A09A5A1E1DULL,
+	0xB4D50855A7127191ULL, 0x791552822FC90346ULL,
+	0x25151EC743B487D7ULL, 0x8E1B5DA08928C404ULL,
+	0x2FC9BF17CEECF5DBULL, 0xAB2360027E0A418BULL,
+	0xA08F2DDDD1E1DCADULL, 0xBA12FA78D64BE1AAULL,
+	0xD9544C79948F0B9EULL, 0x7EE913FC3B5EBCAEULL,
+	0x0F7AA32F1E9DEFE3ULL, 0xD7BA7C0C288B8972ULL,
+	0x12DB518294B2C151ULL, 0x29D0331C0807EBE4ULL,
+	0x52144088F4CD2A41ULL, 0xC1A6104F44F547CDULL,
+	0xD26C76EA87994EC2ULL, 0xE21393169A6E325BULL,
+	0x4A14D826E789C505ULL, 0x68A72409115858BAULL,
+};
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+//	Open-addressed set of the modules in the store, keyed by hash and size.
+typedef	struct	{
+	dump_store_hash_t	hash;
+	uint64_t			size;
+	int					used;
+}	StoredModule;
+
+static StoredModule		*gModules = NULL;
+static size_t			gModuleSlots = 0;
+static size_t			gModuleCount = 0;
+static pthread_mutex_t	gModuleLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char				gDirectory[PATH_MAX];
+static int				gCompress = 0;
+static int				gIndexFD = -1;
+static int				gArchiveFD = -1;
+static pthread_mutex_t	gArchiveLock = PTHREAD_MUTEX_INITIALIZER;
+//	A block header and the block, compressed. Under gArchiveLock.
+static unsigned char	gBlockBuffer[sizeof( dump_archive_block_t ) + kDumpArchiveBlockSize];
+static mach_error_t		gOpenError = err_none;
+static pthread_once_t	gOpenOnce = PTHREAD_ONCE_INIT;
+
+/**************************
+ *
+ *	Hashing
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Hashing)
+
+static inline uint64_t
+read64(
+	   const void	*p )
+{
+	uint64_t	value;
+
+	memcpy( &value, p, sizeof( value ) );
+	return value;
+}
+
+static inline const unsigned char *
+hashKey(
+		size_t	offset )
+{
+	return (const unsigned char *) kHashKey + offset;
+}
+
+#if defined(__SSE2__)
+static inline __m128i
+accumulateLanes(
+				__m128i					lanes,
+				const unsigned char		*stripe,
+				const unsigned char		*key )
+{
+	__m128i	data = _mm_loadu_si128( (const __m128i *) stripe );
+	__m128i	keyed = _mm_xor_si128( data, _mm_loadu_si128( (const __m128i *) key ) );
+	__m128i	product = _mm_mul_epu32( keyed, _mm_shuffle_epi32( keyed, _MM_SHUFFLE( 0, 3, 0, 1 ) ) );
+
+	return _mm_add_epi64( lanes, _mm_add_epi64( product,
+												_mm_shuffle_epi32( data, _MM_SHUFFLE( 1, 0, 3, 2 ) ) ) );
+}
+#endif
+
+static inline void
+accumulateStripe(
+				 uint64_t				*acc,
+				 const unsigned char	*stripe,
+				 const unsigned char	*key )
+{
+#if defined(__SSE2__)
+	//	Unrolled by hand: the four lanes then stay in registers.
+	__m128i	*lanes = (__m128i *) acc;
+
+	lanes[0] = accumulateLanes( lanes[0], stripe, key );
+	lanes[1] = accumulateLanes( lanes[1], stripe + 16, key + 16 );
+	lanes[2] = accumulateLanes( lanes[2], stripe + 32, key + 32 );
+	lanes[3] = accumulateLanes( lanes[3], stripe + 48, key + 48 );
+#else
+	uint64_t	data, keyed;
+	int			i;
+
+	for( i = 0; i < 8; i++ ) {
+		data = read64( stripe + 8 * i );
+		keyed = data ^ read64( key + 8 * i );
+		acc[i ^ 1] += data;
+		acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+	}
+#endif
+}
+
+static inline void
+scrambleAccumulators(
+					 uint64_t				*acc,
+					 const unsigned char	*key )
+{
+#if defined(__SSE2__)
+	__m128i			*lanes = (__m128i *) acc;
+	const __m128i	prime = _mm_set1_epi32( (int) kPrime32 );
+	__m128i			lane;
+	int				i;
+
+	for( i = 0; i < 4; i++ ) {
+		lane = _mm_xor_si128( lanes[i], _mm_srli_epi64( lanes[i], 47 ) );
+		lane = _mm_xor_si128( lane, _mm_loadu_si128( (const __m128i *) key + i ) );
+		lanes[i] = _mm_add_epi64( _mm_mul_epu32( lane, prime ),
+								  _mm_slli_epi64( _mm_mul_epu32( _mm_srli_epi64( lane, 32 ), prime ), 32 ) );
+	}
+#else
+	int	i;
+
+	for( i = 0; i < 8; i++ ) {
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= read64( key + 8 * i );
+		acc[i] *= kPrime32;
+	}
+#endif
+}
+
+//	The two halves of a 64x64->128 bit product, xored.
+static inline uint64_t
+foldedMultiply(
+			   uint64_t	a,
+			   uint64_t	b )
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t	product = (__uint128_t) a * b;
+
+	return (uint64_t) product ^ (uint64_t) (product >> 64);
+#else
+	uint64_t	lowLow = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+	uint64_t	highLow = (a >> 32) * (b & 0xFFFFFFFF);
+	uint64_t	lowHigh = (a & 0xFFFFFFFF) * (b >> 32);
+	uint64_t	highHigh = (a >> 32) * (b >> 32);
+	uint64_t	cross = (lowLow >> 32) + (highLow & 0xFFFFFFFF) + lowHigh;
+
+	return ((cross << 32) | (lowLow & 0xFFFFFFFF))
+		^ ((highLow >> 32) + (cross >> 32) + highHigh);
+#endif
+}
+
+static inline uint64_t
+mergeAccumulators(
+				  const uint64_t		*acc,
+				  const unsigned char	*key,
+				  uint64_t				start )
+{
+	uint64_t	result = start;
+	int			i;
+
+	for( i = 0; i < 4; i++ )
+		result += foldedMultiply( acc[2 * i] ^ read64( key + 16 * i ),
+								  acc[2 * i + 1] ^ read64( key + 16 * i + 8 ) );
+	result ^= result >> 37;
+	result *= 0x165667919E3779F9ULL;
+	return result ^ (result >> 32);
+}
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+//	The module's slot, or the empty slot it would go in. Under gModuleLock.
+static StoredModule *
+findModule(
+		   const dump_store_hash_t	*hash,
+		   uint64_t					size )
+{
+	size_t			i = (size_t) hash->low & (gModuleSlots - 1);
+	StoredModule	*module;
+
+	for( ;; i = (i + 1) & (gModuleSlots - 1) ) {
+		module = &gModules[i];
+		if( !module->used
+			|| (module->hash.low == hash->low && module->hash.high == hash->high
+				&& module->size == size) )
+			return module;
+	}
+}
+
+//	Makes room for one more module. Under gModuleLock.
+static mach_error_t
+growModules( void )
+{
+	StoredModule	*old = gModules;
+	size_t			oldSlots = gModuleSlots, i;
+
+	if( gModuleSlots && (gModuleCount + 1) * 2 <= gModuleSlots )
+		return err_none;
+
+	gModuleSlots = oldSlots ? oldSlots * 2 : kInitialModuleSlots;
+	gModules = calloc( gModuleSlots, sizeof( StoredModule ) );
+	if( !gModules ) {
+		gModules = old;
+		gModuleSlots = oldSlots;
+		return KERN_RESOURCE_SHORTAGE;
+	}
+	for( i = 0; i < oldSlots; i++ )
+		if( old[i].used )
+			*findModule( &old[i].hash, old[i].size ) = old[i];
+	free( old );
+	return err_none;
+}
+
+/***************************************************************************//**
+	Checks the index header, writing it if the index is new, and claims the
+	modules of the records that follow it.
+
+	@param	fd	->	The index, at its start.
+	@result		<-	KERN_FAILURE if it isn't an index.
+
+	***************************************************************************/
+
+static mach_error_t
+loadIndex(
+		  int	fd )
+{
+	dump_store_header_t	header = { kDumpStoreMagic, kDumpStoreVersion,
+								   sizeof( dump_store_record_t ), 0 };
+	dump_store_record_t	records[256];
+	ssize_t				got;
+	size_t				i;
+
+	if( dumpStoreCheckHeader( fd, &header, sizeof( header ) ) )
+		return KERN_FAILURE;
+
+	//	A new index ends at its header. A torn record at the end, from a
+	//	crash, is ignored.
+	while( (got = read( fd, records, sizeof( records ) )) > 0 )
+		for( i = 0; i < got / sizeof( dump_store_record_t ); i++ )
+			dumpStoreClaim( &records[i].hash, records[i].size );
+	return got < 0 ? KERN_FAILURE : err_none;
+}
+
+//	Checks the archive header, writing it if the archive is new.
+static mach_error_t
+checkArchive(
+			 int	fd )
+{
+	dump_archive_header_t	header = { kDumpArchiveMagic, kDumpArchiveVersion,
+									   kDumpArchiveBlockSize, 0 };
+
+	return dumpStoreCheckHeader( fd, &header, sizeof( header ) );
+}
+
+static void
+openStore( void )
+{
+	char	path[PATH_MAX];
+
+	if( mkdir( gDirectory, 0700 ) && errno != EEXIST ) {
+		gOpenError = KERN_FAILURE;
+		return;
+	}
+	snprintf( path, sizeof( path ), "%s/" kDumpStoreIndexName, gDirectory );
+	gIndexFD = open( path, O_RDWR|O_CREAT|O_APPEND, 0600 );
+	gOpenError = gIndexFD < 0 ? KERN_FAILURE : loadIndex( gIndexFD );
+
+	if( !gOpenError && gCompress ) {
+		snprintf( path, sizeof( path ), "%s/" kDumpStoreArchiveName, gDirectory );
+		gArchiveFD = open( path, O_RDWR|O_CREAT|O_APPEND, 0600 );
+		gOpenError = gArchiveFD < 0 ? KERN_FAILURE : checkArchive( gArchiveFD );
+	}
+}
+
+/***************************************************************************//**
+	Appends a module's frame to the archive. A frame that fails part way is
+	cut off again.
+
+	@param	record	->	The capture that claimed the module.
+	@param	bytes	->	The module.
+	@param	offset	<-	Where the frame starts.
+	@result			<-	KERN_FAILURE if it couldn't be written.
+
+	***************************************************************************/
+
+static mach_error_t
+appendToArchive(
+				const dump_store_record_t	*record,
+				const void					*bytes,
+				uint64_t					*offset )
+{
+	dump_archive_module_t	module;
+	dump_archive_block_t	*block = (dump_archive_block_t *) gBlockBuffer;
+	const unsigned char		*p = bytes;
+	uint64_t				left = record->size;
+	size_t					stored;
+	off_t					start;
+	mach_error_t			err;
+
+	module.magic = kDumpArchiveModuleMagic;
+	module.blockCount = (uint32_t) ((left + kDumpArchiveBlockSize - 1) / kDumpArchiveBlockSize);
+	module.hash = record->hash;
+	module.size = left;
+
+	pthread_mutex_lock( &gArchiveLock );
+	start = lseek( gArchiveFD, 0, SEEK_END );
+	err = start < 0 ? KERN_FAILURE : dumpStoreWriteAll( gArchiveFD, &module, sizeof( module ) );
+
+	for( ; !err && left; p += block->size, left -= block->size ) {
+		block->size = left < kDumpArchiveBlockSize ? (uint32_t) left : kDumpArchiveBlockSize;
+		//	Only worth keeping compressed if it comes out smaller.
+		stored = dumpLZCompress( p, block->size, block + 1, block->size - 1 );
+		if( stored ) {
+			block->storedSize = (uint32_t) stored;
+			err = dumpStoreWriteAll( gArchiveFD, gBlockBuffer, sizeof( *block ) + stored );
+		} else {
+			block->storedSize = block->size | kDumpArchiveBlockRaw;
+			err = dumpStoreWriteAll( gArchiveFD, block, sizeof( *block ) );
+			if( !err )
+				err = dumpStoreWriteAll( gArchiveFD, p, block->size );
+		}
+	}
+
+	if( err && start >= 0 )
+		ftruncate( gArchiveFD, start );
+	pthread_mutex_unlock( &gArchiveLock );
+	*offset = (uint64_t) start;
+	return err;
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+dumpStoreOpen(
+			  const char	*directory,
+			  int			compress )
+{
+	if( !gDirectory[0] ) {
+		strlcpy( gDirectory, directory ? directory : kDumpStoreDefaultDirectory,
+				 sizeof( gDirectory ) );
+		gCompress = compress;
+	}
+	pthread_once( &gOpenOnce, openStore );
+	return gOpenError;
+}
+
+void
+dumpStoreHash(
+			  const void			*bytes,
+			  size_t				size,
+			  dump_store_hash_t		*hash )
+{
+	const unsigned char	*input = bytes;
+	unsigned char		padded[kStripeSize];
+	size_t				stripes, block, blocks, s;
+#if defined(__SSE2__)
+	__m128i				lanes[4];
+	uint64_t			*acc = (uint64_t *) lanes;
+#else
+	uint64_t			acc[8];
+#endif
+
+	assert( bytes || !size );
+	assert( hash );
+
+	acc[0] = kPrime32;			acc[1] = kPrime64_1;
+	acc[2] = kPrime64_2;		acc[3] = 0x165667B19E3779F9ULL;
+	acc[4] = 0x85EBCA77C2B2AE63ULL;	acc[5] = 0x85EBCA77U;
+	acc[6] = 0x27D4EB2F165667C5ULL;	acc[7] = 0x61C8864FU;
+
+	if( size <= kStripeSize ) {
+		//	Zero padded; the size tells such inputs apart.
+		memset( padded, 0, sizeof( padded ) );
+		if( size )
+			memcpy( padded, input, size );
+		accumulateStripe( acc, padded, hashKey( 0 ) );
+	} else {
+		//	Whole stripes but the last, then the last 64 bytes, which may
+		//	overlap them.
+		stripes = (size - 1) / kStripeSize;
+		blocks = stripes / kStripesPerBlock;
+		for( block = 0; block < blocks; block++ ) {
+			for( s = 0; s < kStripesPerBlock; s++ )
+				accumulateStripe( acc, input + (block * kStripesPerBlock + s) * kStripeSize,
+								  hashKey( 8 * s ) );
+			scrambleAccumulators( acc, hashKey( kScrambleKeyOffset ) );
+		}
+		for( s = 0; s < stripes % kStripesPerBlock; s++ )
+			accumulateStripe( acc, input + (blocks * kStripesPerBlock + s) * kStripeSize,
+							  hashKey( 8 * s ) );
+		accumulateStripe( acc, input + size - kStripeSize, hashKey( kLastStripeKeyOffset ) );
+	}
+
+	hash->low = mergeAccumulators( acc, hashKey( kLowMergeKeyOffset ), size * kPrime64_1 );
+	hash->high = mergeAccumulators( acc, hashKey( kHighMergeKeyOffset ), ~(size * kPrime64_2) );
+}
+
+int
+dumpStoreClaim(
+			   const dump_store_hash_t	*hash,
+			   uint64_t					size )
+{
+	StoredModule	*module;
+	int				claimed = 0;
+
+	assert( hash );
+
+	pthread_mutex_lock( &gModuleLock );
+	//	Without room to remember it, a module is taken for new every time.
+	if( growModules() )
+		claimed = 1;
+	else {
+		module = findModule( hash, size );
+		if( !module->used ) {
+			module->hash = *hash;
+			module->size = size;
+			module->used = 1;
+			gModuleCount++;
+			claimed = 1;
+		}
+	}
+	pthread_mutex_unlock( &gModuleLock );
+	return claimed;
+}
+
+void
+dumpStoreForget(
+				const dump_store_hash_t	*hash,
+				uint64_t				size )
+{
+	StoredModule	*module;
+	size_t			mask, i, j, home;
+
+	assert( hash );
+
+	pthread_mutex_lock( &gModuleLock );
+	if( gModuleSlots && (module = findModule( hash, size ))->used ) {
+		//	Backward-shift deletion: later modules of the probe sequence move
+		//	up into the hole, so that lookups don't stop short of them.
+		mask = gModuleSlots - 1;
+		i = j = module - gModules;
+		gModules[i].used = 0;
+		for( ;; ) {
+			j = (j + 1) & mask;
+			if( !gModules[j].used )
+				break;
+			home = (size_t) gModules[j].hash.low & mask;
+			if( ((j - home) & mask) < ((j - i) & mask) )
+				continue;
+			gModules[i] = gModules[j];
+			gModules[j].used = 0;
+			i = j;
+		}
+		gModuleCount--;
+	}
+	pthread_mutex_unlock( &gModuleLock );
+}
+
+mach_error_t
+dumpStoreWriteContents(
+					   dump_store_record_t	*record,
+					   const void			*bytes )
+{
+	char			path[PATH_MAX], temporary[PATH_MAX];
+	int				fd;
+	mach_error_t	err;
+
+	assert( record );
+	assert( bytes || !record->size );
+
+	if( dumpStoreOpen( NULL, 0 ) )
+		return KERN_FAILURE;
+	if( gArchiveFD >= 0 )
+		return appendToArchive( record, bytes, &record->archiveOffset );
+
+	record->archiveOffset = kDumpStoreNotArchived;
+	snprintf( path, sizeof( path ), "%s/" kDumpStoreContentName, gDirectory,
+			  (unsigned long long) record->hash.high, (unsigned long long) record->hash.low );
+	snprintf( temporary, sizeof( temporary ), "%s.%d", path, getpid() );
+
+	fd = open( temporary, O_WRONLY|O_CREAT|O_TRUNC, 0600 );
+	if( fd < 0 )
+		return KERN_FAILURE;
+	err = dumpStoreWriteAll( fd, bytes, record->size );
+	close( fd );
+	if( !err && rename( temporary, path ) )
+		err = KERN_FAILURE;
+	if( err )
+		unlink( temporary );
+	return err;
+}
+
+mach_error_t
+dumpStoreAppend(
+				const dump_store_record_t	*records,
+				size_t						count )
+{
+	assert( records || !count );
+
+	if( dumpStoreOpen( NULL, 0 ) )
+		return KERN_FAILURE;
+	return dumpStoreWriteAll( gIndexFD, records, count * sizeof( dump_store_record_t ) );
+}
+
+mach_error_t
+dumpStoreWriteAll(
+				  int			fd,
+				  const void	*bytes,
+				  size_t		size )
+{
+	const char	*p = bytes;
+	ssize_t		written;
+
+	while( size ) {
+		written = write( fd, p, size );
+		if( written < 0 && errno == EINTR )
+			continue;
+		if( written <= 0 )
+			return KERN_FAILURE;
+		p += written;
+		size -= written;
+	}
+	return err_none;
+}
+
+mach_error_t
+dumpStoreCheckHeader(
+					 int			fd,
+					 const void		*header,
+					 size_t			size )
+{
+	char	existing[64];
+	ssize_t	got;
+
+	assert( size <= sizeof( existing ) );
+	got = read( fd, existing, size );
+	if( got == 0 )
+		return dumpStoreWriteAll( fd, header, size );
+	return got == (ssize_t) size && !memcmp( existing, header, size )
+		? err_none : KERN_FAILURE;
+}
@@ -0,0 +1,230 @@
+/*******************************************************************************
+ dump_store.h
+ Content-addressed store of captured modules: each distinct module is
+ written once, under its hash, and every capture is logged in an index.
+
+ ***************************************************************************/
+
+#ifndef		_dump_store_
+#define		_dump_store_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+#define	kDumpStoreMagic				0x44505354	//	'DPST'
+#define	kDumpStoreVersion			2
+
+	/**
+	 Default store directory. Contents are kept in it as
+	 kDumpStoreContentName, formatted with the two halves of the hash, or,
+	 compressed, in the kDumpStoreArchiveName archive.
+	 */
+#define	kDumpStoreDefaultDirectory	"/wow_dumps"
+#define	kDumpStoreContentName		"%016llx%016llx.bin"
+#define	kDumpStoreIndexName			"index"
+#define	kDumpStoreArchiveName		"archive"
+
+	//	dump_store_record_t.flags
+#define	kDumpStoreFirstSeen			0x1			//	this capture wrote the contents
+
+	//	dump_store_record_t.archiveOffset of contents kept in their own file
+#define	kDumpStoreNotArchived		UINT64_MAX
+
+	typedef	struct	{
+		uint64_t	high;
+		uint64_t	low;
+	}	dump_store_hash_t;
+
+	/**
+	 One capture, as logged in the index. The first record of a hash is the
+	 one flagged kDumpStoreFirstSeen.
+	 */
+	typedef	struct	{
+		dump_store_hash_t	hash;
+		uint64_t			size;
+		uint64_t			address;	//	where it was captured
+		uint64_t			time;		//	microseconds since the epoch
+		uint32_t			pid;
+		uint32_t			flags;
+		uint64_t			archiveOffset;	//	of the module's frame, first records only
+	}	dump_store_record_t;
+
+	/**
+	 The index is this header followed by records, appended as captures are
+	 written.
+	 */
+	typedef	struct	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint32_t	recordSize;
+		uint32_t	reserved;
+	}	dump_store_header_t;
+
+#define	kDumpArchiveMagic			0x44504C5A	//	'DPLZ'
+#define	kDumpArchiveVersion			1
+#define	kDumpArchiveModuleMagic		0x4D4F444C	//	'MODL'
+#define	kDumpArchiveBlockSize		65536
+
+	//	dump_archive_block_t.storedSize flag of blocks kept uncompressed
+#define	kDumpArchiveBlockRaw		0x80000000
+
+	/**
+	 The archive is this header followed by module frames, appended as
+	 modules are stored. Frames are located through the index, so a module
+	 is extracted without reading the rest of the archive, and a frame left
+	 incomplete by a crash is never referenced.
+	 */
+	typedef	struct	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint32_t	blockSize;
+		uint32_t	reserved;
+	}	dump_archive_header_t;
+
+	/**
+	 A module frame: this header, then blockCount blocks, each a
+	 dump_archive_block_t and its stored bytes. Every block but the last
+	 holds blockSize bytes of the module, compressed on its own with
+	 dumpLZCompress() unless that saved nothing, so any block is decoded
+	 after skipping the ones before it.
+	 */
+	typedef	struct	{
+		uint32_t			magic;
+		uint32_t			blockCount;
+		dump_store_hash_t	hash;
+		uint64_t			size;
+	}	dump_archive_module_t;
+
+	typedef	struct	{
+		uint32_t	size;			//	decompressed
+		uint32_t	storedSize;		//	| kDumpArchiveBlockRaw
+	}	dump_archive_block_t;
+
+	/***************************************************************************//**
+	 Opens, or creates, the store and loads its index, so that modules stored
+	 by earlier runs aren't written again. Only the first call has an effect.
+
+	 @param	directory	->	Store directory. NULL for kDumpStoreDefaultDirectory.
+	 @param	compress	->	Non-zero to append new modules to the archive,
+							compressed, rather than write them to files.
+	 @result				<-	KERN_FAILURE if the index or archive couldn't be
+							opened or isn't one.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpStoreOpen(
+				  const char	*directory,
+				  int			compress );
+
+	/***************************************************************************//**
+	 Hashes a module. The hash runs eight 64-bit lanes over 64-byte stripes,
+	 with SSE2 where available, so it is much cheaper than copying the bytes.
+	 Not cryptographic.
+
+	 @param	bytes	->	The module.
+	 @param	size	->	Its size.
+	 @param	hash	<-	Its 128-bit hash.
+
+	 ***************************************************************************/
+
+	void
+	dumpStoreHash(
+				  const void			*bytes,
+				  size_t				size,
+				  dump_store_hash_t		*hash );
+
+	/***************************************************************************//**
+	 Records that the store has, or is about to have, a module.
+
+	 @param	hash	->	The module's hash.
+	 @param	size	->	Its size.
+	 @result			<-	Non-zero if it's new, in which case the caller writes
+						it with dumpStoreWriteContents(), or gives it up with
+						dumpStoreForget().
+
+	 ***************************************************************************/
+
+	int
+	dumpStoreClaim(
+				   const dump_store_hash_t	*hash,
+				   uint64_t					size );
+
+	void
+	dumpStoreForget(
+					const dump_store_hash_t	*hash,
+					uint64_t				size );
+
+	/***************************************************************************//**
+	 Writes a claimed module's contents. They are written to a temporary file
+	 and renamed into place, so that a content file is always complete, or
+	 streamed to the archive a block at a time.
+
+	 @param	record	<->	The capture that claimed it; receives the archive
+						offset.
+	 @param	bytes	->	The module.
+	 @result			<-	KERN_FAILURE if it couldn't be written.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpStoreWriteContents(
+						   dump_store_record_t	*record,
+						   const void			*bytes );
+
+	/***************************************************************************//**
+	 Appends records to the index, with a single write.
+
+	 @param	records	->	Records to append.
+	 @param	count	->	Their number.
+	 @result			<-	KERN_FAILURE if they couldn't be written.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpStoreAppend(
+					const dump_store_record_t	*records,
+					size_t						count );
+
+	/***************************************************************************//**
+	 Writes all of a buffer, retrying short and interrupted writes.
+
+	 @param	fd		->	File to write to.
+	 @param	bytes	->	The buffer.
+	 @param	size	->	Its size.
+	 @result			<-	KERN_FAILURE if it couldn't all be written.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpStoreWriteAll(
+					  int			fd,
+					  const void	*bytes,
+					  size_t		size );
+
+	/***************************************************************************//**
+	 Checks the header at the start of a store file, writing it if the file
+	 is new.
+
+	 @param	fd		->	The file, at its start.
+	 @param	header	->	The header it should have.
+	 @param	size	->	The header's size.
+	 @result			<-	KERN_FAILURE if the file has another header.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpStoreCheckHeader(
+						 int			fd,
+						 const void		*header,
+						 size_t			size );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_dump_store_
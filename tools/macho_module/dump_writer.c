@@ -0,0 +1,494 @@
+/*******************************************************************************
+ dump_writer.c
+ Writes captured modules to disk from a background thread, so that the
+ hook that captured them returns without waiting for the disk. Modules go
+ into the content-addressed store of dump_store.h.
+
+ Captures are copied into memory counted against a budget and published in
+ a single-producer, single-consumer ring: capturing threads take turns at
+ the producer end under a lock held only to fill a slot, and the writer
+ thread drains whatever is queued each time it wakes. Neither end takes a
+ lock while the other is running, except to sleep and to be woken.
+
+ Each capture is also described, from its Mach-O header, while its bytes
+ are at hand, and the writer thread logs the descriptions of a batch to
+ the journal of dump_journal.h after the batch's index records.
+
+ Large captures can be queued as copy-on-write snapshots instead, made by
+ remapping their pages within the task, and are then hashed and claimed
+ on the writer thread.
+
+ ***************************************************************************/
+
+#include "dump_writer.h"
+#include "dump_store.h"
+#include "dump_journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach.h>
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#define	kDumpWriterBatch		32			//	captures written per wakeup, at most
+#define	kDumpRingMask			(kDumpWriterRingSize - 1)
+
+typedef	char	RingSizeIsPowerOfTwo[(kDumpWriterRingSize & kDumpRingMask) == 0 ? 1 : -1];
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+typedef	struct	{
+	dump_store_record_t		record;
+	void					*copy;		//	NULL for modules already in the store
+	vm_size_t				snapshot;	//	remapped bytes around copy; 0 if malloc()ed
+	dump_journal_capture_t	journal;	//	entrySize bytes of it
+}	Capture;
+
+//	Slots [gTail, gHead) are queued. Only the producer advances gHead and
+//	only the writer thread advances gTail, each after a barrier.
+static Capture				gRing[kDumpWriterRingSize];
+static volatile uint32_t	gHead = 0;
+static volatile uint32_t	gTail = 0;
+static volatile int64_t		gQueuedBytes = 0;
+
+static size_t				gBudget = kDumpWriterDefaultBudget;
+static dump_overflow_t		gOverflow = kDumpOverflowSpill;
+static int					gSnapshot = 0;
+
+static pthread_mutex_t		gProduceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t		gStartOnce = PTHREAD_ONCE_INIT;
+static mach_error_t			gStartError = err_none;
+
+//	Sleeping and waking. The writer sleeps on gWorkCondition when the ring
+//	is empty; blocked producers and flushers on gProgressCondition.
+static pthread_mutex_t		gWakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		gWorkCondition = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		gProgressCondition = PTHREAD_COND_INITIALIZER;
+static volatile int32_t		gWriterSleeping = 0;
+static volatile int32_t		gWaiters = 0;
+
+static dump_writer_stats_t	gStats;
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+static inline void
+countStat(
+		  uint64_t	*stat,
+		  int64_t	amount )
+{
+	OSAtomicAdd64( amount, (volatile int64_t *) stat );
+}
+
+//	Hashes a capture's module and claims it in the store, if it's new.
+static void
+claimCapture(
+			 dump_store_record_t	*record,
+			 const void				*bytes )
+{
+	dumpStoreHash( bytes, record->size, &record->hash );
+	record->flags = dumpStoreClaim( &record->hash, record->size ) ? kDumpStoreFirstSeen : 0;
+	if( !(record->flags & kDumpStoreFirstSeen) )
+		countStat( &gStats.duplicates, 1 );
+}
+
+/***************************************************************************//**
+	Remaps the pages holding a module, copy-on-write, so that it can be read
+	later as it is now.
+
+	@param	address		->	The module.
+	@param	size		->	Its size.
+	@param	copy		<-	Where the module starts in the snapshot.
+	@param	snapshot	<-	Size of the snapshot, a whole number of pages.
+	@result				<-	Non-zero if it was taken.
+
+	***************************************************************************/
+
+static int
+takeSnapshot(
+			 const void	*address,
+			 size_t		size,
+			 void		**copy,
+			 vm_size_t	*snapshot )
+{
+	vm_address_t	start = (vm_address_t) address & ~(vm_page_size - 1);
+	vm_address_t	end = ((vm_address_t) address + size + vm_page_size - 1) & ~(vm_page_size - 1);
+	vm_address_t	remapped = 0;
+	vm_prot_t		current, maximum;
+
+	if( vm_remap( mach_task_self(), &remapped, end - start, 0, VM_FLAGS_ANYWHERE,
+				  mach_task_self(), start, TRUE, &current, &maximum, VM_INHERIT_NONE ) )
+		return 0;
+	*copy = (void *) (remapped + ((vm_address_t) address - start));
+	*snapshot = end - start;
+	return 1;
+}
+
+static void
+releaseCopy(
+			void		*copy,
+			vm_size_t	snapshot )
+{
+	if( snapshot )
+		vm_deallocate( mach_task_self(), (vm_address_t) copy & ~(vm_page_size - 1), snapshot );
+	else
+		free( copy );
+}
+
+/***************************************************************************//**
+	Puts a capture's module in the store, if it claimed it. A module that
+	can't be written is given up, so that a later capture can try again.
+
+	@param	record	->	The capture.
+	@param	bytes	->	The module's contents.
+	@result			<-	KERN_FAILURE if it couldn't be written.
+
+	***************************************************************************/
+
+static mach_error_t
+writeCapture(
+			 dump_store_record_t	*record,
+			 const void				*bytes )
+{
+	mach_error_t	err = err_none;
+
+	if( record->flags & kDumpStoreFirstSeen ) {
+		err = dumpStoreWriteContents( record, bytes );
+		if( err )
+			dumpStoreForget( &record->hash, record->size );
+		else
+			countStat( &gStats.bytesWritten, record->size );
+	}
+	return err;
+}
+
+//	Counts a reservation of size bytes against the budget, if it fits.
+static int
+reserveBudget(
+			  size_t	size )
+{
+	if( OSAtomicAdd64Barrier( size, &gQueuedBytes ) <= (int64_t) gBudget )
+		return 1;
+	OSAtomicAdd64Barrier( -(int64_t) size, &gQueuedBytes );
+	return 0;
+}
+
+/***************************************************************************//**
+	Waits for the writer thread to drain at least one capture past seenTail.
+	Returns straight away if there is nothing for it to drain, since the
+	budget can then only be held by producers about to publish.
+
+	@param	seenTail	->	gTail when the caller found no room.
+
+	***************************************************************************/
+
+static void
+waitForProgress(
+				uint32_t	seenTail )
+{
+	pthread_mutex_lock( &gWakeLock );
+	OSAtomicIncrement32Barrier( &gWaiters );
+	while( gTail == seenTail && gTail != gHead )
+		pthread_cond_wait( &gProgressCondition, &gWakeLock );
+	OSAtomicDecrement32Barrier( &gWaiters );
+	pthread_mutex_unlock( &gWakeLock );
+	if( gTail == seenTail )
+		sched_yield();
+}
+
+/**************************
+ *
+ *	Writer Thread
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Writer Thread)
+
+static void *
+writerThread(
+			 void	*unused )
+{
+	uint32_t						tail, queued, i, recorded;
+	int64_t							released;
+	Capture							*capture;
+	dump_store_record_t				records[kDumpWriterBatch];
+	const dump_journal_capture_t	*journal[kDumpWriterBatch];
+
+	for( ;; ) {
+		tail = gTail;
+		queued = gHead - tail;
+
+		if( !queued ) {
+			//	Announce the sleep, then look again: a producer publishes
+			//	before checking gWriterSleeping, and signals under the lock.
+			pthread_mutex_lock( &gWakeLock );
+			gWriterSleeping = 1;
+			OSMemoryBarrier();
+			if( gHead == gTail )
+				pthread_cond_wait( &gWorkCondition, &gWakeLock );
+			gWriterSleeping = 0;
+			pthread_mutex_unlock( &gWakeLock );
+			continue;
+		}
+
+		//	Reads of the slots happen after reading gHead.
+		OSMemoryBarrier();
+		if( queued > kDumpWriterBatch )
+			queued = kDumpWriterBatch;
+		released = 0;
+		recorded = 0;
+		for( i = 0; i < queued; i++ ) {
+			capture = &gRing[(tail + i) & kDumpRingMask];
+			if( capture->snapshot ) {
+				claimCapture( &capture->record, capture->copy );
+				capture->journal.entry.hash = capture->record.hash;
+			}
+			if( writeCapture( &capture->record, capture->copy ) )
+				countStat( &gStats.failed, 1 );
+			else {
+				journal[recorded] = &capture->journal;
+				records[recorded++] = capture->record;
+			}
+			if( capture->copy ) {
+				releaseCopy( capture->copy, capture->snapshot );
+				if( !capture->snapshot )
+					released += capture->record.size;
+			}
+		}
+		//	One index write for the whole batch, and one journal write.
+		if( dumpStoreAppend( records, recorded ) )
+			countStat( &gStats.failed, recorded );
+		else {
+			countStat( &gStats.written, recorded );
+			if( dumpJournalAppend( journal, recorded ) )
+				countStat( &gStats.unjournaled, recorded );
+		}
+		countStat( &gStats.batches, 1 );
+
+		//	Hand the slots and the budget back in one go.
+		OSMemoryBarrier();
+		gTail = tail + queued;
+		OSAtomicAdd64Barrier( -released, &gQueuedBytes );
+		if( gWaiters ) {
+			pthread_mutex_lock( &gWakeLock );
+			pthread_cond_broadcast( &gProgressCondition );
+			pthread_mutex_unlock( &gWakeLock );
+		}
+	}
+	return NULL;
+}
+
+static void
+startWriterThread( void )
+{
+	pthread_attr_t	attr;
+	pthread_t		thread;
+
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+	if( pthread_create( &thread, &attr, writerThread, NULL ) )
+		gStartError = KERN_RESOURCE_SHORTAGE;
+	pthread_attr_destroy( &attr );
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+dumpWriterStart(
+				const dump_writer_config_t	*config )
+{
+	mach_error_t	err;
+
+	if( config ) {
+		gBudget = config->memoryBudget ? config->memoryBudget : kDumpWriterDefaultBudget;
+		gOverflow = config->overflow;
+		gSnapshot = config->snapshot;
+	}
+	err = config ? dumpStoreOpen( config->directory, config->compress )
+				 : dumpStoreOpen( NULL, 0 );
+	if( !err )
+		err = dumpJournalOpen( config ? config->directory : NULL );
+	pthread_once( &gStartOnce, startWriterThread );
+	return gStartError ? gStartError : err;
+}
+
+mach_error_t
+dumpWriterSubmit(
+				 const void	*address,
+				 size_t		size,
+				 const void	*caller )
+{
+	void							*copy = NULL;
+	vm_size_t						snapshot = 0;
+	size_t							copied;
+	uint32_t						head, tail;
+	dump_store_record_t				record;
+	dump_journal_capture_t			journal;
+	const dump_journal_capture_t	*logged = &journal;
+	Capture							*slot;
+	struct timeval					now;
+	mach_error_t					err;
+
+	assert( address );
+
+	err = dumpWriterStart( NULL );
+
+	gettimeofday( &now, NULL );
+	record.size = size;
+	record.address = (uintptr_t) address;
+	record.time = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	record.pid = getpid();
+	record.archiveOffset = kDumpStoreNotArchived;
+
+	//	Hashing costs a fraction of copying, and spares modules the store
+	//	already has both the copy and the write: only the record is queued.
+	//	Snapshots cost less still, and are hashed on the writer thread.
+	if( !err && gSnapshot && size >= kDumpWriterSnapshotMinimum
+		&& takeSnapshot( address, size, &copy, &snapshot ) ) {
+		memset( &record.hash, 0, sizeof( record.hash ) );
+		record.flags = 0;
+		copied = 0;
+		countStat( &gStats.snapshots, 1 );
+	} else {
+		claimCapture( &record, address );
+		copied = record.flags & kDumpStoreFirstSeen ? size : 0;
+	}
+
+	//	Only the load commands are read, so this is cheap even for modules
+	//	that turn out to be duplicates.
+	dumpJournalDescribe( address, size, &journal );
+	journal.entry.time = record.time;
+	journal.entry.thread = pthread_mach_thread_np( pthread_self() );
+	journal.entry.caller = (uintptr_t) caller;
+	journal.entry.address = record.address;
+	journal.entry.size = size;
+	journal.entry.hash = record.hash;
+	journal.entry.pid = record.pid;
+	journal.entry.reserved = 0;
+
+	//	Captures that can never fit are dealt with like an overflow; blocking
+	//	on them would wait forever.
+	if( !err && copied <= gBudget ) {
+		if( copied ) {
+			for( ;; ) {
+				tail = gTail;
+				if( reserveBudget( copied ) )
+					break;
+				if( gOverflow != kDumpOverflowBlock )
+					goto overflow;
+				waitForProgress( tail );
+			}
+			copy = malloc( copied );
+			if( !copy ) {
+				OSAtomicAdd64Barrier( -(int64_t) copied, &gQueuedBytes );
+				goto overflow;
+			}
+			memcpy( copy, address, copied );
+		}
+
+		pthread_mutex_lock( &gProduceLock );
+		while( (head = gHead) - (tail = gTail) == kDumpWriterRingSize ) {
+			pthread_mutex_unlock( &gProduceLock );
+			if( gOverflow != kDumpOverflowBlock ) {
+				releaseCopy( copy, snapshot );
+				OSAtomicAdd64Barrier( -(int64_t) copied, &gQueuedBytes );
+				if( snapshot ) {
+					claimCapture( &record, address );
+					journal.entry.hash = record.hash;
+					copied = record.flags & kDumpStoreFirstSeen ? size : 0;
+				}
+				goto overflow;
+			}
+			waitForProgress( tail );
+			pthread_mutex_lock( &gProduceLock );
+		}
+		slot = &gRing[head & kDumpRingMask];
+		slot->record = record;
+		slot->copy = copy;
+		slot->snapshot = snapshot;
+		memcpy( &slot->journal, &journal, journal.entry.entrySize );
+		OSMemoryBarrier();
+		gHead = head + 1;
+		pthread_mutex_unlock( &gProduceLock );
+		countStat( &gStats.queued, 1 );
+
+		//	Pairs with the writer's barrier between announcing its sleep and
+		//	looking at the ring again.
+		OSMemoryBarrier();
+		if( gWriterSleeping ) {
+			pthread_mutex_lock( &gWakeLock );
+			pthread_cond_signal( &gWorkCondition );
+			pthread_mutex_unlock( &gWakeLock );
+		}
+		return err_none;
+	}
+
+overflow:
+	if( gOverflow == kDumpOverflowDrop ) {
+		if( copied )
+			dumpStoreForget( &record.hash, size );
+		countStat( &gStats.dropped, 1 );
+		return KERN_RESOURCE_SHORTAGE;
+	}
+	err = writeCapture( &record, address );
+	if( !err )
+		err = dumpStoreAppend( &record, 1 );
+	countStat( err ? &gStats.failed : &gStats.spilled, 1 );
+	if( !err && dumpJournalAppend( &logged, 1 ) )
+		countStat( &gStats.unjournaled, 1 );
+	return err;
+}
+
+void
+dumpWriterFlush( void )
+{
+	uint32_t	target = gHead;
+
+	pthread_mutex_lock( &gWakeLock );
+	OSAtomicIncrement32Barrier( &gWaiters );
+	while( (int32_t) (gTail - target) < 0 )
+		pthread_cond_wait( &gProgressCondition, &gWakeLock );
+	OSAtomicDecrement32Barrier( &gWaiters );
+	pthread_mutex_unlock( &gWakeLock );
+}
+
+void
+dumpWriterStatistics(
+					 dump_writer_stats_t	*stats )
+{
+	assert( stats );
+
+	*stats = gStats;
+}
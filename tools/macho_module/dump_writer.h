@@ -0,0 +1,119 @@
+/*******************************************************************************
+ dump_writer.h
+ Writes captured modules to disk from a background thread, so that the
+ hook that captured them returns without waiting for the disk.
+
+ ***************************************************************************/
+
+#ifndef		_dump_writer_
+#define		_dump_writer_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+#define	kDumpWriterDefaultBudget	(64 * 1024 * 1024)
+#define	kDumpWriterRingSize			256			//	queued captures, a power of two
+#define	kDumpWriterSnapshotMinimum	(64 * 1024)	//	smaller captures are copied
+
+	/**
+	 What happens to a capture that would take the queued copies over the
+	 memory budget, or find the queue full.
+	 */
+	typedef	enum	{
+		kDumpOverflowBlock,			//	wait for the writer to catch up
+		kDumpOverflowDrop,			//	count it and move on
+		kDumpOverflowSpill			//	write it on the calling thread
+	}	dump_overflow_t;
+
+	typedef	struct	{
+		size_t			memoryBudget;	//	bytes of queued copies; 0 for the default
+		dump_overflow_t	overflow;
+		const char		*directory;		//	of the store; NULL for the default
+		int				compress;		//	see dumpStoreOpen()
+		int				snapshot;		//	see dumpWriterSubmit()
+	}	dump_writer_config_t;
+
+	typedef	struct	{
+		uint64_t	queued;			//	captures handed to the writer thread
+		uint64_t	written;		//	recorded by the writer thread
+		uint64_t	duplicates;		//	of modules already in the store
+		uint64_t	spilled;		//	written on the capturing thread
+		uint64_t	snapshots;		//	captured copy-on-write
+		uint64_t	dropped;
+		uint64_t	failed;			//	couldn't be written
+		uint64_t	unjournaled;	//	written, but not logged to the journal
+		uint64_t	batches;		//	writer thread wakeups
+		uint64_t	bytesWritten;	//	of new modules
+	}	dump_writer_stats_t;
+
+	/***************************************************************************//**
+	 Opens the store and starts the writer thread. Calling it again only
+	 changes the budget and overflow policy. dumpWriterSubmit() starts it
+	 with the defaults if need be: a kDumpWriterDefaultBudget budget,
+	 kDumpOverflowSpill and kDumpStoreDefaultDirectory.
+
+	 @param	config	->	Optional settings. Can be NULL.
+	 @result			<-	KERN_RESOURCE_SHORTAGE if the thread couldn't be
+						started; see dumpStoreOpen().
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpWriterStart(
+					const dump_writer_config_t	*config );
+
+	/***************************************************************************//**
+	 Captures size bytes at address into the store, and logs the capture to
+	 the journal. The bytes are hashed and described from their Mach-O
+	 header and, unless the store already has them, copied before
+	 returning. The capture is handed to the writer thread through a
+	 lock-free ring it drains in batches, appending each batch's records to
+	 the index with one write, and to the journal with another. Only
+	 claiming a ring slot is serialized between capturing threads. A module
+	 the store already has costs only its index record and journal entry.
+	 A capture larger than the whole budget is spilled, or dropped under
+	 kDumpOverflowDrop.
+
+	 With the snapshot setting, a capture of kDumpWriterSnapshotMinimum bytes
+	 or more is instead remapped copy-on-write, which costs a call into the
+	 kernel however big it is: pages are only copied if the module is
+	 written to before the writer thread is done with them. Hashing is left
+	 to the writer thread too. Snapshots aren't counted against the budget,
+	 as until then they share their pages with the module. A capture that
+	 can't be remapped, such as one spanning unmapped pages, is copied.
+
+	 @param	address	->	Required start of the module.
+	 @param	size	->	Its size.
+	 @param	caller	->	Where the capturing hook was called from, for the
+						journal. Can be NULL.
+	 @result			<-	KERN_RESOURCE_SHORTAGE if it was dropped; the error
+						writing it if it was spilled.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	dumpWriterSubmit(
+					 const void	*address,
+					 size_t		size,
+					 const void	*caller );
+
+	/***************************************************************************//**
+	 Waits until every capture submitted so far is on disk.
+	 ***************************************************************************/
+
+	void
+	dumpWriterFlush( void );
+
+	void
+	dumpWriterStatistics(
+						 dump_writer_stats_t	*stats );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_dump_writer_
@@ -0,0 +1,198 @@
+/*
+ * dumpextract - list and extract the modules of a dump store
+ *
+ * SYNOPSIS
+ *     dumpextract [-d directory] -l
+ *     dumpextract [-d directory] [-o file] hash
+ *
+ * DESCRIPTION
+ *     Reads the store written by dump_store.c, by default in /wow_dumps.
+ *
+ *     With -l, prints one line per stored module, in key=value form: its
+ *     hash, size, where and when it was first captured, and whether it is
+ *     kept in the archive or in a file of its own.
+ *
+ *     Otherwise writes the module whose hash starts with the given hex
+ *     digits to file, or to standard output. An archived module is read
+ *     from its frame alone, found through the index, and decompressed a
+ *     block at a time. The result is checked against its hash.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dump_lz.h"
+#include "dump_store.h"
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: dumpextract [-d directory] -l\n"
+                    "       dumpextract [-d directory] [-o file] hash\n");
+    exit(2);
+}
+
+static void
+format_hash(char *buffer, size_t size, const dump_store_hash_t *hash)
+{
+    snprintf(buffer, size, kDumpStoreContentName,
+             (unsigned long long)hash->high, (unsigned long long)hash->low);
+    /* just the digits */
+    buffer[32] = '\0';
+}
+
+static void
+read_exactly(int fd, void *buffer, size_t size, off_t offset, const char *what)
+{
+    ssize_t got = pread(fd, buffer, size, offset);
+
+    if (got != (ssize_t)size)
+        errx(1, "%s: truncated", what);
+}
+
+/* Decodes the frame at offset into bytes, which holds record->size. */
+static void
+extract_archived(const char *directory, const dump_store_record_t *record, unsigned char *bytes)
+{
+    char path[1024];
+    dump_archive_module_t module;
+    dump_archive_block_t block;
+    unsigned char *stored;
+    off_t offset = (off_t)record->archiveOffset;
+    uint64_t done = 0;
+    uint32_t i, size;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/" kDumpStoreArchiveName, directory);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        err(1, "%s", path);
+    read_exactly(fd, &module, sizeof(module), offset, path);
+    if (module.magic != kDumpArchiveModuleMagic || module.size != record->size
+        || memcmp(&module.hash, &record->hash, sizeof(module.hash)))
+        errx(1, "%s: no module frame at offset %llu", path, (unsigned long long)offset);
+    offset += sizeof(module);
+
+    if (!(stored = malloc(kDumpArchiveBlockSize)))
+        err(1, "malloc");
+    for (i = 0; i < module.blockCount; i++) {
+        read_exactly(fd, &block, sizeof(block), offset, path);
+        offset += sizeof(block);
+        size = block.storedSize & ~kDumpArchiveBlockRaw;
+        if (block.size > kDumpArchiveBlockSize || size > kDumpArchiveBlockSize
+            || block.size > module.size - done)
+            errx(1, "%s: corrupt block %u", path, i);
+        if (block.storedSize & kDumpArchiveBlockRaw) {
+            if (size != block.size)
+                errx(1, "%s: corrupt block %u", path, i);
+            read_exactly(fd, bytes + done, size, offset, path);
+        } else {
+            read_exactly(fd, stored, size, offset, path);
+            if (dumpLZDecompress(stored, size, bytes + done, block.size))
+                errx(1, "%s: corrupt block %u", path, i);
+        }
+        offset += size;
+        done += block.size;
+    }
+    if (done != module.size)
+        errx(1, "%s: module is short", path);
+    free(stored);
+    close(fd);
+}
+
+static void
+extract_file(const char *directory, const dump_store_record_t *record, unsigned char *bytes)
+{
+    char path[1024], hash[64];
+    int fd;
+
+    format_hash(hash, sizeof(hash), &record->hash);
+    snprintf(path, sizeof(path), "%s/%s.bin", directory, hash);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        err(1, "%s", path);
+    read_exactly(fd, bytes, record->size, 0, path);
+    close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *directory = kDumpStoreDefaultDirectory, *output = NULL, *prefix = NULL;
+    char path[1024], hash[64];
+    dump_store_header_t header;
+    dump_store_record_t record, found;
+    dump_store_hash_t check;
+    unsigned char *bytes;
+    ssize_t written;
+    uint64_t done;
+    FILE *index;
+    int list = 0, matches = 0, ch, fd;
+
+    while ((ch = getopt(argc, argv, "d:lo:")) != -1) {
+        switch (ch) {
+        case 'd': directory = optarg; break;
+        case 'l': list = 1; break;
+        case 'o': output = optarg; break;
+        default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (list ? argc != 0 : argc != 1)
+        usage();
+    if (!list)
+        prefix = argv[0];
+
+    snprintf(path, sizeof(path), "%s/" kDumpStoreIndexName, directory);
+    if (!(index = fopen(path, "rb")))
+        err(1, "%s", path);
+    if (fread(&header, sizeof(header), 1, index) != 1 || header.magic != kDumpStoreMagic
+        || header.version != kDumpStoreVersion || header.recordSize != sizeof(record))
+        errx(1, "%s: not a version %d dump store index", path, kDumpStoreVersion);
+
+    while (fread(&record, sizeof(record), 1, index) == 1) {
+        if (!(record.flags & kDumpStoreFirstSeen))
+            continue;
+        format_hash(hash, sizeof(hash), &record.hash);
+        if (list)
+            printf("hash=%s size=%llu address=0x%llx time=%llu pid=%u stored=%s\n",
+                   hash, (unsigned long long)record.size, (unsigned long long)record.address,
+                   (unsigned long long)record.time, record.pid,
+                   record.archiveOffset == kDumpStoreNotArchived ? "file" : "archive");
+        else if (!strncasecmp(hash, prefix, strlen(prefix))
+                 && (!matches || memcmp(&found.hash, &record.hash, sizeof(found.hash)))) {
+            /* the first frame of a module stored twice, by two processes, will do */
+            if (matches++ == 0)
+                found = record;
+        }
+    }
+    fclose(index);
+    if (list)
+        return 0;
+    if (matches != 1)
+        errx(1, matches ? "%s: ambiguous hash" : "%s: no such module", prefix);
+
+    if (!(bytes = malloc(found.size ? found.size : 1)))
+        err(1, "malloc");
+    if (found.archiveOffset == kDumpStoreNotArchived)
+        extract_file(directory, &found, bytes);
+    else
+        extract_archived(directory, &found, bytes);
+    dumpStoreHash(bytes, found.size, &check);
+    if (memcmp(&check, &found.hash, sizeof(check)))
+        errx(1, "%s: contents don't match their hash", prefix);
+
+    fd = output ? open(output, O_WRONLY|O_CREAT|O_TRUNC, 0644) : STDOUT_FILENO;
+    if (fd < 0)
+        err(1, "%s", output);
+    for (done = 0; done < found.size; done += written)
+        if ((written = write(fd, bytes + done, found.size - done)) <= 0)
+            err(1, "%s", output ? output : "stdout");
+    if (output)
+        close(fd);
+    free(bytes);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * dumpquery - find captures in the journal of a dump store
+ *
+ * SYNOPSIS
+ *     dumpquery [-d directory] [-cv] [-u uuid] [-s segment]
+ *
+ * DESCRIPTION
+ *     Reads the journal written by dump_journal.c, by default in /wow_dumps,
+ *     and prints one line per capture, in key=value form: when, by which
+ *     process and thread, from which caller, where and how big, the hash
+ *     of its contents in the store, and what its Mach-O header said.
+ *
+ *     With -u, only captures of the image with that UUID are printed; with
+ *     -s, only those with a segment of that name, such as __TEXT. Both can
+ *     be given. -c prints the number of matches instead, and -v reports
+ *     how many index records and entries were looked at, and how long it
+ *     took, on standard error.
+ *
+ *     Matching runs over the journal index, which is mapped and scanned
+ *     without reading the journal: the UUID is compared there, and the
+ *     segment against a 64-bit filter of segment names. Only the entries
+ *     the index leaves in are read, to check the segment name exactly and
+ *     to print them. Entries the index lacks, after a crash, are read from
+ *     the journal. The modules themselves are never opened.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dump_journal.h"
+
+struct query {
+    int by_uuid;
+    uint8_t uuid[16];
+    const char *segment;
+    uint64_t segment_bit;
+    int count_only;
+    uint64_t matches;
+    uint64_t entries_read;
+};
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: dumpquery [-d directory] [-cv] [-u uuid] [-s segment]\n");
+    exit(2);
+}
+
+static void
+parse_uuid(const char *text, uint8_t *uuid)
+{
+    const char *p;
+    int digits = 0, value;
+
+    for (p = text; *p; p++) {
+        if (*p == '-')
+            continue;
+        if (!isxdigit((unsigned char)*p) || digits == 32)
+            errx(2, "%s: not a UUID", text);
+        value = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+        uuid[digits / 2] = digits % 2 ? uuid[digits / 2] | value : value << 4;
+        digits++;
+    }
+    if (digits != 32)
+        errx(2, "%s: not a UUID", text);
+}
+
+/* Maps a journal or journal index, checking its header. */
+static const unsigned char *
+map_file(const char *path, uint32_t magic, uint32_t record_size, size_t *size)
+{
+    const dump_store_header_t *header;
+    struct stat st;
+    void *base;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        err(1, "%s", path);
+    if (fstat(fd, &st) < 0)
+        err(1, "%s", path);
+    if ((size_t)st.st_size < sizeof(*header))
+        errx(1, "%s: too short", path);
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        err(1, "mmap %s", path);
+    close(fd);
+
+    header = base;
+    if (header->magic != magic || header->version != kDumpJournalVersion
+        || header->recordSize != record_size)
+        errx(1, "%s: not a version %d journal", path, kDumpJournalVersion);
+    *size = st.st_size;
+    return base;
+}
+
+/* The entry at offset, or NULL if it runs off the journal or is torn. */
+static const dump_journal_entry_t *
+entry_at(const unsigned char *journal, size_t size, uint64_t offset)
+{
+    const dump_journal_entry_t *entry;
+
+    if (offset % 8 || offset > size || size - offset < sizeof(*entry))
+        return NULL;
+    entry = (const dump_journal_entry_t *)(journal + offset);
+    if (entry->segmentCount > kDumpJournalMaxSegments
+        || entry->entrySize != sizeof(*entry) + entry->segmentCount * sizeof(dump_journal_segment_t)
+        || entry->entrySize > size - offset)
+        return NULL;
+    return entry;
+}
+
+static void
+print_entry(const dump_journal_entry_t *entry)
+{
+    const dump_journal_segment_t *segments = (const dump_journal_segment_t *)(entry + 1);
+    const uint8_t *u = entry->uuid;
+    uint32_t i;
+
+    printf("time=%llu pid=%u thread=0x%llx caller=0x%llx address=0x%llx size=%llu"
+           " hash=%016llx%016llx",
+           (unsigned long long)entry->time, entry->pid, (unsigned long long)entry->thread,
+           (unsigned long long)entry->caller, (unsigned long long)entry->address,
+           (unsigned long long)entry->size,
+           (unsigned long long)entry->hash.high, (unsigned long long)entry->hash.low);
+    if (!(entry->flags & kDumpJournalMachO)) {
+        printf(" macho=no\n");
+        return;
+    }
+    if (entry->flags & kDumpJournalHasUUID)
+        printf(" uuid=%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+               u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+               u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+    printf(" cputype=%d cpusubtype=%d filetype=%u%s segments=",
+           entry->cputype, entry->cpusubtype, entry->filetype,
+           entry->flags & kDumpJournalFat ? " fat=yes" : "");
+    for (i = 0; i < entry->segmentCount; i++)
+        printf("%s%.16s:0x%llx+0x%llx", i ? "," : "", segments[i].name,
+               (unsigned long long)segments[i].vmaddr, (unsigned long long)segments[i].vmsize);
+    printf("%s\n", entry->flags & kDumpJournalTruncated ? ",..." : "");
+}
+
+/* Checks an entry against the query in full, and prints it if it matches. */
+static void
+match_entry(struct query *q, const dump_journal_entry_t *entry)
+{
+    const dump_journal_segment_t *segments = (const dump_journal_segment_t *)(entry + 1);
+    uint32_t i;
+
+    q->entries_read++;
+    if (q->by_uuid && (!(entry->flags & kDumpJournalHasUUID)
+                       || memcmp(entry->uuid, q->uuid, sizeof(q->uuid))))
+        return;
+    if (q->segment) {
+        for (i = 0; i < entry->segmentCount; i++)
+            if (!strncmp(segments[i].name, q->segment, sizeof(segments[i].name)))
+                break;
+        if (i == entry->segmentCount)
+            return;
+    }
+    q->matches++;
+    if (!q->count_only)
+        print_entry(entry);
+}
+
+/* Reads the entries between start and end straight from the journal. */
+static void
+scan_gap(struct query *q, const unsigned char *journal, size_t size, uint64_t start, uint64_t end)
+{
+    const dump_journal_entry_t *entry;
+
+    while (start < end && (entry = entry_at(journal, size, start)) != NULL) {
+        match_entry(q, entry);
+        start += entry->entrySize;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *directory = kDumpStoreDefaultDirectory;
+    char path[1024];
+    const unsigned char *journal, *index_base;
+    const dump_journal_index_t *index;
+    const dump_journal_entry_t *entry;
+    size_t journal_size, index_size, count, i;
+    uint64_t expected;
+    struct query q;
+    struct timeval start, end;
+    int ch, verbose = 0;
+
+    memset(&q, 0, sizeof(q));
+    while ((ch = getopt(argc, argv, "cd:s:u:v")) != -1) {
+        switch (ch) {
+        case 'c': q.count_only = 1; break;
+        case 'd': directory = optarg; break;
+        case 's': q.segment = optarg; break;
+        case 'u': q.by_uuid = 1; parse_uuid(optarg, q.uuid); break;
+        case 'v': verbose = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+    if (q.segment) {
+        if (strlen(q.segment) > 16)
+            errx(2, "%s: segment names are at most 16 characters", q.segment);
+        q.segment_bit = dumpJournalSegmentBit(q.segment);
+    }
+
+    snprintf(path, sizeof(path), "%s/" kDumpJournalName, directory);
+    journal = map_file(path, kDumpJournalMagic, sizeof(dump_journal_entry_t), &journal_size);
+    snprintf(path, sizeof(path), "%s/" kDumpJournalIndexName, directory);
+    index_base = map_file(path, kDumpJournalIndexMagic, sizeof(dump_journal_index_t), &index_size);
+    index = (const dump_journal_index_t *)(index_base + sizeof(dump_store_header_t));
+    /* a torn record at the end, from a crash, is left out */
+    count = (index_size - sizeof(dump_store_header_t)) / sizeof(*index);
+
+    gettimeofday(&start, NULL);
+    expected = sizeof(dump_store_header_t);
+    for (i = 0; i < count; i++) {
+        if (index[i].offset > expected)
+            scan_gap(&q, journal, journal_size, expected, index[i].offset);
+        /* a torn record can't be trusted to move the end on past the journal's */
+        if (index[i].offset + index[i].entrySize > expected
+            && index[i].offset + index[i].entrySize <= journal_size)
+            expected = index[i].offset + index[i].entrySize;
+
+        if (q.by_uuid && memcmp(index[i].uuid, q.uuid, sizeof(q.uuid)))
+            continue;
+        if (q.segment && !(index[i].segments & q.segment_bit))
+            continue;
+        if ((entry = entry_at(journal, journal_size, index[i].offset)) != NULL)
+            match_entry(&q, entry);
+    }
+    scan_gap(&q, journal, journal_size, expected, journal_size);
+    gettimeofday(&end, NULL);
+
+    if (q.count_only)
+        printf("%llu\n", (unsigned long long)q.matches);
+    if (verbose)
+        fprintf(stderr, "%zu index records, %llu entries read, %llu matches, %.3f ms\n",
+                count, (unsigned long long)q.entries_read, (unsigned long long)q.matches,
+                (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3);
+    return 0;
+}
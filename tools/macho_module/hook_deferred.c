@@ -0,0 +1,254 @@
+/*******************************************************************************
+ hook_deferred.c
+ Deferred hooks: kept pending by symbol and image until dyld adds an image
+ that defines the symbol, then installed from its add-image callback.
+
+ A pending hook is claimed, under the lock, by whichever of the callback
+ and the registering thread resolves it first, and installed by that
+ thread outside the lock, so it is installed exactly once.
+
+ ***************************************************************************/
+
+#include "hook_deferred.h"
+#include "mach_override.h"
+#include "symbol_index.h"
+
+#include <mach-o/dyld.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+typedef	struct	PendingHook	{
+	struct PendingHook		*next;
+	char					*symbolName;
+	char					*imageNameHint;		//	NULL for any image
+	hook_deferred_install_t	install;			//	NULL for mach_override_ptr()
+	const void				*overrideFunctionAddress;
+	void					**originalFunctionReentryIsland;
+	hook_deferred_done_t	done;
+	void					*context;
+	void					*address;			//	once resolved
+}	PendingHook;
+
+static PendingHook		*gPendingHooks = NULL;
+static pthread_mutex_t	gPendingLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	gDeferredOnce = PTHREAD_ONCE_INIT;
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+static void
+freePendingHook(
+				PendingHook	*hook )
+{
+	free( hook->symbolName );
+	free( hook->imageNameHint );
+	free( hook );
+}
+
+/***************************************************************************//**
+	Takes the pending hooks an image defines off the pending list.
+
+	@param	mh		->	The image's header.
+	@param	slide	->	Its slide.
+	@param	path	->	Its path, matched against the hints.
+	@param	only	->	Only consider this hook. Can be NULL.
+	@result			<-	The claimed hooks, resolved, linked through next.
+
+	***************************************************************************/
+
+static PendingHook *
+claimImageHooks(
+				const struct mach_header	*mh,
+				intptr_t					slide,
+				const char					*path,
+				PendingHook					*only )
+{
+	PendingHook	**link, *hook, *claimed = NULL;
+
+	pthread_mutex_lock( &gPendingLock );
+	for( link = &gPendingHooks; (hook = *link); ) {
+		if( (!only || hook == only)
+			&& (!hook->imageNameHint || strstr( path, hook->imageNameHint ))
+			&& !symbolIndexLookupInImage( mh, slide, hook->symbolName, &hook->address ) ) {
+			*link = hook->next;
+			hook->next = claimed;
+			claimed = hook;
+		} else
+			link = &hook->next;
+	}
+	pthread_mutex_unlock( &gPendingLock );
+	return claimed;
+}
+
+//	Installs and releases claimed hooks. Returns the last error.
+static mach_error_t
+installClaimedHooks(
+					PendingHook	*hooks,
+					const char	*path )
+{
+	PendingHook		*next;
+	mach_error_t	err = err_none;
+
+	for( ; hooks; hooks = next ) {
+		next = hooks->next;
+		if( hooks->install )
+			err = hooks->install( hooks->address, hooks->context );
+		else
+			err = mach_override_ptr( hooks->address, hooks->overrideFunctionAddress,
+									 hooks->originalFunctionReentryIsland );
+		if( hooks->done )
+			hooks->done( hooks->symbolName, path, err, hooks->context );
+		freePendingHook( hooks );
+	}
+	return err;
+}
+
+/**************************
+ *
+ *	Image Callback
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Image Callback)
+
+static void
+addImage(
+		 const struct mach_header	*mh,
+		 intptr_t					slide )
+{
+	Dl_info		info;
+	const char	*path;
+
+	//	Cheap when nothing is pending, which is the common case.
+	if( !gPendingHooks )
+		return;
+	path = dladdr( mh, &info ) && info.dli_fname ? info.dli_fname : "";
+	installClaimedHooks( claimImageHooks( mh, slide, path, NULL ), path );
+}
+
+static void
+registerImageCallback( void )
+{
+	_dyld_register_func_for_add_image( addImage );
+}
+
+/***************************************************************************//**
+	Records a hook and, if an image that defines its symbol is already
+	loaded, installs it right away.
+
+	@param	symbolName		->	Copied.
+	@param	imageNameHint	->	Copied. Can be NULL.
+	@param	hook			->	The rest of the hook. Consumed.
+	@result					<-	See hookDeferredOverride().
+
+	***************************************************************************/
+
+static mach_error_t
+registerPendingHook(
+					const char	*symbolName,
+					const char	*imageNameHint,
+					PendingHook	*hook )
+{
+	PendingHook	*claimed;
+	uint32_t	i, count;
+
+	hook->symbolName = strdup( symbolName );
+	hook->imageNameHint = imageNameHint ? strdup( imageNameHint ) : NULL;
+	if( !hook->symbolName || (imageNameHint && !hook->imageNameHint) ) {
+		freePendingHook( hook );
+		return KERN_RESOURCE_SHORTAGE;
+	}
+
+	//	Registered first, so that the callback's initial pass over the loaded
+	//	images doesn't see this hook; they are searched below instead.
+	pthread_once( &gDeferredOnce, registerImageCallback );
+
+	pthread_mutex_lock( &gPendingLock );
+	hook->next = gPendingHooks;
+	gPendingHooks = hook;
+	pthread_mutex_unlock( &gPendingLock );
+
+	//	An image added meanwhile may have claimed it already, in which case
+	//	nothing is found here.
+	count = _dyld_image_count();
+	for( i = 0; i < count; i++ ) {
+		const char *path = _dyld_get_image_name( i );
+		if( !path || (imageNameHint && !strstr( path, imageNameHint )) )
+			continue;
+		claimed = claimImageHooks( _dyld_get_image_header( i ),
+								   _dyld_get_image_vmaddr_slide( i ), path, hook );
+		if( claimed )
+			return installClaimedHooks( claimed, path );
+	}
+	return err_none;
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+hookDeferredOverride(
+					 const char				*symbolName,
+					 const char				*imageNameHint,
+					 const void				*overrideFunctionAddress,
+					 void					**originalFunctionReentryIsland,
+					 hook_deferred_done_t	done,
+					 void					*context )
+{
+	PendingHook	*hook;
+
+	assert( symbolName );
+	assert( overrideFunctionAddress );
+
+	hook = calloc( 1, sizeof( PendingHook ) );
+	if( !hook )
+		return KERN_RESOURCE_SHORTAGE;
+	hook->overrideFunctionAddress = overrideFunctionAddress;
+	hook->originalFunctionReentryIsland = originalFunctionReentryIsland;
+	hook->done = done;
+	hook->context = context;
+	return registerPendingHook( symbolName, imageNameHint, hook );
+}
+
+mach_error_t
+hookDeferredInstall(
+					const char				*symbolName,
+					const char				*imageNameHint,
+					hook_deferred_install_t	install,
+					hook_deferred_done_t	done,
+					void					*context )
+{
+	PendingHook	*hook;
+
+	assert( symbolName );
+	assert( install );
+
+	hook = calloc( 1, sizeof( PendingHook ) );
+	if( !hook )
+		return KERN_RESOURCE_SHORTAGE;
+	hook->install = install;
+	hook->done = done;
+	hook->context = context;
+	return registerPendingHook( symbolName, imageNameHint, hook );
+}
@@ -0,0 +1,98 @@
+/*******************************************************************************
+ hook_deferred.h
+ Hooks registered by symbol and image, installed when the image that
+ defines the symbol is loaded rather than up front.
+
+ ***************************************************************************/
+
+#ifndef		_hook_deferred_
+#define		_hook_deferred_
+
+#include <sys/types.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+	/**
+	 Installs a deferred hook once its symbol is resolved, for overriding
+	 with something other than mach_override_ptr(), such as
+	 hookStatsOverride(). Called on the thread loading the image.
+	 */
+	typedef	mach_error_t	(*hook_deferred_install_t)(
+		void	*originalFunctionAddress,
+		void	*context );
+
+	/**
+	 Reports how installing a deferred hook went. Called on the thread
+	 loading the image, once per registration.
+	 */
+	typedef	void			(*hook_deferred_done_t)(
+		const char		*symbolName,
+		const char		*imagePath,
+		mach_error_t	err,
+		void			*context );
+
+	/***************************************************************************//**
+	 Overrides a function like mach_override(), as soon as an image whose
+	 path contains imageNameHint is loaded. If one already is, the hook is
+	 installed before returning.
+
+	 Only the symbol tables of images that match are searched, from dyld's
+	 add-image callback, so images that never load cost nothing beyond a
+	 comparison of their path. Without a hint, every image is searched as it
+	 is added until one defines the symbol.
+
+	 @param	symbolName						->	Required symbol name, with its
+												leading underscore. Copied.
+	 @param	imageNameHint					->	Substring of the path of the image
+												defining the symbol. Copied. Can be
+												NULL.
+	 @param	overrideFunctionAddress			->	Required address of the overriding
+												function.
+	 @param	originalFunctionReentryIsland	<-	Optional pointer to pointer to the
+												reentry island, written when the
+												hook is installed. Can be NULL.
+	 @param	done							->	Optional callback reporting the
+												result. Can be NULL.
+	 @param	context							->	Passed to done.
+	 @result									<-	The install error, if the image was
+												already loaded; KERN_RESOURCE_SHORTAGE
+												if the hook couldn't be recorded.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	hookDeferredOverride(
+						 const char				*symbolName,
+						 const char				*imageNameHint,
+						 const void				*overrideFunctionAddress,
+						 void					**originalFunctionReentryIsland,
+						 hook_deferred_done_t	done,
+						 void					*context );
+
+	/***************************************************************************//**
+	 Same as hookDeferredOverride(), with install doing the overriding.
+
+	 @param	symbolName		->	Required symbol name. Copied.
+	 @param	imageNameHint	->	Optional image path substring. Copied.
+	 @param	install			->	Required installer.
+	 @param	done			->	Optional result callback.
+	 @param	context			->	Passed to install and done.
+	 @result					<-	See hookDeferredOverride().
+
+	 ***************************************************************************/
+
+	mach_error_t
+	hookDeferredInstall(
+						const char				*symbolName,
+						const char				*imageNameHint,
+						hook_deferred_install_t	install,
+						hook_deferred_done_t	done,
+						void					*context );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_hook_deferred_
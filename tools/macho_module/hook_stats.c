@@ -0,0 +1,281 @@
+/*******************************************************************************
+ hook_stats.c
+ Per-hook call counters and latency histograms, published in a shared-memory
+ region that other processes can poll.
+
+ Each instrumented hook gets two stubs (see hook_stub.h): one in front of the
+ overriding function and one in front of the reentry island. Entry counts
+ the call and reads the cycle counter; leave files the elapsed cycles into
+ the calling thread's histogram.
+
+ ***************************************************************************/
+
+#include "hook_stats.h"
+#include "hook_stub.h"
+#include "mach_override.h"
+
+#include <sys/mman.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSAtomic.h>
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+//	Context of one stub: which counters to bump.
+typedef	struct	{
+	hook_stub_t		stub;
+	unsigned int	hookIndex;
+	int				original;		//	counts into hook_stats_slot_t.original
+}	StatsStub;
+
+//	A row given back by an exited thread, for the next thread to reuse.
+typedef	struct	{
+	void			*link;
+	uintptr_t		row;
+}	FreeRow;
+
+static hook_stats_region_t	*gRegion = NULL;
+static mach_error_t			gRegionError = err_none;
+static pthread_once_t		gRegionOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t		gRowKey;			//	row + 1, 0 until assigned
+static FreeRow				gFreeRows[kHookStatsMaxThreads];
+static OSQueueHead			gFreeRowQueue = OS_ATOMIC_QUEUE_INIT;
+static pthread_mutex_t		gInstallLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**************************
+ *
+ *	Callbacks
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Callbacks)
+
+static inline unsigned int
+histogramBucket(
+				uint64_t	cycles )
+{
+	unsigned int	bucket = 0;
+
+	while( cycles >>= 1 )
+		bucket++;
+	return bucket < kHookStatsBuckets ? bucket : kHookStatsBuckets - 1;
+}
+
+//	The calling thread's row of counters, or NULL past kHookStatsMaxThreads.
+//	Rows of exited threads are reused, counters and all, before new ones.
+static hook_stats_slot_t *
+threadRow( void )
+{
+	uintptr_t	row = (uintptr_t) pthread_getspecific( gRowKey );
+	FreeRow		*freeRow;
+
+	if( !row ) {
+		freeRow = OSAtomicDequeue( &gFreeRowQueue, offsetof( FreeRow, link ) );
+		row = freeRow ? freeRow->row
+			: (uintptr_t) OSAtomicIncrement32( (volatile int32_t *) &gRegion->threadCount );
+		pthread_setspecific( gRowKey, (void *) row );
+	}
+	return row <= kHookStatsMaxThreads ? gRegion->slots[row - 1] : NULL;
+}
+
+//	Destructor of gRowKey: gives an exiting thread's row back.
+static void
+releaseRow(
+		   void	*value )
+{
+	uintptr_t	row = (uintptr_t) value;
+
+	if( row <= kHookStatsMaxThreads ) {
+		gFreeRows[row - 1].row = row;
+		OSAtomicEnqueue( &gFreeRowQueue, &gFreeRows[row - 1], offsetof( FreeRow, link ) );
+	}
+}
+
+static hook_stats_counter_t *
+stubCounter(
+			StatsStub	*stub )
+{
+	hook_stats_slot_t	*row = threadRow();
+
+	if( !row )
+		return NULL;
+	return stub->original ? &row[stub->hookIndex].original : &row[stub->hookIndex].hook;
+}
+
+static int
+enterStats(
+		   hook_stub_t			*stub,
+		   hook_stub_entry_t	*entry,
+		   uint64_t				*cookie )
+{
+	hook_stats_counter_t	*counter = stubCounter( (StatsStub *) stub );
+
+	if( !counter ) {
+		OSAtomicIncrement32( (volatile int32_t *) &gRegion->untrackedCalls );
+		return 0;
+	}
+	counter->calls++;
+	*cookie = hookStubCycles();
+	return 1;
+}
+
+static void
+leaveStats(
+		   hook_stub_t		*stub,
+		   hook_stub_exit_t	*exit,
+		   uint64_t			cookie )
+{
+	uint64_t				cycles = hookStubCycles() - cookie;
+	hook_stats_counter_t	*counter = stubCounter( (StatsStub *) stub );
+
+	counter->cycles += cycles;
+	counter->histogram[histogramBucket( cycles )]++;
+}
+
+/**************************
+ *
+ *	Region
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Region)
+
+static void
+unlinkRegion( void )
+{
+	char	name[32];
+
+	snprintf( name, sizeof( name ), kHookStatsRegionName, (int) getpid() );
+	shm_unlink( name );
+}
+
+static void
+createRegion( void )
+{
+	char	name[32];
+	int		fd;
+	void	*region;
+
+	snprintf( name, sizeof( name ), kHookStatsRegionName, (int) getpid() );
+	shm_unlink( name );
+	fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+	if( fd < 0 ) {
+		gRegionError = KERN_FAILURE;
+		return;
+	}
+	if( ftruncate( fd, sizeof( hook_stats_region_t ) ) ) {
+		close( fd );
+		shm_unlink( name );
+		gRegionError = KERN_RESOURCE_SHORTAGE;
+		return;
+	}
+	region = mmap( NULL, sizeof( hook_stats_region_t ), PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0 );
+	close( fd );
+	if( region == MAP_FAILED || pthread_key_create( &gRowKey, releaseRow ) ) {
+		shm_unlink( name );
+		gRegionError = KERN_RESOURCE_SHORTAGE;
+		return;
+	}
+
+	gRegion = region;
+	gRegion->version = kHookStatsVersion;
+	gRegion->maxHooks = kHookStatsMaxHooks;
+	gRegion->maxThreads = kHookStatsMaxThreads;
+	gRegion->buckets = kHookStatsBuckets;
+	OSMemoryBarrier();
+	gRegion->magic = kHookStatsMagic;
+	atexit( unlinkRegion );
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+hookStatsOverride(
+				  void			*originalFunctionAddress,
+				  const void	*overrideFunctionAddress,
+				  void			**originalFunctionReentryIsland,
+				  const char	*hookName )
+{
+	assert( originalFunctionAddress );
+	assert( overrideFunctionAddress );
+
+#if defined(__i386__) || defined(__x86_64__)
+	StatsStub		*stubs;
+	void			*hookThunk = NULL, *originalThunk = NULL;
+	unsigned int	index;
+	mach_error_t	err;
+
+	pthread_once( &gRegionOnce, createRegion );
+	if( gRegionError )
+		return gRegionError;
+
+	pthread_mutex_lock( &gInstallLock );
+
+	index = gRegion->hookCount;
+	stubs = calloc( 2, sizeof( StatsStub ) );
+	err = index < kHookStatsMaxHooks && stubs ? err_none : KERN_RESOURCE_SHORTAGE;
+
+	if( !err ) {
+		hook_stats_hook_t *hook = &gRegion->hooks[index];
+		strlcpy( hook->name, hookName ? hookName : "", sizeof( hook->name ) );
+		hook->address = (uintptr_t) originalFunctionAddress;
+
+		stubs[0].stub.target = overrideFunctionAddress;
+		stubs[0].stub.enter = stubs[1].stub.enter = enterStats;
+		stubs[0].stub.leave = stubs[1].stub.leave = leaveStats;
+		stubs[0].hookIndex = stubs[1].hookIndex = index;
+		stubs[1].original = 1;
+		err = hookStubCreate( &stubs[0].stub, &hookThunk );
+	}
+	if( !err )
+		err = hookStubCreate( &stubs[1].stub, &originalThunk );
+
+	//	The original's stub continues into the reentry island, and the
+	//	caller's pointer to it is set, before the hook's thunk can be
+	//	reached: threads already in the hook call through it.
+	if( !err ) {
+		mach_override_hook_t handle;
+		void *previousIsland = NULL;
+		if( originalFunctionReentryIsland ) {
+			previousIsland = *originalFunctionReentryIsland;
+			*originalFunctionReentryIsland = originalThunk;
+			OSMemoryBarrier();
+		}
+		err = mach_override_hook( originalFunctionAddress, hookThunk,
+								  (void **) &stubs[1].stub.target, &handle );
+		if( err && originalFunctionReentryIsland )
+			*originalFunctionReentryIsland = previousIsland;
+	}
+	if( !err ) {
+		OSMemoryBarrier();
+		gRegion->hookCount = index + 1;
+	} else {
+		//	A thunk built before the failure is leaked; it is one island.
+		free( stubs );
+	}
+
+	pthread_mutex_unlock( &gInstallLock );
+	return err;
+#else
+	return KERN_NOT_SUPPORTED;
+#endif
+}
@@ -0,0 +1,112 @@
+/*******************************************************************************
+ hook_stats.h
+ Per-hook call counters and latency histograms, published in a shared-memory
+ region that other processes can poll.
+
+ ***************************************************************************/
+
+#ifndef		_hook_stats_
+#define		_hook_stats_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+#define	kHookStatsMagic			0x484B5354	//	'HKST'
+#define	kHookStatsVersion		1
+#define	kHookStatsMaxHooks		128
+#define	kHookStatsMaxThreads	32
+#define	kHookStatsBuckets		32			//	log2 of the cycle count
+#define	kHookStatsNameLength	64
+
+	/**
+	 shm_open() name of a process' region, formatted with its pid.
+	 */
+#define	kHookStatsRegionName	"/hook_stats.%d"
+
+	/**
+	 Calls and cycle-counter latency of one side of a hook, for one thread.
+	 Histogram bucket i counts calls that took [2^i, 2^(i+1)) cycles; the last
+	 bucket also counts anything slower.
+	 */
+	typedef	struct	{
+		uint64_t	calls;
+		uint64_t	cycles;
+		uint32_t	histogram[kHookStatsBuckets];
+	}	hook_stats_counter_t;
+
+	/**
+	 One thread's counters for one hook. Time spent in the hook includes the
+	 time spent in the original function it calls.
+	 */
+	typedef	struct	{
+		hook_stats_counter_t	hook;
+		hook_stats_counter_t	original;
+	}	hook_stats_slot_t;
+
+	typedef	struct	{
+		char		name[kHookStatsNameLength];
+		uint64_t	address;		//	of the original function
+	}	hook_stats_hook_t;
+
+	/**
+	 Layout of the shared region. Each thread owns one row of slots and is the
+	 only writer of its counters, so the hooked process never takes a lock or
+	 makes a system call to count. A thread's row is reused, counters and all,
+	 by a later thread once it exits. Readers map the region read-only and sum
+	 the rows; a hook's entry is written before hookCount is bumped past it.
+	 Counters are read without synchronisation and may be momentarily
+	 inconsistent with each other.
+	 */
+	typedef	struct	{
+		uint32_t				magic;
+		uint32_t				version;
+		uint32_t				maxHooks;
+		uint32_t				maxThreads;
+		uint32_t				buckets;
+		volatile uint32_t		hookCount;
+		volatile uint32_t		threadCount;		//	rows handed out so far
+		volatile uint32_t		untrackedCalls;		//	from threads past maxThreads
+		hook_stats_hook_t		hooks[kHookStatsMaxHooks];
+		hook_stats_slot_t		slots[kHookStatsMaxThreads][kHookStatsMaxHooks];
+	}	hook_stats_region_t;
+
+	/***************************************************************************//**
+	 Overrides a function like mach_override_ptr(), with the hook and the
+	 reentry island both wrapped in instrumentation stubs that count calls and
+	 time them with the cycle counter.
+
+	 Timing works by swapping the return address for a stub that pops a
+	 per-thread shadow stack, so functions left by longjmp() or by unwinding
+	 an exception can't be instrumented. Not implemented on ppc.
+
+	 @param	originalFunctionAddress			->	Required address of the function to
+												override.
+	 @param	overrideFunctionAddress			->	Required address of the overriding
+												function.
+	 @param	originalFunctionReentryIsland	<-	Optional pointer to pointer to the
+												(instrumented) reentry island. Can be
+												NULL.
+	 @param	hookName						->	Name published with the counters.
+	 @result									<-	KERN_RESOURCE_SHORTAGE once
+												kHookStatsMaxHooks hooks are
+												instrumented, or any error from
+												mach_override_ptr().
+
+	 ***************************************************************************/
+
+	mach_error_t
+	hookStatsOverride(
+					  void			*originalFunctionAddress,
+					  const void	*overrideFunctionAddress,
+					  void			**originalFunctionReentryIsland,
+					  const char	*hookName );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_hook_stats_
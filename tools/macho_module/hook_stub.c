@@ -0,0 +1,299 @@
+/*******************************************************************************
+ hook_stub.c
+ Generic entry and exit stubs for instrumenting overridden functions.
+
+ A stub's thunk (see mach_override_thunk()) lands in hookStubEntry, which
+ saves the argument registers and calls the stub's enter callback. If enter
+ asks for it, the return address is pushed on a per-thread shadow stack and
+ swapped for hookStubExit, which on the way out saves the return value
+ registers, calls leave and returns to the real caller.
+
+ ***************************************************************************/
+
+#include "hook_stub.h"
+#include "mach_override.h"
+
+#include <mach/mach.h>
+#include <assert.h>
+#include <pthread.h>
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#define	kShadowStackDepth	256
+
+#define	ASM_STRING2( x )	#x
+#define	ASM_STRING( x )		ASM_STRING2( x )
+#define	ASM_SYMBOL( name )	ASM_STRING( __USER_LABEL_PREFIX__ ) #name
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+typedef	struct	{
+	hook_stub_t	*stub;
+	uintptr_t	returnAddress;
+	uint64_t	cookie;
+}	ShadowFrame;
+
+typedef	struct	{
+	unsigned int	depth;
+	ShadowFrame		frames[kShadowStackDepth];
+}	ShadowStack;
+
+static pthread_key_t	gShadowStackKey;
+static int				gShadowStackKeyError = 0;
+static pthread_once_t	gShadowStackOnce = PTHREAD_ONCE_INIT;
+
+/**************************
+ *
+ *	Stubs
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Stubs)
+
+const void	*hookStubEnter( hook_stub_t *stub, hook_stub_entry_t *entry );
+uintptr_t	hookStubLeave( hook_stub_exit_t *exit );
+void		hookStubEntry( void );
+void		hookStubExit( void );
+
+#if defined(__x86_64__)
+asm(
+	".text;"
+	".align 4, 0x90;"
+	".globl " ASM_SYMBOL( hookStubEntry ) ";"
+	ASM_SYMBOL( hookStubEntry ) ":;"
+	//	%r11 = stub, (%rsp) = return address. Builds a hook_stub_entry_t.
+	"	pushq	%rbp;"
+	"	movq	%rsp, %rbp;"
+	"	pushq	%rdi;"
+	"	pushq	%rsi;"
+	"	pushq	%rdx;"
+	"	pushq	%rcx;"
+	"	pushq	%r8;"
+	"	pushq	%r9;"
+	"	pushq	%rax;"				//	%al: vector registers used by varargs
+	"	subq	$136, %rsp;"
+	"	movdqu	%xmm0, 0(%rsp);"
+	"	movdqu	%xmm1, 16(%rsp);"
+	"	movdqu	%xmm2, 32(%rsp);"
+	"	movdqu	%xmm3, 48(%rsp);"
+	"	movdqu	%xmm4, 64(%rsp);"
+	"	movdqu	%xmm5, 80(%rsp);"
+	"	movdqu	%xmm6, 96(%rsp);"
+	"	movdqu	%xmm7, 112(%rsp);"
+	"	movq	%r11, %rdi;"
+	"	movq	%rsp, %rsi;"
+	"	andq	$-16, %rsp;"		//	callers needn't have kept alignment
+	"	call	" ASM_SYMBOL( hookStubEnter ) ";"
+	"	movq	%rax, %r11;"
+	"	leaq	-192(%rbp), %rsp;"
+	"	movdqu	0(%rsp), %xmm0;"
+	"	movdqu	16(%rsp), %xmm1;"
+	"	movdqu	32(%rsp), %xmm2;"
+	"	movdqu	48(%rsp), %xmm3;"
+	"	movdqu	64(%rsp), %xmm4;"
+	"	movdqu	80(%rsp), %xmm5;"
+	"	movdqu	96(%rsp), %xmm6;"
+	"	movdqu	112(%rsp), %xmm7;"
+	"	addq	$136, %rsp;"
+	"	popq	%rax;"
+	"	popq	%r9;"
+	"	popq	%r8;"
+	"	popq	%rcx;"
+	"	popq	%rdx;"
+	"	popq	%rsi;"
+	"	popq	%rdi;"
+	"	popq	%rbp;"
+	"	jmpq	*%r11;"
+
+	".align 4, 0x90;"
+	".globl " ASM_SYMBOL( hookStubExit ) ";"
+	ASM_SYMBOL( hookStubExit ) ":;"
+	//	Returned into from a hooked function. Builds a hook_stub_exit_t.
+	"	subq	$8, %rsp;"			//	becomes the real return address
+	"	pushq	%rax;"
+	"	pushq	%rdx;"
+	"	subq	$40, %rsp;"
+	"	movdqu	%xmm0, 0(%rsp);"
+	"	movdqu	%xmm1, 16(%rsp);"
+	"	movq	%rsp, %rdi;"
+	"	pushq	%rbp;"
+	"	movq	%rsp, %rbp;"
+	"	andq	$-16, %rsp;"
+	"	call	" ASM_SYMBOL( hookStubLeave ) ";"
+	"	movq	%rbp, %rsp;"
+	"	popq	%rbp;"
+	"	movq	%rax, 56(%rsp);"
+	"	movdqu	0(%rsp), %xmm0;"
+	"	movdqu	16(%rsp), %xmm1;"
+	"	addq	$40, %rsp;"
+	"	popq	%rdx;"
+	"	popq	%rax;"
+	"	ret;"
+);
+#elif defined(__i386__)
+asm(
+	".text;"
+	".align 4, 0x90;"
+	".globl " ASM_SYMBOL( hookStubEntry ) ";"
+	ASM_SYMBOL( hookStubEntry ) ":;"
+	//	(%esp) = stub, 4(%esp) = return address. Builds a hook_stub_entry_t.
+	"	pushl	%ebp;"
+	"	movl	%esp, %ebp;"
+	"	pushl	%eax;"
+	"	pushl	%ecx;"
+	"	pushl	%edx;"
+	"	movl	%esp, %eax;"
+	"	andl	$-16, %esp;"		//	callers needn't have kept alignment
+	"	subl	$8, %esp;"
+	"	pushl	%eax;"
+	"	pushl	4(%ebp);"
+	"	call	" ASM_SYMBOL( hookStubEnter ) ";"
+	"	leal	-12(%ebp), %esp;"
+	"	movl	%eax, 4(%ebp);"		//	the stub's slot becomes the target
+	"	popl	%edx;"
+	"	popl	%ecx;"
+	"	popl	%eax;"
+	"	popl	%ebp;"
+	"	ret;"
+
+	".align 4, 0x90;"
+	".globl " ASM_SYMBOL( hookStubExit ) ";"
+	ASM_SYMBOL( hookStubExit ) ":;"
+	//	Returned into from a hooked function. Builds a hook_stub_exit_t.
+	"	subl	$4, %esp;"			//	becomes the real return address
+	"	pushl	%eax;"
+	"	pushl	%edx;"
+	"	movl	%esp, %eax;"
+	"	pushl	%ebp;"
+	"	movl	%esp, %ebp;"
+	"	andl	$-16, %esp;"
+	"	subl	$12, %esp;"
+	"	pushl	%eax;"
+	"	call	" ASM_SYMBOL( hookStubLeave ) ";"
+	"	movl	%ebp, %esp;"
+	"	popl	%ebp;"
+	"	movl	%eax, 8(%esp);"
+	"	popl	%edx;"
+	"	popl	%eax;"
+	"	ret;"
+);
+#endif
+
+static void
+releaseShadowStack(
+				   void	*stack )
+{
+	vm_deallocate( mach_task_self(), (vm_address_t) stack, sizeof( ShadowStack ) );
+}
+
+static void
+createShadowStackKey( void )
+{
+	gShadowStackKeyError = pthread_key_create( &gShadowStackKey, releaseShadowStack );
+}
+
+//	Allocated straight from the VM system so that instrumenting malloc()
+//	doesn't recurse.
+static ShadowStack *
+shadowStack( void )
+{
+	ShadowStack		*stack = pthread_getspecific( gShadowStackKey );
+	vm_address_t	address = 0;
+
+	if( stack )
+		return stack;
+	if( vm_allocate( mach_task_self(), &address, sizeof( ShadowStack ), VM_FLAGS_ANYWHERE ) )
+		return NULL;
+	stack = (ShadowStack *) address;
+	pthread_setspecific( gShadowStackKey, stack );
+	return stack;
+}
+
+/***************************************************************************//**
+	Called by hookStubEntry: runs enter and, if it asks for it and there is
+	room, hijacks the return address.
+
+	@param	stub	->	The thunk's stub.
+	@param	entry	<->	Saved registers and the caller's frame.
+	@result			<-	Where to continue.
+
+	***************************************************************************/
+
+const void *
+hookStubEnter(
+			  hook_stub_t		*stub,
+			  hook_stub_entry_t	*entry )
+{
+	uint64_t	cookie = 0;
+	ShadowStack	*stack;
+	ShadowFrame	*frame;
+
+	if( stub->enter && stub->enter( stub, entry, &cookie ) && stub->leave ) {
+		stack = shadowStack();
+		if( stack && stack->depth < kShadowStackDepth ) {
+			frame = &stack->frames[stack->depth++];
+			frame->stub = stub;
+			frame->returnAddress = entry->returnAddress;
+			frame->cookie = cookie;
+			entry->returnAddress = (uintptr_t) hookStubExit;
+		}
+	}
+	return stub->target;
+}
+
+/***************************************************************************//**
+	Called by hookStubExit: pops the shadow stack and runs leave.
+
+	@param	exit	<->	Saved return value registers.
+	@result			<-	The caller's real return address.
+
+	***************************************************************************/
+
+uintptr_t
+hookStubLeave(
+			  hook_stub_exit_t	*exit )
+{
+	ShadowStack	*stack = pthread_getspecific( gShadowStackKey );
+	ShadowFrame	*frame = &stack->frames[--stack->depth];
+
+	frame->stub->leave( frame->stub, exit, frame->cookie );
+	return frame->returnAddress;
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+hookStubCreate(
+			   hook_stub_t	*stub,
+			   void			**thunk )
+{
+	assert( stub );
+	assert( thunk );
+
+#if defined(__i386__) || defined(__x86_64__)
+	pthread_once( &gShadowStackOnce, createShadowStackKey );
+	if( gShadowStackKeyError )
+		return KERN_RESOURCE_SHORTAGE;
+	return mach_override_thunk( stub, (void *) hookStubEntry, thunk );
+#else
+	return KERN_NOT_SUPPORTED;
+#endif
+}
@@ -0,0 +1,113 @@
+/*******************************************************************************
+ hook_stub.h
+ Generic entry and exit stubs for instrumenting overridden functions: a
+ callback on the way in, with the argument registers, and optionally one on
+ the way out, with the return value.
+
+ ***************************************************************************/
+
+#ifndef		_hook_stub_
+#define		_hook_stub_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+	/**
+	 Registers saved by the entry stub, lowest address first, followed by the
+	 caller's return address and stack arguments. Changing returnAddress is
+	 how the stub arranges to be called back on return; callbacks should
+	 leave it alone.
+	 */
+	typedef	struct	{
+#if defined(__x86_64__)
+		uint64_t	xmm[8][2];
+		uint64_t	padding;
+		uint64_t	rax, r9, r8, rcx, rdx, rsi, rdi;
+		uint64_t	rbp;
+		uint64_t	returnAddress;
+		uint64_t	stack[1];		//	first stack argument, and so on
+#else
+		uint32_t	edx, ecx, eax;
+		uint32_t	ebp;
+		uint32_t	stub;
+		uint32_t	returnAddress;
+		uint32_t	stack[1];		//	first argument, and so on
+#endif
+	}	hook_stub_entry_t;
+
+	/**
+	 Return value registers saved by the exit stub.
+	 */
+	typedef	struct	{
+#if defined(__x86_64__)
+		uint64_t	xmm[2][2];
+		uint64_t	padding;
+		uint64_t	rdx, rax;
+#else
+		uint32_t	edx, eax;
+#endif
+	}	hook_stub_exit_t;
+
+	typedef	struct	hook_stub	hook_stub_t;
+
+	/**
+	 Called on entry. Returning non-zero asks for leave to be called when the
+	 function returns, with the cookie stored here. Must not be instrumented
+	 itself.
+	 */
+	typedef	int		(*hook_stub_enter_t)( hook_stub_t *stub, hook_stub_entry_t *entry,
+										  uint64_t *cookie );
+	typedef	void	(*hook_stub_leave_t)( hook_stub_t *stub, hook_stub_exit_t *exit,
+										  uint64_t cookie );
+
+	struct	hook_stub	{
+		const void			*target;	//	where the stub continues
+		hook_stub_enter_t	enter;
+		hook_stub_leave_t	leave;
+		void				*context;
+	};
+
+	/***************************************************************************//**
+	 Builds a thunk that runs a stub's callbacks around a call to its target.
+	 The stub must stay allocated for as long as the thunk can be called; its
+	 target may be set after the thunk is built, before it is first called.
+
+	 Returns are caught by swapping the return address for an exit stub and
+	 keeping the real one on a per-thread shadow stack, so functions left by
+	 longjmp() or by unwinding an exception can't ask for leave. When the
+	 shadow stack is full, leave is skipped. Not implemented on ppc.
+
+	 @param	stub	->	Required stub.
+	 @param	thunk	<-	Required pointer to the thunk's entry point.
+	 @result			<-	mach_error_t
+
+	 ***************************************************************************/
+
+	mach_error_t
+	hookStubCreate(
+				   hook_stub_t	*stub,
+				   void			**thunk );
+
+	/***************************************************************************//**
+	 Reads the cycle counter.
+
+	 ***************************************************************************/
+
+	static inline uint64_t
+	hookStubCycles( void )
+	{
+		uint32_t	low, high;
+
+		__asm__ volatile( "rdtsc" : "=a" (low), "=d" (high) );
+		return ((uint64_t) high << 32) | low;
+	}
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_hook_stub_
@@ -0,0 +1,285 @@
+/*******************************************************************************
+ hook_trace.c
+ Sampled argument and return value tracing of overridden functions, into
+ per-thread binary rings kept in a memory-mapped trace file.
+
+ A traced function is overridden with a stub (see hook_stub.h) whose target
+ is its own reentry island. Entry counts down the thread's sampling
+ interval for the hook; a sampled call that passes the hook's filter gets
+ an entry record and, from leave, a return record. Each thread appends to
+ its own ring in the shared mapping without locks, so the file can be
+ decoded after the process is gone (see hooktrace.c).
+
+ ***************************************************************************/
+
+#include "hook_trace.h"
+#include "hook_stub.h"
+#include "mach_override.h"
+
+#include <sys/mman.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSAtomic.h>
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+typedef	struct	{
+	hook_stub_t				stub;
+	unsigned int			hookIndex;
+	unsigned int			sampleEvery;
+	hook_trace_filter_t		filter;
+	void					*filterContext;
+}	TraceStub;
+
+static hook_trace_file_t	*gFile = NULL;
+static pthread_key_t		gRingKey;			//	ring index + 1, 0 until assigned
+static pthread_mutex_t		gFileLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**************************
+ *
+ *	Callbacks
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Callbacks)
+
+//	The calling thread's ring, or NULL past maxThreads.
+static hook_trace_ring_t *
+threadRing( void )
+{
+	uintptr_t			index = (uintptr_t) pthread_getspecific( gRingKey );
+	hook_trace_ring_t	*ring;
+
+	if( !index ) {
+		index = OSAtomicIncrement32( (volatile int32_t *) &gFile->threadCount );
+		pthread_setspecific( gRingKey, (void *) index );
+		if( index <= gFile->maxThreads ) {
+			ring = hookTraceRing( gFile, index - 1 );
+			ring->thread = pthread_mach_thread_np( pthread_self() );
+		}
+	}
+	return index <= gFile->maxThreads ? hookTraceRing( gFile, index - 1 ) : NULL;
+}
+
+//	Single writer: fill the slot, then publish it by bumping head.
+static inline void
+appendRecord(
+			 hook_trace_ring_t			*ring,
+			 const hook_trace_record_t	*record )
+{
+	uint32_t	head = ring->head;
+
+	hookTraceRecords( ring )[head & (gFile->ringRecords - 1)] = *record;
+	OSMemoryBarrier();
+	ring->head = head + 1;
+}
+
+static int
+enterTrace(
+		   hook_stub_t			*stub,
+		   hook_stub_entry_t	*entry,
+		   uint64_t				*cookie )
+{
+	TraceStub			*trace = (TraceStub *) stub;
+	hook_trace_ring_t	*ring = threadRing();
+	hook_trace_record_t	record;
+	unsigned int		i;
+
+	if( !ring )
+		return 0;
+	if( ring->countdown[trace->hookIndex] ) {
+		ring->countdown[trace->hookIndex]--;
+		return 0;
+	}
+	ring->countdown[trace->hookIndex] = trace->sampleEvery - 1;
+
+#if defined(__x86_64__)
+	record.values[0] = entry->rdi;
+	record.values[1] = entry->rsi;
+	record.values[2] = entry->rdx;
+	record.values[3] = entry->rcx;
+	record.values[4] = entry->r8;
+	record.values[5] = entry->r9;
+	record.values[6] = entry->xmm[0][0];
+	record.values[7] = entry->xmm[1][0];
+	for( i = 0; i < 4; i++ )
+		record.values[8 + i] = entry->stack[i];
+#else
+	for( i = 0; i < kHookTraceValues; i++ )
+		record.values[i] = entry->stack[i];
+#endif
+	if( trace->filter && !trace->filter( record.values, trace->filterContext ) )
+		return 0;
+
+	record.type = kHookTraceEntry;
+	record.hook = trace->hookIndex;
+	record.call = ++ring->calls;
+	record.returnAddress = entry->returnAddress;
+	record.timestamp = hookStubCycles();
+	appendRecord( ring, &record );
+
+	*cookie = record.call;
+	return 1;
+}
+
+static void
+leaveTrace(
+		   hook_stub_t		*stub,
+		   hook_stub_exit_t	*exit,
+		   uint64_t			cookie )
+{
+	hook_trace_ring_t	*ring = threadRing();
+	hook_trace_record_t	record;
+
+	memset( &record, 0, sizeof( record ) );
+	record.timestamp = hookStubCycles();
+	record.type = kHookTraceReturn;
+	record.hook = ((TraceStub *) stub)->hookIndex;
+	record.call = cookie;
+#if defined(__x86_64__)
+	record.values[0] = exit->rax;
+	record.values[1] = exit->rdx;
+	record.values[2] = exit->xmm[0][0];
+	record.values[3] = exit->xmm[1][0];
+#else
+	record.values[0] = exit->eax;
+	record.values[1] = exit->edx;
+#endif
+	appendRecord( ring, &record );
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+hookTraceOpen(
+			  const char	*path,
+			  unsigned int	ringRecords )
+{
+	char			defaultPath[64];
+	unsigned int	records = 1;
+	size_t			size;
+	int				fd = -1;
+	void			*file = MAP_FAILED;
+	mach_error_t	err = err_none;
+
+	if( !path )
+		path = getenv( "HOOK_TRACE_FILE" );
+	if( !path ) {
+		snprintf( defaultPath, sizeof( defaultPath ), kHookTraceFileName, (int) getpid() );
+		path = defaultPath;
+	}
+	if( !ringRecords )
+		ringRecords = kHookTraceDefaultRecords;
+	while( records < ringRecords )
+		records <<= 1;
+	size = sizeof( hook_trace_file_t ) + kHookTraceMaxThreads
+		* (sizeof( hook_trace_ring_t ) + (size_t) records * sizeof( hook_trace_record_t ));
+
+	pthread_mutex_lock( &gFileLock );
+
+	//	The file is sparse: only the rings of threads that trace get pages.
+	if( gFile || pthread_key_create( &gRingKey, NULL ) )
+		err = KERN_FAILURE;
+	if( !err && ((fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 )) < 0
+				 || ftruncate( fd, size )) )
+		err = KERN_FAILURE;
+	if( !err ) {
+		file = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+		if( file == MAP_FAILED )
+			err = KERN_RESOURCE_SHORTAGE;
+	}
+	if( fd >= 0 )
+		close( fd );
+
+	if( !err ) {
+		hook_trace_file_t *header = file;
+		header->version = kHookTraceVersion;
+		header->pointerSize = sizeof( void * );
+		header->maxHooks = kHookTraceMaxHooks;
+		header->maxThreads = kHookTraceMaxThreads;
+		header->ringRecords = records;
+		OSMemoryBarrier();
+		header->magic = kHookTraceMagic;
+		gFile = header;
+	}
+
+	pthread_mutex_unlock( &gFileLock );
+	return err;
+}
+
+mach_error_t
+hookTraceOverride(
+				  void							*originalFunctionAddress,
+				  const char					*hookName,
+				  const hook_trace_options_t	*options )
+{
+	assert( originalFunctionAddress );
+
+#if defined(__i386__) || defined(__x86_64__)
+	TraceStub		*trace;
+	void			*thunk = NULL;
+	unsigned int	index;
+	mach_error_t	err = err_none;
+
+	if( !gFile && hookTraceOpen( NULL, 0 ) && !gFile )
+		return KERN_FAILURE;
+
+	pthread_mutex_lock( &gFileLock );
+
+	index = gFile->hookCount;
+	trace = calloc( 1, sizeof( TraceStub ) );
+	if( index >= kHookTraceMaxHooks || !trace )
+		err = KERN_RESOURCE_SHORTAGE;
+
+	if( !err ) {
+		hook_trace_hook_t *hook = &gFile->hooks[index];
+		strlcpy( hook->name, hookName ? hookName : "", sizeof( hook->name ) );
+		hook->address = (uintptr_t) originalFunctionAddress;
+
+		trace->stub.enter = enterTrace;
+		trace->stub.leave = leaveTrace;
+		trace->hookIndex = index;
+		trace->sampleEvery = options && options->sampleEvery ? options->sampleEvery : 1;
+		trace->filter = options ? options->filter : NULL;
+		trace->filterContext = options ? options->filterContext : NULL;
+		hook->sampleEvery = trace->sampleEvery;
+		err = hookStubCreate( &trace->stub, &thunk );
+	}
+
+	//	The stub continues into the reentry island, which is handed out
+	//	before the thunk can be reached.
+	if( !err ) {
+		mach_override_hook_t handle;
+		err = mach_override_hook( originalFunctionAddress, thunk,
+								  (void **) &trace->stub.target, &handle );
+	}
+
+	if( !err ) {
+		OSMemoryBarrier();
+		gFile->hookCount = index + 1;
+	} else
+		free( trace );
+
+	pthread_mutex_unlock( &gFileLock );
+	return err;
+#else
+	return KERN_NOT_SUPPORTED;
+#endif
+}
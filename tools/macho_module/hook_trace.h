@@ -0,0 +1,153 @@
+/*******************************************************************************
+ hook_trace.h
+ Sampled argument and return value tracing of overridden functions, into
+ per-thread binary rings kept in a memory-mapped trace file.
+
+ ***************************************************************************/
+
+#ifndef		_hook_trace_
+#define		_hook_trace_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+#define	kHookTraceMagic				0x484B5452	//	'HKTR'
+#define	kHookTraceVersion			1
+#define	kHookTraceMaxHooks			256
+#define	kHookTraceMaxThreads		64
+#define	kHookTraceNameLength		64
+#define	kHookTraceValues			12
+#define	kHookTraceDefaultRecords	4096		//	per thread, a power of two
+
+	/**
+	 Default trace file, formatted with the pid. Overridden by the
+	 HOOK_TRACE_FILE environment variable or hookTraceOpen().
+	 */
+#define	kHookTraceFileName			"/tmp/hook_trace.%d"
+
+#define	kHookTraceEntry				1
+#define	kHookTraceReturn			2
+
+	/**
+	 One traced event. Entry and return records of a call share its call
+	 number, unique per thread. Entry values are, on x86_64, the six integer
+	 argument registers, the low halves of %xmm0 and %xmm1 and the first four
+	 stack words; on i386, the first twelve argument words. Return values are
+	 %rax/%eax, %rdx/%edx and, on x86_64, the low halves of %xmm0 and %xmm1.
+	 */
+	typedef	struct	{
+		uint32_t	type;			//	kHookTraceEntry or kHookTraceReturn
+		uint32_t	hook;			//	index into hook_trace_file_t.hooks
+		uint64_t	call;
+		uint64_t	timestamp;		//	cycle counter
+		uint64_t	returnAddress;	//	caller, entry records only
+		uint64_t	values[kHookTraceValues];
+	}	hook_trace_record_t;
+
+	typedef	struct	{
+		char		name[kHookTraceNameLength];
+		uint64_t	address;		//	of the original function
+		uint32_t	sampleEvery;
+		uint32_t	reserved;
+	}	hook_trace_hook_t;
+
+	/**
+	 A thread's ring. Only its thread writes it: a record is stored at
+	 head modulo the ring size and then head is bumped, so a reader sees the
+	 last ringRecords records before head, oldest overwritten first.
+	 */
+	typedef	struct	{
+		volatile uint32_t	head;
+		uint32_t			thread;		//	pthread_mach_thread_np()
+		uint64_t			calls;		//	sampled calls so far
+		uint32_t			countdown[kHookTraceMaxHooks];
+	}	hook_trace_ring_t;
+
+	/**
+	 Layout of the trace file: this header, then maxThreads rings, each a
+	 hook_trace_ring_t followed by ringRecords records.
+	 */
+	typedef	struct	{
+		uint32_t			magic;
+		uint32_t			version;
+		uint32_t			pointerSize;	//	4 (i386) or 8 (x86_64)
+		uint32_t			maxHooks;
+		uint32_t			maxThreads;
+		uint32_t			ringRecords;
+		volatile uint32_t	hookCount;
+		volatile uint32_t	threadCount;	//	rings handed out so far
+		hook_trace_hook_t	hooks[kHookTraceMaxHooks];
+	}	hook_trace_file_t;
+
+#define	hookTraceRingSize( file )															\
+	(sizeof( hook_trace_ring_t ) + (size_t) (file)->ringRecords * sizeof( hook_trace_record_t ))
+#define	hookTraceRing( file, index )														\
+	((hook_trace_ring_t *) ((char *) (file) + sizeof( hook_trace_file_t )					\
+							+ (size_t) (index) * hookTraceRingSize( file )))
+#define	hookTraceRecords( ring )															\
+	((hook_trace_record_t *) ((ring) + 1))
+
+	/**
+	 Per-hook filter: called for sampled calls with the entry record's
+	 values; returning zero drops the call.
+	 */
+	typedef	int	(*hook_trace_filter_t)( const uint64_t *values, void *context );
+
+	typedef	struct	{
+		unsigned int		sampleEvery;	//	trace 1 call in N per thread; 0 or 1: all
+		hook_trace_filter_t	filter;			//	optional
+		void				*filterContext;
+	}	hook_trace_options_t;
+
+	/***************************************************************************//**
+	 Creates the trace file. Optional: hookTraceOverride() opens the default
+	 file on first use.
+
+	 @param	path			->	Trace file. NULL for HOOK_TRACE_FILE or the
+								default.
+	 @param	ringRecords		->	Records per thread, rounded up to a power of two.
+								0 for kHookTraceDefaultRecords.
+	 @result					<-	KERN_FAILURE if the file can't be created, or
+								if it is already open.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	hookTraceOpen(
+				  const char	*path,
+				  unsigned int	ringRecords );
+
+	/***************************************************************************//**
+	 Overrides a function with a tracing stub that records sampled calls'
+	 arguments and return values and otherwise runs the original unchanged.
+	 Unsampled calls cost a thunk and a per-thread countdown.
+
+	 Return values are caught like hook_stub.h does, so functions left by
+	 longjmp() or by unwinding an exception can't be traced. Not implemented
+	 on ppc.
+
+	 @param	originalFunctionAddress	->	Required address of the function to trace.
+	 @param	hookName				->	Name written to the trace file.
+	 @param	options					->	Sampling and filter. Can be NULL to
+										trace every call.
+	 @result							<-	KERN_RESOURCE_SHORTAGE once
+										kHookTraceMaxHooks functions are traced,
+										or any error from mach_override_hook().
+
+	 ***************************************************************************/
+
+	mach_error_t
+	hookTraceOverride(
+					  void							*originalFunctionAddress,
+					  const char					*hookName,
+					  const hook_trace_options_t	*options );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_hook_trace_
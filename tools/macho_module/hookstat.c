@@ -0,0 +1,125 @@
+/*
+ * hookstat - print the hook counters published by a process
+ *
+ * SYNOPSIS
+ *     hookstat pid [interval]
+ *
+ * DESCRIPTION
+ *     Maps the shared-memory region written by hook_stats.c in process pid
+ *     and prints, for each instrumented hook, the calls and cycle-counter
+ *     latency (mean, median and 99th percentile, as histogram bucket upper
+ *     bounds) of the hook and of the original function, summed over all
+ *     threads. One line per hook side, in key=value form. With an interval
+ *     in seconds, prints again every interval until interrupted.
+ *
+ *     The region is only read; the hooked process is never stopped.
+ */
+
+#include <sys/mman.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hook_stats.h"
+
+static void
+sum_counter(hook_stats_counter_t *total, const hook_stats_counter_t *counter)
+{
+    unsigned int i;
+
+    total->calls += counter->calls;
+    total->cycles += counter->cycles;
+    for (i = 0; i < kHookStatsBuckets; i++)
+        total->histogram[i] += counter->histogram[i];
+}
+
+static unsigned long long
+percentile(const hook_stats_counter_t *counter, double fraction)
+{
+    unsigned long long timed = 0, seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < kHookStatsBuckets; i++)
+        timed += counter->histogram[i];
+    for (i = 0; i < kHookStatsBuckets; i++) {
+        seen += counter->histogram[i];
+        if (timed && seen >= fraction * timed)
+            return 2ULL << i;
+    }
+    return 0;
+}
+
+static void
+print_counter(const char *hook, const char *side, const hook_stats_counter_t *counter)
+{
+    unsigned long long timed = 0;
+    unsigned int i;
+
+    for (i = 0; i < kHookStatsBuckets; i++)
+        timed += counter->histogram[i];
+    printf("hook=%s side=%s calls=%llu mean_cycles=%llu p50_cycles=%llu p99_cycles=%llu\n",
+           hook, side, (unsigned long long)counter->calls,
+           timed ? (unsigned long long)(counter->cycles / timed) : 0ULL,
+           percentile(counter, 0.50), percentile(counter, 0.99));
+}
+
+static void
+print_region(const hook_stats_region_t *region)
+{
+    unsigned int hooks = region->hookCount, threads = region->threadCount, h, t;
+
+    if (hooks > kHookStatsMaxHooks)
+        hooks = kHookStatsMaxHooks;
+    if (threads > kHookStatsMaxThreads)
+        threads = kHookStatsMaxThreads;
+
+    for (h = 0; h < hooks; h++) {
+        hook_stats_counter_t hook, original;
+
+        memset(&hook, 0, sizeof(hook));
+        memset(&original, 0, sizeof(original));
+        for (t = 0; t < threads; t++) {
+            sum_counter(&hook, &region->slots[t][h].hook);
+            sum_counter(&original, &region->slots[t][h].original);
+        }
+        print_counter(region->hooks[h].name, "hook", &hook);
+        print_counter(region->hooks[h].name, "original", &original);
+    }
+    printf("threads=%u untracked_calls=%u\n", region->threadCount, region->untrackedCalls);
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+    const hook_stats_region_t *region;
+    char name[32];
+    int fd, interval = 0;
+
+    if (argc < 2 || argc > 3)
+        errx(1, "usage: %s pid [interval]", argv[0]);
+    if (argc == 3)
+        interval = atoi(argv[2]);
+
+    snprintf(name, sizeof(name), kHookStatsRegionName, atoi(argv[1]));
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        err(1, "shm_open %s", name);
+    region = mmap(NULL, sizeof(*region), PROT_READ, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+        err(1, "mmap");
+    close(fd);
+
+    if (region->magic != kHookStatsMagic || region->version != kHookStatsVersion)
+        errx(1, "%s: not a version %d hook_stats region", name, kHookStatsVersion);
+
+    do {
+        print_region(region);
+        if (interval)
+            sleep(interval);
+    } while (interval);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * hooktrace - decode a trace file written by hook_trace.c
+ *
+ * SYNOPSIS
+ *     hooktrace [-a count] file
+ *
+ * DESCRIPTION
+ *     Reads the per-thread rings of a trace file, merges their records by
+ *     cycle counter and prints one line per record, timestamps relative to
+ *     the earliest record kept. Entry lines show the caller and the first
+ *     count argument values (6 by default, at most 12); return lines show
+ *     the return value registers and the cycles since the matching entry,
+ *     when that entry is still in the ring.
+ *
+ *     The file can be decoded while the traced process runs; records being
+ *     written at that moment may come out torn.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hook_trace.h"
+
+struct decoded {
+    const hook_trace_record_t *record;
+    uint32_t thread;
+    uint64_t cycles;            /* return records: since the entry, 0 if lost */
+};
+
+static int
+compare_decoded(const void *a, const void *b)
+{
+    const struct decoded *x = a, *y = b;
+
+    if (x->record->timestamp != y->record->timestamp)
+        return x->record->timestamp < y->record->timestamp ? -1 : 1;
+    return x->record->type < y->record->type ? -1 : x->record->type > y->record->type;
+}
+
+/* Appends a ring's surviving records in order, pairing returns with entries. */
+static size_t
+decode_ring(const hook_trace_file_t *file, const hook_trace_ring_t *ring, struct decoded *out)
+{
+    const hook_trace_record_t *records = hookTraceRecords(ring);
+    const hook_trace_record_t **open;
+    uint32_t head = ring->head, first, i;
+    size_t count = 0, depth = 0;
+
+    first = head > file->ringRecords ? head - file->ringRecords : 0;
+    if ((open = calloc(file->ringRecords, sizeof(*open))) == NULL)
+        err(1, "calloc");
+
+    for (i = first; i != head; i++) {
+        const hook_trace_record_t *record = &records[i & (file->ringRecords - 1)];
+        struct decoded *d = &out[count++];
+
+        d->record = record;
+        d->thread = ring->thread;
+        d->cycles = 0;
+        if (record->type == kHookTraceEntry) {
+            open[depth++] = record;
+        } else {
+            /* Returns unwind in LIFO order; skip entries whose return was lost. */
+            while (depth && open[depth - 1]->call > record->call)
+                depth--;
+            if (depth && open[depth - 1]->call == record->call)
+                d->cycles = record->timestamp - open[--depth]->timestamp;
+        }
+    }
+    free(open);
+    return count;
+}
+
+int
+main(int argc, char **argv)
+{
+    const hook_trace_file_t *file;
+    struct decoded *decoded;
+    struct stat st;
+    size_t count = 0, i;
+    unsigned int threads, t, shown = 6, a;
+    int fd, ch;
+
+    while ((ch = getopt(argc, argv, "a:")) != -1) {
+        switch (ch) {
+        case 'a':
+            shown = atoi(optarg);
+            if (shown > kHookTraceValues)
+                shown = kHookTraceValues;
+            break;
+        default:
+            errx(1, "usage: %s [-a count] file", argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+        errx(1, "usage: %s [-a count] file", argv[0]);
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st))
+        err(1, "%s", argv[optind]);
+    if ((size_t)st.st_size < sizeof(*file))
+        errx(1, "%s: truncated", argv[optind]);
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED)
+        err(1, "mmap");
+    close(fd);
+
+    if (file->magic != kHookTraceMagic || file->version != kHookTraceVersion)
+        errx(1, "%s: not a version %d trace file", argv[optind], kHookTraceVersion);
+    if (!file->ringRecords || (file->ringRecords & (file->ringRecords - 1))
+        || sizeof(*file) + file->maxThreads * hookTraceRingSize(file) > (size_t)st.st_size)
+        errx(1, "%s: bad ring geometry", argv[optind]);
+
+    threads = file->threadCount < file->maxThreads ? file->threadCount : file->maxThreads;
+    if ((decoded = calloc((size_t)threads * file->ringRecords + 1, sizeof(*decoded))) == NULL)
+        err(1, "calloc");
+    for (t = 0; t < threads; t++)
+        count += decode_ring(file, hookTraceRing(file, t), decoded + count);
+    qsort(decoded, count, sizeof(*decoded), compare_decoded);
+
+    for (i = 0; i < count; i++) {
+        const hook_trace_record_t *r = decoded[i].record;
+        const char *name = r->hook < file->hookCount ? file->hooks[r->hook].name : "?";
+        unsigned long long mask = file->pointerSize == 4 ? 0xffffffffULL : ~0ULL;
+
+        printf("tsc=%llu thread=%u call=%llu hook=%s",
+               (unsigned long long)(r->timestamp - decoded[0].record->timestamp),
+               decoded[i].thread, (unsigned long long)r->call, name);
+        if (r->type == kHookTraceEntry) {
+            printf(" entry caller=0x%llx args=", (unsigned long long)r->returnAddress);
+            for (a = 0; a < shown; a++)
+                printf("%s0x%llx", a ? "," : "", (unsigned long long)(r->values[a] & mask));
+        } else {
+            printf(" return value=0x%llx value2=0x%llx",
+                   (unsigned long long)(r->values[0] & mask),
+                   (unsigned long long)(r->values[1] & mask));
+            if (file->pointerSize == 8)
+                printf(" xmm0=0x%llx", (unsigned long long)r->values[2]);
+            if (decoded[i].cycles)
+                printf(" cycles=%llu", (unsigned long long)decoded[i].cycles);
+        }
+        printf("\n");
+    }
+    return 0;
+}
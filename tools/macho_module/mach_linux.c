@@ -0,0 +1,511 @@
+/*******************************************************************************
+ mach_linux.c
+ The Mach VM calls used by mach_override.c, on top of mmap(), mprotect() and
+ /proc/self/maps, and symbol lookup through the dynamic linker.
+
+ ***************************************************************************/
+
+#define	_GNU_SOURCE
+
+#include "mach_linux.h"
+#include "symbol_index.h"
+
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+//	The calls keep their Mach signatures; most ignore the task or thread.
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+#ifndef	MAP_FIXED_NOREPLACE
+#define	MAP_FIXED_NOREPLACE		0x100000
+#endif
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+static int
+protectionFlags(
+				vm_prot_t	protection )
+{
+	return (protection & VM_PROT_READ ? PROT_READ : 0)
+		| (protection & VM_PROT_WRITE ? PROT_WRITE : 0)
+		| (protection & VM_PROT_EXECUTE ? PROT_EXEC : 0);
+}
+
+static uintptr_t
+parseHex(
+		 const char	**cursor )
+{
+	uintptr_t	value = 0;
+	const char	*p = *cursor;
+
+	for( ;; p++ ) {
+		if( *p >= '0' && *p <= '9' )
+			value = (value << 4) | (uintptr_t) (*p - '0');
+		else if( *p >= 'a' && *p <= 'f' )
+			value = (value << 4) | (uintptr_t) (*p - 'a' + 10);
+		else
+			break;
+	}
+	*cursor = p;
+	return value;
+}
+
+/***************************************************************************//**
+	Parses one /proc/self/maps line: "start-end perms offset dev inode path".
+
+	@param	line		->	The line, not necessarily terminated.
+	@param	start		<-	First address of the mapping.
+	@param	end			<-	Address past the mapping.
+	@param	protection	<-	Its protection as VM_PROT_* flags.
+	@result				<-	Whether the line could be parsed.
+
+	***************************************************************************/
+
+static int
+parseMapsLine(
+			  const char	*line,
+			  uintptr_t		*start,
+			  uintptr_t		*end,
+			  vm_prot_t		*protection )
+{
+	const char	*p = line;
+
+	*start = parseHex( &p );
+	if( *p++ != '-' )
+		return 0;
+	*end = parseHex( &p );
+	if( *p++ != ' ' || !p[0] || !p[1] || !p[2] )
+		return 0;
+	*protection = (p[0] == 'r' ? VM_PROT_READ : 0)
+		| (p[1] == 'w' ? VM_PROT_WRITE : 0)
+		| (p[2] == 'x' ? VM_PROT_EXECUTE : 0);
+	return 1;
+}
+
+/**************************
+ *
+ *	Ports
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Ports)
+
+mach_port_t
+mach_task_self( void )
+{
+	return 1;
+}
+
+mach_port_t
+mach_host_self( void )
+{
+	return 1;
+}
+
+mach_port_t
+mach_thread_self( void )
+{
+	return 1;
+}
+
+kern_return_t
+mach_port_deallocate(
+					 task_t			task,
+					 mach_port_t	name )
+{
+	return KERN_SUCCESS;
+}
+
+kern_return_t
+host_page_size(
+			   host_t		host,
+			   vm_size_t	*pageSize )
+{
+	long	size = sysconf( _SC_PAGESIZE );
+
+	if( size <= 0 )
+		return KERN_FAILURE;
+	*pageSize = (vm_size_t) size;
+	return KERN_SUCCESS;
+}
+
+/**************************
+ *
+ *	Virtual Memory
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Virtual Memory)
+
+kern_return_t
+vm_allocate(
+			vm_map_t		task,
+			vm_address_t	*address,
+			vm_size_t		size,
+			int				flags )
+{
+	void	*hint = (flags & VM_FLAGS_ANYWHERE) ? NULL : (void *) *address;
+	int		mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void	*memory;
+
+	//	Kernels before 4.17 ignore MAP_FIXED_NOREPLACE and treat the address
+	//	as a hint, so a fixed request is also checked for where it landed.
+	if( !(flags & VM_FLAGS_ANYWHERE) )
+		mapFlags |= MAP_FIXED_NOREPLACE;
+	memory = mmap( hint, size, PROT_READ | PROT_WRITE, mapFlags, -1, 0 );
+	if( memory == MAP_FAILED )
+		return errno == EEXIST ? KERN_NO_SPACE : KERN_RESOURCE_SHORTAGE;
+	if( hint && memory != hint ) {
+		munmap( memory, size );
+		return KERN_NO_SPACE;
+	}
+	*address = (vm_address_t) memory;
+	return KERN_SUCCESS;
+}
+
+kern_return_t
+vm_deallocate(
+			  vm_map_t		task,
+			  vm_address_t	address,
+			  vm_size_t		size )
+{
+	return munmap( (void *) address, size ) ? KERN_INVALID_ADDRESS : KERN_SUCCESS;
+}
+
+kern_return_t
+vm_protect(
+		   vm_map_t		task,
+		   vm_address_t	address,
+		   vm_size_t	size,
+		   boolean_t	setMaximum,
+		   vm_prot_t	protection )
+{
+	long		pageSize = sysconf( _SC_PAGESIZE );
+	uintptr_t	start = address & ~(uintptr_t) (pageSize - 1);
+
+	if( setMaximum )
+		return KERN_SUCCESS;
+	if( mprotect( (void *) start, address + size - start, protectionFlags( protection ) ) )
+		return errno == ENOMEM ? KERN_INVALID_ADDRESS : KERN_PROTECTION_FAILURE;
+	return KERN_SUCCESS;
+}
+
+typedef	struct	{
+	uintptr_t	start, end;
+	vm_prot_t	protection;
+}	Mapping;
+
+typedef	int		(*MappingVisitor)( const Mapping *mapping, void *context );
+
+/***************************************************************************//**
+	Reads /proc/self/maps without allocating, since this can run while
+	malloc() is being overridden, calling back with each mapping in address
+	order until the callback returns non-zero.
+
+	@param	visit	->	The callback.
+	@param	context	->	Passed to it.
+	@result			<-	KERN_FAILURE if the file can't be opened.
+
+	***************************************************************************/
+
+static kern_return_t
+readMaps(
+		 MappingVisitor	visit,
+		 void			*context )
+{
+	char			buffer[4096];
+	size_t			filled = 0, lineStart;
+	ssize_t			got;
+	Mapping			mapping;
+	int				fd, done = 0;
+
+	if( (fd = open( "/proc/self/maps", O_RDONLY )) < 0 )
+		return KERN_FAILURE;
+
+	while( !done && (got = read( fd, buffer + filled, sizeof( buffer ) - filled )) > 0 ) {
+		filled += (size_t) got;
+		lineStart = 0;
+		for( size_t i = 0; i < filled && !done; i++ ) {
+			if( buffer[i] != '\n' )
+				continue;
+			buffer[i] = 0;
+			if( parseMapsLine( buffer + lineStart, &mapping.start, &mapping.end,
+							   &mapping.protection ) )
+				done = visit( &mapping, context );
+			lineStart = i + 1;
+		}
+		//	Keep the partial last line; a line never fills the buffer on its
+		//	own, but if one does its tail is dropped.
+		if( lineStart == 0 && filled == sizeof( buffer ) )
+			filled = 0;
+		memmove( buffer, buffer + lineStart, filled - lineStart );
+		filled -= lineStart;
+	}
+	close( fd );
+	return KERN_SUCCESS;
+}
+
+/**************************
+ *
+ *	Regions
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Regions)
+
+//	A walk calls vm_region_64() again at the end of the mapping it was just
+//	given. Such calls are answered from a snapshot of /proc/self/maps taken
+//	by the walk's first call, rather than by reading the file again. If the
+//	snapshot fills up, addresses past its last mapping are read afresh.
+#define	kMapsSnapshotSize		4096
+
+static Mapping				gMapsSnapshot[kMapsSnapshotSize];
+static size_t				gMapsSnapshotCount = 0;
+static int					gMapsSnapshotComplete = 0;	//	holds every mapping
+static unsigned int			gMapsSnapshotGeneration = 0;
+static pthread_mutex_t		gMapsSnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+//	The calling thread's walk: where it continues, and in which snapshot.
+static __thread uintptr_t		gWalkNext = 0;
+static __thread unsigned int	gWalkGeneration = 0;
+
+static int
+snapshotMapping(
+				const Mapping	*mapping,
+				void			*context )
+{
+	if( gMapsSnapshotCount == kMapsSnapshotSize ) {
+		gMapsSnapshotComplete = 0;
+		return 1;
+	}
+	gMapsSnapshot[gMapsSnapshotCount++] = *mapping;
+	return 0;
+}
+
+typedef	struct	{
+	uintptr_t	address;
+	Mapping		found;
+	int			isFound;
+}	MappingSearch;
+
+static int
+findMappingAbove(
+				 const Mapping	*mapping,
+				 void			*context )
+{
+	MappingSearch	*search = context;
+
+	if( mapping->end <= search->address )
+		return 0;
+	search->found = *mapping;
+	search->isFound = 1;
+	return 1;
+}
+
+/***************************************************************************//**
+	Finds the first mapping that ends above an address, like Mach's
+	vm_region_64(), from the walk's snapshot of /proc/self/maps when the call
+	continues a walk, or from the file otherwise.
+
+	@param	task		->	Ignored: only the current task is supported.
+	@param	address		<->	Where to start looking; the mapping's start.
+	@param	size		<-	The mapping's size.
+	@param	flavor		->	Must be VM_REGION_BASIC_INFO_64.
+	@param	info		<-	A vm_region_basic_info_data_64_t.
+	@param	infoCount	<->	Its size in ints.
+	@param	objectName	<-	Always 0.
+	@result				<-	KERN_INVALID_ADDRESS if no mapping is left.
+
+	***************************************************************************/
+
+kern_return_t
+vm_region_64(
+			 vm_map_t				task,
+			 vm_address_t			*address,
+			 vm_size_t				*size,
+			 vm_region_flavor_t		flavor,
+			 vm_region_info_t		info,
+			 mach_msg_type_number_t	*infoCount,
+			 mach_port_t			*objectName )
+{
+	MappingSearch	search = { *address, { 0, 0, 0 }, 0 };
+	kern_return_t	err = KERN_SUCCESS;
+	size_t			low, high, middle;
+	int				readFile = 0;
+
+	if( flavor != VM_REGION_BASIC_INFO_64 || *infoCount < VM_REGION_BASIC_INFO_COUNT_64 )
+		return KERN_INVALID_ARGUMENT;
+
+	pthread_mutex_lock( &gMapsSnapshotLock );
+	if( gWalkGeneration != gMapsSnapshotGeneration || gWalkNext != *address ) {
+		gMapsSnapshotCount = 0;
+		gMapsSnapshotComplete = 1;
+		gMapsSnapshotGeneration++;
+		gWalkGeneration = gMapsSnapshotGeneration;
+		err = readMaps( snapshotMapping, NULL );
+	}
+	if( !err ) {
+		//	The first mapping ending above the address.
+		for( low = 0, high = gMapsSnapshotCount; low < high; ) {
+			middle = (low + high) / 2;
+			if( gMapsSnapshot[middle].end <= *address )
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		if( low < gMapsSnapshotCount ) {
+			search.found = gMapsSnapshot[low];
+			search.isFound = 1;
+		} else
+			readFile = !gMapsSnapshotComplete;
+	}
+	pthread_mutex_unlock( &gMapsSnapshotLock );
+
+	if( readFile )
+		err = readMaps( findMappingAbove, &search );
+	if( err )
+		return err;
+	if( !search.isFound ) {
+		gWalkNext = 0;
+		return KERN_INVALID_ADDRESS;
+	}
+
+	vm_region_basic_info_data_64_t *basic = (vm_region_basic_info_data_64_t *) info;
+	memset( basic, 0, sizeof( *basic ) );
+	basic->protection = search.found.protection;
+	basic->max_protection = VM_PROT_ALL;
+	*address = search.found.start;
+	*size = search.found.end - search.found.start;
+	*infoCount = VM_REGION_BASIC_INFO_COUNT_64;
+	if( objectName )
+		*objectName = 0;
+	gWalkNext = search.found.end;
+	return KERN_SUCCESS;
+}
+
+/**************************
+ *
+ *	Threads
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Threads)
+
+kern_return_t
+task_threads(
+			 task_t					task,
+			 thread_act_array_t		*threads,
+			 mach_msg_type_number_t	*count )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+kern_return_t
+thread_suspend(
+			   thread_act_t	thread )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+kern_return_t
+thread_resume(
+			  thread_act_t	thread )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+kern_return_t
+thread_get_state(
+				 thread_act_t			thread,
+				 int					flavor,
+				 thread_state_t			state,
+				 mach_msg_type_number_t	*count )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+kern_return_t
+thread_set_state(
+				 thread_act_t			thread,
+				 int					flavor,
+				 thread_state_t			state,
+				 mach_msg_type_number_t	count )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+/**************************
+ *
+ *	Symbols
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Symbols)
+
+typedef	struct	{
+	const char	*hint;
+	const char	*path;
+}	ImageSearch;
+
+static int
+findHintedImage(
+				struct dl_phdr_info	*image,
+				size_t				size,
+				void				*context )
+{
+	ImageSearch	*search = context;
+
+	if( image->dlpi_name && strstr( image->dlpi_name, search->hint ) ) {
+		search->path = image->dlpi_name;
+		return 1;
+	}
+	return 0;
+}
+
+/***************************************************************************//**
+	symbol_index.c's lookup, answered by the dynamic linker. ELF symbols carry
+	no leading underscore, so Mach-O style names are tried without it first.
+	A hint is matched against the paths of the loaded objects.
+
+	***************************************************************************/
+
+mach_error_t
+symbolIndexLookup(
+				  const char	*symbolName,
+				  const char	*libraryNameHint,
+				  void			**address )
+{
+	ImageSearch	search = { libraryNameHint, NULL };
+	void		*handle = RTLD_DEFAULT;
+	void		*found = NULL;
+
+	if( !symbolName || !address )
+		return KERN_INVALID_ARGUMENT;
+	if( libraryNameHint ) {
+		dl_iterate_phdr( findHintedImage, &search );
+		if( !search.path || !(handle = dlopen( search.path, RTLD_LAZY | RTLD_NOLOAD )) )
+			return KERN_FAILURE;
+	}
+	if( symbolName[0] == '_' )
+		found = dlsym( handle, symbolName + 1 );
+	if( !found )
+		found = dlsym( handle, symbolName );
+	if( handle != RTLD_DEFAULT )
+		dlclose( handle );
+	if( !found )
+		return KERN_FAILURE;
+	*address = found;
+	return err_none;
+}
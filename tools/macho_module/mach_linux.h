@@ -0,0 +1,167 @@
+/*******************************************************************************
+ mach_linux.h
+ Stand-ins for the Mach, libkern and CoreServices calls used by
+ mach_override.c, built on mmap(), mprotect() and /proc/self/maps, so that
+ the override engine and its island allocator run on Linux.
+
+ Only what mach_override.c needs is provided, with the Mach semantics it
+ relies on: vm_allocate() hands out zero-filled read/write memory and fails
+ with KERN_NO_SPACE when a fixed range is taken, and vm_region_64() reports
+ the first mapping at or above an address. There is no thread control, so
+ live patching isn't available.
+
+ ***************************************************************************/
+
+#ifndef		_mach_linux_
+#define		_mach_linux_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+typedef	int				kern_return_t;
+typedef	kern_return_t	mach_error_t;
+typedef	unsigned int	mach_port_t;
+typedef	mach_port_t		vm_map_t, task_t, host_t, thread_act_t;
+typedef	thread_act_t	*thread_act_array_t;
+typedef	unsigned int	natural_t, mach_msg_type_number_t;
+typedef	uintptr_t		vm_address_t;
+typedef	uintptr_t		vm_size_t;
+typedef	int				vm_prot_t;
+typedef	int				boolean_t;
+typedef	unsigned char	Boolean;
+typedef	int				vm_region_flavor_t;
+typedef	int				*vm_region_info_t;
+typedef	natural_t		*thread_state_t;
+
+#define	KERN_SUCCESS				0
+#define	KERN_INVALID_ADDRESS		1
+#define	KERN_PROTECTION_FAILURE		2
+#define	KERN_NO_SPACE				3
+#define	KERN_INVALID_ARGUMENT		4
+#define	KERN_FAILURE				5
+#define	KERN_RESOURCE_SHORTAGE		6
+#define	KERN_NOT_SUPPORTED			46
+
+#define	err_none					((mach_error_t) 0)
+#define	err_system( x )				(((x) & 0x3f) << 26)
+#define	err_sub( x )				(((x) & 0xfff) << 14)
+#define	err_local					err_system( 0x3e )
+
+#define	VM_PROT_NONE				0x00
+#define	VM_PROT_READ				0x01
+#define	VM_PROT_WRITE				0x02
+#define	VM_PROT_EXECUTE				0x04
+#define	VM_PROT_DEFAULT				(VM_PROT_READ | VM_PROT_WRITE)
+#define	VM_PROT_ALL					(VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE)
+#define	VM_PROT_COPY				0x10	//	ignored: private mappings are copy-on-write
+
+#define	VM_FLAGS_FIXED				0x0
+#define	VM_FLAGS_ANYWHERE			0x1
+
+	/**
+	 Only protection and max_protection are filled in.
+	 */
+	typedef	struct	{
+		vm_prot_t	protection;
+		vm_prot_t	max_protection;
+		unsigned int	inheritance;
+		boolean_t	shared;
+		boolean_t	reserved;
+		uint64_t	offset;
+		int			behavior;
+		unsigned short	user_wired_count;
+	}	vm_region_basic_info_data_64_t;
+
+#define	VM_REGION_BASIC_INFO_64		9
+#define	VM_REGION_BASIC_INFO_COUNT_64												\
+	((mach_msg_type_number_t) (sizeof( vm_region_basic_info_data_64_t ) / sizeof( int )))
+
+	typedef	struct	{
+		uint64_t	__rip;
+	}	x86_thread_state64_t;
+
+	typedef	struct	{
+		uint32_t	__eip;
+	}	x86_thread_state32_t;
+
+#define	x86_THREAD_STATE32			1
+#define	x86_THREAD_STATE64			4
+#define	x86_THREAD_STATE32_COUNT	((mach_msg_type_number_t) (sizeof( x86_thread_state32_t ) / sizeof( int )))
+#define	x86_THREAD_STATE64_COUNT	((mach_msg_type_number_t) (sizeof( x86_thread_state64_t ) / sizeof( int )))
+
+mach_port_t		mach_task_self( void );
+mach_port_t		mach_host_self( void );
+mach_port_t		mach_thread_self( void );
+kern_return_t	mach_port_deallocate( task_t task, mach_port_t name );
+
+kern_return_t	host_page_size( host_t host, vm_size_t *pageSize );
+
+kern_return_t	vm_allocate( vm_map_t task, vm_address_t *address, vm_size_t size, int flags );
+kern_return_t	vm_deallocate( vm_map_t task, vm_address_t address, vm_size_t size );
+kern_return_t	vm_protect( vm_map_t task, vm_address_t address, vm_size_t size,
+							boolean_t setMaximum, vm_prot_t protection );
+kern_return_t	vm_region_64( vm_map_t task, vm_address_t *address, vm_size_t *size,
+							  vm_region_flavor_t flavor, vm_region_info_t info,
+							  mach_msg_type_number_t *infoCount, mach_port_t *objectName );
+
+	//	All report KERN_NOT_SUPPORTED.
+kern_return_t	task_threads( task_t task, thread_act_array_t *threads,
+							  mach_msg_type_number_t *count );
+kern_return_t	thread_suspend( thread_act_t thread );
+kern_return_t	thread_resume( thread_act_t thread );
+kern_return_t	thread_get_state( thread_act_t thread, int flavor, thread_state_t state,
+								  mach_msg_type_number_t *count );
+kern_return_t	thread_set_state( thread_act_t thread, int flavor, thread_state_t state,
+								  mach_msg_type_number_t count );
+
+static inline uint32_t
+OSSwapInt32( uint32_t value )
+{
+	return __builtin_bswap32( value );
+}
+
+static inline uint64_t
+OSSwapInt64( uint64_t value )
+{
+	return __builtin_bswap64( value );
+}
+
+static inline void
+OSMemoryBarrier( void )
+{
+	__sync_synchronize();
+}
+
+static inline bool
+OSAtomicCompareAndSwap64Barrier( int64_t oldValue, int64_t newValue, volatile int64_t *value )
+{
+	return __sync_bool_compare_and_swap( value, oldValue, newValue );
+}
+
+static inline int32_t
+OSAtomicIncrement32( volatile int32_t *value )
+{
+	return __sync_add_and_fetch( value, 1 );
+}
+
+static inline int32_t
+OSAtomicIncrement32Barrier( volatile int32_t *value )
+{
+	return __sync_add_and_fetch( value, 1 );
+}
+
+static inline int32_t
+OSAtomicDecrement32Barrier( volatile int32_t *value )
+{
+	return __sync_sub_and_fetch( value, 1 );
+}
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_mach_linux_
@@ -5,15 +5,41 @@
  
  ***************************************************************************/
 
+#if defined(__linux__)
+#define	_GNU_SOURCE
+#endif
+
 #include "mach_override.h"
+#include "x86_decode.h"
+#include "symbol_index.h"
 
+#if !defined(__linux__)
 #include <mach-o/dyld.h>
 #include <mach/mach_host.h>
 #include <mach/mach_init.h>
+#include <mach/mach_port.h>
+#include <mach/task.h>
+#include <mach/thread_act.h>
 #include <mach/vm_map.h>
+#endif
 #include <sys/mman.h>
+#include <sys/ucontext.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#if defined(__linux__)
+#include <ucontext.h>
+#else
+#include <libkern/OSAtomic.h>
 
 #include <CoreServices/CoreServices.h>
+#endif
 
 /**************************
  *	
@@ -42,11 +68,14 @@ long kIslandTemplate[] = {
 
 #elif defined(__i386__) 
 
-#define kOriginalInstructionsSize 16
+#define kOriginalInstructionsSize MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE
 
 char kIslandTemplate[] = {
 	// kOriginalInstructionsSize nop instructions so that we 
-	// should have enough space to host original instructions 
+	// should have enough space to host original instructions,
+	// including widened relative branches
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
 	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 
 	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
 	// Now the real jump instruction
@@ -55,15 +84,22 @@ char kIslandTemplate[] = {
 
 #define kInstructions	0
 #define kJumpAddress    kInstructions + kOriginalInstructionsSize + 1
+#define kIs64BitCode	0
 #elif defined(__x86_64__)
 
-#define kOriginalInstructionsSize 32
+#define kOriginalInstructionsSize MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE
 
-#define kJumpAddress    kOriginalInstructionsSize + 6
+#define kInstructions	0
+#define kIs64BitCode	1
 
 char kIslandTemplate[] = {
 	// kOriginalInstructionsSize nop instructions so that we 
-	// should have enough space to host original instructions 
+	// should have enough space to host original instructions,
+	// including widened relative branches and rip-relative leas
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
 	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 
 	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
 	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 
@@ -79,6 +115,41 @@ char kIslandTemplate[] = {
 #define	kAllocateHigh		1
 #define	kAllocateNormal		0
 
+#define	kIslandSlabPages	16
+
+//	Offset of the pointer a slot island jumps through; islands are 16-byte
+//	aligned so the slot is naturally aligned and stored atomically.
+#define	kIslandSlotOffset	MACH_OVERRIDE_ISLAND_SLOT_OFFSET
+
+//	Marks offsets that don't start an instruction in a relocation map.
+#define	kNotABoundary		0xFF
+
+//	int3, staged over the first byte of a prologue being live patched.
+#define	kTrapInstruction	0xCC
+
+//	Times to look for threads with a trap still to be delivered before a
+//	committed site's trap redirects are left in place for good.
+#define	kTrapRetireAttempts	16
+
+//	Guard islands (see setGuardIsland()) address their thread-local slot
+//	through the segment register the platform's TLS lives in, and keep the
+//	hook they call, which retargeting replaces, at kGuardHookOffset.
+#if defined(__x86_64__) && defined(__linux__)
+#define	kGuardSegmentPrefix	0x64	//	%fs
+#else
+#define	kGuardSegmentPrefix	0x65	//	%gs
+#endif
+#if defined(__x86_64__)
+#define	kGuardHookOffset	56
+#define	kGuardIslandSize	72
+#else
+#define	kGuardHookOffset	44
+#define	kGuardIslandSize	48
+#endif
+#if defined(__linux__)
+#define	kGuardSlotCount		256
+#endif
+
 /**************************
  *	
  *	Data Types
@@ -92,6 +163,145 @@ typedef	struct	{
 	int		allocatedHigh;
 }	BranchIsland;
 
+//	Branch islands are packed into slabs of executable pages. A free island's
+//	first word links it into its slab's free list.
+typedef	struct	IslandSlab	{
+	struct IslandSlab	*next;
+	vm_address_t		base;
+	vm_size_t			size;
+	unsigned int		capacity;	//	islands that fit in the slab
+	unsigned int		bumped;		//	islands handed out at least once
+	unsigned int		used;		//	islands currently allocated
+	BranchIsland		*freeList;
+}	IslandSlab;
+
+#define	kIslandSlotSize		((sizeof( BranchIsland ) + 15) & ~15)
+
+#if defined(__i386__) || defined(__x86_64__)
+//	Published in mach_override.h; these fail to compile if they drift.
+typedef	char	IslandTemplateMatchesHeader[sizeof( kIslandTemplate )
+	== MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE + MACH_OVERRIDE_ISLAND_JUMP_SIZE ? 1 : -1];
+typedef	char	IslandStrideMatchesHeader[kIslandSlotSize == MACH_OVERRIDE_ISLAND_STRIDE ? 1 : -1];
+typedef	char	GuardIslandFitsSlot[kGuardIslandSize <= kIslandSlotSize ? 1 : -1];
+#endif
+
+static IslandSlab		*gIslandSlabs = NULL;
+static pthread_mutex_t	gIslandLock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__i386__) || defined(__x86_64__)
+//	An override whose islands are built but whose jump isn't written yet.
+typedef	struct	{
+	unsigned char	*code;
+	int				eatenCount;
+	char			originalInstructions[kOriginalInstructionsSize];
+	uint64_t		jumpRelativeInstruction;
+	BranchIsland	*escapeIsland;
+	BranchIsland	*reentryIsland;
+	unsigned char	relocatedOffsets[kOriginalInstructionsSize];
+}	PendingOverride;
+
+//	A page of original code made writable for the duration of a batch.
+typedef	struct	{
+	vm_address_t	address;
+	vm_prot_t		protection;
+	int				changed;
+}	PatchedPage;
+
+//	A function patched for mach_override_hook(). Its escape island jumps
+//	through a slot aimed at the newest enabled hook, or at the reentry island
+//	when there is none.
+typedef	struct	OverrideSite	{
+	struct OverrideSite			*next;
+	unsigned char				*code;
+	uint64_t					originalCode;	//	prologue before patching
+	uint64_t					patchedCode;	//	prologue after patching
+	BranchIsland				*escapeIsland;
+	BranchIsland				*reentryIsland;
+	struct mach_override_hook	*newest;		//	head of the chain
+}	OverrideSite;
+
+//	One 8-byte prologue store. When live patching, its first byte is staged
+//	as an int3 that sends threads on to trapTarget, which does what the
+//	code being replaced did.
+typedef	struct	{
+	unsigned char		*code;
+	uint64_t			newCode;
+	unsigned char		oldFirstByte;
+	const void			*trapTarget;
+	//	Relocated copy of the replaced instructions, which threads stopped
+	//	inside them are moved into. NULL when no thread can be inside them.
+	const unsigned char	*relocatedCode;
+	const unsigned char	*relocatedOffsets;
+	int					replacedCount;
+}	PrologueWrite;
+
+//	Where a thread that executed a staged int3 resumes, keyed by its pc
+//	after the trap. The signal can be delivered after the write it belongs
+//	to has completed, so redirects are only retired once no thread is left
+//	with one pending (see retireTrapRedirects()).
+typedef	struct	TrapRedirect	{
+	struct TrapRedirect	*next;
+	uintptr_t			trapAddress;
+	const void			*target;
+}	TrapRedirect;
+
+#if defined(__x86_64__)
+typedef	x86_thread_state64_t	ThreadState;
+#define	kThreadStateFlavor			x86_THREAD_STATE64
+#define	kThreadStateCount			x86_THREAD_STATE64_COUNT
+#define	threadStatePC( state )		((state)->__rip)
+#if defined(__linux__)
+#define	trapContextPC( context )	(((ucontext_t *) (context))->uc_mcontext.gregs[REG_RIP])
+#else
+#define	trapContextPC( context )	(((ucontext_t *) (context))->uc_mcontext->__ss.__rip)
+#endif
+#else
+typedef	x86_thread_state32_t	ThreadState;
+#define	kThreadStateFlavor			x86_THREAD_STATE32
+#define	kThreadStateCount			x86_THREAD_STATE32_COUNT
+#define	threadStatePC( state )		((state)->__eip)
+#if defined(__linux__)
+#define	trapContextPC( context )	(((ucontext_t *) (context))->uc_mcontext.gregs[REG_EIP])
+#else
+#define	trapContextPC( context )	(((ucontext_t *) (context))->uc_mcontext->__ss.__eip)
+#endif
+#endif
+#endif
+
+//	Hooks of a site, newest first. Each one's reentry island is a slot
+//	island aimed at the next older enabled hook or the site's reentry island.
+struct	mach_override_hook	{
+#if defined(__i386__) || defined(__x86_64__)
+	struct mach_override_hook	*older;
+	OverrideSite				*site;
+	const void					*overrideFunctionAddress;
+	BranchIsland				*reentryIsland;
+	int							enabled;
+	BranchIsland				*guardIsland;	//	once first guarded
+	int32_t						guardSlot;		//	see allocateGuardSlot()
+	int							guarded;
+#endif
+};
+
+#if defined(__i386__) || defined(__x86_64__)
+static OverrideSite		*gOverrideSites = NULL;
+static pthread_mutex_t	gHookLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int						gLivePatching = false;
+static TrapRedirect * volatile	gTrapRedirects = NULL;
+static volatile int32_t			gTrapHandlersActive = 0;
+static struct sigaction			gPreviousTrapAction;
+static pthread_mutex_t			gLivePatchLock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__linux__)
+//	Guard slots, handed out under gHookLock. Initial-exec, so that every
+//	thread's copy is at the same offset from its thread pointer.
+static __thread const void	*gGuardSlots[kGuardSlotCount]
+	__attribute__ ((tls_model( "initial-exec" )));
+static int					gGuardSlotsUsed = 0;
+#endif
+#endif
+
 /**************************
  *	
  *	Funky Protos
@@ -110,6 +320,11 @@ mach_error_t
 freeBranchIsland(
 				 BranchIsland	*island );
 
+static mach_error_t
+allocateIslandSlab(
+				   void			*nearAddress,
+				   IslandSlab		**slab );
+
 #if defined(__ppc__) || defined(__POWERPC__)
 mach_error_t
 setBranchIslandTarget(
@@ -123,7 +338,27 @@ mach_error_t
 setBranchIslandTarget_i386(
 						   BranchIsland	*island,
 						   const void		*branchTo,
-						   char*			instructions );
+						   const unsigned char	*instructions,
+						   int				instructionsCount,
+						   unsigned char	*relocatedOffsets );
+
+static mach_error_t
+relocateInstructions(
+					 const unsigned char	*instructions,
+					 int					instructionsCount,
+					 const unsigned char	*originalAddress,
+					 unsigned char		*destination,
+					 int					capacity,
+					 int					*relocatedCount,
+					 unsigned char		*relocatedOffsets );
+
+static int
+emitBranch(
+		   unsigned char	*buffer,
+		   intptr_t		from,
+		   intptr_t		target,
+		   Boolean			isCall );
+
 void 
 atomic_mov64(
 			 uint64_t *targetAddress,
@@ -135,6 +370,87 @@ eatKnownInstructions(
 					 uint64_t		*newInstruction,
 					 int				*howManyEaten, 
 					 char			*originalInstructions );
+
+static mach_error_t
+prepareOverride(
+				PendingOverride			*pending,
+				mach_override_entry_t	*entry,
+				Boolean					dispatchThroughSlot,
+				Boolean					live );
+
+static mach_error_t
+overrideFunctions(
+				  mach_override_entry_t	*entries,
+				  size_t					count,
+				  size_t					*failedEntry,
+				  Boolean					dispatchThroughSlot,
+				  BranchIsland			**escapeIslands );
+
+static void
+setBranchIslandSlot(
+					BranchIsland	*island,
+					const void		*target );
+
+static void
+storeBranchIslandSlot(
+					  BranchIsland	*island,
+					  const void		*target );
+
+static int
+comparePendingOverrides(
+						const void	*a,
+						const void	*b );
+
+static mach_error_t
+makePageWritable(
+				 PatchedPage	*page,
+				 vm_size_t		pageSize );
+
+static const void *
+relinkHooks(
+			struct mach_override_hook	*hook,
+			const void					*original );
+
+static mach_error_t
+allocateGuardSlot(
+				  int32_t	*displacement );
+
+static void
+setGuardIsland(
+			   BranchIsland	*island,
+			   int32_t		displacement,
+			   const void	*hook,
+			   const void	*bypass );
+
+static mach_error_t
+restoreOriginalCode(
+					OverrideSite	*site );
+
+static Boolean
+returnsIntoPrologue(
+					const unsigned char	*code,
+					int					eatenCount );
+
+static mach_error_t
+stagePrologues(
+			   PrologueWrite	*writes,
+			   size_t			count,
+			   Boolean			live );
+
+static void
+commitPrologues(
+				PrologueWrite	*writes,
+				size_t			count,
+				Boolean			live );
+
+typedef	mach_error_t	(*ThreadVisitor)( thread_act_t thread, ThreadState *state,
+										  PrologueWrite *writes, size_t count );
+
+static mach_error_t
+synchronizeThreads(
+				   PrologueWrite	*writes,
+				   size_t			count,
+				   ThreadVisitor	visit );
 #endif
 
 /*******************************************************************************
@@ -156,42 +472,19 @@ mach_override(
 	assert( strlen( originalFunctionSymbolName ) );
 	assert( overrideFunctionAddress );
 	
-	//	Lookup the original function's code pointer.
-	long	*originalFunctionPtr;
-	if( originalFunctionLibraryNameHint )
-		_dyld_lookup_and_bind_with_hint(
-										originalFunctionSymbolName,
-										originalFunctionLibraryNameHint,
-										(void*) &originalFunctionPtr,
-										NULL );
-	else{
-		_dyld_lookup_and_bind(
-							  originalFunctionSymbolName,
-							  (void*) &originalFunctionPtr,
-							  NULL );
-	}
-	
-	//printf ("In mach_override\n");
+	//	Lookup the original function's code pointer in the symbol index
+	//	rather than having dyld search every image for each name.
+	void			*originalFunctionPtr;
+	mach_error_t	err = symbolIndexLookup( originalFunctionSymbolName,
+											 originalFunctionLibraryNameHint,
+											 &originalFunctionPtr );
+	if( err )
+		return err;
+	
 	return mach_override_ptr( originalFunctionPtr, overrideFunctionAddress,
 							 originalFunctionReentryIsland );
 }
 
-#if defined(__x86_64__)
-mach_error_t makeIslandExecutable(void *address) {
-	mach_error_t err = err_none;
-    vm_size_t pageSize;
-    host_page_size( mach_host_self(), &pageSize );
-    uint64_t page = (uint64_t)address & ~(uint64_t)(pageSize-1);
-    int e = err_none;
-    e |= mprotect((void *)page, pageSize, PROT_EXEC | PROT_READ | PROT_WRITE);
-    e |= msync((void *)page, pageSize, MS_INVALIDATE );
-    if (e) {
-        err = err_cannot_override;
-    }
-    return err;
-}
-#endif
-
 mach_error_t
 mach_override_ptr(
 				  void *originalFunctionAddress,
@@ -201,10 +494,16 @@ mach_override_ptr(
 	assert( originalFunctionAddress );
 	assert( overrideFunctionAddress );
 	
+#if defined(__i386__) || defined(__x86_64__)
+	mach_override_entry_t entry = { originalFunctionAddress,
+									overrideFunctionAddress,
+									originalFunctionReentryIsland };
+	
+	return overrideFunctions( &entry, 1, NULL, false, NULL );
+#elif defined(__ppc__) || defined(__POWERPC__)
 	long	*originalFunctionPtr = (long*) originalFunctionAddress;
 	mach_error_t	err = err_none;
 	
-#if defined(__ppc__) || defined(__POWERPC__)
 	//	Ensure first instruction isn't 'mfctr'.
 #define	kMFCTRMask			0xfc1fffff
 #define	kMFCTRInstruction	0x7c0903a6
@@ -212,20 +511,6 @@ mach_override_ptr(
 	long	originalInstruction = *originalFunctionPtr;
 	if( !err && ((originalInstruction & kMFCTRMask) == kMFCTRInstruction) )
 		err = err_cannot_override;
-#elif defined(__i386__) || defined(__x86_64__)
-	int eatenCount = 0;
-	char originalInstructions[kOriginalInstructionsSize];
-	uint64_t jumpRelativeInstruction = 0; // JMP
-	
-	Boolean overridePossible = eatKnownInstructions ((unsigned char *)originalFunctionPtr, 
-													 &jumpRelativeInstruction, &eatenCount, originalInstructions);
-	if (eatenCount > kOriginalInstructionsSize) {
-		//printf ("Too many instructions eaten\n");
-		overridePossible = false;
-	}
-	if (!overridePossible) err = err_cannot_override;
-	if (err) printf("err = %x %d\n", err, __LINE__);
-#endif
 	
 	//	Make the original function implementation writable.
 	if( !err ) {
@@ -245,8 +530,6 @@ mach_override_ptr(
 		err = allocateBranchIsland( &escapeIsland, kAllocateHigh, originalFunctionAddress );
 	if (err) printf("err = %x %d\n", err, __LINE__);
 	
-	
-#if defined(__ppc__) || defined(__POWERPC__)
 	if( !err )
 		err = setBranchIslandTarget( escapeIsland, overrideFunctionAddress, 0 );
 	
@@ -256,27 +539,6 @@ mach_override_ptr(
 		long escapeIslandAddress = ((long) escapeIsland) & 0x3FFFFFF;
 		branchAbsoluteInstruction = 0x48000002 | escapeIslandAddress;
 	}
-#elif defined(__i386__) || defined(__x86_64__)
-	if (err) printf("err = %x %d\n", err, __LINE__);
-	
-	if( !err )
-		err = setBranchIslandTarget_i386( escapeIsland, overrideFunctionAddress, 0 );
-	
-	if (err) printf("err = %x %d\n", err, __LINE__);
-	// Build the jump relative instruction to the escape island
-#endif
-	
-	
-#if defined(__i386__) || defined(__x86_64__)
-	if (!err) {
-		uint32_t addressOffset = ((void*)escapeIsland - (void*)originalFunctionPtr - 5);
-		addressOffset = OSSwapInt32(addressOffset);
-		
-		jumpRelativeInstruction |= 0xE900000000000000LL; 
-		jumpRelativeInstruction |= ((uint64_t)addressOffset & 0xffffffff) << 24;
-		jumpRelativeInstruction = OSSwapInt64(jumpRelativeInstruction);		
-	}
-#endif
 	
 	//	Optionally allocate & return the reentry island.
 	BranchIsland	*reentryIsland = NULL;
@@ -286,7 +548,6 @@ mach_override_ptr(
 			*originalFunctionReentryIsland = reentryIsland;
 	}
 	
-#if defined(__ppc__) || defined(__POWERPC__)	
 	//	Atomically:
 	//	o If the reentry island was allocated:
 	//		o Insert the original instruction into the reentry island.
@@ -314,23 +575,6 @@ mach_override_ptr(
 			}
 		} while( !err && !escapeIslandEngaged );
 	}
-#elif defined(__i386__) || defined(__x86_64__)
-	// Atomically:
-	//	o If the reentry island was allocated:
-	//		o Insert the original instructions into the reentry island.
-	//		o Target the reentry island at the first non-replaced 
-	//        instruction of the original function.
-	//	o Replace the original first instructions with the jump relative.
-	//
-	// Note that on i386, we do not support someone else changing the code under our feet
-	if ( !err ) {
-		if( reentryIsland )
-			err = setBranchIslandTarget_i386( reentryIsland,
-											 (void*) ((char *)originalFunctionPtr+eatenCount), originalInstructions );
-		if ( !err )
-			atomic_mov64((uint64_t *)originalFunctionPtr, jumpRelativeInstruction);
-	}
-#endif
 	
 	//	Clean up on error.
 	if( err ) {
@@ -340,279 +584,1761 @@ mach_override_ptr(
 			freeBranchIsland( escapeIsland );
 	}
 	
-#if defined(__x86_64__)
-	err = makeIslandExecutable(escapeIsland);
-	err = makeIslandExecutable(reentryIsland);
-#endif
-	
 	return err;
+#endif
 }
 
-/*******************************************************************************
- *	
- *	Implementation
- *	
- *******************************************************************************/
-#pragma mark	-
-#pragma mark	(Implementation)
+mach_error_t
+mach_override_batch(
+					mach_override_entry_t	*entries,
+					size_t					count,
+					size_t					*failedEntry )
+{
+	assert( entries || !count );
+	
+#if defined(__i386__) || defined(__x86_64__)
+	return overrideFunctions( entries, count, failedEntry, false, NULL );
+#else
+	size_t i;
+	
+	//	No batching for branch absolute patches; install one at a time.
+	for( i = 0; i < count; i++ ) {
+		mach_error_t err = mach_override_ptr( entries[i].originalFunctionAddress,
+											  entries[i].overrideFunctionAddress,
+											  entries[i].originalFunctionReentryIsland );
+		if( err ) {
+			if( failedEntry )
+				*failedEntry = i;
+			return err;
+		}
+	}
+	return err_none;
+#endif
+}
 
-/***************************************************************************//**
-																			  Implementation: Allocates memory for a branch island.
-																			  
-																			  @param	island			<-	The allocated island.
-																			  @param	allocateHigh	->	Whether to allocate the island at the end of the
-																			  address space (for use with the branch absolute
-																			  instruction).
-																			  @result					<-	mach_error_t
-																			  
-																			  ***************************************************************************/
+mach_error_t
+mach_override_live_patching(
+							int enabled )
+{
+	//	Linux has no task_threads() to stop and migrate other threads with.
+#if (defined(__i386__) || defined(__x86_64__)) && !defined(__linux__)
+	pthread_mutex_lock( &gLivePatchLock );
+	gLivePatching = enabled != 0;
+	pthread_mutex_unlock( &gLivePatchLock );
+	return err_none;
+#else
+	(void) enabled;
+	return KERN_NOT_SUPPORTED;
+#endif
+}
 
+#if defined(__i386__) || defined(__x86_64__)
 mach_error_t
-allocateBranchIsland(
-					 BranchIsland	**island,
-					 int				allocateHigh,
-					 void *originalFunctionAddress)
+mach_override_hook(
+				   void *originalFunctionAddress,
+				   const void *overrideFunctionAddress,
+				   void **originalFunctionReentryIsland,
+				   mach_override_hook_t *hook )
 {
-	assert( island );
+	assert( originalFunctionAddress );
+	assert( overrideFunctionAddress );
+	assert( hook );
 	
-	mach_error_t	err = err_none;
+	struct mach_override_hook	*newHook;
+	OverrideSite				*site;
+	mach_error_t				err = err_none;
+	
+	newHook = calloc( 1, sizeof( *newHook ) );
+	if( !newHook )
+		return KERN_RESOURCE_SHORTAGE;
+	
+	pthread_mutex_lock( &gHookLock );
 	
-	if( allocateHigh ) {
-		vm_size_t pageSize;
-		err = host_page_size( mach_host_self(), &pageSize );
+	for( site = gOverrideSites; site; site = site->next )
+		if( site->code == originalFunctionAddress )
+			break;
+	
+	//	First hook on this function: patch it to dispatch through a slot,
+	//	passing straight through to the original until the chain is linked.
+	if( !site ) {
+		site = calloc( 1, sizeof( *site ) );
+		if( !site )
+			err = KERN_RESOURCE_SHORTAGE;
 		if( !err ) {
-			assert( sizeof( BranchIsland ) <= pageSize );
-#if defined(__x86_64__)
-			vm_address_t first = (uint64_t)originalFunctionAddress & ~(uint64_t)(((uint64_t)1 << 31) - 1) | ((uint64_t)1 << 31); // start in the middle of the page?
-			vm_address_t last = 0x0;
-#else
-			vm_address_t first = 0xfeffffff;
-			vm_address_t last = 0xfe000000 + pageSize;
-#endif
-			
-			vm_address_t page = first;
-			int allocated = 0;
-			vm_map_t task_self = mach_task_self();
+			mach_override_entry_t entry = { originalFunctionAddress,
+											overrideFunctionAddress,
+											(void **) &site->reentryIsland };
 			
-			while( !err && !allocated && page != last ) {
-				
-				err = vm_allocate( task_self, &page, pageSize, 0 );
-				if( err == err_none )
-					allocated = 1;
-				else if( err == KERN_NO_SPACE ) {
-#if defined(__x86_64__)
-					page -= pageSize;
-#else
-					page += pageSize;
-#endif
-					err = err_none;
-				}
-			}
-			if( allocated )
-				*island = (void*) page;
-			else if( !allocated && !err )
-				err = KERN_NO_SPACE;
+			site->code = originalFunctionAddress;
+			site->originalCode = *(uint64_t *) site->code;
+			err = overrideFunctions( &entry, 1, NULL, true, &site->escapeIsland );
+		}
+		if( !err ) {
+			site->patchedCode = *(uint64_t *) site->code;
+			site->next = gOverrideSites;
+			gOverrideSites = site;
+		} else if( site ) {
+			free( site );
+			site = NULL;
 		}
-	} else {
-		void *block = malloc( sizeof( BranchIsland ) );
-		if( block )
-			*island = block;
-		else
-			err = KERN_NO_SPACE;
 	}
+	
 	if( !err )
-		(**island).allocatedHigh = allocateHigh;
+		err = allocateBranchIsland( &newHook->reentryIsland, kAllocateNormal, NULL );
+	
+	//	Link the hook in as the newest. Its reentry island is aimed and
+	//	handed out before the site's escape slot can reach the hook.
+	if( !err ) {
+		setBranchIslandSlot( newHook->reentryIsland, site->reentryIsland );
+		if( originalFunctionReentryIsland )
+			*originalFunctionReentryIsland = newHook->reentryIsland;
+		
+		newHook->site = site;
+		newHook->overrideFunctionAddress = overrideFunctionAddress;
+		newHook->enabled = true;
+		newHook->older = site->newest;
+		site->newest = newHook;
+		storeBranchIslandSlot( site->escapeIsland,
+							   relinkHooks( site->newest, site->reentryIsland ) );
+		*hook = newHook;
+	}
 	
+	pthread_mutex_unlock( &gHookLock );
+	
+	if( err )
+		free( newHook );
 	return err;
 }
 
-/***************************************************************************//**
-																			  Implementation: Deallocates memory for a branch island.
-																			  
-																			  @param	island	->	The island to deallocate.
-																			  @result			<-	mach_error_t
-																			  
-																			  ***************************************************************************/
+mach_error_t
+mach_override_hook_enable(
+						  mach_override_hook_t hook,
+						  int enabled )
+{
+	assert( hook );
+	
+	pthread_mutex_lock( &gHookLock );
+	hook->enabled = enabled != 0;
+	storeBranchIslandSlot( hook->site->escapeIsland,
+						   relinkHooks( hook->site->newest, hook->site->reentryIsland ) );
+	pthread_mutex_unlock( &gHookLock );
+	return err_none;
+}
 
 mach_error_t
-freeBranchIsland(
-				 BranchIsland	*island )
+mach_override_hook_retarget(
+							mach_override_hook_t hook,
+							const void *overrideFunctionAddress )
 {
-	assert( island );
-	assert( (*(long*)&island->instructions[0]) == kIslandTemplate[0] );
-	assert( island->allocatedHigh );
+	assert( hook );
+	assert( overrideFunctionAddress );
+	
+	pthread_mutex_lock( &gHookLock );
+	hook->overrideFunctionAddress = overrideFunctionAddress;
+	if( hook->guardIsland ) {
+		OSMemoryBarrier();
+		*(const void * volatile *) (hook->guardIsland->instructions + kGuardHookOffset)
+			= overrideFunctionAddress;
+	}
+	storeBranchIslandSlot( hook->site->escapeIsland,
+						   relinkHooks( hook->site->newest, hook->site->reentryIsland ) );
+	pthread_mutex_unlock( &gHookLock );
+	return err_none;
+}
+
+mach_error_t
+mach_override_hook_guard(
+						 mach_override_hook_t hook,
+						 int guarded )
+{
+	assert( hook );
 	
+	BranchIsland	*island;
+	int32_t			displacement;
 	mach_error_t	err = err_none;
 	
-	if( island->allocatedHigh ) {
-		vm_size_t pageSize;
-		err = host_page_size( mach_host_self(), &pageSize );
+	pthread_mutex_lock( &gHookLock );
+	
+	//	Built on first use and kept: a thread may still be inside the hook,
+	//	due to return through the island, after the guard is turned off.
+	if( guarded && !hook->guardIsland ) {
+		err = allocateGuardSlot( &displacement );
+		if( !err )
+			err = allocateBranchIsland( &island, kAllocateNormal, NULL );
 		if( !err ) {
-			assert( sizeof( BranchIsland ) <= pageSize );
-			err = vm_deallocate(
-								mach_task_self(),
-								(vm_address_t) island, pageSize );
+			setGuardIsland( island, displacement,
+							hook->overrideFunctionAddress, hook->reentryIsland );
+			hook->guardSlot = displacement;
+			OSMemoryBarrier();
+			hook->guardIsland = island;
 		}
-	} else {
-		free( island );
+	}
+	if( !err ) {
+		hook->guarded = guarded != 0;
+		storeBranchIslandSlot( hook->site->escapeIsland,
+							   relinkHooks( hook->site->newest, hook->site->reentryIsland ) );
 	}
 	
+	pthread_mutex_unlock( &gHookLock );
 	return err;
 }
 
-/***************************************************************************//**
-																			  Implementation: Sets the branch island's target, with an optional
-																			  instruction.
-																			  
-																			  @param	island		->	The branch island to insert target into.
-																			  @param	branchTo	->	The address of the target.
-																			  @param	instruction	->	Optional instruction to execute prior to branch. Set
-																			  to zero for nop.
-																			  @result				<-	mach_error_t
-																			  
-																			  ***************************************************************************/
-#if defined(__ppc__) || defined(__POWERPC__)
-mach_error_t
-setBranchIslandTarget(
-					  BranchIsland	*island,
-					  const void		*branchTo,
-					  long			instruction )
+const void *
+mach_override_hook_caller(
+						  mach_override_hook_t hook )
 {
-	//	Copy over the template code.
-    bcopy( kIslandTemplate, island->instructions, sizeof( kIslandTemplate ) );
-    
-    //	Fill in the address.
-    ((short*)island->instructions)[kAddressLo] = ((long) branchTo) & 0x0000FFFF;
-    ((short*)island->instructions)[kAddressHi]
-	= (((long) branchTo) >> 16) & 0x0000FFFF;
-    
-    //	Fill in the (optional) instuction.
-    if( instruction != 0 ) {
-        ((short*)island->instructions)[kInstructionLo]
-		= instruction & 0x0000FFFF;
-        ((short*)island->instructions)[kInstructionHi]
-		= (instruction >> 16) & 0x0000FFFF;
-    }
-    
-    //MakeDataExecutable( island->instructions, sizeof( kIslandTemplate ) );
-	msync( island->instructions, sizeof( kIslandTemplate ), MS_INVALIDATE );
-    
-    return err_none;
+	assert( hook );
+	
+	const void	*caller;
+	
+	//	No lock: the slot is set once, before the island is published.
+	if( !hook->guardIsland )
+		return NULL;
+#if defined(__x86_64__) && defined(__linux__)
+	__asm__ volatile( "movq %%fs:(%1), %0" : "=r" (caller) : "r" ((intptr_t) hook->guardSlot) );
+#elif defined(__x86_64__)
+	__asm__ volatile( "movq %%gs:(%1), %0" : "=r" (caller) : "r" ((intptr_t) hook->guardSlot) );
+#else
+	__asm__ volatile( "movl %%gs:(%1), %0" : "=r" (caller) : "r" (hook->guardSlot) );
+#endif
+	return caller;
 }
-#endif 
 
-#if defined(__i386__)
 mach_error_t
-setBranchIslandTarget_i386(
-						   BranchIsland	*island,
-						   const void		*branchTo,
-						   char*			instructions )
+mach_unoverride(
+				mach_override_hook_t hook )
 {
+	assert( hook );
 	
-	//	Copy over the template code.
-    bcopy( kIslandTemplate, island->instructions, sizeof( kIslandTemplate ) );
+	OverrideSite				*site = hook->site;
+	struct mach_override_hook	**link;
+	OverrideSite				**siteLink;
+	mach_error_t				err = err_none;
 	
-	// copy original instructions
-	if (instructions) {
-		bcopy (instructions, island->instructions + kInstructions, kOriginalInstructionsSize);
+	pthread_mutex_lock( &gHookLock );
+	
+	//	Unlink and relink. The removed hook's reentry island keeps aiming at
+	//	what followed it, for threads still running inside the hook.
+	for( link = &site->newest; *link != hook; link = &(*link)->older )
+		assert( *link );
+	*link = hook->older;
+	storeBranchIslandSlot( site->escapeIsland,
+						   relinkHooks( site->newest, site->reentryIsland ) );
+	
+	//	Last hook gone: put the prologue back and forget the site.
+	if( !site->newest ) {
+		err = restoreOriginalCode( site );
+		if( !err ) {
+			for( siteLink = &gOverrideSites; *siteLink != site; siteLink = &(*siteLink)->next )
+				;
+			*siteLink = site->next;
+			free( site );
+		} else if( err == err_cannot_override ) {
+			//	Patched over by someone else; the site just passes through.
+			err = err_none;
+		}
 	}
 	
-    // Fill in the address.
-    int32_t addressOffset = (char *)branchTo - (island->instructions + kJumpAddress + 4);
-    *((int32_t *)(island->instructions + kJumpAddress)) = addressOffset; 
+	pthread_mutex_unlock( &gHookLock );
 	
-    msync( island->instructions, sizeof( kIslandTemplate ), MS_INVALIDATE );
-    return err_none;
+	free( hook );
+	return err;
 }
 
-#elif defined(__x86_64__)
 mach_error_t
-setBranchIslandTarget_i386(
-						   BranchIsland	*island,
-						   const void		*branchTo,
-						   char*			instructions )
+mach_override_thunk(
+					const void *context,
+					const void *handler,
+					void **thunk )
+{
+	assert( handler );
+	assert( thunk );
+	
+	BranchIsland	*island;
+	unsigned char	*instructions;
+	mach_error_t	err = allocateBranchIsland( &island, kAllocateNormal, NULL );
+	
+	if( !err ) {
+		instructions = (unsigned char *) island->instructions;
+#if defined(__x86_64__)
+		//	movabs $context, %r11
+		instructions[0] = 0x49;
+		instructions[1] = 0xBB;
+		*(uint64_t *) (instructions + 2) = (uint64_t) context;
+		emitBranch( instructions + 10, (intptr_t) (instructions + 10),
+					(intptr_t) handler, false );
+#else
+		//	push $context
+		instructions[0] = 0x68;
+		*(uint32_t *) (instructions + 1) = (uint32_t) context;
+		emitBranch( instructions + 5, (intptr_t) (instructions + 5),
+					(intptr_t) handler, false );
+#endif
+		msync( island, sizeof( BranchIsland ), MS_INVALIDATE );
+		*thunk = island;
+	}
+	return err;
+}
+#else
+mach_error_t
+mach_override_hook(
+				   void *originalFunctionAddress,
+				   const void *overrideFunctionAddress,
+				   void **originalFunctionReentryIsland,
+				   mach_override_hook_t *hook )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+mach_error_t
+mach_override_hook_enable(
+						  mach_override_hook_t hook,
+						  int enabled )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+mach_error_t
+mach_override_hook_retarget(
+							mach_override_hook_t hook,
+							const void *overrideFunctionAddress )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+mach_error_t
+mach_override_hook_guard(
+						 mach_override_hook_t hook,
+						 int guarded )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+const void *
+mach_override_hook_caller(
+						  mach_override_hook_t hook )
+{
+	return NULL;
+}
+
+mach_error_t
+mach_unoverride(
+				mach_override_hook_t hook )
+{
+	return KERN_NOT_SUPPORTED;
+}
+
+mach_error_t
+mach_override_thunk(
+					const void *context,
+					const void *handler,
+					void **thunk )
+{
+	return KERN_NOT_SUPPORTED;
+}
+#endif
+
+
+/*******************************************************************************
+ *	
+ *	Implementation
+ *	
+ *******************************************************************************/
+#pragma mark	-
+#pragma mark	(Implementation)
+
+#if defined(__i386__) || defined(__x86_64__)
+/***************************************************************************//**
+	Implementation: Installs a batch of overrides, all or nothing. Backs
+	mach_override_batch(), mach_override_ptr() and hook sites.
+	
+	@param	entries				<->	Overrides to install.
+	@param	count				->	Number of entries.
+	@param	failedEntry			<-	Optional index of the failing entry.
+	@param	dispatchThroughSlot	->	Build escape islands that jump through an
+									updatable slot (see setBranchIslandSlot()),
+									initially aimed at the reentry island.
+	@param	escapeIslands		<-	Optional array of count escape islands.
+	@result						<-	mach_error_t
+	
+	***************************************************************************/
+
+static mach_error_t
+overrideFunctions(
+				  mach_override_entry_t	*entries,
+				  size_t					count,
+				  size_t					*failedEntry,
+				  Boolean					dispatchThroughSlot,
+				  BranchIsland			**escapeIslands )
+{
+	mach_error_t	err = err_none;
+	PendingOverride	*pending = NULL;
+	PendingOverride	**sorted = NULL;
+	PatchedPage		*pages = NULL;
+	PrologueWrite	*writes = NULL;
+	size_t			prepared = 0, pageCount = 0, i;
+	vm_size_t		pageSize;
+	Boolean			live = gLivePatching, trapsStaged = false;
+	
+	if( failedEntry )
+		*failedEntry = count;
+	if( !count )
+		return err_none;
+	
+	err = host_page_size( mach_host_self(), &pageSize );
+	if( !err ) {
+		pending = calloc( count, sizeof( PendingOverride ) );
+		sorted = calloc( count, sizeof( PendingOverride * ) );
+		pages = calloc( 2 * count, sizeof( PatchedPage ) );
+		writes = calloc( count, sizeof( PrologueWrite ) );
+		if( !pending || !sorted || !pages || !writes )
+			err = KERN_RESOURCE_SHORTAGE;
+	}
+	
+	//	Build every island up front; the original code is left untouched
+	//	until all entries are known to be patchable.
+	for( i = 0; !err && i < count; i++ ) {
+		err = prepareOverride( &pending[i], &entries[i], dispatchThroughSlot, live );
+		if( err ) {
+			if( failedEntry )
+				*failedEntry = i;
+		} else {
+			sorted[i] = &pending[i];
+			prepared++;
+		}
+	}
+	
+	//	Patched ranges must not overlap: the jump is written with an 8-byte
+	//	store that rewrites bytes following it from the earlier snapshot.
+	if( !err ) {
+		qsort( sorted, count, sizeof( PendingOverride * ), comparePendingOverrides );
+		for( i = 1; !err && i < count; i++ ) {
+			if( sorted[i]->code - sorted[i-1]->code < (ptrdiff_t) sizeof( uint64_t ) ) {
+				err = err_cannot_override;
+				if( failedEntry )
+					*failedEntry = sorted[i] - pending;
+			}
+		}
+	}
+	
+	//	Make each distinct page writable once, remembering its protection.
+	if( !err ) {
+		for( i = 0; i < count; i++ ) {
+			vm_address_t first = (vm_address_t) sorted[i]->code & ~(pageSize - 1);
+			vm_address_t last = ((vm_address_t) sorted[i]->code + sizeof( uint64_t ) - 1) & ~(pageSize - 1);
+			if( !pageCount || pages[pageCount-1].address != first )
+				pages[pageCount++].address = first;
+			if( last != first )
+				pages[pageCount++].address = last;
+		}
+		for( i = 0; !err && i < pageCount; i++ )
+			err = makePageWritable( &pages[i], pageSize );
+	}
+	
+	//	Commit: swing every prologue over to its escape island. Reentry
+	//	islands are handed out once nothing can fail, before the jumps can
+	//	be taken.
+	if( !err ) {
+		for( i = 0; i < count; i++ ) {
+			writes[i].code = pending[i].code;
+			writes[i].newCode = pending[i].jumpRelativeInstruction;
+			writes[i].oldFirstByte = pending[i].code[0];
+			writes[i].trapTarget = pending[i].reentryIsland;
+			if( pending[i].reentryIsland )
+				writes[i].relocatedCode = (unsigned char *) pending[i].reentryIsland->instructions
+					+ kInstructions;
+			writes[i].relocatedOffsets = pending[i].relocatedOffsets;
+			writes[i].replacedCount = pending[i].eatenCount;
+		}
+		
+		if( live )
+			pthread_mutex_lock( &gLivePatchLock );
+		err = stagePrologues( writes, count, live );
+		if( !err ) {
+			for( i = 0; i < count; i++ ) {
+				if( entries[i].originalFunctionReentryIsland )
+					*entries[i].originalFunctionReentryIsland = pending[i].reentryIsland;
+				if( escapeIslands )
+					escapeIslands[i] = pending[i].escapeIsland;
+			}
+			commitPrologues( writes, count, live );
+		} else
+			trapsStaged = live;
+		if( live )
+			pthread_mutex_unlock( &gLivePatchLock );
+	}
+	
+	//	Restore W^X, whether or not we committed.
+	for( i = 0; i < pageCount; i++ ) {
+		if( pages[i].changed )
+			vm_protect( mach_task_self(), pages[i].address, pageSize, false,
+						pages[i].protection );
+	}
+	
+	//	Roll back on error. Islands that staged traps were sent to stay, for
+	//	traps still being delivered.
+	if( err && !trapsStaged ) {
+		for( i = 0; i < prepared; i++ ) {
+			if( pending[i].reentryIsland )
+				freeBranchIsland( pending[i].reentryIsland );
+			if( pending[i].escapeIsland )
+				freeBranchIsland( pending[i].escapeIsland );
+		}
+	}
+	
+	free( writes );
+	free( pages );
+	free( sorted );
+	free( pending );
+	return err;
+}
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+/***************************************************************************//**
+	Implementation: Turns an island into a slot island: an indirect jump
+	through a pointer stored kIslandSlotOffset bytes into the island, so that
+	its target can be changed with one aligned store.
+	
+	@param	island	->	The island.
+	@param	target	->	Initial target.
+	
+	***************************************************************************/
+
+static void
+setBranchIslandSlot(
+					BranchIsland	*island,
+					const void		*target )
+{
+	unsigned char	*instructions = (unsigned char *) island->instructions;
+	
+	assert( ((uintptr_t) island & 15) == 0 );
+	
+	//	jmp *slot, padded up to the slot with int3s.
+	instructions[0] = 0xFF;
+	instructions[1] = 0x25;
+#if defined(__x86_64__)
+	*(int32_t *) (instructions + 2) = kIslandSlotOffset - 6;
+#else
+	*(uint32_t *) (instructions + 2) = (uint32_t) (instructions + kIslandSlotOffset);
+#endif
+	instructions[6] = 0xCC;
+	instructions[7] = 0xCC;
+	*(const void **) (instructions + kIslandSlotOffset) = target;
+	
+	msync( island, kIslandSlotOffset + sizeof( void * ), MS_INVALIDATE );
+}
+
+/***************************************************************************//**
+	Implementation: Atomically aims a slot island at a new target. Earlier
+	stores, such as those building the target's own islands, are made
+	visible first.
+	
+	@param	island	->	The slot island.
+	@param	target	->	New target.
+	
+	***************************************************************************/
+
+static void
+storeBranchIslandSlot(
+					  BranchIsland	*island,
+					  const void		*target )
+{
+	OSMemoryBarrier();
+	*(const void * volatile *) (island->instructions + kIslandSlotOffset) = target;
+}
+
+/***************************************************************************//**
+	Implementation: Aims each hook's reentry island at the next older enabled
+	hook, working from the original function outwards so that every store
+	publishes a chain that is already consistent.
+	
+	@param	hook		->	Newest hook of the (sub)chain to relink. Can be NULL.
+	@param	original	->	The site's reentry island.
+	@result				<-	Where the (sub)chain should be entered.
+	
+	***************************************************************************/
+
+static const void *
+relinkHooks(
+			struct mach_override_hook	*hook,
+			const void					*original )
+{
+	const void	*next;
+	
+	if( !hook )
+		return original;
+	
+	next = relinkHooks( hook->older, original );
+	storeBranchIslandSlot( hook->reentryIsland, next );
+	if( !hook->enabled )
+		return next;
+	return hook->guarded ? (const void *) hook->guardIsland : hook->overrideFunctionAddress;
+}
+
+/***************************************************************************//**
+	Implementation: Sets aside a pointer-sized thread-local slot for a guard
+	island, reachable at the same displacement from the TLS segment base in
+	every thread. Slots are never given back: a thread can be suspended
+	inside a guarded hook indefinitely.
+	
+	@param	displacement	<-	The slot's offset from the segment base.
+	@result					<-	KERN_RESOURCE_SHORTAGE when out of slots.
+	
+	***************************************************************************/
+
+static mach_error_t
+allocateGuardSlot(
+				  int32_t	*displacement )
+{
+#if defined(__linux__)
+	uintptr_t	threadPointer;
+	
+	if( gGuardSlotsUsed == kGuardSlotCount )
+		return KERN_RESOURCE_SHORTAGE;
+	//	The TCB's first word points at itself.
+#if defined(__x86_64__)
+	__asm__( "movq %%fs:0, %0" : "=r" (threadPointer) );
+#else
+	__asm__( "movl %%gs:0, %0" : "=r" (threadPointer) );
+#endif
+	*displacement = (int32_t) ((uintptr_t) &gGuardSlots[gGuardSlotsUsed++] - threadPointer);
+	return err_none;
+#else
+	//	Darwin's pthread TSD is an array of pointers at the %gs base, indexed
+	//	by key; the values are only ever touched through the guard island.
+	pthread_key_t	key;
+	
+	if( pthread_key_create( &key, NULL ) )
+		return KERN_RESOURCE_SHORTAGE;
+	*displacement = (int32_t) (key * sizeof( void * ));
+	return err_none;
+#endif
+}
+
+/***************************************************************************//**
+	Implementation: Builds a guard island, which calls hook unless the thread
+	is already inside it, in which case it jumps to bypass. The caller's
+	return address doubles as the flag: it is moved into the thread's slot
+	for the duration of the call and put back on the stack afterwards, so
+	the stack, arguments and return registers are exactly as the hook would
+	see them from a direct call.
+	
+		cmp		$0, slot
+		jne		bypass
+		pop		slot
+		call	*hook
+		push	slot
+		and		$0, slot
+		ret
+	bypass:
+		jmp		*bypass
+	
+	@param	island			->	The island to build.
+	@param	displacement	->	Its slot; see allocateGuardSlot().
+	@param	hook			->	What to call.
+	@param	bypass			->	Where nested calls go.
+	
+	***************************************************************************/
+
+static void
+setGuardIsland(
+			   BranchIsland	*island,
+			   int32_t		displacement,
+			   const void	*hook,
+			   const void	*bypass )
+{
+	unsigned char	*code = (unsigned char *) island->instructions;
+	unsigned char	*p = code;
+	unsigned char	*branch;
+	
+	memset( code, 0xCC, kGuardIslandSize );
+	*(const void **) (code + kGuardHookOffset) = hook;
+	
+#if defined(__x86_64__)
+	//	cmpq $0, seg:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0x48; *p++ = 0x83; *p++ = 0x3C; *p++ = 0x25;
+	*(int32_t *) p = displacement; p += 4;
+	*p++ = 0x00;
+	//	jne bypass
+	*p++ = 0x75;
+	branch = p++;
+	//	popq seg:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0x8F; *p++ = 0x04; *p++ = 0x25;
+	*(int32_t *) p = displacement; p += 4;
+	//	call *hook(%rip)
+	*p++ = 0xFF; *p++ = 0x15;
+	*(int32_t *) p = (int32_t) (code + kGuardHookOffset - (p + 4)); p += 4;
+	//	pushq seg:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0xFF; *p++ = 0x34; *p++ = 0x25;
+	*(int32_t *) p = displacement; p += 4;
+	//	andq $0, seg:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0x48; *p++ = 0x83; *p++ = 0x24; *p++ = 0x25;
+	*(int32_t *) p = displacement; p += 4;
+	*p++ = 0x00;
+	//	ret
+	*p++ = 0xC3;
+	//	bypass: jmp *bypass(%rip), aligned so the pointer follows the hook's
+	p = code + kGuardHookOffset - 8;
+	*branch = (unsigned char) (p - (branch + 1));
+	*p++ = 0xFF; *p++ = 0x25;
+	*(int32_t *) p = (int32_t) (code + kGuardHookOffset + 8 - (p + 4));
+	*(const void **) (code + kGuardHookOffset + 8) = bypass;
+#else
+	//	cmpl $0, %gs:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0x83; *p++ = 0x3D;
+	*(int32_t *) p = displacement; p += 4;
+	*p++ = 0x00;
+	//	jne bypass
+	*p++ = 0x75;
+	branch = p++;
+	//	popl %gs:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0x8F; *p++ = 0x05;
+	*(int32_t *) p = displacement; p += 4;
+	//	call *hook
+	*p++ = 0xFF; *p++ = 0x15;
+	*(uint32_t *) p = (uint32_t) (code + kGuardHookOffset); p += 4;
+	//	pushl %gs:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0xFF; *p++ = 0x35;
+	*(int32_t *) p = displacement; p += 4;
+	//	andl $0, %gs:slot
+	*p++ = kGuardSegmentPrefix; *p++ = 0x83; *p++ = 0x25;
+	*(int32_t *) p = displacement; p += 4;
+	*p++ = 0x00;
+	//	ret
+	*p++ = 0xC3;
+	//	bypass: jmp bypass
+	*branch = (unsigned char) (p - (branch + 1));
+	*p++ = 0xE9;
+	*(int32_t *) p = (int32_t) ((const unsigned char *) bypass - (p + 4));
+	p += 4;
+	assert( p <= code + kGuardHookOffset );
+#endif
+	
+	msync( island, kGuardIslandSize, MS_INVALIDATE );
+}
+
+/***************************************************************************//**
+	Implementation: Puts back a site's original prologue the same way it was
+	patched. Threads trapping on a staged int3 carry on through the escape
+	island, as they would have before.
+	
+	@param	site	->	The site, with no hooks left.
+	@result			<-	err_cannot_override if the prologue was patched again
+						since.
+	
+	***************************************************************************/
+
+static mach_error_t
+restoreOriginalCode(
+					OverrideSite	*site )
+{
+	PatchedPage		pages[2];
+	PrologueWrite	write;
+	size_t			pageCount = 1, i;
+	vm_size_t		pageSize;
+	Boolean			live = gLivePatching;
+	mach_error_t	err;
+	
+	if( *(volatile uint64_t *) site->code != site->patchedCode )
+		return err_cannot_override;
+	
+	err = host_page_size( mach_host_self(), &pageSize );
+	if( err )
+		return err;
+	
+	memset( pages, 0, sizeof( pages ) );
+	pages[0].address = (vm_address_t) site->code & ~(pageSize - 1);
+	pages[1].address = ((vm_address_t) site->code + sizeof( uint64_t ) - 1) & ~(pageSize - 1);
+	if( pages[1].address != pages[0].address )
+		pageCount = 2;
+	
+	memset( &write, 0, sizeof( write ) );
+	write.code = site->code;
+	write.newCode = site->originalCode;
+	write.oldFirstByte = site->code[0];
+	write.trapTarget = site->escapeIsland;
+	
+	for( i = 0; !err && i < pageCount; i++ )
+		err = makePageWritable( &pages[i], pageSize );
+	if( !err ) {
+		if( live )
+			pthread_mutex_lock( &gLivePatchLock );
+		err = stagePrologues( &write, 1, live );
+		if( !err )
+			commitPrologues( &write, 1, live );
+		if( live )
+			pthread_mutex_unlock( &gLivePatchLock );
+	}
+	
+	for( i = 0; i < pageCount; i++ ) {
+		if( pages[i].changed )
+			vm_protect( mach_task_self(), pages[i].address, pageSize, false,
+						pages[i].protection );
+	}
+	return err;
+}
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+/***************************************************************************//**
+	Implementation: Tells whether a thread inside a call made by the
+	instructions about to be replaced would return into them. A call that
+	ends the replaced range returns past it, and on i386 call +0 just reads
+	its own address.
+	
+	@param	code		->	The original function.
+	@param	eatenCount	->	Number of bytes to be replaced.
+	@result				<-	true if the prologue can't be live patched.
+	
+	***************************************************************************/
+
+static Boolean
+returnsIntoPrologue(
+					const unsigned char	*code,
+					int					eatenCount )
+{
+	X86Instruction	instruction;
+	int				offset, length;
+	
+	for( offset = 0; offset < eatenCount; offset += length ) {
+		length = x86DecodeInstruction( code + offset, kIs64BitCode, &instruction );
+		if( (instruction.flags & kX86FlagCall) && offset + length < eatenCount
+			&& !(instruction.immSize == 4 && !*(int32_t *) (code + offset + instruction.immOffset)) )
+			return true;
+	}
+	return false;
+}
+
+/***************************************************************************//**
+	Implementation: SIGTRAP handler sending threads that hit a staged int3
+	on to its redirect. Other traps go to the previous handler.
+	
+	***************************************************************************/
+
+static void
+trapHandler(
+			int			signal,
+			siginfo_t	*info,
+			void		*context )
+{
+	TrapRedirect	*redirect;
+	uintptr_t		pc = (uintptr_t) trapContextPC( context );
+	
+	//	Counted so that retireTrapRedirects() can tell when nothing is
+	//	still walking redirects it has unlinked.
+	OSAtomicIncrement32Barrier( &gTrapHandlersActive );
+	for( redirect = gTrapRedirects; redirect; redirect = redirect->next ) {
+		if( redirect->trapAddress == pc ) {
+			trapContextPC( context ) = (uintptr_t) redirect->target;
+			OSAtomicDecrement32Barrier( &gTrapHandlersActive );
+			return;
+		}
+	}
+	OSAtomicDecrement32Barrier( &gTrapHandlersActive );
+	
+	if( gPreviousTrapAction.sa_flags & SA_SIGINFO )
+		gPreviousTrapAction.sa_sigaction( signal, info, context );
+	else if( gPreviousTrapAction.sa_handler == SIG_DFL ) {
+		//	Raised again once this handler returns, with the default action.
+		sigaction( SIGTRAP, &gPreviousTrapAction, NULL );
+		raise( SIGTRAP );
+	} else if( gPreviousTrapAction.sa_handler != SIG_IGN )
+		gPreviousTrapAction.sa_handler( signal );
+}
+
+/***************************************************************************//**
+	Implementation: The pcs a thread can trap at for a staged prologue: past
+	its int3, and at the relocated second instruction, for a thread migrated
+	after it trapped.
+	
+	@param	write		->	The prologue store.
+	@param	addresses	<-	The trap addresses.
+	@result				<-	Number of addresses, 1 or 2.
+	
+	***************************************************************************/
+
+static int
+trapAddresses(
+			  const PrologueWrite	*write,
+			  uintptr_t				addresses[2] )
+{
+	addresses[0] = (uintptr_t) write->code + 1;
+	if( write->relocatedCode && write->replacedCount > 1
+		&& write->relocatedOffsets[1] != kNotABoundary ) {
+		addresses[1] = (uintptr_t) (write->relocatedCode + write->relocatedOffsets[1]);
+		return 2;
+	}
+	return 1;
+}
+
+/***************************************************************************//**
+	Implementation: Installs trapHandler(), unless it's already in place,
+	and adds a redirect for a trap address.
+	
+	@param	trapAddress	->	pc after the int3.
+	@param	target		->	Where to resume.
+	@result				<-	mach_error_t
+	
+	***************************************************************************/
+
+static mach_error_t
+addTrapRedirect(
+				uintptr_t	trapAddress,
+				const void	*target )
+{
+	struct sigaction	action;
+	TrapRedirect		*redirect;
+	
+	if( sigaction( SIGTRAP, NULL, &action ) )
+		return KERN_FAILURE;
+	if( !(action.sa_flags & SA_SIGINFO) || action.sa_sigaction != trapHandler ) {
+		memset( &action, 0, sizeof( action ) );
+		action.sa_sigaction = trapHandler;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset( &action.sa_mask );
+		if( sigaction( SIGTRAP, &action, &gPreviousTrapAction ) )
+			return KERN_FAILURE;
+	}
+	
+	redirect = calloc( 1, sizeof( TrapRedirect ) );
+	if( !redirect )
+		return KERN_RESOURCE_SHORTAGE;
+	redirect->trapAddress = trapAddress;
+	redirect->target = target;
+	redirect->next = gTrapRedirects;
+	OSMemoryBarrier();
+	gTrapRedirects = redirect;
+	return err_none;
+}
+
+/***************************************************************************//**
+	Implementation: Moves a stopped thread whose pc lies inside instructions
+	being replaced to the same instruction in their relocated copy.
+	
+	@param	thread	->	The suspended thread.
+	@param	state	<->	Its registers.
+	@param	writes	->	The prologue stores being made.
+	@param	count	->	Number of stores.
+	@result			<-	err_cannot_override if the thread stopped in the
+						middle of an instruction.
+	
+	***************************************************************************/
+
+static mach_error_t
+migrateThread(
+			  thread_act_t	thread,
+			  ThreadState	*state,
+			  PrologueWrite	*writes,
+			  size_t		count )
+{
+	uintptr_t	pc = threadStatePC( state ), offset;
+	size_t		i;
+	
+	for( i = 0; i < count; i++ ) {
+		if( !writes[i].relocatedCode || pc <= (uintptr_t) writes[i].code )
+			continue;
+		offset = pc - (uintptr_t) writes[i].code;
+		if( offset >= (uintptr_t) writes[i].replacedCount )
+			continue;
+		
+		if( writes[i].relocatedOffsets[offset] == kNotABoundary ) {
+			//	Just past the int3, waiting for its trap to be delivered.
+			if( offset == 1 )
+				continue;
+			return err_cannot_override;
+		}
+		threadStatePC( state ) = (uintptr_t) (writes[i].relocatedCode
+											  + writes[i].relocatedOffsets[offset]);
+		return thread_set_state( thread, kThreadStateFlavor, (thread_state_t) state,
+								 kThreadStateCount );
+	}
+	return err_none;
+}
+
+/***************************************************************************//**
+	Implementation: Suspends every other thread of the task in turn, which
+	takes it off its processor so that it fetches code afresh when resumed,
+	optionally migrating it out of the prologues being replaced.
+	
+	@param	writes	->	The prologue stores being made.
+	@param	count	->	Number of stores.
+	@param	visit	->	Optional, called with each stopped thread, such as
+						migrateThread(). Its first error is returned.
+	@result			<-	mach_error_t
+	
+	***************************************************************************/
+
+static mach_error_t
+synchronizeThreads(
+				   PrologueWrite	*writes,
+				   size_t			count,
+				   ThreadVisitor	visit )
+{
+	task_t					task = mach_task_self();
+	thread_act_t			self = mach_thread_self();
+	thread_act_array_t		threads = NULL;
+	mach_msg_type_number_t	threadCount = 0, i, stateCount;
+	ThreadState				state;
+	mach_error_t			err;
+	
+	err = task_threads( task, &threads, &threadCount );
+	for( i = 0; !err && i < threadCount; i++ ) {
+		if( threads[i] == self || thread_suspend( threads[i] ) != KERN_SUCCESS )
+			continue;
+		//	Getting the state waits for the thread to be off its processor.
+		stateCount = kThreadStateCount;
+		if( thread_get_state( threads[i], kThreadStateFlavor, (thread_state_t) &state,
+							  &stateCount ) == KERN_SUCCESS && visit )
+			err = visit( threads[i], &state, writes, count );
+		thread_resume( threads[i] );
+	}
+	
+	if( threads ) {
+		for( i = 0; i < threadCount; i++ )
+			mach_port_deallocate( task, threads[i] );
+		vm_deallocate( task, (vm_address_t) threads, threadCount * sizeof( thread_act_t ) );
+	}
+	mach_port_deallocate( task, self );
+	return err;
+}
+
+/***************************************************************************//**
+	Implementation: ThreadVisitor finding a thread stopped at one of the
+	writes' trap addresses, with its SIGTRAP not yet delivered.
+	
+	@result	<-	KERN_FAILURE if the thread is at a trap address.
+	
+	***************************************************************************/
+
+static mach_error_t
+findPendingTrap(
+				thread_act_t	thread,
+				ThreadState		*state,
+				PrologueWrite	*writes,
+				size_t			count )
+{
+	uintptr_t	pc = threadStatePC( state ), addresses[2];
+	size_t		i;
+	int			j, addressCount;
+	
+	(void) thread;
+	for( i = 0; i < count; i++ ) {
+		addressCount = trapAddresses( &writes[i], addresses );
+		for( j = 0; j < addressCount; j++ )
+			if( pc == addresses[j] )
+				return KERN_FAILURE;
+	}
+	return err_none;
+}
+
+/***************************************************************************//**
+	Implementation: Frees the trap redirects of committed prologue stores
+	once every thread has refetched the code and none has a trap from them
+	still to be delivered. If threads keep turning up at a trap address the
+	redirects are left in place. Called with gLivePatchLock held.
+	
+	@param	writes	->	The committed prologue stores.
+	@param	count	->	Number of stores.
+	
+	***************************************************************************/
+
+static void
+retireTrapRedirects(
+					PrologueWrite	*writes,
+					size_t			count )
+{
+	TrapRedirect	**link, *redirect, *retired = NULL;
+	uintptr_t		addresses[2];
+	size_t			i;
+	int				attempt, j, addressCount, matches;
+	
+	for( attempt = 0; attempt < kTrapRetireAttempts; attempt++ ) {
+		if( !synchronizeThreads( writes, count, findPendingTrap ) )
+			break;
+		sched_yield();
+	}
+	if( attempt == kTrapRetireAttempts )
+		return;
+	
+	for( link = (TrapRedirect **) &gTrapRedirects; (redirect = *link); ) {
+		for( i = 0, matches = 0; !matches && i < count; i++ ) {
+			addressCount = trapAddresses( &writes[i], addresses );
+			for( j = 0; j < addressCount; j++ )
+				matches |= redirect->trapAddress == addresses[j];
+		}
+		if( matches ) {
+			*link = redirect->next;
+			redirect->next = retired;
+			retired = redirect;
+		} else
+			link = &redirect->next;
+	}
+	
+	//	A handler that started before the unlink may still be reading them.
+	OSMemoryBarrier();
+	while( gTrapHandlersActive )
+		sched_yield();
+	for( ; retired; retired = redirect ) {
+		redirect = retired->next;
+		free( retired );
+	}
+}
+
+/***************************************************************************//**
+	Implementation: When live patching, stages each prologue's first byte as
+	an int3 and moves threads out of the bytes to be replaced. Once this
+	succeeds no thread runs them, and none can until the store is committed.
+	On failure the first bytes are put back. Does nothing otherwise.
+	
+	@param	writes	->	The prologue stores to stage.
+	@param	count	->	Number of stores.
+	@param	live	->	Live patching.
+	@result			<-	err_cannot_override if a thread couldn't be moved.
+	
+	***************************************************************************/
+
+static mach_error_t
+stagePrologues(
+			   PrologueWrite	*writes,
+			   size_t			count,
+			   Boolean			live )
+{
+	mach_error_t	err = err_none;
+	size_t			i;
+	
+	if( !live )
+		return err_none;
+	
+	for( i = 0; !err && i < count; i++ ) {
+		uintptr_t	addresses[2];
+		int			j, addressCount = trapAddresses( &writes[i], addresses );
+		
+		for( j = 0; !err && j < addressCount; j++ )
+			err = addTrapRedirect( addresses[j], writes[i].trapTarget );
+	}
+	if( err )
+		return err;
+	
+	OSMemoryBarrier();
+	for( i = 0; i < count; i++ )
+		*(volatile unsigned char *) writes[i].code = kTrapInstruction;
+	
+	err = synchronizeThreads( writes, count, migrateThread );
+	if( err ) {
+		for( i = 0; i < count; i++ )
+			*(volatile unsigned char *) writes[i].code = writes[i].oldFirstByte;
+		synchronizeThreads( writes, count, NULL );
+	}
+	return err;
+}
+
+/***************************************************************************//**
+	Implementation: Makes the prologue stores. When live patching, the bytes
+	behind each staged int3 are written and made visible to every thread
+	before the int3 itself is replaced; until each thread next refetches
+	the code it may still trap, and be redirected.
+	
+	@param	writes	->	The prologue stores, staged if live.
+	@param	count	->	Number of stores.
+	@param	live	->	Live patching.
+	
+	***************************************************************************/
+
+static void
+commitPrologues(
+				PrologueWrite	*writes,
+				size_t			count,
+				Boolean			live )
+{
+	size_t	i;
+	
+	if( !live ) {
+		for( i = 0; i < count; i++ )
+			atomic_mov64( (uint64_t *) writes[i].code, writes[i].newCode );
+		return;
+	}
+	
+	for( i = 0; i < count; i++ )
+		atomic_mov64( (uint64_t *) writes[i].code,
+					  (writes[i].newCode & ~0xFFULL) | kTrapInstruction );
+	synchronizeThreads( writes, count, NULL );
+	for( i = 0; i < count; i++ )
+		*(volatile unsigned char *) writes[i].code = (unsigned char) writes[i].newCode;
+	retireTrapRedirects( writes, count );
+}
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+/***************************************************************************//**
+	Implementation: Builds the escape and reentry islands for one override
+	and the jump that will replace its prologue, without touching the
+	original code.
+	
+	@param	pending				<-	The prepared override.
+	@param	entry				->	What to override, with what.
+	@param	dispatchThroughSlot	->	Make the escape island jump through its
+									slot, aimed at the reentry island for now.
+	@param	live				->	Prepare for live patching: always build the
+									reentry island, which stopped threads are
+									moved into.
+	@result						<-	err_cannot_override if the prologue can't be
+									patched.
+	
+	***************************************************************************/
+
+static mach_error_t
+prepareOverride(
+				PendingOverride			*pending,
+				mach_override_entry_t	*entry,
+				Boolean					dispatchThroughSlot,
+				Boolean					live )
+{
+	assert( entry->originalFunctionAddress );
+	assert( entry->overrideFunctionAddress );
+	
+	mach_error_t	err = err_none;
+	unsigned char	*code = (unsigned char *) entry->originalFunctionAddress;
+	
+	pending->code = code;
+	if( !eatKnownInstructions( code, &pending->jumpRelativeInstruction,
+							   &pending->eatenCount, pending->originalInstructions )
+		|| pending->eatenCount > kOriginalInstructionsSize )
+		err = err_cannot_override;
+	if( !err && live && returnsIntoPrologue( code, pending->eatenCount ) )
+		err = err_cannot_override;
+	
+	//	Allocate and target the escape island to the overriding function.
+	if( !err )
+		err = allocateBranchIsland( &pending->escapeIsland, kAllocateHigh, code );
+	if( !err && !dispatchThroughSlot )
+		err = setBranchIslandTarget_i386( pending->escapeIsland,
+										  entry->overrideFunctionAddress, NULL, 0, NULL );
+	
+	// Build the jump relative instruction to the escape island
+	if( !err ) {
+		uint32_t addressOffset = ((char*)pending->escapeIsland - (char*)code - 5);
+		addressOffset = OSSwapInt32(addressOffset);
+		
+		uint64_t jumpRelativeInstruction = pending->jumpRelativeInstruction;
+		jumpRelativeInstruction |= 0xE900000000000000LL; 
+		jumpRelativeInstruction |= ((uint64_t)addressOffset & 0xffffffff) << 24;
+		pending->jumpRelativeInstruction = OSSwapInt64(jumpRelativeInstruction);
+	}
+	
+	//	Optionally allocate the reentry island, holding the original
+	//	instructions and targeted at the first one not replaced.
+	if( !err && (entry->originalFunctionReentryIsland || dispatchThroughSlot || live) ) {
+#if defined(__x86_64__)
+		//	Keep the island within rel32 reach of the original function so
+		//	that relocated pc-relative instructions and the jump back stay
+		//	short.
+		err = allocateBranchIsland( &pending->reentryIsland, kAllocateHigh, code );
+#else
+		err = allocateBranchIsland( &pending->reentryIsland, kAllocateNormal, NULL );
+#endif
+		if( !err )
+			err = setBranchIslandTarget_i386( pending->reentryIsland,
+											  code + pending->eatenCount,
+											  (unsigned char *) pending->originalInstructions,
+											  pending->eatenCount, pending->relocatedOffsets );
+	}
+	
+	if( !err && dispatchThroughSlot )
+		setBranchIslandSlot( pending->escapeIsland, pending->reentryIsland );
+	
+	if( err ) {
+		if( pending->reentryIsland )
+			freeBranchIsland( pending->reentryIsland );
+		if( pending->escapeIsland )
+			freeBranchIsland( pending->escapeIsland );
+		pending->reentryIsland = pending->escapeIsland = NULL;
+	}
+	
+	return err;
+}
+
+static int
+comparePendingOverrides(
+						const void	*a,
+						const void	*b )
+{
+	const unsigned char *codeA = (*(PendingOverride * const *) a)->code;
+	const unsigned char *codeB = (*(PendingOverride * const *) b)->code;
+	
+	return codeA < codeB ? -1 : codeA > codeB;
+}
+
+/***************************************************************************//**
+	Implementation: Makes a page of original code writable (copy-on-write,
+	so that shared library pages stay pristine in other processes) and
+	records its protection so that it can be restored.
+	
+	@param	page		<->	The page; protection and changed are filled in.
+	@param	pageSize	->	The VM page size.
+	@result				<-	mach_error_t
+	
+	***************************************************************************/
+
+static mach_error_t
+makePageWritable(
+				 PatchedPage	*page,
+				 vm_size_t		pageSize )
 {
-    // Copy over the template code.
-    bcopy( kIslandTemplate, island->instructions, sizeof( kIslandTemplate ) );
+	vm_map_t						task = mach_task_self();
+	vm_address_t					regionAddress = page->address;
+	vm_size_t						regionSize;
+	vm_region_basic_info_data_64_t	info;
+	mach_msg_type_number_t			count = VM_REGION_BASIC_INFO_COUNT_64;
+	mach_port_t						object;
+	mach_error_t					err;
 	
-    // Copy original instructions.
-    if (instructions) {
-        bcopy (instructions, island->instructions, kOriginalInstructionsSize);
-    }
+	if( vm_region_64( task, &regionAddress, &regionSize, VM_REGION_BASIC_INFO_64,
+					  (vm_region_info_t) &info, &count, &object ) == KERN_SUCCESS
+		&& regionAddress <= page->address )
+		page->protection = info.protection;
+	else
+		page->protection = VM_PROT_READ | VM_PROT_EXECUTE;
 	
-    //	Fill in the address.
-    *((uint64_t *)(island->instructions + kJumpAddress)) = (uint64_t)branchTo; 
-    msync( island->instructions, sizeof( kIslandTemplate ), MS_INVALIDATE );
+	err = vm_protect( task, page->address, pageSize, false, (VM_PROT_ALL | VM_PROT_COPY) );
+	if( err )
+		err = vm_protect( task, page->address, pageSize, false,
+						  (VM_PROT_DEFAULT | VM_PROT_COPY) );
+	if( !err )
+		page->changed = true;
 	
-    return err_none;
+	return err;
 }
 #endif
 
+/***************************************************************************//**
+	Implementation: Computes the address range a slab must lie in for its
+	islands to be reachable from nearAddress.
+	
+	***************************************************************************/
 
-#if defined(__i386__) || defined(__x86_64__)
-// simplistic instruction matching
-typedef struct {
-	unsigned int length; // max 15
-	unsigned char mask[15]; // sequence of bytes in memory order
-	unsigned char constraint[15]; // sequence of bytes in memory order
-}	AsmInstructionMatch;
+static void
+islandWindow(
+			 void			*nearAddress,
+			 vm_address_t	*lowest,
+			 vm_address_t	*highest )
+{
+#if defined(__x86_64__)
+	//	rel32 reaches +/-2 GB from the end of the jump; keep a page of slack.
+	vm_address_t near = (vm_address_t) nearAddress;
+	vm_address_t reach = 0x80000000ULL - 0x1000;
+	*lowest = near > reach ? near - reach : 0x1000;
+	*highest = near < (vm_address_t)-1 - reach ? near + reach : (vm_address_t)-1;
+#elif defined(__ppc__) || defined(__POWERPC__)
+	//	ba reaches the top 32 MB of the address space.
+	*lowest = 0xfe000000;
+	*highest = 0xfffff000;
+#else
+	*lowest = 0x1000;
+	*highest = (vm_address_t)-1;
+#endif
+}
+
+static Boolean
+islandSlabReaches(
+				  IslandSlab	*slab,
+				  void		*nearAddress )
+{
+	vm_address_t lowest, highest;
+	
+	if( !nearAddress )
+		return true;
+	islandWindow( nearAddress, &lowest, &highest );
+	return slab->base >= lowest && slab->base + slab->size <= highest;
+}
+
+/***************************************************************************//**
+	Implementation: Finds an unmapped range of the given size as close as
+	possible to a target address, with a single ascending walk of the task's
+	VM map.
+	
+	@param	target		->	Address to stay close to.
+	@param	size		->	Size of the range, a multiple of the page size.
+	@param	lowest		->	Lowest acceptable start address.
+	@param	highest		->	Highest acceptable end address.
+	@param	address		<-	Start of the free range.
+	@result				<-	KERN_NO_SPACE if no gap in [lowest, highest) fits.
+	
+	***************************************************************************/
+
+static mach_error_t
+findFreeRegionNear(
+				   vm_address_t	target,
+				   vm_size_t		size,
+				   vm_address_t	lowest,
+				   vm_address_t	highest,
+				   vm_address_t	*address )
+{
+	vm_map_t		task = mach_task_self();
+	vm_address_t	gapStart = lowest;
+	vm_address_t	regionAddress = lowest;
+	vm_address_t	best = 0;
+	vm_size_t		bestDistance = (vm_size_t)-1;
+	
+	for( ;; ) {
+		vm_size_t						regionSize = 0;
+		vm_region_basic_info_data_64_t	info;
+		mach_msg_type_number_t			count = VM_REGION_BASIC_INFO_COUNT_64;
+		mach_port_t						object;
+		vm_address_t					gapEnd;
+		kern_return_t					kr;
+		
+		kr = vm_region_64( task, &regionAddress, &regionSize, VM_REGION_BASIC_INFO_64,
+						   (vm_region_info_t) &info, &count, &object );
+		gapEnd = (kr || regionAddress > highest) ? highest : regionAddress;
+		
+		//	Consider the gap [gapStart, gapEnd) below this region.
+		if( gapEnd > gapStart && gapEnd - gapStart >= size ) {
+			vm_address_t candidate;
+			if( target < gapStart )
+				candidate = gapStart;
+			else if( target + size > gapEnd )
+				candidate = gapEnd - size;
+			else
+				candidate = target;
+			vm_size_t distance = candidate > target ? candidate - target : target - candidate;
+			if( distance < bestDistance ) {
+				best = candidate;
+				bestDistance = distance;
+			}
+		}
+		
+		//	Regions come in ascending order; later gaps only get farther.
+		if( kr || gapEnd >= highest
+			|| (best && gapEnd >= target && gapEnd - target >= bestDistance) )
+			break;
+		gapStart = regionAddress + regionSize;
+		regionAddress = gapStart;
+		if( gapStart < regionSize )
+			break;	//	wrapped around the top of the address space
+	}
+	
+	if( bestDistance == (vm_size_t)-1 )
+		return KERN_NO_SPACE;
+	*address = best;
+	return err_none;
+}
+
+/***************************************************************************//**
+	Implementation: Maps a new executable slab of branch islands, near
+	nearAddress when one is given.
+	
+	@param	nearAddress	->	Optional address the slab must be within rel32
+							reach of (x86_64) or the high branch absolute
+							range (ppc). Can be NULL.
+	@param	slab		<-	The new slab.
+	@result				<-	mach_error_t
+	
+	***************************************************************************/
+
+static mach_error_t
+allocateIslandSlab(
+				   void			*nearAddress,
+				   IslandSlab		**slab )
+{
+	vm_map_t		task = mach_task_self();
+	vm_size_t		pageSize;
+	vm_address_t	address = 0;
+	mach_error_t	err = host_page_size( mach_host_self(), &pageSize );
+	vm_size_t		size = kIslandSlabPages * pageSize;
+	int				attempts;
+	
+	if( err )
+		return err;
+	assert( sizeof( BranchIsland ) <= pageSize );
+	
+	if( !nearAddress ) {
+		err = vm_allocate( task, &address, size, VM_FLAGS_ANYWHERE );
+	} else for( attempts = 0; attempts < 4; attempts++ ) {
+		vm_address_t lowest, highest, target;
+		islandWindow( nearAddress, &lowest, &highest );
+		target = (vm_address_t) nearAddress & ~(pageSize - 1);
+		err = findFreeRegionNear( target, size, lowest, highest, &address );
+		if( !err )
+			err = vm_allocate( task, &address, size, VM_FLAGS_FIXED );
+		//	Another thread may have taken the gap since the walk; retry.
+		if( err != KERN_NO_SPACE || attempts == 3 )
+			break;
+	}
+	
+	if( !err ) {
+		err = vm_protect( task, address, size, false, VM_PROT_ALL );
+		if( err )
+			vm_deallocate( task, address, size );
+	}
+	
+	if( !err ) {
+		IslandSlab *newSlab = calloc( 1, sizeof( IslandSlab ) );
+		if( !newSlab ) {
+			vm_deallocate( task, address, size );
+			return KERN_RESOURCE_SHORTAGE;
+		}
+		newSlab->base = address;
+		newSlab->size = size;
+		newSlab->capacity = size / kIslandSlotSize;
+		newSlab->next = gIslandSlabs;
+		gIslandSlabs = newSlab;
+		*slab = newSlab;
+	}
+	
+	return err;
+}
+
+/***************************************************************************//**
+	Implementation: Allocates memory for a branch island. Islands are carved
+	out of executable slabs, so that thousands of them share a few pages.
+	
+	@param	island					<-	The allocated island.
+	@param	allocateHigh			->	Whether the island must be reachable from
+										originalFunctionAddress: within rel32 reach
+										on x86_64, at the end of the address space
+										(for use with the branch absolute
+										instruction) on ppc.
+	@param	originalFunctionAddress	->	The function the island belongs to.
+	@result							<-	mach_error_t
+	
+	***************************************************************************/
 
+mach_error_t
+allocateBranchIsland(
+					 BranchIsland	**island,
+					 int				allocateHigh,
+					 void *originalFunctionAddress)
+{
+	assert( island );
+	
+	mach_error_t	err = err_none;
+	void			*nearAddress = allocateHigh ? originalFunctionAddress : NULL;
+	IslandSlab		*slab;
+	
 #if defined(__i386__)
-static AsmInstructionMatch possibleInstructions[] = {
-	{ 0x1, {0xFF}, {0x90} },							// nop
-	{ 0x1, {0xFF}, {0x55} },							// push %esp
-	{ 0x2, {0xFF, 0xFF}, {0x89, 0xE5} },				                // mov %esp,%ebp
-	{ 0x1, {0xFF}, {0x53} },							// push %ebx
-	{ 0x3, {0xFF, 0xFF, 0x00}, {0x83, 0xEC, 0x00} },	                        // sub 0x??, %esp
-	{ 0x1, {0xFF}, {0x57} },							// push %edi
-	{ 0x1, {0xFF}, {0x56} },							// push %esi
-	
-	// added by Tanaris4!
-	{ 0x3, {0xFF, 0x00, 0x00}, {0x8B, 0x00, 0x00} },							// mov eax, [ebp+arg_0]
-	{ 0x5, {0xFF, 0x00, 0x00, 0x00, 0x00}, {0xA1, 0x00, 0x00, 0x00, 0x00} },	// mov %eax, dword_
-	{ 0x5, {0xFF, 0x00, 0x00, 0x00, 0x00}, {0xB9, 0x00, 0x00, 0x00, 0x00} },	// call    $+5
-	{ 0x5, {0xFF, 0x00, 0x00, 0x00, 0x00}, {0xA1, 0x00, 0x00, 0x00, 0x00} },	// mov     ecx, offset byte_B33150
-
-	{ 0x5, {0xFF, 0x00, 0x00, 0x00, 0x00}, {0x83, 0x00, 0x00, 0x00, 0x00} },	// add     [esp+arg_0], 0FFFFFFF8h
-
-	
-	{ 0x6, {0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00}, {0x81, 0xEC, 0x00, 0x00, 0x00, 0x00} },	//sub     esp, 0C8h
-	{ 0x2, {0xFF, 0x00}, {0x31, 0x00} },			// xor edi edi
-	{ 0x2, {0xFF, 0xFF}, {0x89, 0xC7} },				                // mov     edi, eax
-	{ 0x5, {0xFF, 0x00, 0x00, 0x00, 0x00}, {0xBA, 0x00, 0x00, 0x00, 0x00} },	// mov     edx, 1
-	{ 0x0 }
-};
-#elif defined(__x86_64__)
-static AsmInstructionMatch possibleInstructions[] = {
-	{ 0x1, {0xFF}, {0x90} },							// nop
-	{ 0x1, {0xF8}, {0x50} },							// push %rX
-	{ 0x3, {0xFF, 0xFF, 0xFF}, {0x48, 0x89, 0xE5} },				// mov %rsp,%rbp
-	{ 0x4, {0xFF, 0xFF, 0xFF, 0x00}, {0x48, 0x83, 0xEC, 0x00} },	                // sub 0x??, %rsp
-	{ 0x4, {0xFB, 0xFF, 0x00, 0x00}, {0x48, 0x89, 0x00, 0x00} },	                // move onto rbp
-	{ 0x2, {0xFF, 0x00}, {0x41, 0x00} },						// push %rXX
-	{ 0x2, {0xFF, 0x00}, {0x85, 0x00} },						// test %rX,%rX
-	{ 0x0 }
-};
+	//	rel32 wraps around the 32-bit address space: any slab will do.
+	nearAddress = NULL;
+#elif defined(__ppc__) || defined(__POWERPC__)
+	if( allocateHigh )
+		nearAddress = (void*) 0xfeffffff;
 #endif
+	
+	pthread_mutex_lock( &gIslandLock );
+	
+	for( slab = gIslandSlabs; slab; slab = slab->next ) {
+		if( (slab->freeList || slab->bumped < slab->capacity)
+			&& islandSlabReaches( slab, nearAddress ) )
+			break;
+	}
+	if( !slab )
+		err = allocateIslandSlab( nearAddress, &slab );
+	
+	if( !err ) {
+		BranchIsland *newIsland;
+		if( slab->freeList ) {
+			newIsland = slab->freeList;
+			slab->freeList = *(BranchIsland **) newIsland;
+		} else {
+			newIsland = (BranchIsland *) (slab->base + slab->bumped * kIslandSlotSize);
+			slab->bumped++;
+		}
+		slab->used++;
+		newIsland->allocatedHigh = allocateHigh;
+		*island = newIsland;
+	}
+	
+	pthread_mutex_unlock( &gIslandLock );
+	
+	return err;
+}
+
+/***************************************************************************//**
+	Implementation: Returns a branch island to its slab. Slabs are kept
+	mapped for reuse.
+	
+	@param	island	->	The island to deallocate.
+	@result			<-	mach_error_t
+	
+	***************************************************************************/
 
-static Boolean codeMatchesInstruction(unsigned char *code, AsmInstructionMatch* instruction) 
+mach_error_t
+freeBranchIsland(
+				 BranchIsland	*island )
 {
-	Boolean match = true;
+	assert( island );
 	
-	int i;
-	for (i=0; i<instruction->length; i++) {
-		unsigned char mask = instruction->mask[i];
-		unsigned char constraint = instruction->constraint[i];
-		unsigned char codeValue = code[i];
-		
-		match = ((codeValue & mask) == constraint);
-		if (!match) break;
+	mach_error_t	err = KERN_INVALID_ADDRESS;
+	IslandSlab		*slab;
+	
+	pthread_mutex_lock( &gIslandLock );
+	for( slab = gIslandSlabs; slab; slab = slab->next ) {
+		if( (vm_address_t) island >= slab->base
+			&& (vm_address_t) island < slab->base + slab->size ) {
+			*(BranchIsland **) island = slab->freeList;
+			slab->freeList = island;
+			slab->used--;
+			err = err_none;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &gIslandLock );
+	
+	assert( !err );
+	return err;
+}
+
+/***************************************************************************//**
+																			  Implementation: Sets the branch island's target, with an optional
+																			  instruction.
+																			  
+																			  @param	island		->	The branch island to insert target into.
+																			  @param	branchTo	->	The address of the target.
+																			  @param	instruction	->	Optional instruction to execute prior to branch. Set
+																			  to zero for nop.
+																			  @result				<-	mach_error_t
+																			  
+																			  ***************************************************************************/
+#if defined(__ppc__) || defined(__POWERPC__)
+mach_error_t
+setBranchIslandTarget(
+					  BranchIsland	*island,
+					  const void		*branchTo,
+					  long			instruction )
+{
+	//	Copy over the template code.
+    bcopy( kIslandTemplate, island->instructions, sizeof( kIslandTemplate ) );
+    
+    //	Fill in the address.
+    ((short*)island->instructions)[kAddressLo] = ((long) branchTo) & 0x0000FFFF;
+    ((short*)island->instructions)[kAddressHi]
+	= (((long) branchTo) >> 16) & 0x0000FFFF;
+    
+    //	Fill in the (optional) instuction.
+    if( instruction != 0 ) {
+        ((short*)island->instructions)[kInstructionLo]
+		= instruction & 0x0000FFFF;
+        ((short*)island->instructions)[kInstructionHi]
+		= (instruction >> 16) & 0x0000FFFF;
+    }
+    
+    //MakeDataExecutable( island->instructions, sizeof( kIslandTemplate ) );
+	msync( island->instructions, sizeof( kIslandTemplate ), MS_INVALIDATE );
+    
+    return err_none;
+}
+#endif 
+
+#if defined(__i386__) || defined(__x86_64__)
+/***************************************************************************//**
+	Implementation: Relocates the original instructions into the island and,
+	when they don't fill it, jumps over the remaining nop padding.
+	
+	@param	island				->	The branch island, already holding the
+									template code.
+	@param	branchTo			->	Address just past the original
+									instructions.
+	@param	instructions		->	Copy of the original instructions.
+	@param	instructionsCount	->	Number of bytes to relocate.
+	@param	relocatedOffsets	<-	Optional map of where each instruction
+									went (see relocateInstructions()).
+	@result						<-	mach_error_t
+	
+	***************************************************************************/
+
+static mach_error_t
+copyOriginalInstructions(
+						 BranchIsland	*island,
+						 const void		*branchTo,
+						 const unsigned char	*instructions,
+						 int				instructionsCount,
+						 unsigned char	*relocatedOffsets )
+{
+	unsigned char *destination = (unsigned char *) island->instructions + kInstructions;
+	int relocatedCount = 0;
+	mach_error_t err = relocateInstructions( instructions, instructionsCount,
+											 (const unsigned char *)branchTo - instructionsCount,
+											 destination, kOriginalInstructionsSize, &relocatedCount,
+											 relocatedOffsets );
+	
+	//	Skip the nop sled rather than execute it.
+	if( !err && kOriginalInstructionsSize - relocatedCount > 2 ) {
+		destination[relocatedCount] = 0xEB;
+		destination[relocatedCount+1] = kOriginalInstructionsSize - relocatedCount - 2;
+	}
+	return err;
+}
+#endif
+
+#if defined(__i386__)
+mach_error_t
+setBranchIslandTarget_i386(
+						   BranchIsland	*island,
+						   const void		*branchTo,
+						   const unsigned char	*instructions,
+						   int				instructionsCount,
+						   unsigned char	*relocatedOffsets )
+{
+	
+	//	Copy over the template code.
+    bcopy( kIslandTemplate, island->instructions, sizeof( kIslandTemplate ) );
+	
+	// relocate original instructions
+	if (instructions) {
+		mach_error_t err = copyOriginalInstructions( island, branchTo, instructions, instructionsCount,
+													 relocatedOffsets );
+		if (err)
+			return err;
 	}
 	
-	return match;
+    // Fill in the address.
+    int32_t addressOffset = (char *)branchTo - (island->instructions + kJumpAddress + 4);
+    *((int32_t *)(island->instructions + kJumpAddress)) = addressOffset; 
+	
+    msync( island->instructions, sizeof( kIslandTemplate ), MS_INVALIDATE );
+    return err_none;
+}
+
+#elif defined(__x86_64__)
+mach_error_t
+setBranchIslandTarget_i386(
+						   BranchIsland	*island,
+						   const void		*branchTo,
+						   const unsigned char	*instructions,
+						   int				instructionsCount,
+						   unsigned char	*relocatedOffsets )
+{
+    // Copy over the template code.
+    bcopy( kIslandTemplate, island->instructions, sizeof( kIslandTemplate ) );
+	
+    // Relocate original instructions.
+    if (instructions) {
+        mach_error_t err = copyOriginalInstructions( island, branchTo, instructions, instructionsCount,
+													 relocatedOffsets );
+        if (err)
+            return err;
+    }
+	
+    //	Fill in the jump: rel32 when the target is within reach of the island,
+    //	jmp *0(%rip) through the inline address otherwise.
+    emitBranch( (unsigned char *) island->instructions + kOriginalInstructionsSize,
+                (intptr_t) (island->instructions + kOriginalInstructionsSize),
+                (intptr_t) branchTo, false );
+    msync( island->instructions, sizeof( kIslandTemplate ), MS_INVALIDATE );
+	
+    return err_none;
 }
+#endif
+
 
 #if defined(__i386__) || defined(__x86_64__)
+// 16-bit relative branches truncate the instruction pointer and can't be relocated.
+static Boolean
+instructionIsMovable( const X86Instruction *instruction )
+{
+	return !((instruction->flags & kX86FlagRelativeBranch) && instruction->immSize == 2);
+}
+
 static Boolean 
 eatKnownInstructions( 
 					 unsigned char *code, 
@@ -627,26 +2353,24 @@ eatKnownInstructions(
 	
 	if (howManyEaten) *howManyEaten = 0;
 	while (remainsToEat > 0) {
-		Boolean curInstructionKnown = false;
-		
-		// See if instruction matches one  we know
-		AsmInstructionMatch* curInstr = possibleInstructions;
-		do { 
-			if (curInstructionKnown = codeMatchesInstruction(ptr, curInstr)) break;
-			curInstr++;
-		} while (curInstr->length > 0);
+		X86Instruction instruction;
+		int eaten = x86DecodeInstruction(ptr, kIs64BitCode, &instruction);
 		
-		// if all instruction matches failed, we don't know current instruction then, stop here
-		if (!curInstructionKnown) { 
+		// if we can't decode the current instruction, or can't move it, stop here
+		if (!eaten || !instructionIsMovable(&instruction)) { 
 			allInstructionsKnown = false;
 			break;
 		}
 		
-		// At this point, we've matched curInstr
-		int eaten = curInstr->length;
 		ptr += eaten;
 		remainsToEat -= eaten;
 		totalEaten += eaten;
+		
+		// whatever follows a ret or jmp may not belong to this function
+		if ((instruction.flags & kX86FlagEndsFlow) && remainsToEat > 0) {
+			allInstructionsKnown = false;
+			break;
+		}
 	}
 	
 	
@@ -677,14 +2401,232 @@ eatKnownInstructions(
 	
 	return allInstructionsKnown;
 }
+
+// Computes the rel32 displacement from "from" to "target", if it reaches.
+static Boolean
+displacementFits(
+				 intptr_t	from,
+				 intptr_t	target,
+				 int32_t	*displacement )
+{
+	int64_t delta = (int64_t)target - (int64_t)from;
+#if defined(__i386__)
+	//	rel32 wraps around the 4 GB address space.
+	*displacement = (int32_t)(uint32_t)delta;
+	return true;
+#else
+	*displacement = (int32_t)delta;
+	return delta == (int64_t)*displacement;
+#endif
+}
+
+/***************************************************************************//**
+	Implementation: Writes a jump (or call) from an island address to an
+	arbitrary target, using rel32 when it reaches and an indirect jump
+	through an inline 64-bit literal otherwise.
+	
+	@param	buffer	<-	Where the instruction bytes are written.
+	@param	from	->	Address the instruction will execute at.
+	@param	target	->	Address to branch to.
+	@param	isCall	->	Emit a call rather than a jump.
+	@result			<-	Number of bytes written.
+	
+	***************************************************************************/
+
+static int
+emitBranch(
+		   unsigned char	*buffer,
+		   intptr_t		from,
+		   intptr_t		target,
+		   Boolean			isCall )
+{
+	int32_t displacement;
+	
+	if( displacementFits( from + 5, target, &displacement ) ) {
+		buffer[0] = isCall ? 0xE8 : 0xE9;
+		*(int32_t *)(buffer + 1) = displacement;
+		return 5;
+	}
+	
+	//	call *2(%rip); jmp +8; .quad target	- or -	jmp *0(%rip); .quad target
+	buffer[0] = 0xFF;
+	buffer[1] = isCall ? 0x15 : 0x25;
+	*(int32_t *)(buffer + 2) = isCall ? 2 : 0;
+	if( isCall ) {
+		buffer[6] = 0xEB;
+		buffer[7] = 0x08;
+		*(uint64_t *)(buffer + 8) = (uint64_t)target;
+		return 16;
+	}
+	*(uint64_t *)(buffer + 6) = (uint64_t)target;
+	return 14;
+}
+
+/***************************************************************************//**
+	Implementation: Re-encodes one pc-relative branch so that it reaches the
+	same target from its new address, widening rel8 forms to rel32 and out
+	of range rel32 forms to absolute indirect branches.
+	
+	@param	instruction	->	Decoded original instruction.
+	@param	code		->	Original instruction bytes.
+	@param	target		->	Absolute branch target.
+	@param	from		->	Address the rewritten instruction will execute at.
+	@param	buffer		<-	Rewritten instruction bytes (at least 20 bytes).
+	@result				<-	Number of bytes written, 0 if it can't be relocated.
+	
+	***************************************************************************/
+
+static int
+relocateBranch(
+			   const X86Instruction	*instruction,
+			   const unsigned char	*code,
+			   intptr_t				target,
+			   intptr_t				from,
+			   unsigned char			*buffer )
+{
+	int32_t displacement;
+	unsigned char opcode = instruction->opcode;
+	
+	if( instruction->flags & kX86FlagNoRel32Form ) {
+		//	loop/jcxz +2; jmp +n; jmp target
+		int prefixes = instruction->opcodeOffset;
+		bcopy( code, buffer, prefixes + 1 );
+		buffer[prefixes+1] = 2;
+		int length = emitBranch( buffer + prefixes + 4, from + prefixes + 4, target, false );
+		buffer[prefixes+2] = 0xEB;
+		buffer[prefixes+3] = length;
+		return prefixes + 4 + length;
+	}
+	
+	if( instruction->flags & kX86FlagConditional ) {
+		int condition = opcode & 0x0F;
+		if( displacementFits( from + 6, target, &displacement ) ) {
+			buffer[0] = 0x0F;
+			buffer[1] = 0x80 | condition;
+			*(int32_t *)(buffer + 2) = displacement;
+			return 6;
+		}
+		//	j!cc +14; jmp *0(%rip); .quad target
+		buffer[0] = 0x70 | (condition ^ 1);
+		buffer[1] = 14;
+		return 2 + emitBranch( buffer + 2, from + 2, target, false );
+	}
+	
+	return emitBranch( buffer, from, target, (instruction->flags & kX86FlagCall) != 0 );
+}
+
+/***************************************************************************//**
+	Implementation: Copies instructions to a new address, rewriting
+	rip-relative operands and relative branches so that they still reach
+	their original targets.
+	
+	@param	instructions		->	Copy of the original instructions.
+	@param	instructionsCount	->	Number of bytes to relocate.
+	@param	originalAddress		->	Address the instructions were taken from.
+	@param	destination			<-	Where the relocated instructions go.
+	@param	capacity			->	Space available at destination.
+	@param	relocatedCount		<-	Number of bytes written to destination.
+	@param	relocatedOffsets	<-	Optional map from each original offset to
+									where that instruction went, or
+									kNotABoundary. instructionsCount entries.
+	@result						<-	err_cannot_override if an instruction can't
+									be relocated or doesn't fit.
+	
+	***************************************************************************/
+
+static mach_error_t
+relocateInstructions(
+					 const unsigned char	*instructions,
+					 int					instructionsCount,
+					 const unsigned char	*originalAddress,
+					 unsigned char		*destination,
+					 int					capacity,
+					 int					*relocatedCount,
+					 unsigned char		*relocatedOffsets )
+{
+	int in = 0, out = 0;
+	
+	if( relocatedOffsets )
+		memset( relocatedOffsets, kNotABoundary, instructionsCount );
+	while( in < instructionsCount ) {
+		X86Instruction instruction;
+		const unsigned char *code = instructions + in;
+		intptr_t pc = (intptr_t)(originalAddress + in);
+		intptr_t from = (intptr_t)(destination + out);
+		unsigned char buffer[kX86MaxInstructionLength + 16];
+		int32_t displacement;
+		int length = x86DecodeInstruction( code, kIs64BitCode, &instruction );
+		int emitted = length;
+		
+		if( !length || in + length > instructionsCount )
+			return err_cannot_override;
+		bcopy( code, buffer, length );
+		
+		if( instruction.flags & kX86FlagRelativeBranch ) {
+			int32_t relative = instruction.immSize == 1
+				? *(int8_t *)(code + instruction.immOffset)
+				: *(int32_t *)(code + instruction.immOffset);
+			intptr_t target = pc + length + relative;
+			
+			//	Branching back into the bytes replaced by our jump can't work.
+			if( target >= (intptr_t)originalAddress
+				&& target < (intptr_t)originalAddress + instructionsCount
+				&& !((instruction.flags & kX86FlagCall) && target == pc + length) )
+				return err_cannot_override;
+			
+#if defined(__i386__)
+			if( instruction.flags & kX86FlagCall ) {
+				//	push the original return address, then jmp: pic code
+				//	(call +0; pop %reg, or a call to __i686.get_pc_thunk)
+				//	takes its base from the return address.
+				buffer[0] = 0x68;
+				*(int32_t *)(buffer + 1) = (int32_t)(pc + length);
+				emitted = 5;
+				if( target != pc + length )
+					emitted += emitBranch( buffer + 5, from + 5, target, false );
+			} else
 #endif
+			emitted = relocateBranch( &instruction, code, target, from, buffer );
+		} else if( instruction.flags & kX86FlagRIPRelative ) {
+			intptr_t target = pc + length + *(int32_t *)(code + instruction.dispOffset);
+			
+			if( displacementFits( from + length, target, &displacement ) ) {
+				*(int32_t *)(buffer + instruction.dispOffset) = displacement;
+			} else if( instruction.opcodeLength == 1 && instruction.opcode == 0x8D
+					   && (instruction.rex & 0x08) ) {
+				//	lea target(%rip), %reg  ->  movabs $target, %reg
+				int reg = ((instruction.modrm >> 3) & 7) | ((instruction.rex & 0x04) << 1);
+				buffer[0] = 0x48 | (reg >> 3);
+				buffer[1] = 0xB8 | (reg & 7);
+				*(uint64_t *)(buffer + 2) = (uint64_t)target;
+				emitted = 10;
+			} else
+				return err_cannot_override;
+		}
+		
+		if( !emitted || out + emitted > capacity )
+			return err_cannot_override;
+		bcopy( buffer, destination + out, emitted );
+		if( relocatedOffsets )
+			relocatedOffsets[in] = out;
+		in += length;
+		out += emitted;
+	}
+	
+	*relocatedCount = out;
+	return err_none;
+}
 
 #if defined(__i386__)
+#define	ASM_STRING2( x )	#x
+#define	ASM_STRING( x )		ASM_STRING2( x )
+#define	ASM_SYMBOL( name )	ASM_STRING( __USER_LABEL_PREFIX__ ) #name
+
 asm(		
 	".text;"
 	".align 2, 0x90;"
-	".globl _atomic_mov64;"
-	"_atomic_mov64:;"
+	".globl " ASM_SYMBOL( atomic_mov64 ) ";"
+	ASM_SYMBOL( atomic_mov64 ) ":;"
 	"	pushl %ebp;"
 	"	movl %esp, %ebp;"
 	"	pushl %esi;"
@@ -716,11 +2658,18 @@ asm(
 	"	ret"
 	);
 #elif defined(__x86_64__)
+//	Prologues needn't be aligned: a plain store straddling a cache line can be
+//	seen half done, a locked cmpxchg can't.
 void atomic_mov64(
 				  uint64_t *targetAddress,
 				  uint64_t value )
 {
-    *targetAddress = value;
+	int64_t	current;
+	
+	do
+		current = *(volatile int64_t *) targetAddress;
+	while( !OSAtomicCompareAndSwap64Barrier( current, (int64_t) value,
+											 (volatile int64_t *) targetAddress ) );
 }
 #endif
 #endif
\ No newline at end of file
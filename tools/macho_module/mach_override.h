@@ -29,6 +29,8 @@
 																			  island allocations when they number over 250. Then again, if you're
 																			  overriding more than 250 functions, maybe speed isn't your main
 																			  concern...
+																			  Update: islands are now packed into slabs of executable pages, placed
+																			  near their function with a single walk of the VM map.
 																			  @todo	Add detection of: b, bl, bla, bc, bcl, bcla, bcctrl, bclrl
 																			  first-instructions. Initially, we should refuse to override
 																			  functions beginning with these instructions. Eventually, we should
@@ -38,6 +40,8 @@
 																			  complete rewrite under the covers, because the target address can't
 																			  be spread across two load instructions like it is now since it will
 																			  need to be atomically updatable.
+																			  Update: done for x86 via mach_override_hook(). Hooks dispatch through
+																			  pointer slots in their islands that are updated with a single store.
 																			  @todo	Add non-rentry variants of overrides to test_mach_override.
 																			  
 																			  ***************************************************************************/
@@ -46,7 +50,11 @@
 #define		_mach_override_
 
 #include <sys/types.h>
+#if defined(__linux__)
+#include "mach_linux.h"
+#else
 #include <mach/error.h>
+#endif
 
 #ifdef	__cplusplus
 extern	"C"	{
@@ -83,6 +91,8 @@ extern	"C"	{
 																				  original function's
 																				  implementation begins with the
 																				  'mfctr' instruction.
+																				  KERN_FAILURE if no loaded image
+																				  defines the symbol.
 																				  
 																				  ***************************************************************************/
 	
@@ -117,6 +127,241 @@ extern	"C"	{
 					  const void *overrideFunctionAddress,
 					  void **originalFunctionReentryIsland );
 	
+	/**
+	 One override of a batch passed to mach_override_batch(), with the same
+	 meaning as the arguments of mach_override_ptr().
+	 */
+	typedef	struct	{
+		void		*originalFunctionAddress;
+		const void	*overrideFunctionAddress;
+		void		**originalFunctionReentryIsland;
+	}	mach_override_entry_t;
+	
+	/************************************************************************************//**
+	 Overrides a whole set of functions at once. All islands are built first;
+	 then each distinct page of original code is made writable once, every
+	 prologue is patched in a single pass and the pages' original protections
+	 are restored. If any entry can't be overridden, none is: islands are
+	 freed, no code or reentry island pointer is modified and the page
+	 protections are put back.
+	 
+	 @param	entries		<->	Overrides to install. Reentry island pointers are
+							only written once the whole batch succeeded.
+	 @param	count		->	Number of entries.
+	 @param	failedEntry	<-	Optional index of the entry that failed, or count
+							if the failure wasn't specific to one entry. Can be
+							NULL.
+	 @result				<-	err_cannot_override if an entry's prologue can't be
+							patched or two entries' patches overlap.
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_override_batch(
+						mach_override_entry_t	*entries,
+						size_t					count,
+						size_t					*failedEntry );
+	
+	/************************************************************************************//**
+	 Chooses how later calls write prologues, for overriding functions that
+	 other threads may be running. By default a prologue is replaced with one
+	 locked 8-byte store, which is only safe when no other thread is inside
+	 the instructions being replaced. In live patching mode, the first byte
+	 is staged as an int3 and every other thread is briefly suspended in
+	 turn: a thread stopped inside the instructions being replaced is moved
+	 to the same instruction in the reentry island, and one that hits the
+	 int3 carries on through a SIGTRAP handler. The rest of the prologue is
+	 then written and made visible to all threads before the int3 is
+	 replaced. Removing the last hook with mach_unoverride() works the same
+	 way.
+	 
+	 Functions that make a call from their replaced instructions, other than
+	 as the last one, are refused in this mode, since threads inside the
+	 callee would return into the patch. The SIGTRAP handler stays
+	 installed and passes traps it doesn't own on to the previous handler;
+	 a debugger catching breakpoint exceptions will see the staged int3s.
+	 Not implemented on ppc.
+	 
+	 @param	enabled	->	Non-zero to live patch.
+	 @result			<-	mach_error_t
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_override_live_patching(
+								int enabled );
+	
+	/**
+	 Handle to an override installed with mach_override_hook().
+	 */
+	typedef	struct mach_override_hook	*mach_override_hook_t;
+	
+	/************************************************************************************//**
+	 Installs an override that can later be disabled, retargeted or removed.
+	 Several hooks can be placed on the same function; they form a chain in
+	 which the most recently installed hook runs first and its reentry island
+	 leads to the next older enabled hook, and finally to the original
+	 implementation. Every change to the chain is published with single
+	 pointer-sized stores, so threads running through the function always see
+	 a consistent chain. A disabled hook costs an indirect jump.
+	 
+	 The function's prologue is only patched for the first hook; later hooks
+	 just relink the chain. Not implemented on ppc.
+	 
+	 @param	originalFunctionAddress			->	Required address of the function to
+												override.
+	 @param	overrideFunctionAddress			->	Required address of the overriding
+												function.
+	 @param	originalFunctionReentryIsland	<-	Optional pointer to pointer to this
+												hook's reentry island, which calls the
+												rest of the chain. Written before the
+												hook can first be called. Can be NULL.
+	 @param	hook							<-	Required handle to the new hook,
+												which starts out enabled.
+	 @result									<-	err_cannot_override if the original
+												function can't be patched.
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_override_hook(
+					   void *originalFunctionAddress,
+					   const void *overrideFunctionAddress,
+					   void **originalFunctionReentryIsland,
+					   mach_override_hook_t *hook );
+	
+	/************************************************************************************//**
+	 Enables or disables a hook. A disabled hook is skipped: callers of the
+	 function, and the reentry island of the next newer hook, go straight to
+	 the next older enabled hook or the original implementation.
+	 
+	 @param	hook	->	Required hook.
+	 @param	enabled	->	Non-zero to enable the hook.
+	 @result			<-	mach_error_t
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_override_hook_enable(
+							  mach_override_hook_t hook,
+							  int enabled );
+	
+	/************************************************************************************//**
+	 Atomically redirects a hook to another overriding function. The hook's
+	 reentry island stays the same.
+	 
+	 @param	hook					->	Required hook.
+	 @param	overrideFunctionAddress	->	Required address of the new overriding
+										function.
+	 @result							<-	mach_error_t
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_override_hook_retarget(
+								mach_override_hook_t hook,
+								const void *overrideFunctionAddress );
+
+	/************************************************************************************//**
+	 Turns a hook's reentrancy guard on or off. While it is on, a call made
+	 on a thread that is already running the hook, such as a printf() from
+	 a hook that ends up back in the hooked function, skips the hook and goes
+	 straight to its reentry island, as if the hook were disabled for that
+	 thread alone. Other threads still enter the hook.
+
+	 The guard lives in an island in front of the hook and a thread-local
+	 slot holding the return address of the outer call; it costs a few
+	 instructions per call and no calls into other code. As the hook returns
+	 through the island, a guarded hook must not leave by longjmp() or throw
+	 an exception, and debuggers won't unwind through it. Islands and slots
+	 are kept once built. Not implemented on ppc.
+
+	 @param	hook	->	Required hook.
+	 @param	guarded	->	Non-zero to turn the guard on.
+	 @result			<-	KERN_RESOURCE_SHORTAGE if no slot or island could
+						be set aside for the guard.
+
+	 ************************************************************************************/
+
+    mach_error_t
+	mach_override_hook_guard(
+							 mach_override_hook_t hook,
+							 int guarded );
+
+	/************************************************************************************//**
+	 Returns where the calling thread's current call of a guarded hook came
+	 from. The guard takes the return address off the stack while the hook
+	 runs, so that __builtin_return_address( 0 ) in the hook gives the guard
+	 island instead; call this from within the hook.
+
+	 @param	hook	->	Required hook.
+	 @result			<-	The caller's return address; NULL if the thread isn't
+						inside the hook or it was never guarded.
+
+	 ************************************************************************************/
+
+    const void *
+	mach_override_hook_caller(
+							  mach_override_hook_t hook );
+
+	/************************************************************************************//**
+	 Removes a hook from its chain and releases the handle. Once the last hook
+	 on a function is removed its original prologue is put back, unless
+	 something else patched it since, in which case the function keeps
+	 dispatching straight to its original implementation.
+	 
+	 The islands are not reclaimed, since another thread may still be running
+	 through them.
+	 
+	 @param	hook	->	Required hook. Invalid after the call.
+	 @result			<-	mach_error_t
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_unoverride(
+					mach_override_hook_t hook );
+	
+	/************************************************************************************//**
+	 Builds an executable thunk that passes context to a common handler, so
+	 that one assembly handler can serve many functions. On x86_64 context is
+	 loaded into %r11, which no calling convention uses for arguments; on i386
+	 it is pushed, so the handler finds it at (%esp) with the caller's return
+	 address at 4(%esp). Argument registers and the stack are otherwise left
+	 untouched. Not implemented on ppc.
+	 
+	 @param	context	->	Value handed to handler.
+	 @param	handler	->	Required code to jump to.
+	 @param	thunk	<-	Required pointer to the thunk's entry point.
+	 @result			<-	mach_error_t
+	 
+	 ************************************************************************************/
+	
+    mach_error_t
+	mach_override_thunk(
+						const void *context,
+						const void *handler,
+						void **thunk );
+	
+	/**
+	 Layout of the branch islands behind every override: an escape island
+	 jumping to the override and, when one is asked for, a reentry island
+	 holding the relocated prologue followed by a jump back into the
+	 original function. Islands are packed into slabs of executable pages
+	 at MACH_OVERRIDE_ISLAND_STRIDE bytes each; a hook's replaceable target
+	 lives MACH_OVERRIDE_ISLAND_SLOT_OFFSET bytes into its island.
+	 */
+#if defined(__x86_64__)
+#define	MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE	64	//	room for the relocated prologue
+#define	MACH_OVERRIDE_ISLAND_JUMP_SIZE			14	//	jmp *0(%rip); .quad target
+#define	MACH_OVERRIDE_ISLAND_STRIDE				96
+#elif defined(__i386__)
+#define	MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE	32
+#define	MACH_OVERRIDE_ISLAND_JUMP_SIZE			5	//	jmp rel32
+#define	MACH_OVERRIDE_ISLAND_STRIDE				48
+#endif
+#define	MACH_OVERRIDE_ISLAND_SLOT_OFFSET		8
+	
 	/************************************************************************************//**
 																						   
 																						   
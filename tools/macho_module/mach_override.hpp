@@ -0,0 +1,244 @@
+/*******************************************************************************
+ mach_override.hpp
+ Typed C++ hooks over mach_override_hook().
+
+ A hook is declared from the signature of the function it overrides:
+
+	static mach_hook::hook<MACH_HOOK_SIGNATURE( NSLinkModule )>	gLinkModule;
+
+	static NSModule
+	linkModule( NSObjectFileImage image, const char *name, uint32_t options )
+	{
+		return gLinkModule.original( image, name, options );
+	}
+
+	err = gLinkModule.install( NSLinkModule, linkModule );
+
+ The override and the original must have exactly the same type, and
+ original() takes and returns what the function does, so a mismatch is a
+ compile error rather than a crash. original() is an inline call through
+ the reentry island, with nothing in between. Variadic functions can be
+ hooked but have no original(), since their arguments can't be forwarded;
+ call original_function() with the arguments spelled out instead.
+
+ ***************************************************************************/
+
+#ifndef		_mach_override_hpp_
+#define		_mach_override_hpp_
+
+#include "mach_override.h"
+#include "symbol_index.h"
+
+#include <stddef.h>
+
+#if __cplusplus < 201103L
+#error mach_override.hpp requires C++11
+#endif
+
+	/**
+	 The type of a named function, for declaring its hook.
+	 */
+#define	MACH_HOOK_SIGNATURE( FUNCTION )	decltype( FUNCTION )
+
+namespace	mach_hook	{
+
+#if defined(MACH_OVERRIDE_ISLAND_STRIDE)
+	/**
+	 Island memory, known at compile time: see mach_override.h.
+	 */
+	struct	island_layout	{
+		static constexpr size_t	instructions_size = MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE;
+		static constexpr size_t	jump_offset = MACH_OVERRIDE_ISLAND_INSTRUCTIONS_SIZE;
+		static constexpr size_t	jump_size = MACH_OVERRIDE_ISLAND_JUMP_SIZE;
+		static constexpr size_t	slot_offset = MACH_OVERRIDE_ISLAND_SLOT_OFFSET;
+		static constexpr size_t	stride = MACH_OVERRIDE_ISLAND_STRIDE;
+		//	The first hook on a function takes an escape and a reentry island,
+		//	later hooks on it a reentry island each.
+		static constexpr size_t	first_hook_size = 2 * stride;
+		static constexpr size_t	chained_hook_size = stride;
+	};
+
+	static_assert( island_layout::jump_offset + island_layout::jump_size <= island_layout::stride,
+				   "island code overruns its slab slot" );
+	static_assert( island_layout::slot_offset % sizeof( void * ) == 0
+				   && island_layout::stride % 16 == 0,
+				   "hook slots must be naturally aligned to be stored atomically" );
+#endif
+
+	/**
+	 Untyped state shared by every hook: the handle and the reentry island.
+	 */
+	class	hook_base	{
+	public:
+		bool
+		installed() const	{ return handle_ != nullptr; }
+
+		mach_error_t
+		enable()	{ return handle_ ? mach_override_hook_enable( handle_, 1 ) : KERN_INVALID_ARGUMENT; }
+
+		mach_error_t
+		disable()	{ return handle_ ? mach_override_hook_enable( handle_, 0 ) : KERN_INVALID_ARGUMENT; }
+
+		//	See mach_override_hook_guard().
+		mach_error_t
+		guard( bool guarded = true )
+		{
+			return handle_ ? mach_override_hook_guard( handle_, guarded ) : KERN_INVALID_ARGUMENT;
+		}
+
+		//	See mach_override_hook_caller().
+		const void *
+		caller() const	{ return handle_ ? mach_override_hook_caller( handle_ ) : nullptr; }
+
+		//	See mach_unoverride(). The reentry island stays valid, for threads
+		//	still running the override.
+		mach_error_t
+		remove()
+		{
+			mach_override_hook_t	handle = handle_;
+
+			if( !handle )
+				return KERN_INVALID_ARGUMENT;
+			handle_ = nullptr;
+			return mach_unoverride( handle );
+		}
+
+	protected:
+		constexpr hook_base() : handle_( nullptr ), reentry_( nullptr ) {}
+		hook_base( const hook_base & ) = delete;
+		hook_base &operator=( const hook_base & ) = delete;
+
+		mach_error_t
+		install(
+				void		*originalFunctionAddress,
+				const void	*overrideFunctionAddress )
+		{
+			if( handle_ )
+				return KERN_INVALID_ARGUMENT;
+			return mach_override_hook( originalFunctionAddress, overrideFunctionAddress,
+									   &reentry_, &handle_ );
+		}
+
+		mach_error_t
+		install(
+				const char	*symbolName,
+				const char	*libraryNameHint,
+				const void	*overrideFunctionAddress )
+		{
+			void			*address = nullptr;
+			mach_error_t	err = symbolIndexLookup( symbolName, libraryNameHint, &address );
+
+			return err ? err : install( address, overrideFunctionAddress );
+		}
+
+		mach_error_t
+		retarget(
+				 const void	*overrideFunctionAddress )
+		{
+			return handle_ ? mach_override_hook_retarget( handle_, overrideFunctionAddress )
+						   : KERN_INVALID_ARGUMENT;
+		}
+
+		mach_override_hook_t	handle_;
+		void					*reentry_;
+	};
+
+	/**
+	 Only function types can be hooked; anything else has no definition.
+	 */
+	template	<typename Signature>
+	class	hook;
+
+	template	<typename Return, typename... Args>
+	class	hook<Return( Args... )> : public hook_base	{
+	public:
+		typedef	Return	(*function_type)( Args... );
+
+		constexpr hook() = default;
+
+		/**
+		 Installs replacement in front of original and of any hooks already
+		 on it. A hook can be installed once; remove() it to reuse it.
+		 */
+		mach_error_t
+		install(
+				function_type	original,
+				function_type	replacement )
+		{
+			return hook_base::install( reinterpret_cast<void *>( original ),
+									   reinterpret_cast<const void *>( replacement ) );
+		}
+
+		/**
+		 Same, looking original up by its symbol name, with its leading
+		 underscore. The type can't be checked against the symbol.
+		 */
+		mach_error_t
+		install(
+				const char		*symbolName,
+				const char		*libraryNameHint,
+				function_type	replacement )
+		{
+			return hook_base::install( symbolName, libraryNameHint,
+									   reinterpret_cast<const void *>( replacement ) );
+		}
+
+		mach_error_t
+		retarget(
+				 function_type	replacement )
+		{
+			return hook_base::retarget( reinterpret_cast<const void *>( replacement ) );
+		}
+
+		//	The rest of the chain: older hooks, then the original implementation.
+		function_type
+		original_function() const	{ return reinterpret_cast<function_type>( reentry_ ); }
+
+		Return
+		original(
+				 Args...	args ) const
+		{
+			return original_function()( static_cast<Args &&>( args )... );
+		}
+	};
+
+	template	<typename Return, typename... Args>
+	class	hook<Return( Args..., ... )> : public hook_base	{
+	public:
+		typedef	Return	(*function_type)( Args..., ... );
+
+		constexpr hook() = default;
+
+		mach_error_t
+		install(
+				function_type	original,
+				function_type	replacement )
+		{
+			return hook_base::install( reinterpret_cast<void *>( original ),
+									   reinterpret_cast<const void *>( replacement ) );
+		}
+
+		mach_error_t
+		install(
+				const char		*symbolName,
+				const char		*libraryNameHint,
+				function_type	replacement )
+		{
+			return hook_base::install( symbolName, libraryNameHint,
+									   reinterpret_cast<const void *>( replacement ) );
+		}
+
+		mach_error_t
+		retarget(
+				 function_type	replacement )
+		{
+			return hook_base::retarget( reinterpret_cast<const void *>( replacement ) );
+		}
+
+		function_type
+		original_function() const	{ return reinterpret_cast<function_type>( reentry_ ); }
+	};
+
+}	//	namespace mach_hook
+
+#endif	//	_mach_override_hpp_
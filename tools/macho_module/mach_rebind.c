@@ -0,0 +1,596 @@
+/*******************************************************************************
+ mach_rebind.c
+ Rebinding of the lazy and non-lazy symbol pointers of loaded images.
+
+ Symbol pointer sections are matched to symbol names through the image's
+ indirect symbol table: entry n of a section holding pointers is named by
+ indirect symbol reserved1 + n. Every batch records the pointers it stored
+ and the values they held, for mach_unrebind(). Loaded images are tracked
+ from dyld's callbacks, so that images added later get the live batches
+ applied and the pointers of removed images are forgotten.
+
+ ***************************************************************************/
+
+#include "mach_rebind.h"
+#include "symbol_index.h"
+
+#include <mach/mach.h>
+#include <mach-o/dyld.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#if defined(__LP64__)
+typedef	struct mach_header_64		MachHeader;
+typedef	struct segment_command_64	SegmentCommand;
+typedef	struct section_64			Section;
+typedef	struct nlist_64				SymbolEntry;
+#define	kSegmentCommand				LC_SEGMENT_64
+#else
+typedef	struct mach_header			MachHeader;
+typedef	struct segment_command		SegmentCommand;
+typedef	struct section				Section;
+typedef	struct nlist				SymbolEntry;
+#define	kSegmentCommand				LC_SEGMENT
+#endif
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+typedef	struct	LoadedImage	{
+	struct LoadedImage			*next;
+	const struct mach_header	*header;
+	intptr_t					slide;
+}	LoadedImage;
+
+typedef	struct	{
+	char		*name;
+	uint32_t	hash;
+	const void	*replacement;
+}	RebindSymbol;
+
+typedef	struct	{
+	void						**slot;
+	void						*savedValue;
+	const struct mach_header	*image;
+	unsigned int				symbol;		//	index into the batch's symbols
+	int							lazy;
+}	ReboundSlot;
+
+struct	mach_rebinding	{
+	struct mach_rebinding	*next;
+	RebindSymbol			*symbols;
+	size_t					symbolCount;
+	ReboundSlot				*slots;
+	size_t					slotCount, slotCapacity;
+};
+
+//	A page of symbol pointers made writable for the duration of a store.
+typedef	struct	{
+	vm_address_t	address;
+	vm_prot_t		protection;
+	int				changed;
+}	WritablePage;
+
+static LoadedImage				*gLoadedImages = NULL;
+static struct mach_rebinding	*gRebindings = NULL;
+static pthread_mutex_t			gRebindLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t			gRebindOnce = PTHREAD_ONCE_INIT;
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+static int
+compareAddresses(
+				 const void	*a,
+				 const void	*b )
+{
+	vm_address_t	x = *(const vm_address_t *) a, y = *(const vm_address_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static mach_error_t
+appendSlot(
+		   struct mach_rebinding	*rebinding,
+		   const ReboundSlot		*slot )
+{
+	if( rebinding->slotCount == rebinding->slotCapacity ) {
+		size_t		capacity = rebinding->slotCapacity ? 2 * rebinding->slotCapacity : 64;
+		ReboundSlot	*slots = realloc( rebinding->slots, capacity * sizeof( ReboundSlot ) );
+		if( !slots )
+			return KERN_RESOURCE_SHORTAGE;
+		rebinding->slots = slots;
+		rebinding->slotCapacity = capacity;
+	}
+	rebinding->slots[rebinding->slotCount++] = *slot;
+	return err_none;
+}
+
+/***************************************************************************//**
+	Finds an image's symbol pointers bound to the batch's symbols and appends
+	them to its slots. Pointers already aimed at their replacement are
+	skipped, so an image can be scanned twice.
+
+	@param	rebinding	<->	The batch.
+	@param	image		->	The image.
+	@result				<-	mach_error_t
+
+	***************************************************************************/
+
+static mach_error_t
+collectImageSlots(
+				  struct mach_rebinding	*rebinding,
+				  const LoadedImage		*image )
+{
+	const MachHeader				*header = (const MachHeader *) image->header;
+	const struct load_command		*command = (const struct load_command *) (header + 1);
+	const struct symtab_command		*symtab = NULL;
+	const struct dysymtab_command	*dysymtab = NULL;
+	const SegmentCommand			*linkedit = NULL;
+	const SymbolEntry				*symbols;
+	const char						*strings;
+	const uint32_t					*indirectSymbols;
+	uintptr_t						linkeditBase;
+	mach_error_t					err = err_none;
+	uint32_t						i;
+
+	for( i = 0; i < header->ncmds; i++ ) {
+		switch( command->cmd ) {
+			case kSegmentCommand:
+				if( !strncmp( ((const SegmentCommand *) command)->segname, "__LINKEDIT", 16 ) )
+					linkedit = (const SegmentCommand *) command;
+				break;
+			case LC_SYMTAB:
+				symtab = (const struct symtab_command *) command;
+				break;
+			case LC_DYSYMTAB:
+				dysymtab = (const struct dysymtab_command *) command;
+				break;
+		}
+		command = (const struct load_command *) ((const char *) command + command->cmdsize);
+	}
+	if( !linkedit || !symtab || !dysymtab || !dysymtab->nindirectsyms )
+		return err_none;
+
+	linkeditBase = image->slide + linkedit->vmaddr - linkedit->fileoff;
+	symbols = (const SymbolEntry *) (linkeditBase + symtab->symoff);
+	strings = (const char *) (linkeditBase + symtab->stroff);
+	indirectSymbols = (const uint32_t *) (linkeditBase + dysymtab->indirectsymoff);
+
+	command = (const struct load_command *) (header + 1);
+	for( i = 0; !err && i < header->ncmds; i++ ) {
+		const SegmentCommand	*segment = (const SegmentCommand *) command;
+		const Section			*section = (const Section *) (segment + 1);
+		uint32_t				s;
+
+		command = (const struct load_command *) ((const char *) command + command->cmdsize);
+		if( segment->cmd != kSegmentCommand )
+			continue;
+
+		for( s = 0; !err && s < segment->nsects; s++, section++ ) {
+			uint32_t	type = section->flags & SECTION_TYPE;
+			uint32_t	count = (uint32_t) (section->size / sizeof( void * )), n;
+			void		**pointers = (void **) (image->slide + section->addr);
+
+			if( type != S_LAZY_SYMBOL_POINTERS && type != S_NON_LAZY_SYMBOL_POINTERS
+				&& type != S_LAZY_DYLIB_SYMBOL_POINTERS )
+				continue;
+			if( section->reserved1 > dysymtab->nindirectsyms
+				|| count > dysymtab->nindirectsyms - section->reserved1 )
+				continue;
+
+			for( n = 0; !err && n < count; n++ ) {
+				uint32_t	index = indirectSymbols[section->reserved1 + n];
+				const char	*name;
+				uint32_t	hash, k;
+
+				if( (index & (INDIRECT_SYMBOL_LOCAL | INDIRECT_SYMBOL_ABS)) || index >= symtab->nsyms )
+					continue;
+				if( symbols[index].n_un.n_strx >= symtab->strsize )
+					continue;
+				name = strings + symbols[index].n_un.n_strx;
+				hash = symbolIndexHash( name );
+
+				for( k = 0; k < rebinding->symbolCount; k++ ) {
+					const RebindSymbol *symbol = &rebinding->symbols[k];
+					ReboundSlot slot;
+
+					if( symbol->hash != hash || strcmp( symbol->name, name ) )
+						continue;
+					if( pointers[n] == symbol->replacement )
+						break;
+					slot.slot = &pointers[n];
+					slot.savedValue = NULL;
+					slot.image = image->header;
+					slot.symbol = k;
+					slot.lazy = type != S_NON_LAZY_SYMBOL_POINTERS;
+					err = appendSlot( rebinding, &slot );
+					break;
+				}
+			}
+		}
+	}
+	return err;
+}
+
+static void
+restorePages(
+			 WritablePage	*pages,
+			 size_t			pageCount )
+{
+	vm_size_t	pageSize;
+	size_t		i;
+
+	if( host_page_size( mach_host_self(), &pageSize ) )
+		return;
+	for( i = 0; i < pageCount; i++ )
+		if( pages[i].changed )
+			vm_protect( mach_task_self(), pages[i].address, pageSize, FALSE, pages[i].protection );
+}
+
+/***************************************************************************//**
+	Makes the pages holding a run of slots writable, copy-on-write, and
+	records their protection so that it can be restored. Pages of __DATA are
+	usually writable already and are left alone. On failure no page is left
+	changed.
+
+	@param	slots		->	The slots.
+	@param	count		->	Number of slots.
+	@param	pages		<-	The pages, to pass to restorePages(). Free it.
+	@param	pageCount	<-	Number of pages.
+	@result				<-	KERN_PROTECTION_FAILURE if a page can't be made
+							writable.
+
+	***************************************************************************/
+
+static mach_error_t
+makeSlotsWritable(
+				  const ReboundSlot	*slots,
+				  size_t			count,
+				  WritablePage		**pages,
+				  size_t			*pageCount )
+{
+	vm_map_t		task = mach_task_self();
+	vm_address_t	*addresses;
+	vm_size_t		pageSize;
+	mach_error_t	err;
+	size_t			i, unique = 0;
+
+	*pages = NULL;
+	*pageCount = 0;
+	if( !count )
+		return err_none;
+	err = host_page_size( mach_host_self(), &pageSize );
+	if( err )
+		return err;
+
+	addresses = calloc( count, sizeof( vm_address_t ) );
+	*pages = calloc( count, sizeof( WritablePage ) );
+	if( !addresses || !*pages ) {
+		free( addresses );
+		free( *pages );
+		*pages = NULL;
+		return KERN_RESOURCE_SHORTAGE;
+	}
+
+	//	Pointers are naturally aligned, so each lies in exactly one page.
+	for( i = 0; i < count; i++ )
+		addresses[i] = (vm_address_t) slots[i].slot & ~(pageSize - 1);
+	qsort( addresses, count, sizeof( vm_address_t ), compareAddresses );
+	for( i = 0; i < count; i++ )
+		if( !unique || addresses[unique - 1] != addresses[i] )
+			addresses[unique++] = addresses[i];
+
+	for( i = 0; !err && i < unique; i++ ) {
+		WritablePage					*page = &(*pages)[i];
+		vm_address_t					regionAddress = addresses[i];
+		vm_size_t						regionSize;
+		vm_region_basic_info_data_64_t	info;
+		mach_msg_type_number_t			infoCount = VM_REGION_BASIC_INFO_COUNT_64;
+		mach_port_t						object;
+
+		page->address = addresses[i];
+		if( vm_region_64( task, &regionAddress, &regionSize, VM_REGION_BASIC_INFO_64,
+						  (vm_region_info_t) &info, &infoCount, &object ) == KERN_SUCCESS
+			&& regionAddress <= page->address ) {
+			page->protection = info.protection;
+			if( info.protection & VM_PROT_WRITE )
+				continue;
+		} else
+			page->protection = VM_PROT_READ;
+
+		if( vm_protect( task, page->address, pageSize, FALSE,
+						VM_PROT_READ | VM_PROT_WRITE | VM_PROT_COPY ) )
+			err = KERN_PROTECTION_FAILURE;
+		else
+			page->changed = TRUE;
+	}
+	free( addresses );
+
+	*pageCount = i;
+	if( err ) {
+		restorePages( *pages, *pageCount );
+		free( *pages );
+		*pages = NULL;
+		*pageCount = 0;
+	}
+	return err;
+}
+
+/***************************************************************************//**
+	Stores the replacements into a batch's slots from first on. If their
+	pages can't be made writable, the slots are dropped and nothing changes.
+
+	@param	rebinding	<->	The batch.
+	@param	first		->	Index of the first slot to store.
+	@result				<-	mach_error_t
+
+	***************************************************************************/
+
+static mach_error_t
+storeSlots(
+		   struct mach_rebinding	*rebinding,
+		   size_t					first )
+{
+	WritablePage	*pages;
+	size_t			pageCount, i;
+	mach_error_t	err;
+
+	err = makeSlotsWritable( rebinding->slots + first, rebinding->slotCount - first,
+							 &pages, &pageCount );
+	if( err ) {
+		rebinding->slotCount = first;
+		return err;
+	}
+
+	//	Aligned pointer stores: callers see either the old or the new target.
+	for( i = first; i < rebinding->slotCount; i++ ) {
+		ReboundSlot *slot = &rebinding->slots[i];
+		slot->savedValue = *slot->slot;
+		*slot->slot = (void *) rebinding->symbols[slot->symbol].replacement;
+	}
+
+	restorePages( pages, pageCount );
+	free( pages );
+	return err_none;
+}
+
+static void
+freeRebinding(
+			  struct mach_rebinding	*rebinding )
+{
+	size_t	i;
+
+	if( !rebinding )
+		return;
+	for( i = 0; rebinding->symbols && i < rebinding->symbolCount; i++ )
+		free( rebinding->symbols[i].name );
+	free( rebinding->symbols );
+	free( rebinding->slots );
+	free( rebinding );
+}
+
+/**************************
+ *
+ *	Image Tracking
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Image Tracking)
+
+/***************************************************************************//**
+	Records a loaded image and applies the live batches to it. Registered
+	with dyld, which calls it for each image as it is loaded.
+
+	@param	mh		->	The image's header.
+	@param	slide	->	Its slide.
+
+	***************************************************************************/
+
+static void
+addImage(
+		 const struct mach_header	*mh,
+		 intptr_t					slide )
+{
+	LoadedImage				*image = calloc( 1, sizeof( LoadedImage ) );
+	struct mach_rebinding	*rebinding;
+
+	if( !image )
+		return;
+	image->header = mh;
+	image->slide = slide;
+
+	pthread_mutex_lock( &gRebindLock );
+	image->next = gLoadedImages;
+	gLoadedImages = image;
+	for( rebinding = gRebindings; rebinding; rebinding = rebinding->next ) {
+		size_t first = rebinding->slotCount;
+		if( collectImageSlots( rebinding, image ) )
+			rebinding->slotCount = first;
+		else
+			storeSlots( rebinding, first );
+	}
+	pthread_mutex_unlock( &gRebindLock );
+}
+
+//	Forgets an unloaded image and the slots batches had in it.
+static void
+removeImage(
+			const struct mach_header	*mh,
+			intptr_t					slide )
+{
+	LoadedImage				**link, *image;
+	struct mach_rebinding	*rebinding;
+	size_t					i, kept;
+
+	pthread_mutex_lock( &gRebindLock );
+	for( link = &gLoadedImages; *link && (*link)->header != mh; link = &(*link)->next )
+		;
+	image = *link;
+	if( image )
+		*link = image->next;
+	for( rebinding = gRebindings; rebinding; rebinding = rebinding->next ) {
+		for( i = kept = 0; i < rebinding->slotCount; i++ )
+			if( rebinding->slots[i].image != mh )
+				rebinding->slots[kept++] = rebinding->slots[i];
+		rebinding->slotCount = kept;
+	}
+	pthread_mutex_unlock( &gRebindLock );
+
+	free( image );
+}
+
+static void
+registerImageCallbacks( void )
+{
+	//	dyld calls addImage() right away for every image already loaded.
+	_dyld_register_func_for_add_image( addImage );
+	_dyld_register_func_for_remove_image( removeImage );
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+mach_rebind_symbols(
+					const mach_rebind_entry_t	*entries,
+					size_t						count,
+					mach_rebinding_t			*rebinding )
+{
+	struct mach_rebinding	*batch;
+	LoadedImage				*image;
+	void					**originals = NULL;
+	mach_error_t			err = err_none;
+	size_t					i, k;
+
+	assert( entries || !count );
+	assert( rebinding );
+
+	pthread_once( &gRebindOnce, registerImageCallbacks );
+
+	batch = calloc( 1, sizeof( struct mach_rebinding ) );
+	if( batch ) {
+		batch->symbols = calloc( count ? count : 1, sizeof( RebindSymbol ) );
+		originals = calloc( count ? count : 1, sizeof( void * ) );
+	}
+	if( !batch || !batch->symbols || !originals )
+		err = KERN_RESOURCE_SHORTAGE;
+	for( i = 0; !err && i < count; i++ ) {
+		assert( entries[i].symbolName );
+		assert( entries[i].replacement );
+		batch->symbols[i].name = strdup( entries[i].symbolName );
+		if( !batch->symbols[i].name ) {
+			err = KERN_RESOURCE_SHORTAGE;
+			break;
+		}
+		batch->symbols[i].hash = symbolIndexHash( entries[i].symbolName );
+		batch->symbols[i].replacement = entries[i].replacement;
+		batch->symbolCount++;
+		//	Outside gRebindLock: the index may register with dyld.
+		if( entries[i].original )
+			symbolIndexLookup( entries[i].symbolName, NULL, &originals[i] );
+	}
+
+	if( !err ) {
+		pthread_mutex_lock( &gRebindLock );
+		for( image = gLoadedImages; !err && image; image = image->next )
+			err = collectImageSlots( batch, image );
+		if( !err )
+			err = storeSlots( batch, 0 );
+		if( !err ) {
+			batch->next = gRebindings;
+			gRebindings = batch;
+			//	Symbols the index lacks: a bound non-lazy pointer has the address.
+			for( k = 0; k < batch->slotCount; k++ ) {
+				ReboundSlot *slot = &batch->slots[k];
+				if( !slot->lazy && !originals[slot->symbol] )
+					originals[slot->symbol] = slot->savedValue;
+			}
+		}
+		pthread_mutex_unlock( &gRebindLock );
+	}
+
+	if( !err ) {
+		for( i = 0; i < count; i++ )
+			if( entries[i].original )
+				*entries[i].original = originals[i];
+		*rebinding = batch;
+	} else
+		freeRebinding( batch );
+	free( originals );
+	return err;
+}
+
+mach_error_t
+mach_unrebind(
+			  mach_rebinding_t	rebinding )
+{
+	struct mach_rebinding	**link, *other;
+	WritablePage			*pages;
+	size_t					pageCount, i, j;
+	mach_error_t			err;
+
+	assert( rebinding );
+
+	pthread_mutex_lock( &gRebindLock );
+
+	err = makeSlotsWritable( rebinding->slots, rebinding->slotCount, &pages, &pageCount );
+	if( !err ) {
+		for( link = &gRebindings; *link && *link != rebinding; link = &(*link)->next )
+			;
+		if( *link )
+			*link = rebinding->next;
+
+		for( i = 0; i < rebinding->slotCount; i++ ) {
+			ReboundSlot	*slot = &rebinding->slots[i];
+			const void	*replacement = rebinding->symbols[slot->symbol].replacement;
+
+			if( *slot->slot == replacement ) {
+				*slot->slot = slot->savedValue;
+				continue;
+			}
+			//	Rebound again since: hand our saved value to the batch that
+			//	saved our replacement.
+			for( other = gRebindings; other; other = other->next )
+				for( j = 0; j < other->slotCount; j++ )
+					if( other->slots[j].slot == slot->slot
+						&& other->slots[j].savedValue == replacement )
+						other->slots[j].savedValue = slot->savedValue;
+		}
+		restorePages( pages, pageCount );
+		free( pages );
+	}
+
+	pthread_mutex_unlock( &gRebindLock );
+
+	if( !err )
+		freeRebinding( rebinding );
+	return err;
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ mach_rebind.h
+ Overrides calls that cross image boundaries by rebinding the lazy and
+ non-lazy symbol pointers images call through, rather than patching the
+ callee like mach_override_ptr().
+
+ Nothing is written to code and no branch islands are needed: a rebound
+ call goes straight to its replacement, with no extra jump. Calls from
+ within the defining image, and calls made through pointers obtained
+ before the rebinding, are not affected.
+
+ ***************************************************************************/
+
+#ifndef		_mach_rebind_
+#define		_mach_rebind_
+
+#include <sys/types.h>
+#include <mach/error.h>
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+	/**
+	 One symbol of a batch passed to mach_rebind_symbols().
+	 */
+	typedef	struct	{
+		const char	*symbolName;			//	with its leading underscore
+		const void	*replacement;
+		void		**original;				//	optional, see mach_rebind_symbols()
+	}	mach_rebind_entry_t;
+
+	/**
+	 Handle to a batch of rebound symbols.
+	 */
+	typedef	struct mach_rebinding	*mach_rebinding_t;
+
+	/************************************************************************************//**
+	 Points every lazy and non-lazy symbol pointer bound to one of entries'
+	 symbols, in every loaded image, at its replacement. All the pointers are
+	 found and their pages made writable first, then they are all stored, so
+	 the batch either applies everywhere or nowhere. Images loaded later are
+	 rebound as dyld adds them, until the batch is undone.
+
+	 Each entry's original receives the symbol's own address, for calling
+	 through to it; lazy pointers that were never bound can't provide it. A
+	 symbol no loaded image imports is not an error.
+
+	 @param	entries		->	Required array of symbols to rebind. The names are
+							copied.
+	 @param	count		->	Number of entries.
+	 @param	rebinding	<-	Required handle to the batch.
+	 @result				<-	KERN_PROTECTION_FAILURE if a pointer couldn't be
+							made writable, in which case nothing was rebound.
+
+	 ************************************************************************************/
+
+	mach_error_t
+	mach_rebind_symbols(
+						const mach_rebind_entry_t	*entries,
+						size_t						count,
+						mach_rebinding_t			*rebinding );
+
+	/************************************************************************************//**
+	 Undoes a batch: each pointer it rebound gets back the value it saved. A
+	 pointer rebound again by a later batch is left alone, and that batch
+	 restores the saved value instead when it is undone, so batches can be
+	 undone in any order.
+
+	 @param	rebinding	->	Required batch. Invalid after the call.
+	 @result				<-	mach_error_t
+
+	 ************************************************************************************/
+
+	mach_error_t
+	mach_unrebind(
+				  mach_rebinding_t	rebinding );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_mach_rebind_
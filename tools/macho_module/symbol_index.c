@@ -0,0 +1,683 @@
+/*******************************************************************************
+ symbol_index.c
+ Hash index over the symbol tables and export tries of the images loaded in
+ the current task, used by mach_override() to resolve symbol names.
+
+ Every defined, external nlist entry is indexed, followed by the export trie
+ for names the symbol table doesn't carry. Names point into each image's
+ __LINKEDIT (or, for trie-only names, into a per-image string pool), so the
+ index costs one entry per symbol.
+
+ ***************************************************************************/
+
+#include "symbol_index.h"
+
+#include <mach/mach.h>
+#include <mach-o/dyld.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**************************
+ *
+ *	Constants
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Constants)
+
+#if defined(__LP64__)
+typedef	struct mach_header_64		MachHeader;
+typedef	struct segment_command_64	SegmentCommand;
+typedef	struct nlist_64				SymbolEntry;
+#define	kSegmentCommand				LC_SEGMENT_64
+#else
+typedef	struct mach_header			MachHeader;
+typedef	struct segment_command		SegmentCommand;
+typedef	struct nlist				SymbolEntry;
+#define	kSegmentCommand				LC_SEGMENT
+#endif
+
+#define	kInitialBucketCount		4096
+#define	kMaxTrieDepth			128
+#define	kMaxSymbolLength		1024
+
+/**************************
+ *
+ *	Data Types
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Data Types)
+
+typedef	struct	IndexedImage	{
+	struct IndexedImage		*next;
+	const struct mach_header	*header;
+	const char				*name;			//	install name or path, for hints
+	unsigned int			loadOrder;
+	struct IndexedSymbol	*symbols;			//	from the symbol table
+	struct IndexedSymbol	*exportedSymbols;	//	only found in the trie
+	char					*stringPool;		//	names of exportedSymbols
+}	IndexedImage;
+
+typedef	struct	IndexedSymbol	{
+	struct IndexedSymbol	*next;			//	bucket chain
+	const char				*name;
+	void					*address;
+	IndexedImage			*image;
+	uint32_t				hash;
+}	IndexedSymbol;
+
+static IndexedImage			*gImages = NULL;
+static unsigned int			gLoadOrder = 0;
+static IndexedSymbol		**gBuckets = NULL;
+static size_t				gBucketCount = 0;
+static size_t				gSymbolCount = 0;
+static pthread_mutex_t		gIndexLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t		gIndexOnce = PTHREAD_ONCE_INIT;
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+static void
+insertSymbol(
+			 IndexedSymbol	*symbol )
+{
+	IndexedSymbol	**bucket = &gBuckets[symbol->hash & (gBucketCount - 1)];
+
+	symbol->next = *bucket;
+	*bucket = symbol;
+	gSymbolCount++;
+}
+
+//	Keeps the load factor at or below one.
+static void
+growBuckets(
+			size_t	symbolCount )
+{
+	size_t			newCount = gBucketCount ? gBucketCount : kInitialBucketCount;
+	IndexedSymbol	**newBuckets, *symbol, *next;
+	size_t			i;
+
+	while( newCount < symbolCount )
+		newCount *= 2;
+	if( newCount == gBucketCount )
+		return;
+
+	newBuckets = calloc( newCount, sizeof( IndexedSymbol * ) );
+	if( !newBuckets )
+		return;
+	for( i = 0; i < gBucketCount; i++ ) {
+		for( symbol = gBuckets[i]; symbol; symbol = next ) {
+			next = symbol->next;
+			symbol->next = newBuckets[symbol->hash & (newCount - 1)];
+			newBuckets[symbol->hash & (newCount - 1)] = symbol;
+		}
+	}
+	free( gBuckets );
+	gBuckets = newBuckets;
+	gBucketCount = newCount;
+}
+
+static IndexedSymbol *
+findImageSymbol(
+				IndexedImage	*image,
+				const char		*name,
+				uint32_t		hash )
+{
+	IndexedSymbol	*symbol;
+
+	for( symbol = gBuckets[hash & (gBucketCount - 1)]; symbol; symbol = symbol->next )
+		if( symbol->image == image && symbol->hash == hash && !strcmp( symbol->name, name ) )
+			return symbol;
+	return NULL;
+}
+
+static uintptr_t
+readUleb128(
+			const uint8_t	**p,
+			const uint8_t	*end )
+{
+	uintptr_t	result = 0;
+	int			shift = 0;
+
+	while( *p < end ) {
+		uint8_t byte = *(*p)++;
+		if( shift < (int) (8 * sizeof( result )) )
+			result |= (uintptr_t) (byte & 0x7f) << shift;
+		shift += 7;
+		if( !(byte & 0x80) )
+			break;
+	}
+	return result;
+}
+
+typedef	struct	{
+	const uint8_t				*trie;
+	const uint8_t				*end;
+	const struct mach_header	*header;
+	void						(*callback)( const char *name, void *address, void *context );
+	void						*context;
+	char						name[kMaxSymbolLength];
+}	TrieWalk;
+
+/***************************************************************************//**
+	Walks an export trie node and its children, calling back with each
+	regular or absolute export. Re-exports and thread-locals are skipped; for
+	stub-and-resolver exports the stub is reported. Malformed tries are cut
+	short, never overrun.
+
+	@param	walk		<->	The walk; name holds the node's prefix.
+	@param	node		->	The node.
+	@param	nameLength	->	Length of the node's prefix.
+	@param	depth		->	Recursion depth, bounded by kMaxTrieDepth.
+
+	***************************************************************************/
+
+static void
+walkExportTrie(
+			   TrieWalk			*walk,
+			   const uint8_t	*node,
+			   size_t			nameLength,
+			   int				depth )
+{
+	const uint8_t	*p = node, *end = walk->end, *children;
+	uintptr_t		terminalSize;
+	unsigned int	childCount;
+
+	if( p >= end || depth > kMaxTrieDepth )
+		return;
+
+	terminalSize = readUleb128( &p, end );
+	children = p + terminalSize;
+	if( terminalSize && children <= end ) {
+		uintptr_t flags = readUleb128( &p, end );
+		if( !(flags & EXPORT_SYMBOL_FLAGS_REEXPORT) ) {
+			uintptr_t offset = readUleb128( &p, end );
+			walk->name[nameLength] = '\0';
+			switch( flags & EXPORT_SYMBOL_FLAGS_KIND_MASK ) {
+				case EXPORT_SYMBOL_FLAGS_KIND_REGULAR:
+					walk->callback( walk->name, (char *) walk->header + offset, walk->context );
+					break;
+				case EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE:
+					walk->callback( walk->name, (void *) offset, walk->context );
+					break;
+			}
+		}
+	}
+
+	if( children >= end )
+		return;
+	p = children;
+	childCount = *p++;
+	while( childCount-- && p < end ) {
+		size_t		edgeLength = strnlen( (const char *) p, end - p );
+		uintptr_t	childOffset;
+
+		if( p + edgeLength >= end || nameLength + edgeLength >= sizeof( walk->name ) )
+			return;
+		memcpy( walk->name + nameLength, p, edgeLength );
+		p += edgeLength + 1;
+		childOffset = readUleb128( &p, end );
+		if( childOffset < (uintptr_t) (end - walk->trie) )
+			walkExportTrie( walk, walk->trie + childOffset, nameLength + edgeLength, depth + 1 );
+	}
+}
+
+typedef	struct	{
+	const SymbolEntry			*symbols;
+	uint32_t					symbolCount;
+	const char					*strings;
+	uint32_t					stringsSize;
+	const uint8_t				*trie;		//	NULL if the image has none
+	size_t						trieSize;
+	const struct dylib_command	*dylibId;
+}	ImageTables;
+
+/***************************************************************************//**
+	Finds an image's symbol table, string table and export trie.
+
+	@param	mh		->	The image's header.
+	@param	slide	->	Its slide.
+	@param	tables	<-	The tables, in memory.
+	@result			<-	Whether the image has a __LINKEDIT segment.
+
+	***************************************************************************/
+
+static int
+readImageTables(
+				const struct mach_header	*mh,
+				intptr_t					slide,
+				ImageTables					*tables )
+{
+	const MachHeader				*header = (const MachHeader *) mh;
+	const struct load_command		*command = (const struct load_command *) (header + 1);
+	const struct symtab_command		*symtab = NULL;
+	const SegmentCommand			*linkedit = NULL;
+	uintptr_t						trieOffset = 0, linkeditBase;
+	uint32_t						i;
+
+	memset( tables, 0, sizeof( ImageTables ) );
+	for( i = 0; i < header->ncmds; i++ ) {
+		switch( command->cmd ) {
+			case kSegmentCommand:
+				if( !strncmp( ((const SegmentCommand *) command)->segname, "__LINKEDIT", 16 ) )
+					linkedit = (const SegmentCommand *) command;
+				break;
+			case LC_SYMTAB:
+				symtab = (const struct symtab_command *) command;
+				break;
+			case LC_ID_DYLIB:
+				tables->dylibId = (const struct dylib_command *) command;
+				break;
+			case LC_DYLD_INFO:
+			case LC_DYLD_INFO_ONLY:
+				trieOffset = ((const struct dyld_info_command *) command)->export_off;
+				tables->trieSize = ((const struct dyld_info_command *) command)->export_size;
+				break;
+			case LC_DYLD_EXPORTS_TRIE:
+				trieOffset = ((const struct linkedit_data_command *) command)->dataoff;
+				tables->trieSize = ((const struct linkedit_data_command *) command)->datasize;
+				break;
+		}
+		command = (const struct load_command *) ((const char *) command + command->cmdsize);
+	}
+	if( !linkedit )
+		return 0;
+
+	linkeditBase = slide + linkedit->vmaddr - linkedit->fileoff;
+	if( symtab ) {
+		tables->symbols = (const SymbolEntry *) (linkeditBase + symtab->symoff);
+		tables->symbolCount = symtab->nsyms;
+		tables->strings = (const char *) (linkeditBase + symtab->stroff);
+		tables->stringsSize = symtab->strsize;
+	}
+	if( trieOffset && tables->trieSize )
+		tables->trie = (const uint8_t *) (linkeditBase + trieOffset);
+	else
+		tables->trieSize = 0;
+	return 1;
+}
+
+//	External, defined in a section and named: what the index and lookups
+//	consider. Private symbols were never bound by _dyld_lookup_and_bind().
+static int
+isExternalSymbol(
+				 const ImageTables	*tables,
+				 const SymbolEntry	*entry )
+{
+	return !(entry->n_type & N_STAB) && (entry->n_type & N_EXT)
+		&& (entry->n_type & N_TYPE) == N_SECT && entry->n_un.n_strx && entry->n_un.n_strx < tables->stringsSize;
+}
+
+/***************************************************************************//**
+	Follows an export trie down the edges spelling name, without walking the
+	rest of it. Re-exports, thread-locals and malformed tries give NULL.
+
+	@param	tables	->	The image's tables; trie must be set.
+	@param	mh		->	The image's header.
+	@param	name	->	The symbol name.
+	@result			<-	The export's address, or NULL.
+
+	***************************************************************************/
+
+static void *
+findTrieExport(
+			   const ImageTables			*tables,
+			   const struct mach_header		*mh,
+			   const char					*name )
+{
+	const uint8_t	*trie = tables->trie, *end = trie + tables->trieSize, *p = trie;
+	int				depth;
+
+	for( depth = 0; depth <= kMaxTrieDepth && p < end; depth++ ) {
+		uintptr_t		terminalSize = readUleb128( &p, end );
+		const uint8_t	*children = p + terminalSize;
+		unsigned int	childCount;
+		uintptr_t		childOffset = 0;
+
+		if( !*name ) {
+			uintptr_t flags, offset;
+			if( !terminalSize || children > end )
+				return NULL;
+			flags = readUleb128( &p, end );
+			if( flags & EXPORT_SYMBOL_FLAGS_REEXPORT )
+				return NULL;
+			offset = readUleb128( &p, end );
+			switch( flags & EXPORT_SYMBOL_FLAGS_KIND_MASK ) {
+				case EXPORT_SYMBOL_FLAGS_KIND_REGULAR:
+					return (char *) mh + offset;
+				case EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE:
+					return (void *) offset;
+			}
+			return NULL;
+		}
+
+		if( children >= end )
+			return NULL;
+		p = children;
+		childCount = *p++;
+		while( childCount-- && p < end ) {
+			size_t	edgeLength = strnlen( (const char *) p, end - p );
+			int		matches = !strncmp( (const char *) p, name, edgeLength );
+
+			if( p + edgeLength >= end )
+				return NULL;
+			p += edgeLength + 1;
+			childOffset = readUleb128( &p, end );
+			if( matches ) {
+				name += edgeLength;
+				break;
+			}
+			childOffset = 0;
+		}
+		if( !childOffset || childOffset >= (uintptr_t) (end - trie) )
+			return NULL;
+		p = trie + childOffset;
+	}
+	return NULL;
+}
+
+/**************************
+ *
+ *	Indexing
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Indexing)
+
+typedef	struct	{
+	IndexedImage	*image;
+	IndexedSymbol	*symbols;
+	size_t			count, capacity;
+	char			*pool;
+	size_t			poolSize, poolCapacity;
+}	TrieExports;
+
+//	Collects trie exports the symbol table didn't define. Names are pooled
+//	by offset since the pool moves while growing.
+static void
+collectTrieExport(
+				  const char	*name,
+				  void			*address,
+				  void			*context )
+{
+	TrieExports		*exports = context;
+	size_t			length = strlen( name ) + 1;
+	uint32_t		hash = symbolIndexHash( name );
+
+	if( findImageSymbol( exports->image, name, hash ) )
+		return;
+
+	if( exports->count == exports->capacity ) {
+		size_t capacity = exports->capacity ? 2 * exports->capacity : 64;
+		IndexedSymbol *symbols = realloc( exports->symbols, capacity * sizeof( IndexedSymbol ) );
+		if( !symbols )
+			return;
+		exports->symbols = symbols;
+		exports->capacity = capacity;
+	}
+	if( exports->poolSize + length > exports->poolCapacity ) {
+		size_t capacity = exports->poolCapacity ? 2 * exports->poolCapacity : 4096;
+		char *pool;
+		while( capacity < exports->poolSize + length )
+			capacity *= 2;
+		pool = realloc( exports->pool, capacity );
+		if( !pool )
+			return;
+		exports->pool = pool;
+		exports->poolCapacity = capacity;
+	}
+
+	memcpy( exports->pool + exports->poolSize, name, length );
+	exports->symbols[exports->count].name = (const char *) exports->poolSize;
+	exports->symbols[exports->count].address = address;
+	exports->symbols[exports->count].hash = hash;
+	exports->count++;
+	exports->poolSize += length;
+}
+
+static const char *
+imageName(
+		  const struct mach_header	*mh )
+{
+	uint32_t	i, count = _dyld_image_count();
+
+	for( i = 0; i < count; i++ )
+		if( _dyld_get_image_header( i ) == mh )
+			return _dyld_get_image_name( i );
+	return "";
+}
+
+/***************************************************************************//**
+	Indexes an image's defined symbols. Registered with dyld, which calls it
+	for each image as it is loaded.
+
+	@param	mh		->	The image's header.
+	@param	slide	->	Its slide.
+
+	***************************************************************************/
+
+static void
+addImage(
+		 const struct mach_header	*mh,
+		 intptr_t					slide )
+{
+	ImageTables		tables;
+	IndexedImage	*image;
+	TrieExports		exports;
+	uint32_t		i;
+
+	if( !readImageTables( mh, slide, &tables ) )
+		return;
+
+	image = calloc( 1, sizeof( IndexedImage ) );
+	if( !image )
+		return;
+	image->header = mh;
+	image->name = tables.dylibId
+		? (const char *) tables.dylibId + tables.dylibId->dylib.name.offset : imageName( mh );
+
+	pthread_mutex_lock( &gIndexLock );
+
+	image->loadOrder = gLoadOrder++;
+	image->next = gImages;
+	gImages = image;
+
+	//	Symbol table: every external symbol defined in a section.
+	if( tables.symbolCount ) {
+		size_t	count = 0;
+
+		image->symbols = calloc( tables.symbolCount, sizeof( IndexedSymbol ) );
+		growBuckets( gSymbolCount + tables.symbolCount );
+		for( i = 0; image->symbols && gBucketCount && i < tables.symbolCount; i++ ) {
+			const SymbolEntry *entry = &tables.symbols[i];
+			IndexedSymbol *symbol;
+
+			if( !isExternalSymbol( &tables, entry ) )
+				continue;
+			symbol = &image->symbols[count++];
+			symbol->name = tables.strings + entry->n_un.n_strx;
+			symbol->address = (void *) (entry->n_value + slide);
+			symbol->image = image;
+			symbol->hash = symbolIndexHash( symbol->name );
+			insertSymbol( symbol );
+		}
+	}
+
+	//	Export trie: names stripped from the symbol table, such as those of
+	//	images in the shared cache.
+	if( tables.trie && gBucketCount ) {
+		TrieWalk *walk = malloc( sizeof( TrieWalk ) );
+
+		memset( &exports, 0, sizeof( exports ) );
+		exports.image = image;
+		if( walk ) {
+			walk->trie = tables.trie;
+			walk->end = tables.trie + tables.trieSize;
+			walk->header = mh;
+			walk->callback = collectTrieExport;
+			walk->context = &exports;
+			walkExportTrie( walk, walk->trie, 0, 0 );
+			free( walk );
+		}
+		growBuckets( gSymbolCount + exports.count );
+		for( i = 0; i < exports.count; i++ ) {
+			exports.symbols[i].name = exports.pool + (uintptr_t) exports.symbols[i].name;
+			exports.symbols[i].image = image;
+			insertSymbol( &exports.symbols[i] );
+		}
+		image->exportedSymbols = exports.symbols;
+		image->stringPool = exports.pool;
+	}
+
+	pthread_mutex_unlock( &gIndexLock );
+}
+
+/***************************************************************************//**
+	Drops an unloaded image's symbols. Registered with dyld.
+
+	@param	mh		->	The image's header.
+	@param	slide	->	Its slide.
+
+	***************************************************************************/
+
+static void
+removeImage(
+			const struct mach_header	*mh,
+			intptr_t					slide )
+{
+	IndexedImage	**link, *image;
+	IndexedSymbol	**symbol;
+	size_t			i;
+
+	pthread_mutex_lock( &gIndexLock );
+
+	for( link = &gImages; *link && (*link)->header != mh; link = &(*link)->next )
+		;
+	image = *link;
+	if( image ) {
+		*link = image->next;
+		for( i = 0; i < gBucketCount; i++ ) {
+			for( symbol = &gBuckets[i]; *symbol; ) {
+				if( (*symbol)->image == image ) {
+					*symbol = (*symbol)->next;
+					gSymbolCount--;
+				} else
+					symbol = &(*symbol)->next;
+			}
+		}
+	}
+
+	pthread_mutex_unlock( &gIndexLock );
+
+	if( image ) {
+		free( image->symbols );
+		free( image->exportedSymbols );
+		free( image->stringPool );
+		free( image );
+	}
+}
+
+static void
+registerImageCallbacks( void )
+{
+	//	dyld calls addImage() right away for every image already loaded.
+	_dyld_register_func_for_add_image( addImage );
+	_dyld_register_func_for_remove_image( removeImage );
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+mach_error_t
+symbolIndexLookup(
+				  const char	*symbolName,
+				  const char	*libraryNameHint,
+				  void			**address )
+{
+	IndexedSymbol	*symbol, *best = NULL;
+	uint32_t		hash;
+
+	assert( symbolName );
+	assert( address );
+
+	pthread_once( &gIndexOnce, registerImageCallbacks );
+
+	hash = symbolIndexHash( symbolName );
+
+	pthread_mutex_lock( &gIndexLock );
+	if( gBucketCount ) {
+		for( symbol = gBuckets[hash & (gBucketCount - 1)]; symbol; symbol = symbol->next ) {
+			if( symbol->hash != hash || strcmp( symbol->name, symbolName ) )
+				continue;
+			if( libraryNameHint && !strstr( symbol->image->name, libraryNameHint ) )
+				continue;
+			if( !best || symbol->image->loadOrder < best->image->loadOrder )
+				best = symbol;
+		}
+	}
+	if( best )
+		*address = best->address;
+	pthread_mutex_unlock( &gIndexLock );
+
+	return best ? err_none : KERN_FAILURE;
+}
+
+mach_error_t
+symbolIndexLookupInImage(
+						 const struct mach_header	*header,
+						 intptr_t					slide,
+						 const char					*symbolName,
+						 void						**address )
+{
+	ImageTables		tables;
+	const void		*found = NULL;
+	uint32_t		i;
+
+	assert( header );
+	assert( symbolName );
+	assert( address );
+
+	if( !readImageTables( header, slide, &tables ) )
+		return KERN_FAILURE;
+	for( i = 0; i < tables.symbolCount && !found; i++ ) {
+		const SymbolEntry *entry = &tables.symbols[i];
+
+		if( !isExternalSymbol( &tables, entry )
+			|| strcmp( tables.strings + entry->n_un.n_strx, symbolName ) )
+			continue;
+		found = (const void *) (entry->n_value + slide);
+	}
+	if( !found && tables.trie )
+		found = findTrieExport( &tables, header, symbolName );
+	if( !found )
+		return KERN_FAILURE;
+	*address = (void *) found;
+	return err_none;
+}
+
+//	FNV-1a.
+uint32_t
+symbolIndexHash(
+				const char	*symbolName )
+{
+	uint32_t	hash = 2166136261u;
+
+	while( *symbolName )
+		hash = (hash ^ (unsigned char) *symbolName++) * 16777619u;
+	return hash;
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+ symbol_index.h
+ Hash index over the symbol tables and export tries of the images loaded in
+ the current task, used by mach_override() to resolve symbol names.
+
+ ***************************************************************************/
+
+#ifndef		_symbol_index_
+#define		_symbol_index_
+
+#include <sys/types.h>
+#include <stdint.h>
+#if defined(__linux__)
+#include "mach_linux.h"
+#else
+#include <mach/error.h>
+#endif
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+	/***************************************************************************//**
+	 Looks up the address of a symbol defined by a loaded image.
+
+	 The first call indexes every loaded image; images loaded later are added
+	 from dyld's add-image callback and unloaded ones dropped from its
+	 remove-image callback, so each lookup is a hash probe rather than a walk
+	 of every image.
+
+	 Only external symbols are found, as with _dyld_lookup_and_bind(). Without
+	 a hint the earliest loaded image wins, as with dyld's flat namespace.
+
+	 @param	symbolName			->	Required symbol name, with its leading
+										underscore.
+	 @param	libraryNameHint		->	Optional substring of the install name (or
+										path) of the image defining the symbol.
+										Can be NULL.
+	 @param	address				<-	Address of the symbol.
+	 @result						<-	KERN_FAILURE if no loaded image defines
+										the symbol.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	symbolIndexLookup(
+					  const char	*symbolName,
+					  const char	*libraryNameHint,
+					  void			**address );
+
+	struct	mach_header;
+
+	/***************************************************************************//**
+	 Looks up a symbol in one image without indexing anything, for resolving
+	 a symbol as its image is added. Symbol table entries are searched
+	 linearly, then the export trie is followed down the symbol's name. Only
+	 external symbols are found.
+
+	 @param	header				->	Required header of the image.
+	 @param	slide				->	The image's slide.
+	 @param	symbolName			->	Required symbol name, with its leading
+										underscore.
+	 @param	address				<-	Address of the symbol.
+	 @result						<-	KERN_FAILURE if the image doesn't define
+										the symbol.
+
+	 ***************************************************************************/
+
+	mach_error_t
+	symbolIndexLookupInImage(
+							 const struct mach_header	*header,
+							 intptr_t					slide,
+							 const char					*symbolName,
+							 void						**address );
+
+	/***************************************************************************//**
+	 Hashes a symbol name as the index does, so that other modules can keep
+	 their own tables of names that compare hashes first.
+
+	 @param	symbolName			->	Required symbol name.
+	 @result						<-	The name's hash.
+
+	 ***************************************************************************/
+
+	uint32_t
+	symbolIndexHash(
+					const char	*symbolName );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_symbol_index_
@@ -1,48 +1,242 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
+#include <string.h>
 #include <err.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <mach-o/dyld.h>
 
 #include "mach_override.h"
+#include "hook_deferred.h"
+#include "hook_stats.h"
+#include "dump_writer.h"
+#include "dump_journal.h"
 
 /**********************************************************************
  *                               Hooks                                *
  **********************************************************************/
+// Every way of loading code from memory we know of, in the order of _hooks;
+// images dlopen()ed from temporary files are caught as dyld adds them
+enum { kHookFromMemory, kHookLinkModule, kHookMmap, kHookCount, kCaptureAddImage = kHookCount };
+
+// Set for hooks that are guarded, which is what keeps track of their caller;
+// the stats stubs don't, so the journal gets no caller under WOW_HOOK_STATS
+static mach_override_hook_t _guarded_hooks[kHookCount];
+
+// WOW_VERBOSE=1 logs every capture as it is made
+static int _verbose;
+
+// save the module to a file :-) The writer thread does the actual writing
+// from a copy, or a copy-on-write snapshot, so the caller doesn't wait on
+// the disk, and logs the capture to the journal (query it with dumpquery)
+static void captureModule(const void *address, size_t size, int hook)
+{
+	if (_verbose)
+		printf("WRITING module at 0x%lX, 0x%lX bytes\n", (unsigned long)address, (unsigned long)size);
+	dumpWriterSubmit(address, size, hook < kHookCount && _guarded_hooks[hook]
+	 ? mach_override_hook_caller(_guarded_hooks[hook]) : NULL);
+}
+
+// A linked image is captured as laid out in memory: from its header to the
+// end of its last segment
+static size_t loadedImageSize(const struct mach_header *header)
+{
+	dump_journal_capture_t capture;
+	size_t headerSize = header->magic == MH_MAGIC_64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header);
+	uint64_t base = 0, end = 0;
+	uint32_t i;
+
+	if (dumpJournalDescribe(header, headerSize + header->sizeofcmds, &capture))
+		return 0;
+	for (i = 0; i < capture.entry.segmentCount; i++) {
+		const dump_journal_segment_t *segment = &capture.segments[i];
+		if (segment->fileoff == 0 && segment->filesize)
+			base = segment->vmaddr;
+		if (segment->maxprot && segment->vmaddr + segment->vmsize > end)
+			end = segment->vmaddr + segment->vmsize;
+	}
+	return end > base ? (size_t)(end - base) : 0;
+}
+
+static const struct mach_header *imageNamed(const char *name)
+{
+	uint32_t i, count = _dyld_image_count();
+
+	for (i = 0; name && i < count; i++) {
+		const char *image = _dyld_get_image_name(i);
+		if (image && !strcmp(image, name))
+			return _dyld_get_image_header(i);
+	}
+	return NULL;
+}
+
+// Where code that is loaded from memory is usually written out to first
+static int isTemporary(const char *path)
+{
+	static const char *prefixes[] = { "/tmp/", "/private/tmp/", "/var/folders/", "/private/var/folders/" };
+	const char *tmpdir = getenv("TMPDIR");
+	size_t i;
+
+	for (i = 0; i < sizeof(prefixes) / sizeof(*prefixes); i++)
+		if (!strncmp(path, prefixes[i], strlen(prefixes[i])))
+			return 1;
+	return tmpdir && *tmpdir && !strncmp(path, tmpdir, strlen(tmpdir));
+}
+
 int (*_real_NSCreateObjectFileImageFromMemory)(const void* address, size_t size, NSObjectFileImage* objectFileImage);
 int _hook_NSCreateObjectFileImageFromMemory(const void* address, size_t size, NSObjectFileImage* objectFileImage){
-	
+
 	// call the original function!
 	int res = (*_real_NSCreateObjectFileImageFromMemory)(address, size, objectFileImage);
-	
-	// save the module to a file :-)
-	char name[100];
-	snprintf(name, sizeof(name), "/0x%X_0x%X.bin", (unsigned int)address, (unsigned int)size);
-	printf("WRITING module to %s\n", name);
-	int fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-	if (fd > 0) {
-		// pretty straightforward, we know the start address of where the module is stored within wow's memory
-		//	and we know the size!
-		write(fd, address, size);
-	}
-	close(fd);
 
-	return res;	
+	captureModule(address, size, kHookFromMemory);
+
+	return res;
+}
+
+NSModule (*_real_NSLinkModule)(NSObjectFileImage objectFileImage, const char* moduleName, uint32_t options);
+NSModule _hook_NSLinkModule(NSObjectFileImage objectFileImage, const char* moduleName, uint32_t options){
+	const struct mach_header *header;
+	size_t size;
+
+	NSModule module = (*_real_NSLinkModule)(objectFileImage, moduleName, options);
+
+	if (module && (header = imageNamed(NSNameOfModule(module))) && (size = loadedImageSize(header)))
+		captureModule(header, size, kHookLinkModule);
+
+	return module;
+}
+
+// Only mappings of files hold code when they're made; anonymous ones are
+// filled in later
+void* (*_real_mmap)(void* address, size_t length, int prot, int flags, int fd, off_t offset);
+void* _hook_mmap(void* address, size_t length, int prot, int flags, int fd, off_t offset){
+	struct stat st;
+
+	void *res = (*_real_mmap)(address, length, prot, flags, fd, offset);
+
+	if (res != MAP_FAILED && (prot & PROT_EXEC) && (prot & PROT_READ) && fd >= 0
+	 && !fstat(fd, &st) && offset < st.st_size)
+		captureModule(res, MIN(length, (size_t)(st.st_size - offset)), kHookMmap);
+
+	return res;
+}
+
+// dlopen() isn't hooked: called from here, @rpath and @loader_path would
+// resolve against this bundle rather than the caller. The image is captured
+// as laid out in memory instead, once dyld has loaded it
+static void imageAdded(const struct mach_header *header, intptr_t slide)
+{
+	Dl_info info;
+	size_t size;
+
+	if (dladdr(header, &info) && info.dli_fname && isTemporary(info.dli_fname)
+	 && (size = loadedImageSize(header)))
+		captureModule(header, size, kCaptureAddImage);
 }
 
 
 /**********************************************************************
  *                         Bundle Interface                           *
  **********************************************************************/
+typedef struct {
+	const char *symbol;
+	void *hook;
+	void **real;
+} WowHook;
+
+// Searched for in every image, as they live in libSystem before 10.7 and in
+// libdyld and libsystem_kernel since
+static WowHook _hooks[kHookCount] = {
+	{ "_NSCreateObjectFileImageFromMemory",
+	 (void*)&_hook_NSCreateObjectFileImageFromMemory, (void**)&_real_NSCreateObjectFileImageFromMemory },
+	{ "_NSLinkModule", (void*)&_hook_NSLinkModule, (void**)&_real_NSLinkModule },
+	{ "_mmap", (void*)&_hook_mmap, (void**)&_real_mmap },
+};
+
+static mach_error_t installStatsHook(void *original, void *context)
+{
+	WowHook *hook = context;
+
+	return hookStatsOverride(original, hook->hook, hook->real, hook->symbol + 1);
+}
+
+// The hooks call printf() and mmap(); guarded, they can't recurse if those
+// end up back in the function they hook
+static mach_error_t installGuardedHook(void *original, void *context)
+{
+	WowHook *entry = context;
+	mach_override_hook_t hook;
+	mach_error_t me = mach_override_hook(original, entry->hook, entry->real, &hook);
+	if (!me)
+		me = mach_override_hook_guard(hook, 1);
+	if (!me)
+		_guarded_hooks[entry - _hooks] = hook;
+	return me;
+}
+
+static void hookInstalled(const char *symbol, const char *image, mach_error_t me, void *context)
+{
+	warnx("Was the hook on %s in %s successful? %x %s", symbol, image, me, mach_error_string(me));
+}
+
+static void flushDumps(void)
+{
+	dump_writer_stats_t stats;
+
+	dumpWriterFlush();
+	dumpWriterStatistics(&stats);
+	if (stats.dropped || stats.failed)
+		warnx("%llu module(s) dropped, %llu not written",
+		 (unsigned long long)stats.dropped, (unsigned long long)stats.failed);
+	if (stats.unjournaled)
+		warnx("%llu capture(s) missing from the journal", (unsigned long long)stats.unjournaled);
+}
+
+// WOW_DUMP_BUDGET is in megabytes; WOW_DUMP_OVERFLOW is block, drop or spill;
+// WOW_DUMP_DIR is where the modules are stored, by content; WOW_DUMP_COMPRESS=1
+// keeps them compressed in one archive there (read them back with dumpextract);
+// WOW_DUMP_SNAPSHOT=0 copies large modules rather than snapshotting them
+static void startDumpWriter(void)
+{
+	dump_writer_config_t config = { 0, kDumpOverflowSpill, getenv("WOW_DUMP_DIR"),
+	 getenv("WOW_DUMP_COMPRESS") != NULL, 1 };
+	const char *value;
+
+	if ((value = getenv("WOW_DUMP_BUDGET")))
+		config.memoryBudget = (size_t)strtoul(value, NULL, 10) << 20;
+	if ((value = getenv("WOW_DUMP_OVERFLOW"))) {
+		if (!strcmp(value, "block"))
+			config.overflow = kDumpOverflowBlock;
+		else if (!strcmp(value, "drop"))
+			config.overflow = kDumpOverflowDrop;
+	}
+	if ((value = getenv("WOW_DUMP_SNAPSHOT")))
+		config.snapshot = strcmp(value, "0") != 0;
+	if (dumpWriterStart(&config))
+		warnx("Dump writer not started, modules may not be saved");
+	atexit(flushDumps);
+}
+
 static void init(void) __attribute__ ((constructor));
 void init(void)
 {
     mach_error_t me;
+	int i;
 
-	me = mach_override(	"_NSCreateObjectFileImageFromMemory", NULL,
-	 (void*)&_hook_NSCreateObjectFileImageFromMemory,
-	 (void**)&_real_NSCreateObjectFileImageFromMemory);
+	_verbose = getenv("WOW_VERBOSE") != NULL;
+	startDumpWriter();
 
-	warnx("Was the hook successful? %x %s", me, mach_error_string(me));
+	// The hooks go in when their image is loaded, which it normally already is;
+	// hookInstalled() reports the outcome either way.
+	// WOW_HOOK_STATS=1 publishes call counts and latencies; read them with hookstat
+	for (i = 0; i < kHookCount; i++) {
+		me = hookDeferredInstall(_hooks[i].symbol, NULL,
+		 getenv("WOW_HOOK_STATS") ? installStatsHook : installGuardedHook, hookInstalled, &_hooks[i]);
+		if (me == KERN_RESOURCE_SHORTAGE)
+			warnx("Could not register the hook on %s: %x %s", _hooks[i].symbol, me, mach_error_string(me));
+	}
+	_dyld_register_func_for_add_image(imageAdded);
 }
@@ -0,0 +1,349 @@
+/*******************************************************************************
+ x86_decode.c
+ Table-driven i386/x86_64 instruction length decoder used by mach_override
+ to eat function prologues.
+
+ Only lengths and operand layout are decoded, which is all that is needed to
+ copy (and later relocate) the instructions overwritten by the jump to the
+ escape island. Operand semantics are deliberately ignored.
+
+ ***************************************************************************/
+
+#include "x86_decode.h"
+
+#include <string.h>
+
+/**************************
+ *
+ *	Opcode Attributes
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Opcode Attributes)
+
+#define	kM			0x00000001	//	ModRM follows
+#define	kI8			0x00000002	//	imm8
+#define	kI16		0x00000004	//	imm16
+#define	kIz			0x00000008	//	imm16/32 (operand size)
+#define	kIv			0x00000010	//	imm16/32/64 (mov reg, imm)
+#define	kJ8			0x00000020	//	rel8
+#define	kJz			0x00000040	//	rel16/32
+#define	kMoffs		0x00000080	//	moffs (address size)
+#define	kFar		0x00000100	//	ptr16:16/32
+#define	kPfx		0x00000200	//	legacy prefix
+#define	kEsc		0x00000400	//	0F escape
+#define	kInv64		0x00000800	//	invalid in 64-bit mode
+#define	kInv		0x00001000	//	invalid in any mode
+#define	kGrp3		0x00002000	//	F6/F7: immediate only for /0 and /1
+#define	kGrp5		0x00004000	//	FF: /2 /3 call, /4 /5 jmp
+#define	kCond		0x00008000
+#define	kCall		0x00010000
+#define	kJmp		0x00020000
+#define	kRet		0x00040000
+#define	kNoRel32	0x00080000
+#define	kVEX		0x00100000	//	C4/C5 (LES/LDS outside 64-bit mode)
+#define	kEsc38		0x00200000
+#define	kEsc3A		0x00400000
+#define	kCtrlReg	0x00800000	//	ModRM always names registers
+#define	kEVEX		0x01000000	//	62 (BOUND outside 64-bit mode)
+
+#define	kALU		kM, kM, kM, kM, kI8, kIz
+#define	kX4			0, 0, 0, 0
+#define	kX8			kX4, kX4
+#define	kX16		kX8, kX8
+#define	kM4			kM, kM, kM, kM
+#define	kM8			kM4, kM4
+#define	kM16		kM8, kM8
+
+static const unsigned int kOneByteMap[256] = {
+	/* 00 */ kALU, kInv64, kInv64, kALU, kInv64, kEsc,
+	/* 10 */ kALU, kInv64, kInv64, kALU, kInv64, kInv64,
+	/* 20 */ kALU, kPfx, kInv64, kALU, kPfx, kInv64,
+	/* 30 */ kALU, kPfx, kInv64, kALU, kPfx, kInv64,
+	/* 40 */ kX16,		//	inc/dec, REX in 64-bit mode
+	/* 50 */ kX16,
+	/* 60 */ kInv64, kInv64, kM|kEVEX, kM, kPfx, kPfx, kPfx, kPfx,
+	         kIz, kM|kIz, kI8, kM|kI8, kX4,
+	/* 70 */ kJ8|kCond, kJ8|kCond, kJ8|kCond, kJ8|kCond,
+	         kJ8|kCond, kJ8|kCond, kJ8|kCond, kJ8|kCond,
+	         kJ8|kCond, kJ8|kCond, kJ8|kCond, kJ8|kCond,
+	         kJ8|kCond, kJ8|kCond, kJ8|kCond, kJ8|kCond,
+	/* 80 */ kM|kI8, kM|kIz, kM|kI8|kInv64, kM|kI8, kM4, kM8,
+	/* 90 */ kX8, 0, 0, kFar|kCall|kInv64, 0, kX4,
+	/* A0 */ kMoffs, kMoffs, kMoffs, kMoffs, kX4, kI8, kIz, 0, 0, kX4,
+	/* B0 */ kI8, kI8, kI8, kI8, kI8, kI8, kI8, kI8,
+	         kIv, kIv, kIv, kIv, kIv, kIv, kIv, kIv,
+	/* C0 */ kM|kI8, kM|kI8, kI16|kRet, kRet, kM|kVEX, kM|kVEX, kM|kI8, kM|kIz,
+	         kI16|kI8, 0, kI16|kRet, kRet, 0, kI8, kInv64, kRet,
+	/* D0 */ kM4, kI8|kInv64, kI8|kInv64, kInv, 0, kM8,
+	/* E0 */ kJ8|kCond|kNoRel32, kJ8|kCond|kNoRel32, kJ8|kCond|kNoRel32, kJ8|kCond|kNoRel32,
+	         kI8, kI8, kI8, kI8,
+	         kJz|kCall, kJz|kJmp, kFar|kJmp|kInv64, kJ8|kJmp, kX4,
+	/* F0 */ kPfx, 0, kPfx, kPfx, 0, 0, kM|kGrp3|kI8, kM|kGrp3|kIz,
+	         0, 0, 0, 0, 0, 0, kM, kM|kGrp5
+};
+
+static const unsigned int kTwoByteMap[256] = {
+	/* 00 */ kM4, kInv, 0, 0, 0, 0, 0, kInv, 0, kInv, kM, 0, kM|kI8,
+	/* 10 */ kM16,
+	/* 20 */ kM|kCtrlReg, kM|kCtrlReg, kM|kCtrlReg, kM|kCtrlReg,
+	         kInv, kInv, kInv, kInv, kM8,
+	/* 30 */ 0, 0, 0, 0, 0, 0, kInv, 0,
+	         kEsc38, kInv, kEsc3A, kInv, kInv, kInv, kInv, kInv,
+	/* 40 */ kM16,
+	/* 50 */ kM16,
+	/* 60 */ kM16,
+	/* 70 */ kM|kI8, kM|kI8, kM|kI8, kM|kI8, kM, kM, kM, 0,
+	         kM, kM, kInv, kInv, kM4,
+	/* 80 */ kJz|kCond, kJz|kCond, kJz|kCond, kJz|kCond,
+	         kJz|kCond, kJz|kCond, kJz|kCond, kJz|kCond,
+	         kJz|kCond, kJz|kCond, kJz|kCond, kJz|kCond,
+	         kJz|kCond, kJz|kCond, kJz|kCond, kJz|kCond,
+	/* 90 */ kM16,
+	/* A0 */ 0, 0, 0, kM, kM|kI8, kM, kInv, kInv,
+	         0, 0, 0, kM, kM|kI8, kM, kM, kM,
+	/* B0 */ kM8, kM, kM, kM|kI8, kM, kM4,
+	/* C0 */ kM, kM, kM|kI8, kM, kM|kI8, kM|kI8, kM|kI8, kM, kX8,
+	/* D0 */ kM16,
+	/* E0 */ kM16,
+	/* F0 */ kM16
+};
+
+/**************************
+ *
+ *	Helpers
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Helpers)
+
+/*
+ Returns the size of the ModRM addressing bytes that follow the ModRM byte
+ (SIB plus displacement) and fills in the displacement layout.
+ */
+static int
+decodeModRM(
+			const unsigned char	*p,
+			int					is64Bit,
+			int					addressSize16,
+			int					forceRegister,
+			X86Instruction		*insn,
+			int					modrmOffset )
+{
+	unsigned char	modrm = p[0];
+	int				mod = modrm >> 6;
+	int				rm = modrm & 7;
+	int				extra = 0;
+	int				disp = 0;
+
+	insn->modrm = modrm;
+	insn->flags |= kX86FlagModRM;
+	if( mod == 3 || forceRegister )
+		return 0;
+
+	if( addressSize16 ) {
+		if( mod == 0 && rm == 6 )
+			disp = 2;
+		else if( mod == 1 )
+			disp = 1;
+		else if( mod == 2 )
+			disp = 2;
+	} else {
+		if( rm == 4 ) {
+			unsigned char sib = p[1];
+			insn->flags |= kX86FlagSIB;
+			extra = 1;
+			if( mod == 0 && (sib & 7) == 5 )
+				disp = 4;
+		} else if( mod == 0 && rm == 5 ) {
+			disp = 4;
+			if( is64Bit )
+				insn->flags |= kX86FlagRIPRelative;
+		}
+		if( mod == 1 )
+			disp = 1;
+		else if( mod == 2 )
+			disp = 4;
+	}
+
+	if( disp ) {
+		insn->dispOffset = modrmOffset + 1 + extra;
+		insn->dispSize = disp;
+	}
+	return extra + disp;
+}
+
+/**************************
+ *
+ *	Interface
+ *
+ **************************/
+#pragma mark	-
+#pragma mark	(Interface)
+
+int
+x86DecodeInstruction(
+					 const unsigned char	*code,
+					 int					is64Bit,
+					 X86Instruction		*instruction )
+{
+	X86Instruction	scratch;
+	X86Instruction	*insn = instruction ? instruction : &scratch;
+	const unsigned char	*p = code;
+	int				operandSize16 = 0;
+	int				addressSize16 = 0;	//	16-bit in 32-bit mode
+	int				addressSize32 = 0;	//	32-bit in 64-bit mode
+	int				rexW = 0;
+	int				immSize = 0;
+	unsigned int	attr;
+
+	memset( insn, 0, sizeof( *insn ) );
+
+	//	Legacy prefixes, then REX. A legacy prefix after REX cancels it.
+	for( ;; ) {
+		if( p - code >= kX86MaxInstructionLength )
+			return 0;
+		if( kOneByteMap[*p] & kPfx ) {
+			if( *p == 0x66 )
+				operandSize16 = 1;
+			else if( *p == 0x67 ) {
+				if( is64Bit )
+					addressSize32 = 1;
+				else
+					addressSize16 = 1;
+			}
+			insn->prefixCount++;
+			insn->rex = 0;
+			p++;
+		} else if( is64Bit && (*p & 0xF0) == 0x40 ) {
+			insn->rex = *p;
+			p++;
+		} else
+			break;
+	}
+	rexW = (insn->rex & 0x08) != 0;
+
+	insn->opcodeOffset = p - code;
+	attr = kOneByteMap[*p];
+
+	if( attr & (kVEX | kEVEX) ) {
+		//	C4/C5/62 are LES/LDS/BOUND in 32-bit mode unless ModRM.mod == 11.
+		if( is64Bit || (p[1] & 0xC0) == 0xC0 ) {
+			int	map = 1;
+			int	vexLength = (*p == 0xC5) ? 2 : (*p == 0xC4) ? 3 : 4;
+			if( insn->rex )
+				return 0;
+			if( *p == 0xC4 ) {
+				map = p[1] & 0x1F;
+				rexW = (p[2] & 0x80) != 0;
+			} else if( *p == 0x62 ) {
+				map = p[1] & 0x07;
+				rexW = (p[2] & 0x80) != 0;
+			}
+			if( map < 1 || map > 3 )
+				return 0;
+			insn->flags |= kX86FlagVEX;
+			p += vexLength;
+			insn->opcode = *p;
+			insn->opcodeLength = map == 1 ? 2 : 3;
+			p++;
+			attr = map == 1 ? kTwoByteMap[insn->opcode] : kM;
+			if( map == 3 )
+				attr |= kI8;
+			if( map == 1 && insn->opcode == 0x77 )
+				attr = 0;	//	vzeroupper, vzeroall
+			attr &= ~(kJz | kCond | kEsc38 | kEsc3A);
+			if( attr & kInv )
+				return 0;
+			goto operands;
+		}
+		attr &= ~(kVEX | kEVEX);
+	}
+
+	if( attr & kEsc ) {
+		p++;
+		attr = kTwoByteMap[*p];
+		insn->opcodeLength = 2;
+		if( attr & kEsc38 ) {
+			p++;
+			attr = kM;
+			insn->opcodeLength = 3;
+		} else if( attr & kEsc3A ) {
+			p++;
+			attr = kM | kI8;
+			insn->opcodeLength = 3;
+		}
+	} else {
+		insn->opcodeLength = 1;
+		if( is64Bit && (attr & kInv64) )
+			return 0;
+	}
+	if( attr & kInv )
+		return 0;
+	insn->opcode = *p++;
+
+operands:
+	if( attr & kM ) {
+		unsigned char modrm = *p;
+		int reg = (modrm >> 3) & 7;
+		int modrmOffset = p - code;
+		p += 1 + decodeModRM( p, is64Bit, !is64Bit && addressSize16,
+							  (attr & kCtrlReg) != 0, insn, modrmOffset );
+		if( (attr & kGrp3) && reg > 1 )
+			attr &= ~(kI8 | kIz);
+		if( attr & kGrp5 ) {
+			if( reg == 2 || reg == 3 )
+				attr |= kCall;
+			else if( reg == 4 || reg == 5 )
+				attr |= kJmp;
+			else if( reg == 7 )
+				return 0;
+		}
+	}
+
+	if( attr & kI8 )
+		immSize += 1;
+	if( attr & kI16 )
+		immSize += 2;
+	if( attr & kIz )
+		immSize += (operandSize16 && !rexW) ? 2 : 4;
+	if( attr & kIv )
+		immSize += rexW ? 8 : (operandSize16 ? 2 : 4);
+	if( attr & kFar )
+		immSize += operandSize16 ? 4 : 6;
+	if( attr & kMoffs ) {
+		if( is64Bit )
+			immSize += addressSize32 ? 4 : 8;
+		else
+			immSize += addressSize16 ? 2 : 4;
+	}
+	if( attr & kJ8 ) {
+		immSize += 1;
+		insn->flags |= kX86FlagRelativeBranch;
+	}
+	if( attr & kJz ) {
+		immSize += (operandSize16 && !is64Bit) ? 2 : 4;
+		insn->flags |= kX86FlagRelativeBranch;
+	}
+	if( immSize ) {
+		insn->immOffset = p - code;
+		insn->immSize = immSize;
+		p += immSize;
+	}
+
+	if( attr & kCond )
+		insn->flags |= kX86FlagConditional;
+	if( attr & kCall )
+		insn->flags |= kX86FlagCall;
+	if( attr & kJmp )
+		insn->flags |= kX86FlagJump;
+	if( attr & kRet )
+		insn->flags |= kX86FlagReturn;
+	if( attr & kNoRel32 )
+		insn->flags |= kX86FlagNoRel32Form;
+
+	if( p - code > kX86MaxInstructionLength )
+		return 0;
+	insn->length = p - code;
+	return insn->length;
+}
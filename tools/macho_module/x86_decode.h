@@ -0,0 +1,76 @@
+/*******************************************************************************
+ x86_decode.h
+ Table-driven i386/x86_64 instruction length decoder used by mach_override
+ to eat function prologues.
+
+ ***************************************************************************/
+
+#ifndef		_x86_decode_
+#define		_x86_decode_
+
+#ifdef	__cplusplus
+extern	"C"	{
+#endif
+
+	/**
+	 Longest legal x86 instruction, prefixes included.
+	 */
+#define	kX86MaxInstructionLength	15
+
+	/**
+	 Instruction flags reported by x86DecodeInstruction().
+	 */
+#define	kX86FlagModRM				0x0001	//	has a ModRM byte
+#define	kX86FlagSIB					0x0002	//	has a SIB byte
+#define	kX86FlagRIPRelative			0x0004	//	memory operand is [rip+disp32]
+#define	kX86FlagRelativeBranch		0x0008	//	immediate is a pc-relative target
+#define	kX86FlagConditional			0x0010	//	conditional branch (jcc, loop, jcxz)
+#define	kX86FlagCall				0x0020	//	call (direct or indirect)
+#define	kX86FlagJump				0x0040	//	unconditional jump (direct or indirect)
+#define	kX86FlagReturn				0x0080	//	ret, retf, iret
+#define	kX86FlagNoRel32Form			0x0100	//	rel8 branch without a rel32 encoding
+#define	kX86FlagVEX					0x0200	//	VEX or EVEX encoded (AVX, AVX-512)
+
+	/**
+	 Anything that ends straight-line execution of the prologue.
+	 */
+#define	kX86FlagEndsFlow			(kX86FlagJump | kX86FlagReturn)
+
+	typedef	struct	{
+		unsigned char	length;			//	total length in bytes
+		unsigned char	prefixCount;	//	legacy prefixes, REX and VEX excluded
+		unsigned char	rex;			//	REX byte, 0 if absent
+		unsigned char	opcodeOffset;	//	offset of the first opcode byte
+		unsigned char	opcodeLength;	//	1, 2 (0F xx) or 3 (0F 38/3A xx)
+		unsigned char	opcode;			//	last opcode byte
+		unsigned char	modrm;			//	ModRM byte, valid with kX86FlagModRM
+		unsigned char	dispOffset;		//	offset of the displacement, 0 if none
+		unsigned char	dispSize;		//	displacement size: 0, 1, 2 or 4
+		unsigned char	immOffset;		//	offset of the immediate, 0 if none
+		unsigned char	immSize;		//	immediate size: 0, 1, 2, 3, 4, 6 or 8
+		unsigned short	flags;			//	kX86Flag*
+	}	X86Instruction;
+
+	/***************************************************************************//**
+	 Decodes the length and layout of the instruction at code.
+
+	 @param	code		->	Instruction bytes. Up to kX86MaxInstructionLength bytes
+							may be read.
+	 @param	is64Bit		->	Non-zero to decode in 64-bit (long) mode, zero for
+							32-bit protected mode.
+	 @param	instruction	<-	Optional decoded layout. Can be NULL.
+	 @result				<-	Length of the instruction in bytes, or 0 if the bytes
+							do not form a valid instruction in that mode.
+
+	 ***************************************************************************/
+
+	int
+	x86DecodeInstruction(
+						 const unsigned char	*code,
+						 int					is64Bit,
+						 X86Instruction		*instruction );
+
+#ifdef	__cplusplus
+}
+#endif
+#endif	//	_x86_decode_